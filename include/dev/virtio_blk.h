@@ -27,7 +27,22 @@
 #define _VIRTIO_BLK
 
 #include <dev/virtio_pci.h>
+#include <nautilus/blkdev.h>
+
+struct virtio_blk_stats {
+    uint64_t submits;           // requests placed in the avail ring
+    uint64_t kicks;             // notifications written to the device
+    uint64_t kicks_suppressed;  // notifications the device did not want
+    uint64_t interrupts;
+    uint64_t completions;
+    uint16_t num_queues;
+    int      indirect;
+    int      event_idx;
+};
 
 int virtio_blk_init(struct virtio_pci_dev *dev);
 
+// sums over all request queues, fails if d is not a virtio block device
+int virtio_blk_get_stats(struct nk_block_dev *d, struct virtio_blk_stats *s);
+
 #endif
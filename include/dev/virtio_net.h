@@ -27,8 +27,22 @@
 #define _VIRTIO_NET
 
 #include <dev/virtio_pci.h>
+#include <nautilus/netdev.h>
+
+struct virtio_net_stats {
+    uint64_t posts;             // buffers placed in avail rings
+    uint64_t kicks;             // notifications written to the device
+    uint64_t kicks_suppressed;  // notifications the device did not want
+    uint64_t interrupts;
+    uint64_t completions;
+    uint64_t csum_fixups;       // received packets whose checksum we finished
+    uint16_t num_queues;        // queue pairs
+};
 
 int virtio_net_init(struct virtio_pci_dev *dev);
 
+// sums over all queues, fails if n is not a virtio network device
+int virtio_net_get_stats(struct nk_net_dev *n, struct virtio_net_stats *s);
+
 
 #endif
@@ -31,7 +31,8 @@
 #include <dev/virtqueue.h>
 #include <nautilus/nautilus.h>
 
-#define MAX_VIRTQS 4
+// multiqueue block devices expose up to one queue per vCPU
+#define MAX_VIRTQS 64
 #define VIRTIO_MSI_NO_VECTOR 0xffff
 
 enum virtio_pci_dev_model {
@@ -83,6 +84,8 @@ struct virtio_pci_virtq {
     struct virtq vq;
     // for processing respones 
     uint16_t last_seen_used;
+    // avail idx as of the last notification of the device
+    uint16_t kicked_idx;
 
     // descriptor allocator
     uint16_t nfree;
@@ -182,6 +185,16 @@ int virtio_pci_desc_free(struct virtio_pci_dev *dev, uint16_t qidx, uint16_t des
 int virtio_pci_desc_chain_free(struct virtio_pci_dev *dev, uint16_t qidx, uint16_t desc_idx);
 // notify a device's virtqueue
 int virtio_pci_virtqueue_notify(struct virtio_pci_dev *dev, uint16_t qidx);
+// notify a device's virtqueue of buffers made available since the
+// last kick, unless the device has said it does not need to hear about
+// them (VIRTQ_USED_F_NO_NOTIFY or the avail event index)
+// returns 1 if the device was notified, the caller serializes
+int virtio_pci_virtqueue_kick(struct virtio_pci_dev *dev, uint16_t qidx);
+// ask the device not to interrupt us for a virtqueue
+void virtio_pci_virtqueue_disable_interrupts(struct virtio_pci_dev *dev, uint16_t qidx);
+// ask the device to interrupt us at the next used buffer
+// returns nonzero if there already are used buffers we have not seen
+int virtio_pci_virtqueue_enable_interrupts(struct virtio_pci_dev *dev, uint16_t qidx);
 
 /******************************************************************
       LEGACY/TRANSITIONAL INTERFACE TO DEVICE REGISTERS
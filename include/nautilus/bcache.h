@@ -0,0 +1,104 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <nautilus/blkdev.h>
+
+//
+// Buffer cache for filesystem block I/O
+//
+// Filesystems read and write their devices through here instead of
+// calling nk_block_dev_read/write directly.  Each attached device gets
+// one cache, shared by everything attached to it, of page-sized
+// buffers that each hold a run of device blocks.  Replacement is CLOCK.
+// A miss that continues a sequential run starts asynchronous reads of
+// the buffers that follow it.  Writes only dirty buffers; a flusher
+// thread writes them back periodically, and nk_bcache_sync() forces
+// them out.  I/O done directly on the device bypasses the cache and
+// is not coherent with it.
+//
+// A device without a cache (never attached, or one whose block size
+// does not divide a buffer) is read and written directly.
+//
+
+struct nk_bcache_stats {
+    uint64_t num_bufs;
+    uint64_t buf_size;
+    uint64_t valid_bufs;
+    uint64_t dirty_bufs;
+
+    uint64_t hits;             // buffer lookups satisfied from the cache
+    uint64_t misses;           // ... that went to the device
+    uint64_t waits;            // ... that waited for I/O in flight
+    uint64_t readaheads;       // buffers read ahead
+    uint64_t readahead_hits;   // ... that were later used
+    uint64_t writebacks;       // buffers written to the device
+    uint64_t evictions;        // valid buffers replaced
+    uint64_t dirty_evictions;  // ... that had to be written first
+    uint64_t flushes;          // flusher thread passes that wrote something
+};
+
+#ifdef NAUT_CONFIG_FS_BUFFER_CACHE
+
+// attach is refcounted - the last detach writes back and frees
+int nk_bcache_attach(struct nk_block_dev *dev);
+int nk_bcache_detach(struct nk_block_dev *dev);
+
+// blocking, in units of device blocks
+int nk_bcache_read(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *dest);
+int nk_bcache_write(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *src);
+
+// write back every dirty buffer of the device
+int nk_bcache_sync(struct nk_block_dev *dev);
+
+// make a range safe for I/O that bypasses the cache - dirty data in
+// it reaches the device, and before a write (write=1) the buffers
+// that would go stale are dropped
+int nk_bcache_prepare_direct(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, int write);
+
+int nk_bcache_get_stats(struct nk_block_dev *dev, struct nk_bcache_stats *s);
+
+#else
+
+static inline int nk_bcache_attach(struct nk_block_dev *dev) { return 0; }
+static inline int nk_bcache_detach(struct nk_block_dev *dev) { return 0; }
+
+static inline int nk_bcache_read(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *dest)
+{
+    return nk_block_dev_read(dev,blocknum,count,dest,NK_DEV_REQ_BLOCKING,0,0);
+}
+
+static inline int nk_bcache_write(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *src)
+{
+    return nk_block_dev_write(dev,blocknum,count,src,NK_DEV_REQ_BLOCKING,0,0);
+}
+
+static inline int nk_bcache_sync(struct nk_block_dev *dev) { return 0; }
+static inline int nk_bcache_prepare_direct(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, int write) { return 0; }
+static inline int nk_bcache_get_stats(struct nk_block_dev *dev, struct nk_bcache_stats *s) { return -1; }
+
+#endif
+
+#endif
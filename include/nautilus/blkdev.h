@@ -48,6 +48,17 @@ struct nk_block_dev_int {
     int (*get_characteristics)(void *state, struct nk_block_dev_characteristics *c);
     int (*read_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
     int (*write_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
+    // optional batching - while plugged, the device may queue requests
+    // without notifying the hardware; unplug submits everything queued
+    // plugs nest, and unplug may run on a different CPU than plug
+    int (*plug)(void *state);
+    int (*unplug)(void *state);
+    // optional polling - complete up to budget requests from the
+    // caller's context, returning how many, or -1 on error
+    int (*poll)(void *state, uint64_t budget);
+    // mask (0) or unmask (1) completion interrupts - unmasking returns
+    // 1 if completions are already waiting, and might not interrupt
+    int (*set_interrupts)(void *state, int enable);
 };
 
 
@@ -83,6 +94,14 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		       void (*callback)(nk_block_dev_status_t status, void *state), 
 		       void *state);
 
+// bracket a burst of callback requests so the device can submit
+// them together - these are no-ops for devices that do not batch
+int nk_block_dev_plug(struct nk_block_dev *dev);
+int nk_block_dev_unplug(struct nk_block_dev *dev);
+
+// -1 if the device cannot be polled - see also devpoll.h
+int nk_block_dev_poll(struct nk_block_dev *dev, uint64_t budget);
+int nk_block_dev_set_interrupts(struct nk_block_dev *dev, int enable);
 
 
 #endif
@@ -50,6 +50,10 @@ struct buddy_mempool * buddy_init(ulong_t base_addr, ulong_t pool_order, ulong_t
 void buddy_free(struct buddy_mempool * mp, void * addr, ulong_t order);
 void * buddy_alloc(struct buddy_mempool * mp, ulong_t order);
 
+// ranges that are not single blocks, for the large object allocator
+void buddy_free_range(struct buddy_mempool * mp, void * addr, ulong_t len);
+int  buddy_claim_range(struct buddy_mempool * mp, void * addr, ulong_t len);
+
 int  buddy_sanity_check(struct buddy_mempool *mp);
 
 struct buddy_pool_stats {
@@ -47,6 +47,7 @@ struct nk_dev_int {
 };
 
 typedef struct nk_wait_queue nk_wait_queue_t;
+struct nk_dev_poller;
 
 // this is the class for devices.  It should be the first
 // member of any specific type of device
@@ -61,6 +62,8 @@ struct nk_dev {
     struct nk_dev_int *interface;
     
     nk_wait_queue_t *waiting_threads;
+
+    struct nk_dev_poller *poller; // see devpoll.h
 };
 
 // Not all request types apply to all device types
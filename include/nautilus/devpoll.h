@@ -0,0 +1,97 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __DEV_POLL
+#define __DEV_POLL
+
+#include <nautilus/dev.h>
+
+//
+// Completion polling for block and network devices
+//
+// A poller is a thread, usually bound to a dedicated CPU, that
+// completes a device's requests by calling its poll() op instead
+// of waiting for its interrupts.  In busy mode, device interrupts
+// stay masked and the poller spins.  In adaptive mode, the poller
+// spins while there is work, and after an idle period unmasks
+// interrupts and sleeps; the next interrupt wakes it and masks
+// them again (as NAPI does).
+//
+// Drivers that implement poll() must call nk_dev_poll_claim_interrupt()
+// at the top of their completion interrupt handlers and, if it
+// returns nonzero, return without touching their rings.
+//
+
+typedef enum {
+    NK_DEV_POLL_OFF=0,     // interrupt driven
+    NK_DEV_POLL_BUSY,      // always polling
+    NK_DEV_POLL_ADAPTIVE,  // polling under load, interrupts when idle
+} nk_dev_poll_mode_t;
+
+// log2 histogram - bucket i counts values in [2^i, 2^(i+1)),
+// with zero counted in bucket 0 and the last bucket open ended
+#define NK_DEV_POLL_HIST_BUCKETS 32
+
+struct nk_dev_poll_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t bucket[NK_DEV_POLL_HIST_BUCKETS];
+};
+
+void nk_dev_poll_hist_add(struct nk_dev_poll_hist *h, uint64_t val);
+void nk_dev_poll_hist_print(struct nk_dev_poll_hist *h, char *what, char *unit);
+
+struct nk_dev_poll_stats {
+    nk_dev_poll_mode_t mode;
+    int      cpu;
+    uint64_t budget;
+    uint64_t idle_ns;
+
+    uint64_t polls;        // calls to the device's poll()
+    uint64_t empty_polls;  // ... that completed nothing
+    uint64_t completions;
+    uint64_t interrupts;   // claimed from the driver
+    uint64_t sleeps;       // switches to interrupts (adaptive)
+    uint64_t wakeups;      // switches back to polling (adaptive)
+
+    struct nk_dev_poll_hist batch;   // completions per productive poll
+    struct nk_dev_poll_hist wake;    // ns from interrupt to poller running
+};
+
+// dev must be a block or network device whose interface has poll()
+// and set_interrupts(); cpu can be CPU_ANY; zero budget or idle_ns
+// selects the default
+int nk_dev_poll_start(struct nk_dev *dev, nk_dev_poll_mode_t mode, int cpu, uint64_t budget, uint64_t idle_ns);
+int nk_dev_poll_stop(struct nk_dev *dev);
+
+int nk_dev_poll_get_stats(struct nk_dev *dev, struct nk_dev_poll_stats *s);
+
+// called by drivers from their interrupt handlers - nonzero means
+// a poller owns the device's completions
+int nk_dev_poll_claim_interrupt(struct nk_dev *dev);
+
+// called when the device is unregistered
+void nk_dev_poll_free(struct nk_dev *dev);
+
+#endif
@@ -79,6 +79,10 @@ typedef struct nk_fiber {
   uint64_t rsp;                /* +0  SHOULD NOT CHANGE POSITION */
   void *stack;                 /* +8  SHOULD NOT CHANGE POSITION */
   uint64_t fpu_state_offset;   /* +16 SHOULD NOT CHANGE POSITION */
+  volatile uint64_t on_cpu;    /* +24 SHOULD NOT CHANGE POSITION */
+                               /* cleared by the context switch once the
+                                  fiber's state is saved and it has
+                                  been switched away from */
   
   nk_stack_size_t stack_size;
     
@@ -107,8 +111,24 @@ typedef struct nk_fiber {
   void **output;  // output for the fiber's routine
 
   uint8_t is_done; //indicates whether the fiber is done (for reaping?)
+  uint8_t pinned;  // never taken by another CPU's work stealing
+
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+  volatile uint32_t queued; // 1 while a queue entry may run the fiber
+  volatile uint32_t refs;   // queue entries + 1 while the fiber is alive
+  int pin_cpu;              // CPU a pinned fiber stays on, -1 until it is first run
+#endif
 } nk_fiber_t;
 
+// Per-CPU fiber scheduling counters
+struct nk_fiber_stats {
+  uint64_t spawns;       // fibers created on this CPU
+  uint64_t yields;       // yields by fibers other than the idle fiber
+  uint64_t steals;       // fibers taken from another CPU's queue
+  uint64_t steal_fails;  // steal passes that found nothing
+  uint64_t stale;        // queue entries skipped because yield_to took the fiber
+};
+
 // Returns the fiber that is currently running on this CPU
 nk_fiber_t *nk_fiber_current();
 
@@ -168,6 +188,12 @@ int nk_fiber_join(nk_fiber_t *wait_on);
 // Set virtual console of the current fiber
 void nk_fiber_set_vc(struct nk_virtual_console *vc);
 
+// Keep a created fiber on the CPU it is first run on (call before nk_fiber_run)
+void nk_fiber_set_pinned(nk_fiber_t *f, int pinned);
+
+
+// Copy out the scheduling counters for a CPU, returns -1 on a bad CPU
+int nk_fiber_get_stats(int cpu, struct nk_fiber_stats *stats);
 
 // Called by BSP after scheduler init
 int nk_fiber_init();
@@ -23,6 +23,17 @@
 #ifndef __FPU_H__
 #define __FPU_H__
 
+/*
+ * How thread FPU state is saved and restored, chosen by fpu_init
+ * from what the CPU and XCR0 support.  XSAVE is only used if it
+ * covers the SSE registers, as FXSAVE does.
+ */
+#define NK_FPU_FXSAVE    0
+#define NK_FPU_XSAVE     1
+#define NK_FPU_XSAVEOPT  2
+
+#ifndef __ASSEMBLER__
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,8 +61,18 @@ struct naut_info;
 
 void fpu_init(struct naut_info *, int is_ap);
 
+extern uint8_t  nk_fpu_save_mode;     // NK_FPU_*
+extern uint8_t  nk_fpu_has_xinuse;    // XGETBV(1) reports components in use
+extern uint64_t nk_fpu_lazy_restores; // restores done on #NM (NAUT_CONFIG_FPU_LAZY)
+
+// C-callable save/restore of a thread's FPU state (src/asm/thread_lowlevel.S)
+void nk_fp_save(void *dest);
+void nk_fp_restore(void *src);
+
 #ifdef __cplusplus
 }
 #endif
 
+#endif /* !__ASSEMBLER__ */
+
 #endif /* !__FPU_H__! */
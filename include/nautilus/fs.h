@@ -56,6 +56,8 @@ struct nk_fs_int {
     ssize_t  (*read_file)(void *state, void *file, void *dest, off_t offset, size_t n);
     ssize_t  (*write_file)(void *state, void *file, void *src, off_t offset, size_t n);
     void  (*close_file)(void *state, void *file);
+    // write back anything buffered - optional
+    int   (*sync)(void *state);
 };
 
 // This is the class for a filesystem.  It should be the first
@@ -70,7 +72,8 @@ struct nk_fs {
 
     void             *state;  // internal FS state
     struct nk_fs_int *interface;
-    
+
+    uint64_t          refcount;  // syncs in progress, unregister waits for them
 };
 
 int nk_fs_init();
@@ -117,6 +120,8 @@ ssize_t    nk_fs_tell(nk_fs_fd_t fd);
 ssize_t    nk_fs_read(nk_fs_fd_t fd, void *buf, size_t len);
 ssize_t    nk_fs_write(nk_fs_fd_t fd, void *buf, size_t len);
 int        nk_fs_close(nk_fs_fd_t fd);
+// write back buffered data of every filesystem
+int        nk_fs_sync(void);
 
 
 void test_fs(void);
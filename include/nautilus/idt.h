@@ -125,6 +125,7 @@ int setup_idt(void);
 
 int idt_assign_entry(ulong_t entry, ulong_t handler_addr, ulong_t state_addr);
 int idt_get_entry(ulong_t entry, ulong_t *handler_addr, ulong_t *state_addr);
+int idt_assign_ist(ulong_t entry, uint8_t ist);
 
 int idt_find_and_reserve_range(ulong_t numentries, int aligned, ulong_t *first);
 
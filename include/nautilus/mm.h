@@ -81,8 +81,61 @@ void mm_boot_free(void *addr, ulong_t size);
 
 /* KMEM FUNCTIONS */
 
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+// Allocations above 2^KMEM_LARGE_MIN_ORDER bytes are carved to an
+// exact multiple of the page size instead of the next power of two
+#define KMEM_LARGE_MIN_ORDER   21  /* 2 MB */
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+// Per-CPU caches cover block orders from the kmem minimum order
+// up to KMEM_CACHE_MAX_ORDER (inclusive)
+#define KMEM_CACHE_MIN_ORDER   5   /* must match kmem's MIN_ORDER */
+#define KMEM_CACHE_MAX_ORDER   11  /* 2 KB */
+#define KMEM_CACHE_NUM_CLASSES (KMEM_CACHE_MAX_ORDER-KMEM_CACHE_MIN_ORDER+1)
+#define KMEM_CACHE_MAG_SIZE    32  /* blocks held per size class */
+#define KMEM_CACHE_BATCH       16  /* blocks moved per refill/drain */
+
+struct kmem_cache_mag {
+    uint64_t count;
+    void     *blocks[KMEM_CACHE_MAG_SIZE];
+};
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+// Zones keep pre-zeroed blocks of orders KMEM_ZERO_MIN_ORDER
+// through KMEM_ZERO_MAX_ORDER (inclusive)
+#define KMEM_ZERO_MIN_ORDER    12  /* 4 KB */
+#define KMEM_ZERO_MAX_ORDER    21  /* 2 MB */
+#define KMEM_ZERO_NUM_ORDERS   (KMEM_ZERO_MAX_ORDER-KMEM_ZERO_MIN_ORDER+1)
+
+struct kmem_zero_pool {
+    void     *head[KMEM_ZERO_NUM_ORDERS];   // linked through the first word
+    uint64_t  count[KMEM_ZERO_NUM_ORDERS];
+};
+#endif
+
 struct kmem_data {
     struct list_head ordered_regions;
+    // bytes asked for and bytes handed out by allocations made
+    // on this CPU since boot, for internal fragmentation stats
+    uint64_t bytes_requested;
+    uint64_t bytes_granted;
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+    // zeroed allocations served from / missing the pools, and
+    // blocks zeroed by this CPU while idle
+    uint64_t zero_hits;
+    uint64_t zero_misses;
+    uint64_t zero_fills;
+#endif
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    // only touched by the owning CPU with interrupts off
+    struct kmem_cache_mag mags[KMEM_CACHE_NUM_CLASSES];
+    uint64_t cache_alloc_hits;
+    uint64_t cache_alloc_misses;
+    uint64_t cache_free_hits;
+    uint64_t cache_drains;
+#endif
 };
 
 int nk_kmem_init(void);
@@ -105,18 +158,55 @@ void * kmem_mallocz(size_t size);
 void * kmem_realloc(void * ptr, size_t size);
 void   kmem_free(void * addr);
 
+// NUMA placement policies
+//
+// The nodemask has one bit per NUMA domain id (domains 0..63).
+//
+// DEFAULT    - scan the regions in the affinity order of the
+//              current (or given) cpu, nodemask is ignored
+// PREFERRED  - try the domains in the nodemask first (in affinity
+//              order), then fall back to any domain
+// BIND       - only the domains in the nodemask, fail otherwise
+// INTERLEAVE - successive allocations rotate over the domains in the
+//              nodemask, falling back to the other domains in the mask
+//
+// Kernel memory is identity mapped, so a single allocation is
+// always physically contiguous and lives in one domain.  Interleave
+// is therefore done per allocation; to interleave a large array,
+// allocate it in page (or larger) sized chunks.
+#define KMEM_POLICY_DEFAULT     0
+#define KMEM_POLICY_PREFERRED   1
+#define KMEM_POLICY_BIND        2
+#define KMEM_POLICY_INTERLEAVE  3
+
+#define KMEM_NODEMASK_ALL       (~0ULL)
+#define KMEM_NODEMASK_NODE(d)   (1ULL << (d))
+
+void * kmem_malloc_policy(size_t size, int policy, uint64_t nodemask);
+
+// default policy of the calling thread, used by kmem_malloc() and
+// kmem_mallocz() and inherited by threads it creates afterwards
+int    kmem_set_thread_policy(int policy, uint64_t nodemask);
+void   kmem_get_thread_policy(int *policy, uint64_t *nodemask);
+
 // Support functions for garbage collection
 // We currently assume these are done with the world stopped,
 // hence no locking
 
+// A block carries a single user flag bit, KMEM_USER_FLAGS_MASK.  The
+// flags live in kmem's page map beside the block's order, one byte
+// for every 32 bytes of memory, and there is no room for more.
+// Functions that set or match flags fail if given any other bits.
+#define KMEM_USER_FLAGS_MASK 0x1ULL
+
 // find the matching block that contains addr and its flags
 // returns nonzero if the addr is invalid or within no allocated block
-// user flags are allocate from low bit up, while kmem's flags are allocated
-// high bit down
 int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags);
 // set the flags of an allocated block
+// fails if flags outside of KMEM_USER_FLAGS_MASK are given
 int  kmem_set_block_flags(void *block_addr, uint64_t flags);
 // apply an mask to all the blocks (and mask unless or=1)
+// or'ing in bits outside of KMEM_USER_FLAGS_MASK fails
 int  kmem_mask_all_blocks_flags(uint64_t mask, int ormask);
 
 // range of addresses used for internal kmem state that should be
@@ -124,8 +214,12 @@ int  kmem_mask_all_blocks_flags(uint64_t mask, int ormask);
 void kmem_get_internal_pointer_range(void **start, void **end);
 
 // check to see if the masked flags match the given flags
+// fails if flags has bits outside of the mask or KMEM_USER_FLAGS_MASK
 int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state);
 
+// bytes of the range that are allocated or cached rather than free
+uint64_t kmem_range_used_bytes(void *start, uint64_t len);
+
 int  kmem_sanity_check();
 
 /* KCH: I don't believe the GC implementations support realloc explicitly. 
@@ -174,6 +268,23 @@ struct kmem_stats {
     uint64_t total_bytes_free;
     uint64_t min_alloc_size;
     uint64_t max_alloc_size;
+    // per-CPU cache counters, summed over all CPUs (0 if not configured)
+    uint64_t cache_alloc_hits;
+    uint64_t cache_alloc_misses;
+    uint64_t cache_free_hits;
+    uint64_t cache_drains;
+    uint64_t cache_bytes;    // bytes currently held in the per-CPU caches
+    // internal fragmentation, summed over all CPUs
+    uint64_t bytes_requested;  // since boot
+    uint64_t bytes_granted;    // since boot
+    uint64_t large_blocks;     // live large (exact-size) blocks
+    uint64_t large_bytes;      // bytes they hold
+    uint64_t large_slack;      // bytes they hold beyond what was asked for
+    // pre-zeroed pools, summed over all CPUs and zones (0 if not configured)
+    uint64_t zero_hits;
+    uint64_t zero_misses;
+    uint64_t zero_fills;
+    uint64_t zero_bytes;       // bytes currently held in the pools
     uint64_t max_pools;  // how many pools can we written in the following
     uint64_t num_pools;   // how many pools were written in the following
     struct buddy_pool_stats pool_stats[0];
@@ -182,6 +293,13 @@ struct kmem_stats {
 uint64_t kmem_num_pools();
 void     kmem_stats(struct kmem_stats *stats);
 
+// return all blocks held in the calling CPU's cache to the buddy zones
+void     kmem_cache_drain_local(void);
+
+// zero one free block for the pools of the calling CPU's domain,
+// returns nonzero if there was one to do - called by idle CPUs
+int      kmem_zero_pool_fill(void);
+
 #ifdef __cplusplus
 }
 #endif
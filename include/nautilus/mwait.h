@@ -65,6 +65,21 @@ nk_mwait (uint32_t eax, uint32_t ecx)
                     
 }
 
+/*
+ * Enable interrupts and mwait.  The sti shadow covers the mwait, so
+ * an interrupt that arrives in between still ends the wait
+ */
+static inline void
+nk_sti_mwait (uint32_t eax, uint32_t ecx)
+{
+    asm volatile ("sti; mwait"
+                  : /* no outputs */
+                  : "a" (eax),
+                    "c" (ecx)
+                  : "memory");
+}
+
+uint8_t has_mwait(void);
 int nk_mwait_init(void);
 
 
@@ -28,11 +28,33 @@
 
 #define ETHER_MAC_LEN 6
 
+// offloads a device can perform (nk_net_dev_characteristics.offloads)
+#define NK_NET_DEV_OFFLOAD_TX_CSUM  0x1  // finishes partial TCP/UDP checksums on send
+#define NK_NET_DEV_OFFLOAD_TSO4     0x2  // segments TCP over IPv4 on send
+#define NK_NET_DEV_OFFLOAD_TSO6     0x4  // segments TCP over IPv6 on send
+
 struct nk_net_dev_characteristics {
     uint8_t  mac[ETHER_MAC_LEN];
     uint64_t min_tu;
     uint64_t max_tu;
     uint64_t (*packet_size_to_buffer_size)(uint64_t packet_size);
+    uint64_t offloads;     // NK_NET_DEV_OFFLOAD_*
+    uint64_t max_tso;      // largest frame accepted with segmentation offload
+    uint32_t num_queues;   // send/receive queue pairs, sends go to the caller's CPU's pair
+};
+
+#define NK_NET_DEV_GSO_NONE   0
+#define NK_NET_DEV_GSO_TCPV4  1
+#define NK_NET_DEV_GSO_TCPV6  2
+
+// how the device should finish a frame given to post_send_offload
+struct nk_net_dev_tx_offload {
+    uint8_t  csum;         // fill in the TCP/UDP checksum described below
+    uint8_t  gso_type;     // NK_NET_DEV_GSO_*, requires csum
+    uint16_t csum_start;   // offset in the frame where checksumming starts
+    uint16_t csum_offset;  // offset from csum_start where the checksum goes
+    uint16_t hdr_len;      // bytes of headers repeated in every segment
+    uint16_t mss;          // payload bytes per segment
 };
 
 
@@ -41,6 +63,14 @@ typedef enum {
     NK_NET_DEV_STATUS_ERROR
 } nk_net_dev_status_t;
 
+// one element of a batched send or receive
+struct nk_net_dev_buf {
+    uint8_t  *buf;
+    uint64_t  len;
+    void    (*callback)(nk_net_dev_status_t status, void *context);  // can be null
+    void     *context;
+};
+
 struct nk_net_dev_int {
     // this must be first so it derives cleanly
     // from nk_dev_int
@@ -53,6 +83,20 @@ struct nk_net_dev_int {
     // callback can be null
     int (*post_receive)(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
     int (*post_send)(void *state, uint8_t *src, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    // as post_send, but the device finishes the frame as described by o
+    int (*post_send_offload)(void *state, uint8_t *src, uint64_t len, struct nk_net_dev_tx_offload *o, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    // optional batching - post bufs[0..num) under one lock acquisition
+    // and one notification of the device.  Returns how many were
+    // posted, which are always a prefix of bufs; fewer than num means
+    // the device is full.  -1 on error
+    int (*post_receive_batch)(void *state, struct nk_net_dev_buf *bufs, uint64_t num);
+    int (*post_send_batch)(void *state, struct nk_net_dev_buf *bufs, uint64_t num);
+    // optional polling - complete up to budget sends and receives
+    // from the caller's context, returning how many, or -1 on error
+    int (*poll)(void *state, uint64_t budget);
+    // mask (0) or unmask (1) completion interrupts - unmasking returns
+    // 1 if completions are already waiting, and might not interrupt
+    int (*set_interrupts)(void *state, int enable);
 };
 
 
@@ -88,6 +132,25 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
                                             void *state),  // for callback reqs
 			   void *state);                  // for callback reqs
 
+// o can be null, in which case this is nk_net_dev_send_packet
+int nk_net_dev_send_packet_offload(struct nk_net_dev *dev, 
+				   uint8_t *src,
+				   uint64_t len,
+				   struct nk_net_dev_tx_offload *o,
+				   nk_dev_request_type_t type,
+				   void (*callback)(nk_net_dev_status_t status, 
+						    void *state),  // for callback reqs
+				   void *state);                  // for callback reqs
+
+// callback requests only - returns how many of bufs were posted, as
+// above; devices without batch support get one post per buffer
+int nk_net_dev_receive_batch(struct nk_net_dev *dev, struct nk_net_dev_buf *bufs, uint64_t num);
+int nk_net_dev_send_batch(struct nk_net_dev *dev, struct nk_net_dev_buf *bufs, uint64_t num);
+
+// -1 if the device cannot be polled - see also devpoll.h
+int nk_net_dev_poll(struct nk_net_dev *dev, uint64_t budget);
+int nk_net_dev_set_interrupts(struct nk_net_dev *dev, int enable);
+
 
 #endif
 
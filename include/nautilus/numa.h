@@ -66,6 +66,10 @@ struct mem_region {
 
     /* used by the kernel memory allocator */
     struct buddy_mempool * mm_state;
+    uint8_t              * mm_pmap;  /* per-block order and flags */
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+    struct kmem_zero_pool * mm_zero; /* pre-zeroed free blocks */
+#endif
 
     struct list_head entry;
 
@@ -99,6 +99,13 @@ typedef enum {
 
 int nk_map_page (addr_t vaddr, addr_t paddr, uint64_t flags, page_size_t ps);
 int nk_map_page_nocache (addr_t paddr, uint64_t flags, page_size_t ps);
+// unmap (guard=1) or remap (guard=0) one 4KB page of the identity map
+int nk_paging_guard_page (addr_t vaddr, int guard);
+// complete guard shootdowns deferred from interrupt context;
+// the idle loop calls this
+void nk_paging_guard_flush_deferred (void);
+// nonzero if the page is currently unmapped as a guard
+int nk_paging_guard_page_armed (addr_t vaddr);
 void nk_paging_init(struct nk_mem_info * mem, ulong_t mbd);
 
 int nk_pf_handler(excp_entry_t * excp, excp_vec_t vector, void *state);
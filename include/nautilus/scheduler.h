@@ -131,6 +131,11 @@ int    nk_sched_thread_move(struct nk_thread *thread, int new_cpu, int block);
 // any threads are stolen
 int    nk_sched_cpu_mug(int cpu, uint64_t max, uint64_t *actual);
 
+// Pull threads from a busier cpu to the caller's cpu if the average
+// aperiodic load is sufficiently imbalanced (NAUT_CONFIG_LOAD_BALANCE)
+// This is normally invoked periodically by the idle thread
+int    nk_sched_balance(uint64_t *actual);
+
 // Make the thread schedulable - generally only called by thread.c
 // When the thread is first launched admit=1 is used to do admisson on the 
 // designated CPU
@@ -140,6 +145,14 @@ int    nk_sched_make_runnable(struct nk_thread *thread, int cpu, int admit);
 // force a scheduling event on the CPU
 void   nk_sched_kick_cpu(int cpu);
 
+// nonzero if the caller's cpu has runnable threads (other than
+// the caller) or queued tasks.  Used by idle to decide to halt
+int    nk_sched_cpu_has_work();
+
+// a word that remote cpus write when they hand the caller's cpu
+// work, suitable for idle to monitor
+void  *nk_sched_cpu_wake_addr();
+
 // Put the thread to sleep / awaken it
 // these signal the scheduler that the thread is now on a 
 // non-scheduler queue (sleep) or is to be returned to a scheduler 
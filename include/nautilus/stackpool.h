@@ -0,0 +1,106 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter A. Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter A. Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __STACKPOOL_H__
+#define __STACKPOOL_H__
+
+#include <nautilus/mm.h>
+#include <nautilus/thread.h>
+
+// Thread stacks come in power-of-two size classes.  Each CPU keeps
+// a few free stacks of each class so that creating a thread after
+// one has been destroyed does not need the allocator.  With
+// NAUT_CONFIG_THREAD_STACK_GUARD, the lowest page of each stack
+// of at least STACK_GUARD_MIN_SIZE is unmapped.  The guard comes out
+// of the size class, so the usable stack can be 4 KB smaller than
+// what was asked for.   nk_stack_size() gives the usable size for
+// a request, and is what a thread's stack_size should be set to.
+
+#define STACK_POOL_MIN_ORDER  12  // 4 KB
+#define STACK_POOL_MAX_ORDER  22  // 4 MB, larger stacks bypass the pool
+#define STACK_GUARD_MIN_SIZE  0x4000
+#define STACK_GUARD_SIZE      0x1000
+
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+
+struct nk_stack_pool_stats {
+    uint64_t hits;      // allocations served from a pool
+    uint64_t misses;    // allocations that went to the allocator
+    uint64_t frees;     // stacks returned to a pool
+    uint64_t releases;  // stacks returned to the allocator
+    uint64_t pooled;    // stacks currently held in pools
+    uint64_t bytes;     // bytes currently held in pools
+    uint64_t guards;    // guard pages currently armed
+};
+
+int   nk_stack_pool_init(void);
+int   nk_stack_pool_init_ap(void);
+
+nk_stack_size_t nk_stack_size(nk_stack_size_t size);
+
+// returns the lowest usable address of a stack of nk_stack_size(size)
+// bytes, preferring memory and a pool local to cpu
+void *nk_stack_alloc(nk_stack_size_t size, int cpu);
+// size is the usable size, cpu is where the stack should be pooled
+void  nk_stack_free(void *stack, nk_stack_size_t size, int cpu);
+
+// return all pooled stacks to the allocator
+void  nk_stack_pool_drain(void);
+
+void  nk_stack_pool_get_stats(struct nk_stack_pool_stats *s);
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+// report a fault on a guard page, returns nonzero if it was one
+int   nk_stack_guard_check(addr_t fault_addr);
+// if the allocator block is a stack with an armed guard, give the
+// guard's range and return nonzero.  Used by code that walks
+// every allocated block and must not touch the guard
+int   nk_stack_guard_range(void *block, uint64_t size, addr_t *start, addr_t *end);
+#endif
+
+#else
+
+static inline nk_stack_size_t nk_stack_size(nk_stack_size_t size)
+{
+    return size;
+}
+
+static inline void *nk_stack_alloc(nk_stack_size_t size, int cpu)
+{
+    return malloc_specific(size,cpu);
+}
+
+static inline void nk_stack_free(void *stack, nk_stack_size_t size, int cpu)
+{
+    free(stack);
+}
+
+#endif
+
+#ifndef NAUT_CONFIG_THREAD_STACK_GUARD
+static inline int nk_stack_guard_range(void *block, uint64_t size, addr_t *start, addr_t *end)
+{
+    return 0;
+}
+#endif
+
+#endif
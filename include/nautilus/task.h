@@ -65,14 +65,14 @@ struct nk_task {
 
 
 // create and queue a task
-// cpu == -1 => any cpu
+// cpu == -1 => any cpu (queued locally, other cpus steal it if idle)
 // size == 0 => unknown size, otherwise worst case run time in ns
 // null return indicated the task cannot be queued
 struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void * (*f)(void*), void *input, uint64_t flags);
 
 // dequeue a task, typically used internally
 // dequeuing a task does not execute it.
-// cpu = -1 => any cpu
+// cpu = -1 => any other cpu (steal, nearest NUMA domains first)
 // size = 0 => unsized first, then sized
 // size > 0 => search sized queue for up to search_limit steps
 struct nk_task *nk_task_consume(int cpu, uint64_t size, uint64_t search_limit);
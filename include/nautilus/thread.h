@@ -207,6 +207,10 @@ struct nk_thread {
     int placement_cpu;
     int current_cpu;
 
+    // default kmem placement policy (KMEM_POLICY_*), inherited at creation
+    int      kmem_policy;
+    uint64_t kmem_nodemask;
+
     uint8_t is_idle;
 
     void **output_loc;  // where the thread should write output
@@ -47,7 +47,9 @@ typedef struct nk_timer {
     void              (*callback)(void *priv);
     void              *priv;
     struct list_head  node;            // global list of all timers
-    struct list_head  active_node;     // global list of active timers
+    struct list_head  active_node;     // slot of the timer wheel it is in
+    uint32_t          wheel_cpu;       // cpu whose wheel it is in
+    uint32_t          wheel_slot;      // level*WHEEL_SIZE+slot within the wheel
 } nk_timer_t;
 
 nk_timer_t *nk_timer_create(char *name);
@@ -94,10 +96,34 @@ void nk_timer_deinit();
 
 void nk_timer_dump_timers();
 
+// Active timers live in per-CPU timer wheels.  A callback timer
+// goes on the wheel of the cpu its callback is to run on, and any
+// other timer on the wheel of the cpu that starts it.  A timer must
+// not be started from two cpus at once.
+
 // The cpu time driver (e.g., apic) will invoke the following handler
 // function on every timer interrupt, regardless of how much time has passed
+// It expires the timers of the calling cpu's wheel.
 // The handler returns the time (in ns) from now whereupon it must be
 // called again at the latest.
 uint64_t nk_timer_handler(void);
 
+// The earliest time (in ns since CPU reset) at which some active 
+// timer on the calling cpu's wheel may expire, or -1 if there is 
+// none.  The handler must be invoked on this cpu at this time.  
+uint64_t nk_timer_next_deadline(void);
+
+struct nk_timer_stats {
+    uint64_t active;
+    uint64_t starts;
+    uint64_t cancels;
+    uint64_t expires;
+    uint64_t cascades;
+    uint64_t late_sum_ns;   // sum of expiry lateness
+    uint64_t late_max_ns;
+};
+
+// statistics of one cpu's wheel
+int nk_timer_get_stats(int cpu, struct nk_timer_stats *stats);
+
 #endif
@@ -0,0 +1,109 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2019, Peter Dinda
+ * Copyright (c) 2019, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __NK_TLB
+#define __NK_TLB
+
+//
+// TLB shootdowns for address spaces
+//
+// An address space implementation embeds a struct nk_tlb_domain for
+// each set of page tables it manages.  Its switch_to calls
+// nk_tlb_domain_enter() and its switch_from nk_tlb_domain_leave(),
+// which track the CPUs the domain is active on.  After it changes or
+// removes mappings, it describes them in a batch and flushes the
+// batch, which invalidates them on this CPU and sends one IPI to each
+// other CPU the domain is active on.  Each CPU uses INVLPG for small
+// batches and drops the whole domain from its TLB for large ones.
+//
+// A CPU that is not running the domain is not interrupted.  Each
+// flush advances the domain's generation, and a CPU entering the
+// domain with entries cached from an older generation flushes them
+// then.  Batches for one domain must be serialized by the caller,
+// usually by the lock protecting its page tables.
+//
+// Interrupts are off while a flush waits for the other CPUs.  Code
+// that spins with interrupts off on something a flushing CPU may hold
+// (such as that lock) must call nk_tlb_poll() while it spins.
+//
+
+#define NK_TLB_BATCH_RANGES 16
+
+// more pages than this in a batch are flushed all at once
+#define NK_TLB_INVLPG_MAX   32
+
+#define NK_TLB_CPU_WORDS    ((NAUT_CONFIG_MAX_CPUS+63)/64)
+
+struct nk_tlb_domain {
+    uint64_t           pcid;        // 0 => untagged, entering always flushes
+    volatile uint64_t  gen;
+    volatile uint64_t  active[NK_TLB_CPU_WORDS];
+    volatile uint64_t  cpu_gen[NAUT_CONFIG_MAX_CPUS];  // generation each CPU's TLB holds
+};
+
+struct nk_tlb_range {
+    addr_t   va;
+    uint64_t page_size;
+    uint64_t num_pages;
+};
+
+struct nk_tlb_batch {
+    struct nk_tlb_domain *domain;   // 0 => the kernel's shared mappings
+    int                   full;     // too much to do page by page
+    uint64_t              num_pages;
+    uint64_t              num_ranges;
+    struct nk_tlb_range   ranges[NK_TLB_BATCH_RANGES];
+};
+
+struct nk_tlb_stats {
+    uint64_t flushes;       // batches flushed
+    uint64_t ipis;          // IPIs sent for them
+    uint64_t handled;       // requests handled for other CPUs
+    uint64_t lazy;          // ... where the domain had been left
+    uint64_t invlpgs;
+    uint64_t full_flushes;
+};
+
+void nk_tlb_domain_init(struct nk_tlb_domain *d, uint64_t pcid);
+
+// interrupts must be off - returns 1 if the domain's tagged entries
+// in this CPU's TLB are current, so CR3 can be loaded without flushing
+int  nk_tlb_domain_enter(struct nk_tlb_domain *d);
+void nk_tlb_domain_leave(struct nk_tlb_domain *d);
+
+void nk_tlb_batch_init(struct nk_tlb_batch *b, struct nk_tlb_domain *d);
+void nk_tlb_batch_add(struct nk_tlb_batch *b, addr_t va, uint64_t page_size);
+// returns once every CPU running the domain has invalidated the batch
+void nk_tlb_batch_flush(struct nk_tlb_batch *b);
+
+// handle requests from other CPUs while spinning with interrupts off
+void nk_tlb_poll(void);
+
+// invalidate a change to the kernel's shared mappings on every CPU
+void nk_tlb_flush_kernel(addr_t va, uint64_t page_size);
+
+void nk_tlb_get_stats(struct nk_tlb_stats *s);
+
+int  nk_tlb_init(void);
+
+#endif
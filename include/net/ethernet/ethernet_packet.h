@@ -50,6 +50,8 @@ typedef struct nk_ethernet_packet {
 
     int              alloc_cpu;      // the cpu this packet was allocated for
 
+    uint32_t         pool;           // internal - the pool this packet returns to
+
     uint32_t         len;            // how many bytes of the raw data are in use
 
     void             *metadata;      // for external use
@@ -73,7 +75,8 @@ typedef struct nk_ethernet_packet {
 #define htons(x) ntohs(x)
 #define htonl(x) ntohl(x)
 
-// allocate a packet with an affinity for the given cpu (-1 => any)
+// allocate a packet with an affinity for the given cpu (-1 => the
+// caller's cpu, which is the fast path)
 // allocating a packet will also acquire it (refcount => 1 ).
 // until the packet is released for the final time, the node field can be used
 // by the caller
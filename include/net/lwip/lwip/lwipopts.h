@@ -18,6 +18,12 @@
 // ?
 //#define LWIP_DBG_TYPES_ON 1
 
+// ethernetif hands received frames to lwIP in place as custom pbufs,
+// and sends single-pbuf frames in place, so have TCP build each
+// segment in one pbuf
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+#define LWIP_NETIF_TX_SINGLE_PBUF 1
+
 // New after here
 
 // new - do core locking
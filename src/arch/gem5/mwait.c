@@ -38,7 +38,7 @@ static struct mwait_info {
 } mwait;
 
 
-static uint8_t
+uint8_t
 has_mwait (void) 
 {
     cpuid_ret_t ret;
@@ -71,13 +71,13 @@ nk_mwait_init (void)
 
     if (has_mwait()) {
         printk("Processor supports MONITOR/MWAIT extensions\n");
-        mwait.available = 1;
     } else {
         printk("MWAIT not supported\n");
         return 0;
     }
 
     memset(&mwait, 0, sizeof(mwait));
+    mwait.available = 1;
 
     cpuid(0x5, &ret);
 
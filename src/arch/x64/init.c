@@ -169,6 +169,10 @@
 #include <nautilus/monitor.h>
 #endif
 
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+#include <nautilus/stackpool.h>
+#endif
+
 
 extern spinlock_t printk_lock;
 
@@ -408,6 +412,10 @@ init (unsigned long mbd,
 
     pci_init(naut);
 
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+    nk_stack_pool_init();
+#endif
+
     nk_sched_init(&sched_cfg);
 
 #ifdef NAUT_CONFIG_CACHEPART
@@ -27,7 +27,13 @@
 #include <nautilus/spinlock.h>
 #include <nautilus/paging.h>
 #include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/timer.h>
+#include <nautilus/smp.h>
+#include <nautilus/mm.h>
+#include <nautilus/stackpool.h>
 #include <nautilus/shell.h>
+#include <nautilus/vc.h>
 
 #include <nautilus/aspace.h>
 
@@ -40,15 +46,1120 @@
 #define DEBUG(fmt, args...) DEBUG_PRINT("aspace-carat: " fmt, ##args)
 #define INFO(fmt, args...)   INFO_PRINT("aspace-carat: " fmt, ##args)
 
+//
+// A CARAT address space does not translate - it runs on the kernel's
+// identity map - but it knows where each piece of memory it holds is
+// and where the pointers to it are, so it can move that memory while
+// it is in use.  A region is a kmem block (va == pa == the start of
+// the block, at most the block's length) that is handed to
+// nk_aspace_add_region().  There is no compiler instrumentation to
+// register allocations, so only memory that is explicitly added is
+// tracked.  Protections are recorded but not enforced.
+//
+// Pointers into a region ("escapes") are found with the world stopped
+// by a conservative scan like the one pdsgc does, except that instead
+// of chasing pointers from the roots it searches the data and bss
+// sections and every allocated block, which includes the stacks and
+// saved registers of every thread.  Moving a region copies it into a
+// new block, rewrites each escape to point into the copy, and frees
+// the old block.  Any aligned, even word whose value falls inside the
+// region is taken to be a pointer to it.  Odd values are not, since
+// page table entries (physical address | present) would otherwise look
+// exactly like pointers into the memory they map.  A region that is
+// known by address to something the scan cannot see or must not
+// change - a device, a DMA descriptor, a pointer to an odd address in
+// it, or one just past its end - has to be pinned (NK_ASPACE_PIN).
+//
+// A compactor empties chunks of memory (2 MB by default) whose only
+// allocated blocks are movable regions, so that each coalesces into a
+// free block that can back a large page or a large allocation.  It
+// runs in the background when configured to, and on demand from the
+// "carat" shell command.
+//
+
+#define CHUNK_SIZE  (1ULL << NAUT_CONFIG_ASPACE_CARAT_CHUNK_ORDER)
+#define MAX_MOVES   NAUT_CONFIG_ASPACE_CARAT_MAX_MOVES
+#define MAX_HOLDS   64    // replacement blocks that landed in the chunk being emptied
+#define MAX_CHUNKS  64    // chunks one compaction pass looks at
+#define MIN_BLOCK   32    // smallest kmem block
+
+// chunks emptied per background pass
+#define COMPACT_CHUNKS 8
+
+typedef struct carat_region {
+    nk_aspace_region_t region;
+    uint64_t           block_size;  // of the kmem block holding the region
+    uint64_t           escapes;     // pointers into it found by the last scan
+    struct list_head   node;
+} carat_region_t;
+
+typedef struct nk_aspace_carat {
+    nk_aspace_t       *aspace;
+
+    spinlock_t         lock;
+
+    struct list_head   regions;
+
+    nk_aspace_characteristics_t chars;
+
+    uint64_t           num_threads;
+
+    struct list_head   node;         // on the list of all carat aspaces
+
+    struct {
+	uint64_t moves;
+	uint64_t bytes_moved;
+	uint64_t escapes_patched;
+    } stats;
+} nk_aspace_carat_t;
+
+// one region being moved or scanned for
+struct carat_move {
+    nk_aspace_carat_t *p;
+    carat_region_t    *r;
+    addr_t             src;
+    addr_t             dst;
+    uint64_t           len;       // bytes copied and searched for, 0 => skip
+    uint64_t           dst_size;  // of the destination block
+    uint64_t           escapes;
+    int                moved;
+};
+
+// Everything the relocation machinery keeps track of addresses with.
+// It is one block that the scan skips, so that patching does not
+// rewrite the source addresses of the moves in progress.
+static struct carat_work {
+    struct carat_move  moves[MAX_MOVES];
+    uint64_t           num_moves;
+    addr_t             tried[MAX_CHUNKS];
+    uint64_t           num_tried;
+    void              *holds[MAX_HOLDS];
+    uint64_t           num_holds;
+} *work;
+
+struct carat_scan {
+    struct carat_move *moves;      // sorted by src
+    uint64_t           num;
+    int                patch;
+    addr_t             lo, hi;     // bounds of all the sources
+    struct {
+	addr_t start;
+	addr_t end;
+    } excl[3];
+    uint64_t           num_excl;
+    uint64_t           words;
+    uint64_t           found;
+};
+
+static spinlock_t        carat_lock;    // protects carat_list
+static LIST_HEAD(carat_list);
+
+// one relocation, scan, or compaction pass at a time, and no aspace
+// is destroyed during one
+static spinlock_t        move_lock;
+
+static struct {
+    uint64_t scans;
+    uint64_t scan_words;
+    uint64_t stopped_ns;
+    uint64_t moves;
+    uint64_t bytes_moved;
+    uint64_t escapes_patched;
+    uint64_t passes;
+    uint64_t chunks_freed;
+    uint64_t chunks_failed;
+} stats;
+
+extern int _data_start, _data_end;
+
+// the holder may stop the world, so we must not wait with interrupts off
+static void move_lock_acquire(void)
+{
+    while (spin_try_lock(&move_lock)) {
+	nk_yield();
+    }
+}
+
+static void move_lock_release(void)
+{
+    spin_unlock(&move_lock);
+}
+
+#define CARAT_LOCK_CONF uint8_t _carat_lock_flags
+#define CARAT_LOCK(p) _carat_lock_flags = spin_lock_irq_save(&(p)->lock)
+#define CARAT_UNLOCK(p) spin_unlock_irq_restore(&(p)->lock, _carat_lock_flags)
+
+static inline int is_pow2(uint64_t x)
+{
+    return x && !(x & (x-1));
+}
+
+// large blocks are not movable because kmem keeps their address in a
+// descriptor of its own
+static inline int region_movable(carat_region_t *r)
+{
+    return !(r->region.protect.flags & NK_ASPACE_PIN) && is_pow2(r->block_size);
+}
+
+static carat_region_t *find_region(nk_aspace_carat_t *p, nk_aspace_region_t *region)
+{
+    struct list_head *cur;
+
+    list_for_each(cur,&p->regions) {
+	carat_region_t *r = list_entry(cur,carat_region_t,node);
+	if (r->region.va_start==region->va_start &&
+	    r->region.pa_start==region->pa_start &&
+	    r->region.len_bytes==region->len_bytes) {
+	    return r;
+	}
+    }
+
+    return 0;
+}
+
+// is the block at addr a region of any carat aspace?
+static int block_tracked(addr_t addr)
+{
+    struct list_head *cur, *rcur;
+    int found = 0;
+    uint8_t flags;
+    CARAT_LOCK_CONF;
+
+    flags = spin_lock_irq_save(&carat_lock);
+
+    list_for_each(cur,&carat_list) {
+	nk_aspace_carat_t *p = list_entry(cur,nk_aspace_carat_t,node);
+	CARAT_LOCK(p);
+	list_for_each(rcur,&p->regions) {
+	    carat_region_t *r = list_entry(rcur,carat_region_t,node);
+	    if ((addr_t)r->region.va_start==addr) {
+		found = 1;
+		break;
+	    }
+	}
+	CARAT_UNLOCK(p);
+	if (found) {
+	    break;
+	}
+    }
+
+    spin_unlock_irq_restore(&carat_lock,flags);
+
+    return found;
+}
+
+// a region must be an allocated kmem block, or a prefix of one,
+// and must not already be tracked; returns the block's size
+static uint64_t region_block(nk_aspace_region_t *region)
+{
+    void *block;
+    uint64_t size, flags;
+
+    if (!region->len_bytes || region->va_start!=region->pa_start) {
+	ERROR("Region %p-%p is empty or not identity mapped\n",
+	      region->va_start,region->va_start+region->len_bytes);
+	return 0;
+    }
+
+    if (kmem_find_block(region->va_start,&block,&size,&flags) ||
+	block!=region->va_start || region->len_bytes>size) {
+	ERROR("Region %p-%p is not an allocated block\n",
+	      region->va_start,region->va_start+region->len_bytes);
+	return 0;
+    }
+
+    if (block_tracked((addr_t)block)) {
+	ERROR("Region %p-%p is already tracked\n",
+	      region->va_start,region->va_start+region->len_bytes);
+	return 0;
+    }
+
+    return size;
+}
+
+
+//
+// Scanning
+//
+
+static struct carat_move *find_move(struct carat_scan *s, addr_t v)
+{
+    uint64_t lo = 0, hi = s->num, mid;
+
+    if (v<s->lo || v>=s->hi) {
+	return 0;
+    }
+
+    // skipped moves have no length, so never match
+    while (lo<hi) {
+	mid = (lo+hi)/2;
+	if (v<s->moves[mid].src) {
+	    hi = mid;
+	} else if (v>=s->moves[mid].src+s->moves[mid].len) {
+	    lo = mid+1;
+	} else {
+	    return &s->moves[mid];
+	}
+    }
+
+    return 0;
+}
+
+static void scan_words(struct carat_scan *s, addr_t start, addr_t end)
+{
+    addr_t *w = (addr_t *)((start+7) & ~0x7UL);
+    addr_t *e = (addr_t *)(end & ~0x7UL);
+    struct carat_move *m;
+    addr_t v;
+
+    if (w>=e) {
+	return;
+    }
+
+    s->words += e-w;
+
+    for (;w<e;w++) {
+	v = *w;
+	if ((v & 0x1) || !(m = find_move(s,v))) {
+	    continue;
+	}
+	m->escapes++;
+	s->found++;
+	if (s->patch) {
+	    *w = v - m->src + m->dst;
+	}
+    }
+}
+
+// scan a range, leaving out the excluded ranges from excl on
+static void scan_range(struct carat_scan *s, addr_t start, addr_t end, uint64_t excl)
+{
+    for (;excl<s->num_excl;excl++) {
+	addr_t es = s->excl[excl].start;
+	addr_t ee = s->excl[excl].end;
+	if (es<end && ee>start) {
+	    if (start<es) {
+		scan_range(s,start,es,excl+1);
+	    }
+	    if (ee<end) {
+		scan_range(s,ee,end,excl+1);
+	    }
+	    return;
+	}
+    }
+
+    scan_words(s,start,end);
+}
+
+static int scan_block(void *block, void *state)
+{
+    struct carat_scan *s = (struct carat_scan *)state;
+    struct carat_move *m;
+    void *b;
+    uint64_t size, flags;
+    addr_t gs, ge;
+
+    if (kmem_find_block(block,&b,&size,&flags) || b!=block) {
+	return 0;
+    }
+
+    // a source that has been copied is garbage
+    if (s->patch && (m = find_move(s,(addr_t)block)) && m->src==(addr_t)block) {
+	return 0;
+    }
+
+    // the guard page of a thread stack is not mapped
+    if (nk_stack_guard_range(block,size,&gs,&ge)) {
+	scan_range(s,(addr_t)block,gs,0);
+	scan_range(s,ge,(addr_t)block+size,0);
+	return 0;
+    }
+
+    scan_range(s,(addr_t)block,(addr_t)block+size,0);
+
+    return 0;
+}
+
+// is the move's region still where it was when the move was set up?
+// The world is stopped, so nothing holds the aspace's lock.
+static int move_valid(struct carat_move *m, int patch)
+{
+    struct list_head *cur;
+    void *block;
+    uint64_t size, flags;
+
+    list_for_each(cur,&m->p->regions) {
+	carat_region_t *r = list_entry(cur,carat_region_t,node);
+	if (r==m->r) {
+	    return (addr_t)r->region.va_start==m->src &&
+		(!patch || region_movable(r)) &&
+		!kmem_find_block((void*)m->src,&block,&size,&flags) &&
+		(addr_t)block==m->src;
+	}
+    }
+
+    return 0;
+}
+
+// With the world stopped, search for pointers into the sources of
+// the moves, and if patching, first copy each source to its
+// destination and afterwards retarget the pointers and the regions.
+// limit is the lowest address of the calling thread's stack that
+// belongs to our callers - everything below it is ours, so this must
+// not be inlined into carat_scan().
+static __attribute__((noinline)) void world_scan(struct carat_move *m, uint64_t n, int patch, addr_t limit)
+{
+    struct carat_scan s;
+    nk_thread_t *t = get_cur_thread();
+    void *kstart, *kend;
+    uint64_t start, i;
+
+    memset(&s,0,sizeof(s));
+    s.moves = m;
+    s.num = n;
+    s.patch = patch;
+    s.lo = -1;
+
+    kmem_get_internal_pointer_range(&kstart,&kend);
+    s.excl[s.num_excl].start = (addr_t)kstart;
+    s.excl[s.num_excl++].end = (addr_t)kend;
+    s.excl[s.num_excl].start = (addr_t)t->stack;
+    s.excl[s.num_excl++].end = limit;
+    s.excl[s.num_excl].start = (addr_t)work;
+    s.excl[s.num_excl++].end = (addr_t)(work+1);
+
+    nk_sched_stop_world();
+
+    start = nk_sched_get_realtime();
+
+    for (i=0;i<n;i++) {
+	m[i].escapes = 0;
+	m[i].moved = 0;
+	if (!move_valid(&m[i],patch)) {
+	    m[i].len = 0;
+	    continue;
+	}
+	if (patch) {
+	    memcpy((void*)m[i].dst,(void*)m[i].src,m[i].len);
+	}
+	if (m[i].src<s.lo) {
+	    s.lo = m[i].src;
+	}
+	if (m[i].src+m[i].len>s.hi) {
+	    s.hi = m[i].src+m[i].len;
+	}
+    }
+
+    scan_range(&s,(addr_t)&_data_start,(addr_t)&_data_end,0);
+    kmem_apply_to_matching_blocks(0,0,scan_block,&s);
+
+    for (i=0;i<n;i++) {
+	carat_region_t *r = m[i].r;
+	if (!m[i].len) {
+	    continue;
+	}
+	r->escapes = m[i].escapes;
+	if (patch) {
+	    // the scan has usually done this already, since the
+	    // region's record points at it
+	    r->region.va_start = r->region.pa_start = (void*)m[i].dst;
+	    r->block_size = m[i].dst_size;
+	    m[i].moved = 1;
+	    m[i].p->stats.moves++;
+	    m[i].p->stats.bytes_moved += m[i].len;
+	    m[i].p->stats.escapes_patched += m[i].escapes;
+	    stats.moves++;
+	    stats.bytes_moved += m[i].len;
+	    stats.escapes_patched += m[i].escapes;
+	}
+    }
+
+    stats.scans++;
+    stats.scan_words += s.words;
+    stats.stopped_ns += nk_sched_get_realtime() - start;
+
+    nk_sched_start_world();
+
+    DEBUG("%s %lu regions: %lu words searched, %lu pointers found\n",
+	  patch ? "Moved" : "Scanned for",n,s.words,s.found);
+}
+
+// Our callers may hold pointers into the regions in registers.  This
+// frame spills every callee-saved register and the scan of our stack
+// starts at its bottom, so those, and our callers' frames, are
+// patched, while world_scan's own frames are not.  Caller must hold
+// move_lock.
+static __attribute__((noinline)) void carat_scan(struct carat_move *m, uint64_t n, int patch)
+{
+    addr_t limit;
+
+    __builtin_unwind_init();
+
+    asm volatile ("movq %%rsp, %0" : "=r"(limit));
+
+    world_scan(m,n,patch,limit);
+
+    // keep the frame alive until the scan is done
+    asm volatile ("" : : "r"(limit) : "memory");
+}
+
+static void sort_moves(struct carat_move *m, uint64_t n)
+{
+    struct carat_move t;
+    uint64_t i, j;
+
+    for (i=1;i<n;i++) {
+	t = m[i];
+	for (j=i;j>0 && m[j-1].src>t.src;j--) {
+	    m[j] = m[j-1];
+	}
+	m[j] = t;
+    }
+}
+
+
+//
+// Compaction
+//
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+static void drain_xcall(void *arg)
+{
+    kmem_cache_drain_local();
+}
+#endif
+
+// blocks parked in CPU caches would keep chunks from coalescing
+static void drain_caches(void)
+{
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    struct sys_info *sys = &(nk_get_nautilus_info()->sys);
+    uint64_t i;
+
+    for (i=0;i<sys->num_cpus;i++) {
+	smp_xcall(i,drain_xcall,0,1);
+    }
+#endif
+}
+
+static inline int in_chunk(addr_t chunk, addr_t addr)
+{
+    return addr>=chunk && addr<chunk+CHUNK_SIZE;
+}
+
+// a region the compactor can take out of its chunk
+static inline int region_evacuable(carat_region_t *r)
+{
+    return region_movable(r) && r->block_size<CHUNK_SIZE;
+}
+
+// caller holds carat_lock
+static uint64_t movable_bytes_in_chunk(addr_t chunk)
+{
+    struct list_head *cur, *rcur;
+    uint64_t bytes = 0;
+    CARAT_LOCK_CONF;
+
+    list_for_each(cur,&carat_list) {
+	nk_aspace_carat_t *p = list_entry(cur,nk_aspace_carat_t,node);
+	CARAT_LOCK(p);
+	list_for_each(rcur,&p->regions) {
+	    carat_region_t *r = list_entry(rcur,carat_region_t,node);
+	    if (region_evacuable(r) && in_chunk(chunk,(addr_t)r->region.va_start)) {
+		bytes += r->block_size;
+	    }
+	}
+	CARAT_UNLOCK(p);
+    }
+
+    return bytes;
+}
+
+// caller holds carat_lock
+static addr_t untried_chunk(void)
+{
+    struct list_head *cur, *rcur;
+    addr_t chunk = 0;
+    uint64_t i;
+    CARAT_LOCK_CONF;
+
+    list_for_each(cur,&carat_list) {
+	nk_aspace_carat_t *p = list_entry(cur,nk_aspace_carat_t,node);
+	CARAT_LOCK(p);
+	list_for_each(rcur,&p->regions) {
+	    carat_region_t *r = list_entry(rcur,carat_region_t,node);
+	    if (!region_evacuable(r)) {
+		continue;
+	    }
+	    chunk = (addr_t)r->region.va_start & ~(CHUNK_SIZE-1);
+	    for (i=0;i<work->num_tried && work->tried[i]!=chunk;i++) {
+	    }
+	    if (i==work->num_tried) {
+		break;
+	    }
+	    chunk = 0;
+	}
+	CARAT_UNLOCK(p);
+	if (chunk) {
+	    break;
+	}
+    }
+
+    return chunk;
+}
+
+// The next chunk that is partly free and otherwise holds only
+// movable regions.  It is recorded as tried.
+static addr_t next_chunk(void)
+{
+    addr_t chunk;
+    uint64_t movable, used;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&carat_lock);
+
+    while (work->num_tried<MAX_CHUNKS && (chunk = untried_chunk())) {
+	work->tried[work->num_tried++] = chunk;
+	movable = movable_bytes_in_chunk(chunk);
+	used = kmem_range_used_bytes((void*)chunk,CHUNK_SIZE);
+	if (used==movable && used<CHUNK_SIZE) {
+	    spin_unlock_irq_restore(&carat_lock,flags);
+	    return chunk;
+	}
+    }
+
+    spin_unlock_irq_restore(&carat_lock,flags);
+
+    return 0;
+}
+
+// gather the chunk's regions into the work moves
+static int collect_chunk(addr_t chunk)
+{
+    struct list_head *cur, *rcur;
+    int rc = 0;
+    uint8_t flags;
+    CARAT_LOCK_CONF;
+
+    work->num_moves = 0;
+
+    flags = spin_lock_irq_save(&carat_lock);
+
+    list_for_each(cur,&carat_list) {
+	nk_aspace_carat_t *p = list_entry(cur,nk_aspace_carat_t,node);
+	CARAT_LOCK(p);
+	list_for_each(rcur,&p->regions) {
+	    carat_region_t *r = list_entry(rcur,carat_region_t,node);
+	    struct carat_move *m;
+	    if (!region_evacuable(r) || !in_chunk(chunk,(addr_t)r->region.va_start)) {
+		continue;
+	    }
+	    if (work->num_moves==MAX_MOVES) {
+		rc = -1;
+		break;
+	    }
+	    m = &work->moves[work->num_moves++];
+	    memset(m,0,sizeof(*m));
+	    m->p = p;
+	    m->r = r;
+	    m->src = (addr_t)r->region.va_start;
+	    m->len = r->region.len_bytes;
+	    m->dst_size = r->block_size;
+	}
+	CARAT_UNLOCK(p);
+	if (rc) {
+	    break;
+	}
+    }
+
+    spin_unlock_irq_restore(&carat_lock,flags);
+
+    return rc;
+}
+
+static void free_holds(void)
+{
+    while (work->num_holds) {
+	kmem_free(work->holds[--work->num_holds]);
+    }
+}
+
+// Find each region of the chunk a new home outside of it.  A block
+// the allocator hands back from inside the chunk is held until the
+// evacuation is over, so it is not offered again.
+static int place_moves(addr_t chunk)
+{
+    uint64_t i;
+    void *d;
+
+    for (i=0;i<work->num_moves;i++) {
+	while ((d = kmem_malloc(work->moves[i].dst_size)) && in_chunk(chunk,(addr_t)d)) {
+	    if (work->num_holds==MAX_HOLDS) {
+		kmem_free(d);
+		d = 0;
+		break;
+	    }
+	    work->holds[work->num_holds++] = d;
+	}
+	if (!d) {
+	    while (i--) {
+		kmem_free((void*)work->moves[i].dst);
+	    }
+	    free_holds();
+	    return -1;
+	}
+	work->moves[i].dst = (addr_t)d;
+    }
+
+    return 0;
+}
+
+// caller holds move_lock
+static int evacuate(addr_t chunk)
+{
+    struct carat_move *m;
+    uint64_t i;
+
+    work->num_holds = 0;
+
+    if (collect_chunk(chunk) || !work->num_moves) {
+	DEBUG("Chunk %016lx has too many regions to move\n",chunk);
+	return -1;
+    }
+
+    if (place_moves(chunk)) {
+	DEBUG("Cannot place the regions of chunk %016lx elsewhere\n",chunk);
+	return -1;
+    }
+
+    sort_moves(work->moves,work->num_moves);
+
+    // from here, chunk may have been patched if a region starts there
+    carat_scan(work->moves,work->num_moves,1);
+
+    for (i=0;i<work->num_moves;i++) {
+	m = &work->moves[i];
+	kmem_free((void*)(m->moved ? m->src : m->dst));
+    }
+
+    free_holds();
+
+    // our frees went to this CPU's cache
+    kmem_cache_drain_local();
+
+    return 0;
+}
+
+// empty up to max_chunks chunks, returning how many were emptied
+static uint64_t compact(uint64_t max_chunks)
+{
+    uint64_t freed = 0;
+    addr_t chunk;
+
+    drain_caches();
+
+    move_lock_acquire();
+
+    if (!work) {
+	move_lock_release();
+	return 0;
+    }
+
+    work->num_tried = 0;
+
+    while (freed<max_chunks && (chunk = next_chunk())) {
+	if (evacuate(chunk)) {
+	    stats.chunks_failed++;
+	} else {
+	    freed++;
+	}
+    }
+
+    stats.passes++;
+    stats.chunks_freed += freed;
+
+    move_lock_release();
+
+    return freed;
+}
+
+#ifdef NAUT_CONFIG_ASPACE_CARAT_COMPACTOR
+static int compactor_started = 0;
+
+static void compactor(void *in, void **out)
+{
+    nk_thread_name(get_cur_thread(),"carat-compactor");
+
+    while (1) {
+	nk_sleep(NAUT_CONFIG_ASPACE_CARAT_COMPACT_PERIOD * 1000000ULL);
+	if (!list_empty(&carat_list)) {
+	    compact(COMPACT_CHUNKS);
+	}
+    }
+}
+#endif
+
+
+//
+// Address space interface
+//
+
+static int destroy(void *state)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+    struct list_head *cur, *temp;
+    uint8_t flags;
+    CARAT_LOCK_CONF;
+
+    // no move may be using our regions
+    move_lock_acquire();
+
+    CARAT_LOCK(p);
+
+    if (p->num_threads) {
+	CARAT_UNLOCK(p);
+	move_lock_release();
+	ERROR("Cannot destroy %s while it has %lu threads\n",p->aspace->name,p->num_threads);
+	return -1;
+    }
+
+    list_for_each_safe(cur,temp,&p->regions) {
+	carat_region_t *r = list_entry(cur,carat_region_t,node);
+	list_del(&r->node);
+	free(r);
+    }
+
+    CARAT_UNLOCK(p);
+
+    flags = spin_lock_irq_save(&carat_lock);
+    list_del(&p->node);
+    spin_unlock_irq_restore(&carat_lock,flags);
+
+    move_lock_release();
+
+    nk_aspace_unregister(p->aspace);
+
+    free(p);
+
+    return 0;
+}
+
+static int add_thread(void *state)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+
+    __sync_fetch_and_add(&p->num_threads,1);
+
+    DEBUG("Add thread %d to %s\n",get_cur_thread()->tid,p->aspace->name);
+
+    return 0;
+}
+
+static int remove_thread(void *state)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+
+    __sync_fetch_and_sub(&p->num_threads,1);
+
+    DEBUG("Remove thread %d from %s\n",get_cur_thread()->tid,p->aspace->name);
+
+    return 0;
+}
+
+static int add_region(void *state, nk_aspace_region_t *region)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+    carat_region_t *r;
+    uint64_t size;
+    CARAT_LOCK_CONF;
+
+    if (!(size = region_block(region))) {
+	return -1;
+    }
+
+    r = malloc(sizeof(*r));
+
+    if (!r) {
+	ERROR("Cannot allocate region\n");
+	return -1;
+    }
+
+    memset(r,0,sizeof(*r));
+    r->region = *region;
+    r->block_size = size;
+    INIT_LIST_HEAD(&r->node);
+
+    CARAT_LOCK(p);
+    list_add_tail(&r->node,&p->regions);
+    CARAT_UNLOCK(p);
+
+    DEBUG("Added region %p-%p (block of %lu bytes) to %s\n",region->va_start,
+	  region->va_start+region->len_bytes, size, p->aspace->name);
+
+    return 0;
+}
+
+// the block stays allocated - it is the caller's again
+static int remove_region(void *state, nk_aspace_region_t *region)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+    carat_region_t *r;
+    CARAT_LOCK_CONF;
+
+    CARAT_LOCK(p);
+
+    if (!(r = find_region(p,region))) {
+	CARAT_UNLOCK(p);
+	ERROR("Region %p-%p is not in %s\n",region->va_start,
+	      region->va_start+region->len_bytes,p->aspace->name);
+	return -1;
+    }
+
+    list_del(&r->node);
+
+    CARAT_UNLOCK(p);
+
+    free(r);
+
+    return 0;
+}
+
+static int protect_region(void *state, nk_aspace_region_t *region, nk_aspace_protection_t *prot)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+    carat_region_t *r;
+    CARAT_LOCK_CONF;
+
+    CARAT_LOCK(p);
+
+    if (!(r = find_region(p,region))) {
+	CARAT_UNLOCK(p);
+	ERROR("Region %p-%p is not in %s\n",region->va_start,
+	      region->va_start+region->len_bytes,p->aspace->name);
+	return -1;
+    }
+
+    r->region.protect = *prot;
+
+    CARAT_UNLOCK(p);
+
+    return 0;
+}
+
+// The region's contents move to new_region, which must be a freshly
+// allocated block at least as long, and every pointer into the region
+// is changed to point to the same place in the new one.  The old
+// block is freed.  Since the caller's own pointers are patched too,
+// cur_region itself may describe the new region afterwards.
+static int move_region(void *state, nk_aspace_region_t *cur_region, nk_aspace_region_t *new_region)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+    nk_aspace_protection_t prot = new_region->protect;
+    struct carat_move *m;
+    carat_region_t *r;
+    uint64_t size;
+    int rc;
+    CARAT_LOCK_CONF;
+
+    if (cur_region->len_bytes != new_region->len_bytes) {
+	ERROR("Cannot change the length of a region by moving it\n");
+	return -1;
+    }
+
+    if (!(size = region_block(new_region))) {
+	return -1;
+    }
+
+    move_lock_acquire();
+
+    if (!work) {
+	move_lock_release();
+	return -1;
+    }
+
+    CARAT_LOCK(p);
+
+    if (!(r = find_region(p,cur_region))) {
+	CARAT_UNLOCK(p);
+	move_lock_release();
+	ERROR("Region %p-%p is not in %s\n",cur_region->va_start,
+	      cur_region->va_start+cur_region->len_bytes,p->aspace->name);
+	return -1;
+    }
+
+    if (!region_movable(r)) {
+	CARAT_UNLOCK(p);
+	move_lock_release();
+	ERROR("Region %p-%p is pinned or a large block\n",cur_region->va_start,
+	      cur_region->va_start+cur_region->len_bytes);
+	return -1;
+    }
+
+    m = &work->moves[0];
+    memset(m,0,sizeof(*m));
+    m->p = p;
+    m->r = r;
+    m->src = (addr_t)r->region.va_start;
+    m->dst = (addr_t)new_region->va_start;
+    m->len = r->region.len_bytes;
+    m->dst_size = size;
+    work->num_moves = 1;
+
+    CARAT_UNLOCK(p);
+
+    carat_scan(work->moves,1,1);
+
+    if ((rc = m->moved ? 0 : -1)) {
+	ERROR("Region was removed while it was being moved\n");
+    } else {
+	kmem_free((void*)m->src);
+	CARAT_LOCK(p);
+	r->region.protect = prot;
+	CARAT_UNLOCK(p);
+    }
+
+    move_lock_release();
+
+    return rc;
+}
+
+static int switch_from(void *state)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+
+    DEBUG("Switching out %s from thread %d\n",p->aspace->name,get_cur_thread()->tid);
+
+    return 0;
+}
+
+static int switch_to(void *state)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+
+    // the last aspace on this CPU may have had its own page tables
+    write_cr3(nk_paging_default_cr3());
+
+    DEBUG("Switching in %s to thread %d\n",p->aspace->name,get_cur_thread()->tid);
+
+    return 0;
+}
+
+static int print(void *state, int detailed)
+{
+    nk_aspace_carat_t *p = (nk_aspace_carat_t *)state;
+    struct list_head *cur;
+    CARAT_LOCK_CONF;
+
+    CARAT_LOCK(p);
+
+    nk_vc_printf("%s CARAT Address Space [granularity 0x%lx alignment 0x%lx]\n"
+		 "   Threads: %lu  Moves: %lu (%lu bytes, %lu pointers patched)\n",
+		 p->aspace->name, p->chars.granularity, p->chars.alignment,
+		 p->num_threads, p->stats.moves, p->stats.bytes_moved,
+		 p->stats.escapes_patched);
+
+    if (detailed) {
+	list_for_each(cur,&p->regions) {
+	    carat_region_t *r = list_entry(cur,carat_region_t,node);
+	    nk_vc_printf("   Region: %016lx - %016lx %c%c%c%c block %lu escapes %lu\n",
+			 (uint64_t) r->region.va_start,
+			 (uint64_t) r->region.va_start + r->region.len_bytes,
+			 r->region.protect.flags & NK_ASPACE_READ ? 'r' : '-',
+			 r->region.protect.flags & NK_ASPACE_WRITE ? 'w' : '-',
+			 r->region.protect.flags & NK_ASPACE_EXEC ? 'x' : '-',
+			 r->region.protect.flags & NK_ASPACE_PIN ? 'p' : '-',
+			 r->block_size, r->escapes);
+	}
+    }
+
+    CARAT_UNLOCK(p);
+
+    return 0;
+}
+
+static nk_aspace_interface_t carat_interface = {
+    .destroy = destroy,
+    .add_thread = add_thread,
+    .remove_thread = remove_thread,
+    .add_region = add_region,
+    .remove_region = remove_region,
+    .protect_region = protect_region,
+    .move_region = move_region,
+    .switch_from = switch_from,
+    .switch_to = switch_to,
+    .print = print
+};
+
 
 static int get_characteristics(nk_aspace_characteristics_t *c)
 {
-    return -1;
+    c->granularity = c->alignment = MIN_BLOCK;
+
+    return 0;
 }
 
 static struct nk_aspace *create(char *name, nk_aspace_characteristics_t *c)
 {
-    return 0;
+    nk_aspace_carat_t *p;
+    struct carat_work *w;
+    uint8_t flags;
+
+    if (!work) {
+	if (!(w = malloc(sizeof(*w)))) {
+	    ERROR("Cannot allocate relocation state\n");
+	    return 0;
+	}
+	memset(w,0,sizeof(*w));
+	if (!__sync_bool_compare_and_swap(&work,0,w)) {
+	    free(w);
+	}
+    }
+
+    p = malloc(sizeof(*p));
+
+    if (!p) {
+	ERROR("Cannot allocate carat aspace %s\n",name);
+	return 0;
+    }
+
+    memset(p,0,sizeof(*p));
+
+    spinlock_init(&p->lock);
+    INIT_LIST_HEAD(&p->regions);
+    INIT_LIST_HEAD(&p->node);
+
+    if (c) {
+	p->chars = *c;
+    }
+    if (!p->chars.granularity) {
+	p->chars.granularity = MIN_BLOCK;
+    }
+    if (!p->chars.alignment) {
+	p->chars.alignment = MIN_BLOCK;
+    }
+
+    p->aspace = nk_aspace_register(name, 0, &carat_interface, p);
+
+    if (!p->aspace) {
+	ERROR("Unable to register carat aspace %s\n",name);
+	free(p);
+	return 0;
+    }
+
+    flags = spin_lock_irq_save(&carat_lock);
+    list_add_tail(&p->node,&carat_list);
+    spin_unlock_irq_restore(&carat_lock,flags);
+
+#ifdef NAUT_CONFIG_ASPACE_CARAT_COMPACTOR
+    if (__sync_bool_compare_and_swap(&compactor_started,0,1) &&
+	nk_thread_start(compactor, 0, 0, 1, TSTACK_DEFAULT, 0, CPU_ANY)) {
+	ERROR("Cannot start the compactor - compact with the carat command\n");
+    }
+#endif
+
+    DEBUG("Created carat aspace %s\n",name);
+
+    return p->aspace;
 }
 
 
@@ -61,3 +1172,89 @@ static nk_aspace_impl_t carat = {
 nk_aspace_register_impl(carat);
 
 
+//
+// Shell
+//
+
+// count the pointers into every movable region
+static void count_escapes(void)
+{
+    struct list_head *cur, *rcur;
+    uint8_t flags;
+    uint64_t i;
+    CARAT_LOCK_CONF;
+
+    work->num_moves = 0;
+
+    flags = spin_lock_irq_save(&carat_lock);
+
+    list_for_each(cur,&carat_list) {
+	nk_aspace_carat_t *p = list_entry(cur,nk_aspace_carat_t,node);
+	CARAT_LOCK(p);
+	list_for_each(rcur,&p->regions) {
+	    carat_region_t *r = list_entry(rcur,carat_region_t,node);
+	    struct carat_move *m;
+	    if (work->num_moves==MAX_MOVES) {
+		break;
+	    }
+	    m = &work->moves[work->num_moves++];
+	    memset(m,0,sizeof(*m));
+	    m->p = p;
+	    m->r = r;
+	    m->src = (addr_t)r->region.va_start;
+	    m->len = r->region.len_bytes;
+	}
+	CARAT_UNLOCK(p);
+    }
+
+    spin_unlock_irq_restore(&carat_lock,flags);
+
+    sort_moves(work->moves,work->num_moves);
+
+    carat_scan(work->moves,work->num_moves,0);
+
+    for (i=0;i<work->num_moves;i++) {
+	struct carat_move *m = &work->moves[i];
+	if (m->len) {
+	    nk_vc_printf("%s: %016lx - %016lx  %lu pointers\n", m->p->aspace->name,
+			 m->src, m->src+m->len, m->escapes);
+	}
+    }
+}
+
+static int
+handle_carat (char * buf, void * priv)
+{
+    char what[16];
+    uint64_t n = COMPACT_CHUNKS;
+
+    if (sscanf(buf,"carat %15s %lu",what,&n)>=1) {
+	if (!strcmp(what,"compact")) {
+	    nk_vc_printf("emptied %lu chunks of %lu bytes\n",compact(n),CHUNK_SIZE);
+	} else if (!strcmp(what,"escapes")) {
+	    move_lock_acquire();
+	    if (work) {
+		count_escapes();
+	    }
+	    move_lock_release();
+	} else {
+	    nk_vc_printf("Don't understand %s\n",buf);
+	    return 0;
+	}
+    }
+
+    nk_vc_printf("carat: %lu scans (%lu words, %lu ns stopped), %lu moves (%lu bytes, %lu pointers patched)\n"
+		 "       %lu compaction passes, %lu chunks emptied, %lu failed\n",
+		 stats.scans, stats.scan_words, stats.stopped_ns,
+		 stats.moves, stats.bytes_moved, stats.escapes_patched,
+		 stats.passes, stats.chunks_freed, stats.chunks_failed);
+
+    return 0;
+}
+
+static struct shell_cmd_impl carat_impl = {
+    .cmd      = "carat",
+    .help_str = "carat [compact [chunks] | escapes]",
+    .handler  = handle_carat,
+};
+nk_register_shell_cmd(carat_impl);
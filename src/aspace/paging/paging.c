@@ -28,8 +28,14 @@ xo */
 #include <nautilus/paging.h>
 #include <nautilus/thread.h>
 #include <nautilus/shell.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/msr.h>
 
 #include <nautilus/aspace.h>
+#include <nautilus/tlb.h>
+
+#include "paging_helpers.h"
 
 #ifndef NAUT_CONFIG_DEBUG_ASPACE_PAGING
 #undef DEBUG_PRINT
@@ -40,15 +46,783 @@ xo */
 #define DEBUG(fmt, args...) DEBUG_PRINT("aspace-paging: " fmt, ##args)
 #define INFO(fmt, args...)   INFO_PRINT("aspace-paging: " fmt, ##args)
 
+//
+// A paging address space has its own page tables, except that the
+// top-level entries of the boot identity map are shared into it, so
+// the kernel, its stacks, heap, and devices are always mapped and
+// never fault into us.  Regions are added in the rest of the (lower
+// half) address space.  Each region is mapped with the largest pages
+// that its virtual/physical alignment and extent allow (4 KB, 2 MB,
+// or 1 GB if the CPU has them), either all at once (NK_ASPACE_EAGER)
+// or a page at a time from the page fault hook.  Demand faults
+// allocate page tables, so memory the allocator or the fault path
+// itself touches must not be in a demand region.
+//
+// Each aspace gets its own PCID when the CPU supports it, so
+// switching to it does not flush the TLB unless its tables have
+// changed since this CPU last ran it.  Removing or reducing mappings
+// is shot down on the CPUs running the aspace (see nautilus/tlb.h).
+//
+
+#define CR3_NOFLUSH (1ULL<<63)
+#define MAX_PCID    4096
+
+// canonical lower half
+#define VA_LIMIT    (1ULL<<47)
+
+typedef struct paging_region {
+    nk_aspace_region_t region;
+    uint64_t           max_page;   // largest page size alignment allows
+    struct list_head   node;
+} paging_region_t;
+
+typedef struct nk_aspace_paging {
+    nk_aspace_t       *aspace;
+
+    spinlock_t         lock;
+
+    struct list_head   regions;
+
+    nk_aspace_characteristics_t chars;
+
+    ph_cr3e_t          cr3;
+    uint64_t           pcid;        // 0 => none, every switch flushes
+
+    uint64_t           kern_slots[NUM_PML4E_ENTRIES/64]; // shared PML4 entries
+
+    struct nk_tlb_domain tlb;
+
+    uint64_t           num_threads;
+
+    struct {
+	uint64_t faults;
+	uint64_t switches;
+	uint64_t flushing_switches;
+    } stats;
+} nk_aspace_paging_t;
+
+// whoever holds the lock may be waiting for us to handle a shootdown
+static inline uint8_t aspace_lock(nk_aspace_paging_t *p)
+{
+    uint8_t flags = irq_disable_save();
+
+    while (spin_try_lock(&p->lock)) {
+	nk_tlb_poll();
+	asm volatile ("pause");
+    }
+
+    return flags;
+}
+
+#define ASPACE_LOCK_CONF uint8_t _aspace_lock_flags
+#define ASPACE_LOCK(a) _aspace_lock_flags = aspace_lock(a)
+#define ASPACE_UNLOCK(a) spin_unlock_irq_restore(&(a)->lock, _aspace_lock_flags);
+
+// CPU features, determined on first use
+static int      features_known = 0;
+static int      nx_ok;
+static int      pcid_ok;
+static uint64_t max_page_size;
+
+static spinlock_t pcid_lock;
+static uint64_t   pcid_map[MAX_PCID/64];
+
+static void probe_features(void)
+{
+    cpuid_ret_t r;
+
+    if (features_known) {
+	return;
+    }
+
+    nx_ok = !!(msr_read(IA32_MSR_EFER) & EFER_NXE);
+
+    cpuid(1,&r);
+    pcid_ok = !!(r.c & (1<<17));
+
+    // the boot identity map already uses 1 GB pages if they exist
+    max_page_size = nk_paging_default_page_size()==PAGE_SIZE_1GB ? PAGE_SIZE_1GB : PAGE_SIZE_2MB;
+
+    spinlock_init(&pcid_lock);
+    memset(pcid_map,0,sizeof(pcid_map));
+    pcid_map[0] = 1;  // PCID 0 belongs to the base address space
+
+    features_known = 1;
+
+    INFO("NX %s, PCID %s, largest page %lx\n", nx_ok ? "on" : "off",
+	 pcid_ok ? "supported" : "unsupported", max_page_size);
+}
+
+static uint64_t alloc_pcid(void)
+{
+    uint64_t i, pcid = 0;
+
+    if (!pcid_ok) {
+	return 0;
+    }
+
+    spin_lock(&pcid_lock);
+    for (i=1;i<MAX_PCID;i++) {
+	if (!(pcid_map[i/64] & (1ULL<<(i%64)))) {
+	    pcid_map[i/64] |= 1ULL<<(i%64);
+	    pcid = i;
+	    break;
+	}
+    }
+    spin_unlock(&pcid_lock);
+
+    return pcid;
+}
+
+static void free_pcid(uint64_t pcid)
+{
+    if (pcid) {
+	spin_lock(&pcid_lock);
+	pcid_map[pcid/64] &= ~(1ULL<<(pcid%64));
+	spin_unlock(&pcid_lock);
+    }
+}
+
+static ph_pf_access_t access_for(nk_aspace_protection_t *p)
+{
+    ph_pf_access_t a;
+
+    memset(&a,0,sizeof(a));
+
+    a.write = !!(p->flags & NK_ASPACE_WRITE);
+    // everything runs in ring 0 - the user bit stays clear
+    a.user = 0;
+    // without EFER.NXE the no_exec bit is reserved
+    a.ifetch = !!(p->flags & NK_ASPACE_EXEC) || !nx_ok;
+
+    return a;
+}
+
+static inline int region_contains(nk_aspace_region_t *r, addr_t va)
+{
+    return va >= (addr_t)r->va_start && va < (addr_t)r->va_start + r->len_bytes;
+}
+
+static inline int regions_overlap(nk_aspace_region_t *a, nk_aspace_region_t *b)
+{
+    return (addr_t)a->va_start < (addr_t)b->va_start + b->len_bytes &&
+	(addr_t)b->va_start < (addr_t)a->va_start + a->len_bytes;
+}
+
+static uint64_t region_max_page(nk_aspace_region_t *r)
+{
+    uint64_t delta = (addr_t)r->va_start - (addr_t)r->pa_start;
+
+    if (max_page_size==PAGE_SIZE_1GB && !(delta & (PAGE_SIZE_1GB-1))) {
+	return PAGE_SIZE_1GB;
+    }
+    if (!(delta & (PAGE_SIZE_2MB-1))) {
+	return PAGE_SIZE_2MB;
+    }
+    return PAGE_SIZE_4KB;
+}
+
+// largest page containing va that fits inside the region
+static uint64_t page_for(paging_region_t *r, addr_t va)
+{
+    addr_t start = (addr_t)r->region.va_start;
+    addr_t end = start + r->region.len_bytes;
+    uint64_t size;
+
+    for (size=r->max_page; size>PAGE_SIZE_4KB; size = size==PAGE_SIZE_1GB ? PAGE_SIZE_2MB : PAGE_SIZE_4KB) {
+	addr_t base = va & ~(size-1);
+	if (base>=start && base+size<=end) {
+	    return size;
+	}
+    }
+
+    return PAGE_SIZE_4KB;
+}
+
+// map the page containing va, returning its size
+static int map_page(nk_aspace_paging_t *p, paging_region_t *r, addr_t va, uint64_t *size)
+{
+    addr_t base;
+
+    *size = page_for(r,va);
+    base = va & ~(*size-1);
+
+    return paging_helper_map(p->cr3, base,
+			     (addr_t)r->region.pa_start + (base - (addr_t)r->region.va_start),
+			     *size, access_for(&r->region.protect));
+}
+
+static int map_region(nk_aspace_paging_t *p, paging_region_t *r)
+{
+    addr_t va = (addr_t)r->region.va_start;
+    addr_t end = va + r->region.len_bytes;
+    uint64_t size;
+
+    while (va<end) {
+	if (map_page(p,r,va,&size)) {
+	    ERROR("Failed to map %016lx in region %p\n",va,r->region.va_start);
+	    return -1;
+	}
+	va = (va & ~(size-1)) + size;
+    }
+
+    return 0;
+}
+
+// leaves in [start,end) are passed to fn, which may change them,
+// and are added to the batch to be shot down
+static void for_each_leaf(nk_aspace_paging_t *p, addr_t start, addr_t end,
+			  void (*fn)(uint64_t *entry, void *arg), void *arg, struct nk_tlb_batch *b)
+{
+    addr_t va = start;
+    uint64_t *e, size;
+
+    while (va<end) {
+	if (!paging_helper_lookup(p->cr3,va,&e,&size)) {
+	    fn(e,arg);
+	    nk_tlb_batch_add(b,va & ~(size-1),size);
+	}
+	va = (va & ~(size-1)) + size;
+    }
+}
+
+static void clear_leaf(uint64_t *e, void *arg)
+{
+    *e = 0;
+}
+
+static void protect_leaf(uint64_t *e, void *arg)
+{
+    ph_pf_access_t *a = (ph_pf_access_t *)arg;
+
+    *e &= ~(PTE_WRITABLE_BIT | PTE_NX_BIT);
+    *e |= a->write ? PTE_WRITABLE_BIT : 0;
+    *e |= a->ifetch ? 0 : PTE_NX_BIT;
+}
+
+static void unmap_region(nk_aspace_paging_t *p, paging_region_t *r, struct nk_tlb_batch *b)
+{
+    for_each_leaf(p, (addr_t)r->region.va_start,
+		  (addr_t)r->region.va_start + r->region.len_bytes,
+		  clear_leaf, 0, b);
+}
+
+static paging_region_t *find_region(nk_aspace_paging_t *p, nk_aspace_region_t *region)
+{
+    struct list_head *cur;
+
+    list_for_each(cur,&p->regions) {
+	paging_region_t *r = list_entry(cur,paging_region_t,node);
+	if (r->region.va_start==region->va_start &&
+	    r->region.pa_start==region->pa_start &&
+	    r->region.len_bytes==region->len_bytes) {
+	    return r;
+	}
+    }
+
+    return 0;
+}
+
+// check a region is well formed and fits beside the others (except skip)
+static int region_ok(nk_aspace_paging_t *p, nk_aspace_region_t *region, paging_region_t *skip)
+{
+    struct list_head *cur;
+    addr_t va = (addr_t)region->va_start;
+    addr_t pa = (addr_t)region->pa_start;
+    uint64_t len = region->len_bytes;
+    uint64_t i;
+
+    if (!len || ((va | pa | len) & (PAGE_SIZE_4KB-1))) {
+	ERROR("Region %016lx-%016lx is empty or not page aligned\n",va,va+len);
+	return 0;
+    }
+
+    if (va+len > VA_LIMIT || va+len < va) {
+	ERROR("Region %016lx-%016lx is outside of the lower half\n",va,va+len);
+	return 0;
+    }
+
+    for (i=ADDR_TO_PML4_INDEX(va); i<=ADDR_TO_PML4_INDEX(va+len-1); i++) {
+	if (p->kern_slots[i/64] & (1ULL<<(i%64))) {
+	    ERROR("Region %016lx-%016lx overlaps the kernel identity map\n",va,va+len);
+	    return 0;
+	}
+    }
+
+    list_for_each(cur,&p->regions) {
+	paging_region_t *r = list_entry(cur,paging_region_t,node);
+	if (r!=skip && regions_overlap(&r->region,region)) {
+	    ERROR("Region %016lx-%016lx overlaps region at %p\n",va,va+len,r->region.va_start);
+	    return 0;
+	}
+    }
+
+    return 1;
+}
+
+
+static int destroy(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    struct list_head *cur, *temp;
+    uint64_t *pml4;
+    uint64_t i;
+    ASPACE_LOCK_CONF;
+
+    ASPACE_LOCK(p);
+
+    if (p->num_threads) {
+	ASPACE_UNLOCK(p);
+	ERROR("Cannot destroy %s while it has %lu threads\n",p->aspace->name,p->num_threads);
+	return -1;
+    }
+
+    list_for_each_safe(cur,temp,&p->regions) {
+	paging_region_t *r = list_entry(cur,paging_region_t,node);
+	list_del(&r->node);
+	free(r);
+    }
+
+    ASPACE_UNLOCK(p);
+
+    // the shared kernel tables are not ours to free
+    pml4 = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(p->cr3.pml4_base);
+    for (i=0;i<NUM_PML4E_ENTRIES;i++) {
+	if (p->kern_slots[i/64] & (1ULL<<(i%64))) {
+	    pml4[i] = 0;
+	}
+    }
+
+    paging_helper_free(p->cr3,0);
+
+    // a later owner of the PCID starts a new domain, so no CPU will
+    // trust what it cached for us
+    free_pcid(p->pcid);
+
+    nk_aspace_unregister(p->aspace);
+
+    free(p);
+
+    return 0;
+}
+
+static int add_thread(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+
+    __sync_fetch_and_add(&p->num_threads,1);
+
+    DEBUG("Add thread %d to %s\n",get_cur_thread()->tid,p->aspace->name);
+
+    return 0;
+}
+
+static int remove_thread(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+
+    __sync_fetch_and_sub(&p->num_threads,1);
+
+    DEBUG("Remove thread %d from %s\n",get_cur_thread()->tid,p->aspace->name);
+
+    return 0;
+}
+
+static int add_region(void *state, nk_aspace_region_t *region)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    paging_region_t *r;
+    struct nk_tlb_batch b;
+    ASPACE_LOCK_CONF;
+
+    r = malloc(sizeof(*r));
+
+    if (!r) {
+	ERROR("Cannot allocate region\n");
+	return -1;
+    }
+
+    memset(r,0,sizeof(*r));
+    r->region = *region;
+    r->max_page = region_max_page(region);
+    INIT_LIST_HEAD(&r->node);
+
+    ASPACE_LOCK(p);
+
+    if (!region_ok(p,region,0)) {
+	ASPACE_UNLOCK(p);
+	free(r);
+	return -1;
+    }
+
+    if ((region->protect.flags & (NK_ASPACE_EAGER | NK_ASPACE_READ)) == (NK_ASPACE_EAGER | NK_ASPACE_READ)
+	&& map_region(p,r)) {
+	// back out whatever we managed to map
+	nk_tlb_batch_init(&b,&p->tlb);
+	unmap_region(p,r,&b);
+	nk_tlb_batch_flush(&b);
+	ASPACE_UNLOCK(p);
+	free(r);
+	return -1;
+    }
+
+    list_add_tail(&r->node,&p->regions);
+
+    ASPACE_UNLOCK(p);
+
+    DEBUG("Added region %p-%p -> %p (max page %lx) to %s\n",region->va_start,
+	  region->va_start+region->len_bytes, region->pa_start, r->max_page, p->aspace->name);
+
+    return 0;
+}
+
+static int remove_region(void *state, nk_aspace_region_t *region)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    paging_region_t *r;
+    struct nk_tlb_batch b;
+    ASPACE_LOCK_CONF;
+
+    ASPACE_LOCK(p);
+
+    if (!(r = find_region(p,region))) {
+	ASPACE_UNLOCK(p);
+	ERROR("Region %p-%p is not in %s\n",region->va_start,
+	      region->va_start+region->len_bytes,p->aspace->name);
+	return -1;
+    }
+
+    list_del(&r->node);
+
+    nk_tlb_batch_init(&b,&p->tlb);
+    unmap_region(p,r,&b);
+    nk_tlb_batch_flush(&b);
+
+    ASPACE_UNLOCK(p);
+
+    free(r);
+
+    return 0;
+}
+
+static int protect_region(void *state, nk_aspace_region_t *region, nk_aspace_protection_t *prot)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    paging_region_t *r;
+    ph_pf_access_t a;
+    struct nk_tlb_batch b;
+    int rc = 0;
+    ASPACE_LOCK_CONF;
+
+    ASPACE_LOCK(p);
+
+    if (!(r = find_region(p,region))) {
+	ASPACE_UNLOCK(p);
+	ERROR("Region %p-%p is not in %s\n",region->va_start,
+	      region->va_start+region->len_bytes,p->aspace->name);
+	return -1;
+    }
+
+    r->region.protect = *prot;
+    a = access_for(prot);
+
+    nk_tlb_batch_init(&b,&p->tlb);
+    if (prot->flags & NK_ASPACE_READ) {
+	for_each_leaf(p, (addr_t)r->region.va_start,
+		      (addr_t)r->region.va_start + r->region.len_bytes,
+		      protect_leaf, &a, &b);
+    } else {
+	// x86 cannot map a page without read access
+	unmap_region(p,r,&b);
+    }
+    nk_tlb_batch_flush(&b);
+
+    if ((prot->flags & (NK_ASPACE_EAGER | NK_ASPACE_READ)) == (NK_ASPACE_EAGER | NK_ASPACE_READ)) {
+	rc = map_region(p,r);
+    }
+
+    ASPACE_UNLOCK(p);
+
+    return rc;
+}
+
+// the region's contents are not copied - moving the physical start
+// changes what the virtual range shows
+static int move_region(void *state, nk_aspace_region_t *cur_region, nk_aspace_region_t *new_region)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    paging_region_t *r;
+    struct nk_tlb_batch b;
+    int rc = 0;
+    ASPACE_LOCK_CONF;
+
+    if (cur_region->len_bytes != new_region->len_bytes) {
+	ERROR("Cannot change the length of a region by moving it\n");
+	return -1;
+    }
+
+    ASPACE_LOCK(p);
+
+    if (!(r = find_region(p,cur_region))) {
+	ASPACE_UNLOCK(p);
+	ERROR("Region %p-%p is not in %s\n",cur_region->va_start,
+	      cur_region->va_start+cur_region->len_bytes,p->aspace->name);
+	return -1;
+    }
+
+    if (!region_ok(p,new_region,r)) {
+	ASPACE_UNLOCK(p);
+	return -1;
+    }
+
+    nk_tlb_batch_init(&b,&p->tlb);
+    unmap_region(p,r,&b);
+    nk_tlb_batch_flush(&b);
+
+    r->region = *new_region;
+    r->max_page = region_max_page(new_region);
+
+    if ((new_region->protect.flags & (NK_ASPACE_EAGER | NK_ASPACE_READ)) == (NK_ASPACE_EAGER | NK_ASPACE_READ)) {
+	rc = map_region(p,r);
+    }
+
+    ASPACE_UNLOCK(p);
+
+    return rc;
+}
+
+static int switch_from(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+
+    nk_tlb_domain_leave(&p->tlb);
+
+    DEBUG("Switching out %s from thread %d\n",p->aspace->name,get_cur_thread()->tid);
+
+    return 0;
+}
+
+static int switch_to(void *state)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    uint64_t cr3 = p->cr3.val | p->pcid;
+
+    if (p->pcid && !(read_cr4() & CR4_PCIDE)) {
+	// first tagged aspace on this CPU - the current CR3 has PCID 0,
+	// which is what enabling requires
+	write_cr4(read_cr4() | CR4_PCIDE);
+    }
+
+    if (nk_tlb_domain_enter(&p->tlb)) {
+	cr3 |= CR3_NOFLUSH;
+    } else {
+	p->stats.flushing_switches++;
+    }
+
+    write_cr3(cr3);
+
+    p->stats.switches++;
+
+    return 0;
+}
+
+static int exception(void *state, excp_entry_t *exp, excp_vec_t vec)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    addr_t va = read_cr2();
+    ph_pf_error_t err = *(ph_pf_error_t *)&exp->error_code;
+    struct list_head *cur;
+    paging_region_t *r = 0;
+    uint64_t *e, size;
+    int rc = -1;
+    ASPACE_LOCK_CONF;
+
+    if (vec!=PF_EXCP) {
+	return -1;
+    }
+
+    ASPACE_LOCK(p);
+
+    list_for_each(cur,&p->regions) {
+	paging_region_t *t = list_entry(cur,paging_region_t,node);
+	if (region_contains(&t->region,va)) {
+	    r = t;
+	    break;
+	}
+    }
+
+    if (!r) {
+	DEBUG("Fault at %016lx is outside of any region of %s\n",va,p->aspace->name);
+	goto out;
+    }
+
+    if (!(r->region.protect.flags & NK_ASPACE_READ) ||
+	(err.write && !(r->region.protect.flags & NK_ASPACE_WRITE)) ||
+	(err.ifetch && !(r->region.protect.flags & NK_ASPACE_EXEC))) {
+	DEBUG("Fault at %016lx (error %lx) violates region protections\n",va,exp->error_code);
+	goto out;
+    }
+
+    if (!paging_helper_lookup(p->cr3,va,&e,&size)) {
+	// already mapped with the needed access - another CPU got here
+	// first, or our TLB is older than a protection increase
+	invlpg(va);
+	rc = 0;
+	goto out;
+    }
+
+    if (map_page(p,r,va,&size)) {
+	ERROR("Cannot map %016lx on fault\n",va);
+	goto out;
+    }
+
+    p->stats.faults++;
+    rc = 0;
+
+ out:
+    ASPACE_UNLOCK(p);
+    return rc;
+}
+
+static int print(void *state, int detailed)
+{
+    nk_aspace_paging_t *p = (nk_aspace_paging_t *)state;
+    struct list_head *cur;
+    ASPACE_LOCK_CONF;
+
+    ASPACE_LOCK(p);
+
+    nk_vc_printf("%s Paging Address Space [granularity 0x%lx alignment 0x%lx]\n"
+		 "   CR3:    %016lx  PCID: %lu  Generation: %lu  Threads: %lu\n"
+		 "   Faults: %lu  Switches: %lu (%lu flushed)\n",
+		 p->aspace->name, p->chars.granularity, p->chars.alignment,
+		 p->cr3.val, p->pcid, p->tlb.gen, p->num_threads,
+		 p->stats.faults, p->stats.switches, p->stats.flushing_switches);
+
+    list_for_each(cur,&p->regions) {
+	paging_region_t *r = list_entry(cur,paging_region_t,node);
+	nk_vc_printf("   Region: %016lx - %016lx => %016lx %c%c%c%c max page %lx\n",
+		     (uint64_t) r->region.va_start,
+		     (uint64_t) r->region.va_start + r->region.len_bytes,
+		     (uint64_t) r->region.pa_start,
+		     r->region.protect.flags & NK_ASPACE_READ ? 'r' : '-',
+		     r->region.protect.flags & NK_ASPACE_WRITE ? 'w' : '-',
+		     r->region.protect.flags & NK_ASPACE_EXEC ? 'x' : '-',
+		     r->region.protect.flags & NK_ASPACE_EAGER ? 'e' : '-',
+		     r->max_page);
+	if (detailed) {
+	    addr_t va = (addr_t)r->region.va_start;
+	    addr_t end = va + r->region.len_bytes;
+	    uint64_t *e, size, n4k=0, n2m=0, n1g=0;
+	    while (va<end) {
+		if (!paging_helper_lookup(p->cr3,va,&e,&size)) {
+		    n4k += size==PAGE_SIZE_4KB;
+		    n2m += size==PAGE_SIZE_2MB;
+		    n1g += size==PAGE_SIZE_1GB;
+		}
+		va = (va & ~(size-1)) + size;
+	    }
+	    nk_vc_printf("           mapped: %lu 4K %lu 2M %lu 1G pages\n",n4k,n2m,n1g);
+	}
+    }
+
+    ASPACE_UNLOCK(p);
+
+    return 0;
+}
+
+static nk_aspace_interface_t paging_interface = {
+    .destroy = destroy,
+    .add_thread = add_thread,
+    .remove_thread = remove_thread,
+    .add_region = add_region,
+    .remove_region = remove_region,
+    .protect_region = protect_region,
+    .move_region = move_region,
+    .switch_from = switch_from,
+    .switch_to = switch_to,
+    .exception = exception,
+    .print = print
+};
+
 
 static int get_characteristics(nk_aspace_characteristics_t *c)
 {
-    return -1;
+    probe_features();
+
+    c->granularity = c->alignment = PAGE_SIZE_4KB;
+
+    return 0;
 }
 
 static struct nk_aspace *create(char *name, nk_aspace_characteristics_t *c)
 {
-    return 0;
+    nk_aspace_paging_t *p;
+    uint64_t *pml4, *kern_pml4;
+    uint64_t i;
+
+    probe_features();
+
+    if (c && ((c->granularity & (PAGE_SIZE_4KB-1)) || (c->alignment & (PAGE_SIZE_4KB-1)))) {
+	ERROR("Granularity and alignment must be multiples of 4 KB\n");
+	return 0;
+    }
+
+    p = malloc(sizeof(*p));
+
+    if (!p) {
+	ERROR("Cannot allocate paging aspace %s\n",name);
+	return 0;
+    }
+
+    memset(p,0,sizeof(*p));
+
+    spinlock_init(&p->lock);
+    INIT_LIST_HEAD(&p->regions);
+
+    if (c) {
+	p->chars = *c;
+    }
+    if (!p->chars.granularity) {
+	p->chars.granularity = PAGE_SIZE_4KB;
+    }
+    if (!p->chars.alignment) {
+	p->chars.alignment = PAGE_SIZE_4KB;
+    }
+
+    if (paging_helper_create(&p->cr3)) {
+	ERROR("Cannot create page tables for %s\n",name);
+	free(p);
+	return 0;
+    }
+
+    // share the identity map's top level entries
+    pml4 = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(p->cr3.pml4_base);
+    kern_pml4 = (uint64_t *)PTE_ADDR(nk_paging_default_cr3());
+    for (i=0;i<NUM_PML4E_ENTRIES;i++) {
+	if (kern_pml4[i] & PTE_PRESENT_BIT) {
+	    pml4[i] = kern_pml4[i];
+	    p->kern_slots[i/64] |= 1ULL<<(i%64);
+	}
+    }
+
+    p->pcid = alloc_pcid();
+    nk_tlb_domain_init(&p->tlb,p->pcid);
+
+    p->aspace = nk_aspace_register(name, NK_ASPACE_HOOK_PF, &paging_interface, p);
+
+    if (!p->aspace) {
+	ERROR("Unable to register paging aspace %s\n",name);
+	memset(pml4,0,PAGE_SIZE_4KB);
+	paging_helper_free(p->cr3,0);
+	free_pcid(p->pcid);
+	free(p);
+	return 0;
+    }
+
+    DEBUG("Created paging aspace %s (cr3 %016lx pcid %lu)\n",name,p->cr3.val,p->pcid);
+
+    return p->aspace;
 }
 
 
@@ -59,5 +833,3 @@ static nk_aspace_impl_t paging = {
 };
 
 nk_aspace_register_impl(paging);
-
-
@@ -68,10 +68,10 @@ int paging_helper_free(ph_cr3e_t cr3, int free_data)
 	if (pml4[i].present) {
 	    ph_pdpe_t *pdpe = (ph_pdpe_t *)PAGE_NUM_TO_ADDR_4KB(pml4[i].pdp_base);
 	    for (j=0;j<NUM_PDPE_ENTRIES;j++) {
-		if (pdpe[j].present) {
+		if (pdpe[j].present && !(pdpe[j].val & PTE_PAGE_SIZE_BIT)) {
 		    ph_pde_t *pde = (ph_pde_t *)PAGE_NUM_TO_ADDR_4KB(pdpe[j].pd_base);
 		    for (k=0;k<NUM_PDE_ENTRIES;k++) {
-			if (pde[k].present) {
+			if (pde[k].present && !(pde[k].val & PTE_PAGE_SIZE_BIT)) {
 			    ph_pte_t *pte = (ph_pte_t *)PAGE_NUM_TO_ADDR_4KB(pde[k].pt_base);
 			    if (free_data) { 
 				for (l=0;l<NUM_PTE_ENTRIES;l++) {
@@ -234,3 +234,156 @@ int paging_helper_drill(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, ph_pf_access_
 	return paging_helper_drill(cr3,vaddr,paddr,access_type);
     }
 }
+
+
+// physical address held in an entry at any level, ignoring no_exec
+#define ENTRY_ADDR(e) ((e) & 0x000ffffffffff000ULL)
+
+static int table_empty(uint64_t *t)
+{
+    int i;
+
+    for (i=0;i<512;i++) {
+	if (t[i] & PTE_PRESENT_BIT) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+// follow a non-leaf entry to the table below it, creating the table
+// if the entry is not present - returns 0 if the entry is a leaf
+static uint64_t *next_table(uint64_t *e)
+{
+    uint64_t *t;
+
+    if (*e & PTE_PRESENT_BIT) {
+	if (*e & PTE_PAGE_SIZE_BIT) {
+	    return 0;
+	}
+	return (uint64_t *)ENTRY_ADDR(*e);
+    }
+
+    t = ALLOC_PHYSICAL_PAGE();
+
+    if (!t) {
+	ERROR("Cannot allocate page table\n");
+	return 0;
+    }
+
+    memset(t,0,PAGE_SIZE_4KB);
+
+    *e = (uint64_t)t | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+
+    return t;
+}
+
+// install a large leaf - a table left behind by unmapping is freed,
+// but one that still has entries is in the way
+static int set_large_leaf(uint64_t *e, uint64_t leaf)
+{
+    if ((*e & PTE_PRESENT_BIT) && !(*e & PTE_PAGE_SIZE_BIT)) {
+	uint64_t *t = (uint64_t *)ENTRY_ADDR(*e);
+	if (!table_empty(t)) {
+	    ERROR("Smaller pages are in the way of large page\n");
+	    return -1;
+	}
+	FREE_PHYSICAL_PAGE(t);
+    }
+    *e = leaf;
+    return 0;
+}
+
+int paging_helper_map(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, uint64_t page_size, ph_pf_access_t access)
+{
+    uint64_t *pml4 = (uint64_t *)PAGE_NUM_TO_ADDR_4KB(cr3.pml4_base);
+    uint64_t *pdp, *pd, *pt;
+    uint64_t leaf;
+
+    if ((vaddr | paddr) & (page_size-1)) {
+	ERROR("Unaligned mapping %016lx -> %016lx for page size %lx\n",vaddr,paddr,page_size);
+	return -1;
+    }
+
+    leaf = paddr | PTE_PRESENT_BIT;
+    if (access.write) {
+	leaf |= PTE_WRITABLE_BIT;
+    }
+    if (access.user) {
+	leaf |= PTE_KERNEL_ONLY_BIT;  // the U/S bit, despite its name
+    }
+    if (!access.ifetch) {
+	leaf |= PTE_NX_BIT;
+    }
+
+    if (!(pdp = next_table(&pml4[ADDR_TO_PML4_INDEX(vaddr)]))) {
+	return -1;
+    }
+
+    if (page_size==PAGE_SIZE_1GB) {
+	return set_large_leaf(&pdp[ADDR_TO_PDP_INDEX(vaddr)], leaf | PTE_PAGE_SIZE_BIT);
+    }
+
+    if (!(pd = next_table(&pdp[ADDR_TO_PDP_INDEX(vaddr)]))) {
+	ERROR("Cannot map %016lx - 1 GB page in the way\n",vaddr);
+	return -1;
+    }
+
+    if (page_size==PAGE_SIZE_2MB) {
+	return set_large_leaf(&pd[ADDR_TO_PD_INDEX(vaddr)], leaf | PTE_PAGE_SIZE_BIT);
+    }
+
+    if (page_size!=PAGE_SIZE_4KB) {
+	ERROR("Unsupported page size %lx\n",page_size);
+	return -1;
+    }
+
+    if (!(pt = next_table(&pd[ADDR_TO_PD_INDEX(vaddr)]))) {
+	ERROR("Cannot map %016lx - 2 MB page in the way\n",vaddr);
+	return -1;
+    }
+
+    pt[ADDR_TO_PT_INDEX(vaddr)] = leaf;
+
+    return 0;
+}
+
+int paging_helper_lookup(ph_cr3e_t cr3, addr_t vaddr, uint64_t **entry, uint64_t *page_size)
+{
+    uint64_t *e = &((uint64_t *)PAGE_NUM_TO_ADDR_4KB(cr3.pml4_base))[ADDR_TO_PML4_INDEX(vaddr)];
+    uint64_t size = PAGE_SIZE_1GB*512;
+    int level;
+
+    // descend until we hit a leaf or a hole
+    for (level=0;level<4;level++) {
+	if (!(*e & PTE_PRESENT_BIT)) {
+	    *entry = 0;
+	    *page_size = size;
+	    return 1;
+	}
+	if (level==3 || (level>0 && (*e & PTE_PAGE_SIZE_BIT))) {
+	    *entry = e;
+	    *page_size = size;
+	    return 0;
+	}
+	size >>= 9;
+	e = &((uint64_t *)ENTRY_ADDR(*e))[(vaddr >> (12 + 9*(2-level))) & 0x1ff];
+    }
+
+    // not reached
+    *entry = 0;
+    *page_size = PAGE_SIZE_4KB;
+    return 1;
+}
+
+int paging_helper_unmap(ph_cr3e_t cr3, addr_t vaddr, uint64_t *page_size)
+{
+    uint64_t *e;
+    int rc = paging_helper_lookup(cr3,vaddr,&e,page_size);
+
+    if (!rc) {
+	*e = 0;
+    }
+
+    return rc;
+}
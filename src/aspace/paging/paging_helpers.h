@@ -242,6 +242,27 @@ int paging_helper_walk(ph_cr3e_t cr3, addr_t vaddr, ph_pf_access_t access_type,
 // build a path through the PT hierarchy to enable an access of the given type
 int paging_helper_drill(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, ph_pf_access_t access_type);
 
+// The following handle leaves of any size - page_size is one of
+// PAGE_SIZE_4KB (PTE), PAGE_SIZE_2MB (PDE with PS), or
+// PAGE_SIZE_1GB (PDPE with PS).  Unlike drill, the permissions of
+// intermediate entries are left fully open and only the leaf
+// restricts access.  ifetch=0 sets the leaf's no_exec bit, so only
+// ask for that when EFER.NXE is on.
+
+// map vaddr->paddr with a single leaf, building tables as needed
+// fails if a leaf of a different size is in the way
+int paging_helper_map(ph_cr3e_t cr3, addr_t vaddr, addr_t paddr, uint64_t page_size, ph_pf_access_t access);
+
+// find the leaf mapping vaddr
+// return 0 if mapped, *entry points to the leaf, *page_size is its size
+// return 1 if not mapped, *entry is 0, *page_size is the size of the
+//          unmapped span (aligned) vaddr falls in
+int paging_helper_lookup(ph_cr3e_t cr3, addr_t vaddr, uint64_t **entry, uint64_t *page_size);
+
+// remove the leaf mapping vaddr, if any, returning the same as lookup
+// tables that become empty are kept
+int paging_helper_unmap(ph_cr3e_t cr3, addr_t vaddr, uint64_t *page_size);
+
 
 
 #endif
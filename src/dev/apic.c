@@ -972,28 +972,35 @@ void apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks)
     apic->current_ticks = ticks;
 }
 
-void apic_update_oneshot_timer(struct apic_dev *apic, uint32_t ticks,
-			       nk_timer_condition_t cond)
+int apic_update_oneshot_timer(struct apic_dev *apic, uint32_t ticks,
+			      nk_timer_condition_t cond)
 {
+    int set = 0;
+
     if (!apic->timer_set) { 
-	apic_set_oneshot_timer(apic,ticks);
+	set = 1;
     } else {
 	switch (cond) { 
 	case UNCOND:
-	    apic_set_oneshot_timer(apic,ticks);
+	    set = 1;
 	    break;
 	case IF_EARLIER:
-	    if (ticks < apic->current_ticks) { apic_set_oneshot_timer(apic,ticks);}
+	    set = ticks < apic->current_ticks;
 	    break;
 	case IF_LATER:
-	    if (ticks > apic->current_ticks) { apic_set_oneshot_timer(apic,ticks);}
+	    set = ticks > apic->current_ticks;
 	    break;
 	}
     }
+    if (set) {
+	apic_set_oneshot_timer(apic,ticks);
+    }
     // note that this is set at the entry to apic_timer_handler
     apic->in_timer_interrupt=0;
     // note that this is set at the entry to null_kick
     apic->in_kick_interrupt=0;
+
+    return set;
 }
 	    
 
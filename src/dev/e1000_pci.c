@@ -27,6 +27,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/netdev.h>
+#include <nautilus/devpoll.h>
 #include <nautilus/cpu.h>
 #include <dev/pci.h>
 #include <nautilus/mm.h>              // malloc, free
@@ -208,6 +209,8 @@
 #define E1000_ICR_RXT0              (1 << 7)   // receiver timer interrupt 
 #define E1000_ICR_RXO               (1 << 6)   // receive overrun 
 #define E1000_ICR_LSC               (1 << 2)   // link state change 
+// what we interrupt on
+#define E1000_ICR_COMPLETIONS       (E1000_ICR_TXDW | E1000_ICR_RXT0)
 
 
 struct e1000_desc_ring {
@@ -303,6 +306,10 @@ struct e1000_state {
   // a circular queue mapping between callback funtion and rx descriptor
   struct e1000_map_ring *rx_map;
   uint64_t rx_buffer_size;
+  // completions come from the interrupt handler and from pollers
+  spinlock_t reap_lock;
+  // sends and receives can be posted from any CPU
+  spinlock_t post_lock;
 };
 
 static struct list_head dev_list;
@@ -442,22 +449,14 @@ static int e1000_init_receive_ring(struct e1000_state *state)
   return 0;
 }
 
-static int e1000_send_packet(uint8_t* packet_addr,
-                             uint64_t packet_size,
-                             struct e1000_state *state) 
+// Fill the descriptor at the tail without telling the card - the
+// caller holds post_lock and writes TDT once it has filled a batch.
+// TDT is only written by us, so our copy of the tail is current.
+static void e1000_fill_txd(uint8_t* packet_addr,
+                           uint64_t packet_size,
+                           struct e1000_state *state) 
 {
-  DEBUG("e1000_send_packet fn\n");
   DEBUG("packet_addr 0x%p packet_size: %d\n", packet_addr, packet_size);
-  TXD_TAIL = READ_MEM(state, TDT_OFFSET);
-  DEBUG("status before sending a packet: TDH = %d TDT = %d tail_pos = %d\n",
-        READ_MEM(state, TDH_OFFSET),
-        READ_MEM(state, TDT_OFFSET),
-        TXD_TAIL);
-  DEBUG("tpt total packet transmit: %d\n", READ_MEM(state, E1000_TPT_OFFSET));
-  if(packet_size > MAX_TU) {
-    ERROR("packet is too large.\n");
-    return -1;
-  }
 
   // e1000_init_single_txd(TXD_TAIL, state); // make new descriptor
   memset(((struct e1000_tx_desc *)TXD_RING_BUFFER + TXD_TAIL),
@@ -478,30 +477,25 @@ static int e1000_send_packet(uint8_t* packet_addr,
   TXD_CMD(TXD_TAIL).rs = 1;
   
   // increment transmit descriptor list tail by 1
-  DEBUG("moving the tail\n");
   TXD_TAIL = TXD_INC(1, TXD_TAIL);
+}
+
+static void e1000_kick_tx(struct e1000_state *state)
+{
+  DEBUG("moving the tail\n");
   WRITE_MEM(state, TDT_OFFSET, TXD_TAIL);
   DEBUG("status after moving tail: TDH = %d TDT = %d tail_pos = %d\n",
         READ_MEM(state, TDH_OFFSET),
         READ_MEM(state, TDT_OFFSET),
         TXD_TAIL);
-  DEBUG("transmit error: %d\n",
-        TXD_STATUS(TXD_PREV_HEAD).ec | TXD_STATUS(TXD_PREV_HEAD).lc);
   DEBUG("tpt total packet transmit: %d\n", READ_MEM(state, E1000_TPT_OFFSET));
-  DEBUG("e1000_send_packet fn end\n");
-  return 0;
 }
 
-static int e1000_receive_packet(uint8_t* buffer,
-                                uint64_t buffer_size,
-                                struct e1000_state *state) 
+// if the buffer size is changed,
+// let the network adapter know the new buffer size
+static int e1000_set_rx_buffer_size(uint64_t buffer_size,
+                                    struct e1000_state *state)
 {
-  DEBUG("e1000 receive packet fn buffer = 0x%p, len = %lu\n", buffer, buffer_size);
-  DEBUG("before moving tail head: %d, tail: %d\n",
-        READ_MEM(state, RDH_OFFSET),
-        READ_MEM(state, RDT_OFFSET));
-  // if the buffer size is changed,
-  // let the network adapter know the new buffer size
   if(state->rx_buffer_size != buffer_size) {
     uint32_t rctl = READ_MEM(state, RCTL_OFFSET) & E1000_RCTL_BSIZE_MASK;
     switch(buffer_size) {
@@ -533,21 +527,27 @@ static int e1000_receive_packet(uint8_t* buffer,
     WRITE_MEM(state, RCTL_OFFSET, rctl);
     state->rx_buffer_size = buffer_size;
   }
-        
-  RXD_PREV_HEAD = READ_MEM(state, RDH_OFFSET);
-  RXD_TAIL = READ_MEM(state, RDT_OFFSET);
+  return 0;
+}
+
+// As for sends, the caller holds post_lock and writes RDT
+static void e1000_fill_rxd(uint8_t* buffer,
+                           struct e1000_state *state) 
+{
+  DEBUG("e1000 receive packet fn buffer = 0x%p\n", buffer);
   // e1000_init_single_rxd(RXD_TAIL, state);
   memset(((struct e1000_rx_desc *)RXD_RING_BUFFER + RXD_TAIL),
          0, sizeof(struct e1000_rx_desc));
   RXD_ADDR(RXD_TAIL) = (uint64_t*) buffer;
-  WRITE_MEM(state, RDT_OFFSET, RXD_INC(RXD_TAIL, 1));
   RXD_TAIL = RXD_INC(RXD_TAIL, 1);
+}
+
+static void e1000_kick_rx(struct e1000_state *state)
+{
+  WRITE_MEM(state, RDT_OFFSET, RXD_TAIL);
   DEBUG("after moving tail head: %d, prev_head: %d tail: %d\n",
         READ_MEM(state, RDH_OFFSET), RXD_PREV_HEAD,
         READ_MEM(state, RDT_OFFSET));
-  
-  DEBUG("end e1000 receive paket fn -----------------------\n");
-  return 0;
 }
 
 uint64_t e1000_packet_size_to_buffer_size(uint64_t sz) 
@@ -636,98 +636,214 @@ static int e1000_map_callback(struct e1000_map_ring* map,
   return 0;
 }
 
-static int e1000_post_send(void *state,
+static int e1000_post_send(void *vstate,
 			   uint8_t *src,
 			   uint64_t len,
 			   void (*callback)(nk_net_dev_status_t, void *),
 			   void *context) 
 {
-  // always map callback
+  struct e1000_state *state = (struct e1000_state*) vstate;
   int result = 0;
+  uint8_t flags;
+
   DEBUG("post send fn callback 0x%p\n", callback);
-  result = e1000_map_callback(((struct e1000_state*)state)->tx_map, callback, context);
+  if(len > MAX_TU) {
+    ERROR("packet is too large.\n");
+    return -1;
+  }
 
+  flags = spin_lock_irq_save(&state->post_lock);
+  // always map callback
+  result = e1000_map_callback(state->tx_map, callback, context);
   if (!result) {
-    result = e1000_send_packet(src, len, (struct e1000_state*) state);
+    e1000_fill_txd(src, len, state);
+    e1000_kick_tx(state);
   }
+  spin_unlock_irq_restore(&state->post_lock, flags);
+
   DEBUG("post send fn end\n");
   return result;
 }
 
-static int e1000_post_receive(void *state,
+static int e1000_post_receive(void *vstate,
 			      uint8_t *src,
 			      uint64_t len,
 			      void (*callback)(nk_net_dev_status_t, void *),
 			      void *context) 
 {
-  // mapping the callback always
-  // if result != -1 receive packet
+  struct e1000_state *state = (struct e1000_state*) vstate;
   int result = 0;
-  result  = e1000_map_callback(((struct e1000_state*)state)->rx_map, callback, context);
+  uint8_t flags;
 
-  if(!result) {
-    result = e1000_receive_packet(src, len, (struct e1000_state*) state);
+  flags = spin_lock_irq_save(&state->post_lock);
+  // mapping the callback always
+  // if result != -1 receive packet
+  result = e1000_set_rx_buffer_size(len, state);
+  if (!result) {
+    result = e1000_map_callback(state->rx_map, callback, context);
+  }
+  if (!result) {
+    e1000_fill_rxd(src, state);
+    e1000_kick_rx(state);
   }
+  spin_unlock_irq_restore(&state->post_lock, flags);
+
   return result;
 }
 
-static int e1000_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s) 
+// Batches fill descriptors until the callback map is full and then
+// move the tail register once
+static int e1000_post_send_batch(void *vstate,
+                                 struct nk_net_dev_buf *bufs,
+                                 uint64_t num)
 {
-  DEBUG("e1000_irq_handler fn vector: 0x%x rip: 0x%p\n", vec, excp->rip);
+  struct e1000_state *state = (struct e1000_state*) vstate;
+  uint64_t i;
+  uint8_t flags;
+
+  DEBUG("post send batch of %lu\n", num);
+  flags = spin_lock_irq_save(&state->post_lock);
+  for (i = 0; i < num; i++) {
+    if (bufs[i].len > MAX_TU) {
+      ERROR("packet is too large.\n");
+      break;
+    }
+    if (e1000_map_callback(state->tx_map, bufs[i].callback, bufs[i].context)) {
+      break;
+    }
+    e1000_fill_txd(bufs[i].buf, bufs[i].len, state);
+  }
+  if (i) {
+    e1000_kick_tx(state);
+  }
+  spin_unlock_irq_restore(&state->post_lock, flags);
 
-  struct e1000_state* state = (struct e1000_state *)s;
+  return (i || !num) ? i : -1;
+}
 
-  uint32_t icr = READ_MEM(state, E1000_ICR_OFFSET);
-  uint32_t ims = READ_MEM(state, E1000_IMS_OFFSET);
-  uint32_t mask_int = icr & ims;
-  DEBUG("ICR: 0x%08x IMS: 0x%08x mask_int: 0x%08x\n", icr, ims, mask_int);
-  DEBUG("ICR: 0x%08x icr should be zero.\n",
-        READ_MEM(state, E1000_ICR_OFFSET));
-  
-  void (*callback)(nk_net_dev_status_t, void*) = NULL;
-  void *context = NULL;
-  nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
-  
-  if(mask_int & E1000_ICR_TXDW) {
-    // transmit interrupt
-    DEBUG("handle the txdw interrupt\n");
-    e1000_unmap_callback(state->tx_map, (uint64_t **)&callback, (void **)&context);
-    // if there is an error while sending a packet, set the error status
-    if(TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
-      ERROR("transmit errors\n");
-      status = NK_NET_DEV_STATUS_ERROR;
+static int e1000_post_receive_batch(void *vstate,
+                                    struct nk_net_dev_buf *bufs,
+                                    uint64_t num)
+{
+  struct e1000_state *state = (struct e1000_state*) vstate;
+  uint64_t i;
+  uint8_t flags;
+
+  DEBUG("post receive batch of %lu\n", num);
+  flags = spin_lock_irq_save(&state->post_lock);
+  for (i = 0; i < num; i++) {
+    if (e1000_set_rx_buffer_size(bufs[i].len, state)) {
+      break;
     }
-
-    // update the head of the ring buffer
-    TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
-    DEBUG("total packet transmitted = %d\n",
-          READ_MEM(state, E1000_TPT_OFFSET));    
+    if (e1000_map_callback(state->rx_map, bufs[i].callback, bufs[i].context)) {
+      break;
+    }
+    e1000_fill_rxd(bufs[i].buf, state);
   }
+  if (i) {
+    e1000_kick_rx(state);
+  }
+  spin_unlock_irq_restore(&state->post_lock, flags);
+
+  return (i || !num) ? i : -1;
+}
 
-  if(mask_int & E1000_ICR_RXT0) {
-    // receive interrupt
-    DEBUG("handle the rxt0 interrupt\n");
-    e1000_unmap_callback(state->rx_map, (uint64_t **)&callback, (void **)&context);
-    // checking errors
-    if(RXD_ERRORS(RXD_PREV_HEAD)) {
-      ERROR("receive an error packet\n");
-      status = NK_NET_DEV_STATUS_ERROR;
+// the oldest outstanding send or receive has been written back
+static inline int e1000_tx_done(struct e1000_state *state)
+{
+  return TXMAP->head_pos != TXMAP->tail_pos && TXD_STATUS(TXD_PREV_HEAD).dd;
+}
+
+static inline int e1000_rx_done(struct e1000_state *state)
+{
+  return RXMAP->head_pos != RXMAP->tail_pos && RXD_STATUS(RXD_PREV_HEAD).dd;
+}
+
+// Complete up to budget sends and receives in descriptor order, going
+// by the descriptor done bits rather than the interrupt cause, so one
+// interrupt or poll can pick up several.  Returns how many.
+static int e1000_reap(struct e1000_state *state, uint64_t budget)
+{
+  void (*callback)(nk_net_dev_status_t, void*);
+  void *context;
+  nk_net_dev_status_t status;
+  uint64_t done = 0;
+  uint8_t flags;
+
+  while (done < budget) {
+    callback = NULL;
+    context = NULL;
+    status = NK_NET_DEV_STATUS_SUCCESS;
+
+    flags = spin_lock_irq_save(&state->reap_lock);
+
+    if (e1000_tx_done(state)) {
+      DEBUG("reap send at %d\n", TXD_PREV_HEAD);
+      e1000_unmap_callback(state->tx_map, (uint64_t **)&callback, (void **)&context);
+      // if there is an error while sending a packet, set the error status
+      if(TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
+        ERROR("transmit errors\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+      TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
+    } else if (e1000_rx_done(state)) {
+      DEBUG("reap receive at %d\n", RXD_PREV_HEAD);
+      e1000_unmap_callback(state->rx_map, (uint64_t **)&callback, (void **)&context);
+      // checking errors
+      if(RXD_ERRORS(RXD_PREV_HEAD)) {
+        ERROR("receive an error packet\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+      RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
+    } else {
+      spin_unlock_irq_restore(&state->reap_lock, flags);
+      break;
     }
-    DEBUG("RDLEN=0x%08x, RDH=0x%08x, RDT=0x%08x, RCTL=0x%08x\n",
-		    READ_MEM(state, RDLEN_OFFSET),
-		    READ_MEM(state, RDH_OFFSET),
-		    READ_MEM(state, RDT_OFFSET),
-		    READ_MEM(state, RCTL_OFFSET));
-    
-    // in the irq, update only the head of the buffer
-    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);    
-    DEBUG("total packet received = %d\n",
-          READ_MEM(state, E1000_TPR_OFFSET));
+
+    spin_unlock_irq_restore(&state->reap_lock, flags);
+
+    done++;
+
+    if(callback) {
+      DEBUG("invoke callback function callback: 0x%p\n", callback);
+      callback(status, context);
+    }
+  }
+
+  return done;
+}
+
+static int e1000_poll(void *state, uint64_t budget)
+{
+  return e1000_reap((struct e1000_state *)state, budget);
+}
+
+static int e1000_set_interrupts(void *vstate, int enable)
+{
+  struct e1000_state *state = (struct e1000_state *)vstate;
+
+  if (enable) {
+    WRITE_MEM(state, E1000_IMS_OFFSET, E1000_ICR_COMPLETIONS);
+    return e1000_tx_done(state) || e1000_rx_done(state);
+  } else {
+    WRITE_MEM(state, E1000_IMC_OFFSET, E1000_ICR_COMPLETIONS);
+    return 0;
   }
+}
+
+static int e1000_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s) 
+{
+  DEBUG("e1000_irq_handler fn vector: 0x%x rip: 0x%p\n", vec, excp->rip);
+
+  struct e1000_state* state = (struct e1000_state *)s;
+
+  // reading the cause clears it
+  uint32_t icr = READ_MEM(state, E1000_ICR_OFFSET);
+  uint32_t ims = READ_MEM(state, E1000_IMS_OFFSET);
+  DEBUG("ICR: 0x%08x IMS: 0x%08x mask_int: 0x%08x\n", icr, ims, icr & ims);
 
-  if(callback) {
-    DEBUG("invoke callback function callback: 0x%p\n", callback);
-    callback(status, context);
+  if (!nk_dev_poll_claim_interrupt(&state->netdev->dev)) {
+    e1000_reap(state, -1ULL);
   }
 
   DEBUG("end irq\n\n\n");
@@ -741,6 +857,10 @@ static struct nk_net_dev_int ops = {
   .get_characteristics = e1000_get_characteristics,
   .post_receive        = e1000_post_receive,
   .post_send           = e1000_post_send,
+  .post_receive_batch  = e1000_post_receive_batch,
+  .post_send_batch     = e1000_post_send_batch,
+  .poll                = e1000_poll,
+  .set_interrupts      = e1000_set_interrupts,
 };
 
 
@@ -790,6 +910,8 @@ int e1000_pci_init(struct naut_info * naut)
 
         memset(state,0,sizeof(*state));
         state->pci_dev = pdev;
+        spinlock_init(&state->reap_lock);
+        spinlock_init(&state->post_lock);
 
         // PCI Interrupt (A..D)
         state->pci_intr = cfg->dev_cfg.intr_pin;
@@ -903,7 +1025,7 @@ int e1000_pci_init(struct naut_info * naut)
 	// -> interrupt when the device receives a package
 	WRITE_MEM(state, E1000_RDTR_OFFSET, 0);
 	// enable only transmit descriptor written back and receive interrupt timer
-	WRITE_MEM(state, E1000_IMS_OFFSET, E1000_ICR_TXDW | E1000_ICR_RXT0);
+	WRITE_MEM(state, E1000_IMS_OFFSET, E1000_ICR_COMPLETIONS);
 	// after the interrupt is turned on, the interrupt handler is called
 	// due to the transmit descriptor queue empty.
 	
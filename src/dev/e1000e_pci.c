@@ -27,6 +27,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/netdev.h>
+#include <nautilus/devpoll.h>
 #include <nautilus/cpu.h>
 #include <dev/pci.h>
 #include <nautilus/mm.h>              // malloc, free
@@ -487,6 +488,10 @@ struct e1000e_state {
   uint64_t rx_buffer_size;
   // interrupt mark set
   uint32_t ims_reg;
+  // completions come from the interrupt handler and from pollers
+  spinlock_t reap_lock;
+  // sends and receives can be posted from any CPU
+  spinlock_t post_lock;
 
 #if TIMING
   volatile iteration_t measure;
@@ -696,24 +701,15 @@ static int e1000e_init_receive_ring(struct e1000e_state *state)
   return 0;
 }
 
-static int e1000e_send_packet(uint8_t* packet_addr,
-                              uint64_t packet_size,
-                              struct e1000e_state *state)
+// Fill the descriptor at the tail without telling the card - the
+// caller holds post_lock, checks the size, and moves TDT once it has
+// filled a batch
+static void e1000e_fill_txd(uint8_t* packet_addr,
+                            uint64_t packet_size,
+                            struct e1000e_state *state)
 {
   DEBUG("send pkt fn: pkt_addr 0x%p pkt_size: %d\n", packet_addr, packet_size);
 
-  DEBUG("send pkt fn: before sending TDH = %d TDT = %d tail_pos = %d\n",
-        READ_MEM(state, E1000E_TDH_OFFSET),
-        READ_MEM(state, E1000E_TDT_OFFSET),
-        TXD_TAIL);
-  DEBUG("send pkt fn: tpt total packet transmit: %d\n",
-        READ_MEM(state, E1000E_TPT_OFFSET));
-
-  if (packet_size > MAX_TU) {
-    ERROR("send pkt fn: packet is too large.\n");
-    return -1;
-  }
-
   memset(((struct e1000e_tx_desc *)TXD_RING_BUFFER + TXD_TAIL),
          0, sizeof(struct e1000e_tx_desc));
   TXD_ADDR(TXD_TAIL) = (uint64_t*) packet_addr;
@@ -733,8 +729,12 @@ static int e1000e_send_packet(uint8_t* packet_addr,
   TXD_CMD(TXD_TAIL).byte = E1000E_TXD_CMD_EOP | E1000E_TXD_CMD_IFCS | E1000E_TXD_CMD_RS; 
 
   // increment transmit descriptor list tail by 1
-  DEBUG("send pkt fn: moving the tail\n");
   TXD_TAIL = TXD_INC(1, TXD_TAIL);
+}
+
+static void e1000e_kick_tx(struct e1000e_state *state)
+{
+  DEBUG("send pkt fn: moving the tail\n");
   WRITE_MEM(state, E1000E_TDT_OFFSET, TXD_TAIL);
   DEBUG("send pkt fn: after moving tail TDH = %d TDT = %d tail_pos = %d\n",
         READ_MEM(state, E1000E_TDH_OFFSET),
@@ -755,7 +755,6 @@ static int e1000e_send_packet(uint8_t* packet_addr,
   //                                     0, E1000E_PCI_STATUS_OFFSET);
   // DEBUG("send pkt fn: status_pci 0x%04x int %d\n",
   //       status_pci, status_pci & E1000E_PCI_STATUS_INT);
-  return 0;
 }
 
 static void e1000e_disable_receive(struct e1000e_state* state)
@@ -774,15 +773,11 @@ static void e1000e_enable_receive(struct e1000e_state* state)
   return;
 }
 
-static int e1000e_receive_packet(uint8_t* buffer,
-                                 uint64_t buffer_size,
-                                 struct e1000e_state *state)
+// As for sends, the caller holds post_lock and moves RDT
+static void e1000e_fill_rxd(uint8_t* buffer,
+                            struct e1000e_state *state)
 {
-  DEBUG("e1000e receive packet fn: buffer = 0x%p, len = %lu\n",
-        buffer, buffer_size);
-  DEBUG("e1000e receive pkt fn: before moving tail head: %d, tail: %d\n",
-        READ_MEM(state, E1000E_RDH_OFFSET), 
-        READ_MEM(state, E1000E_RDT_OFFSET)); 
+  DEBUG("e1000e receive packet fn: buffer = 0x%p\n", buffer);
 
   memset(((struct e1000e_rx_desc *) RXD_RING_BUFFER + RXD_TAIL),
          0, sizeof(struct e1000e_rx_desc));
@@ -790,14 +785,16 @@ static int e1000e_receive_packet(uint8_t* buffer,
   RXD_ADDR(RXD_TAIL) = (uint64_t*) buffer;
 
   RXD_TAIL = RXD_INC(RXD_TAIL, 1);
+}
+
+static void e1000e_kick_rx(struct e1000e_state *state)
+{
   WRITE_MEM(state, E1000E_RDT_OFFSET, RXD_TAIL);
 
   DEBUG("e1000e receive pkt fn: after moving tail head: %d, prev_head: %d tail: %d\n",
         READ_MEM(state, E1000E_RDH_OFFSET), 
         RXD_PREV_HEAD, 
         READ_MEM(state, E1000E_RDT_OFFSET)); 
-
-  return 0;
 }
 
 static uint64_t e1000e_packet_size_to_buffer_size(uint64_t sz)
@@ -946,8 +943,16 @@ static int e1000e_post_send(void *vstate,
 {
   // always map callback
   struct e1000e_state* state = (struct e1000e_state*) vstate;
+  uint8_t flags;
   DEBUG("post tx fn: callback 0x%p context 0x%p\n", callback, context);
 
+  if (len > MAX_TU) {
+    ERROR("send pkt fn: packet is too large.\n");
+    return -1;
+  }
+
+  flags = spin_lock_irq_save(&state->post_lock);
+
   // #measure
   TIMING_GET_TSC(state->measure.tx.postx_map.start);
   int result = e1000e_map_callback(state->tx_map, callback, context);
@@ -956,10 +961,13 @@ static int e1000e_post_send(void *vstate,
   // #measure
   TIMING_GET_TSC(state->measure.tx.xpkt.start);
   if (!result) {
-    result = e1000e_send_packet(src, len, (struct e1000e_state*) state);
+    e1000e_fill_txd(src, len, state);
+    e1000e_kick_tx(state);
   }
   TIMING_GET_TSC(state->measure.tx.xpkt.end);
 
+  spin_unlock_irq_restore(&state->post_lock, flags);
+
   DEBUG("post tx fn: end\n");
   return result;
 }
@@ -973,8 +981,11 @@ static int e1000e_post_receive(void *vstate,
   // mapping the callback always
   // if result != -1 receive packet
   struct e1000e_state* state = (struct e1000e_state*) vstate;
+  uint8_t flags;
   DEBUG("post rx fn: callback 0x%p, context 0x%p\n", callback, context);
 
+  flags = spin_lock_irq_save(&state->post_lock);
+
   // #measure
   TIMING_GET_TSC(state->measure.rx.postx_map.start);
   int result = e1000e_map_callback(state->rx_map, callback, context);
@@ -983,16 +994,182 @@ static int e1000e_post_receive(void *vstate,
   // #measure
   TIMING_GET_TSC(state->measure.rx.xpkt.start);
   if (!result) {
-    result = e1000e_receive_packet(src, len, state);
+    e1000e_fill_rxd(src, state);
+    e1000e_kick_rx(state);
   }
   TIMING_GET_TSC(state->measure.rx.xpkt.end);
 
+  spin_unlock_irq_restore(&state->post_lock, flags);
+
   DEBUG("post rx fn: end --------------------\n");
   return result;
 }
 
+// Batches fill descriptors until the callback map is full and then
+// move the tail register once
+static int e1000e_post_send_batch(void *vstate,
+                                  struct nk_net_dev_buf *bufs,
+                                  uint64_t num)
+{
+  struct e1000e_state* state = (struct e1000e_state*) vstate;
+  uint64_t i;
+  uint8_t flags;
+
+  DEBUG("post tx batch fn: %lu packets\n", num);
+  flags = spin_lock_irq_save(&state->post_lock);
+  for (i = 0; i < num; i++) {
+    if (bufs[i].len > MAX_TU) {
+      ERROR("send pkt fn: packet is too large.\n");
+      break;
+    }
+    if (e1000e_map_callback(state->tx_map, bufs[i].callback, bufs[i].context)) {
+      break;
+    }
+    e1000e_fill_txd(bufs[i].buf, bufs[i].len, state);
+  }
+  if (i) {
+    e1000e_kick_tx(state);
+  }
+  spin_unlock_irq_restore(&state->post_lock, flags);
+
+  return (i || !num) ? i : -1;
+}
+
+static int e1000e_post_receive_batch(void *vstate,
+                                     struct nk_net_dev_buf *bufs,
+                                     uint64_t num)
+{
+  struct e1000e_state* state = (struct e1000e_state*) vstate;
+  uint64_t i;
+  uint8_t flags;
+
+  DEBUG("post rx batch fn: %lu buffers\n", num);
+  flags = spin_lock_irq_save(&state->post_lock);
+  for (i = 0; i < num; i++) {
+    if (e1000e_map_callback(state->rx_map, bufs[i].callback, bufs[i].context)) {
+      break;
+    }
+    e1000e_fill_rxd(bufs[i].buf, state);
+  }
+  if (i) {
+    e1000e_kick_rx(state);
+  }
+  spin_unlock_irq_restore(&state->post_lock, flags);
+
+  return (i || !num) ? i : -1;
+}
+
 enum pkt_op { op_unknown, op_tx, op_rx };
 
+// the oldest outstanding send or receive has been written back
+static inline int e1000e_tx_done(struct e1000e_state *state)
+{
+  return TXMAP->head_pos != TXMAP->tail_pos && TXD_STATUS(TXD_PREV_HEAD).dd;
+}
+
+static inline int e1000e_rx_done(struct e1000e_state *state)
+{
+  return RXMAP->head_pos != RXMAP->tail_pos && RXD_STATUS(RXD_PREV_HEAD).dd;
+}
+
+// Complete up to budget sends and receives in descriptor order, going
+// by the descriptor done bits rather than the interrupt cause, so one
+// interrupt or poll can pick up several.  Returns how many.
+static int e1000e_reap(struct e1000e_state *state, uint64_t budget)
+{
+  void (*callback)(nk_net_dev_status_t, void*);
+  void *context;
+  nk_net_dev_status_t status;
+  enum pkt_op which_op;
+  uint64_t done = 0;
+  uint8_t flags;
+
+  while (done < budget) {
+    callback = NULL;
+    context = NULL;
+    status = NK_NET_DEV_STATUS_SUCCESS;
+
+    flags = spin_lock_irq_save(&state->reap_lock);
+
+    if (e1000e_tx_done(state)) {
+      which_op = op_tx;
+      DEBUG("reap fn: send at %d\n", TXD_PREV_HEAD);
+      TIMING_GET_TSC(state->measure.tx.irq_unmap.start);
+      e1000e_unmap_callback(state->tx_map,
+                            (uint64_t **)&callback,
+                            (void **)&context);
+      TIMING_GET_TSC(state->measure.tx.irq_unmap.end);
+
+      // if there is an error while sending a packet, set the error status
+      if (TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
+        ERROR("reap fn: transmit errors\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+
+      // update the head of the ring buffer
+      TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
+    } else if (e1000e_rx_done(state)) {
+      which_op = op_rx;
+      DEBUG("reap fn: receive at %d\n", RXD_PREV_HEAD);
+      TIMING_GET_TSC(state->measure.rx.irq_unmap.start);
+      e1000e_unmap_callback(state->rx_map,
+                            (uint64_t **)&callback,
+                            (void **)&context);
+      TIMING_GET_TSC(state->measure.rx.irq_unmap.end);
+
+      // checking errors
+      if (RXD_ERRORS(RXD_PREV_HEAD)) {
+        ERROR("reap fn: receive an error packet\n");
+        status = NK_NET_DEV_STATUS_ERROR;
+      }
+
+      RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
+    } else {
+      spin_unlock_irq_restore(&state->reap_lock, flags);
+      break;
+    }
+
+    spin_unlock_irq_restore(&state->reap_lock, flags);
+
+    done++;
+
+    if (which_op == op_tx) {
+      TIMING_GET_TSC(state->measure.tx.irq_callback.start);
+    } else {
+      TIMING_GET_TSC(state->measure.rx.irq_callback.start);
+    }
+    if (callback) {
+      DEBUG("reap fn: invoke callback function callback: 0x%p\n", callback);
+      callback(status, context);
+    }
+    if (which_op == op_tx) {
+      TIMING_GET_TSC(state->measure.tx.irq_callback.end);
+    } else {
+      TIMING_GET_TSC(state->measure.rx.irq_callback.end);
+    }
+  }
+
+  return done;
+}
+
+static int e1000e_poll(void *state, uint64_t budget)
+{
+  return e1000e_reap((struct e1000e_state *)state, budget);
+}
+
+static int e1000e_set_interrupts(void *vstate, int enable)
+{
+  struct e1000e_state *state = (struct e1000e_state *)vstate;
+
+  if (enable) {
+    WRITE_MEM(state, E1000E_IMS_OFFSET, state->ims_reg);
+    return e1000e_tx_done(state) || e1000e_rx_done(state);
+  } else {
+    WRITE_MEM(state, E1000E_IMC_OFFSET, state->ims_reg);
+    return 0;
+  }
+}
+
 static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
 {
   DEBUG("irq_handler fn: vector: 0x%x rip: 0x%p s: 0x%p\n",
@@ -1001,83 +1178,19 @@ static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
   // #measure
   uint64_t irq_start = 0;
   uint64_t irq_end = 0;
-  uint64_t callback_start = 0;
-  uint64_t callback_end = 0;
-  enum pkt_op which_op = op_unknown; 
   
   TIMING_GET_TSC(irq_start);
   struct e1000e_state* state = s;
+  // reading the cause clears it
   uint32_t icr = READ_MEM(state, E1000E_ICR_OFFSET);
   uint32_t mask_int = icr & state->ims_reg;
   DEBUG("irq_handler fn: ICR: 0x%08x IMS: 0x%08x mask_int: 0x%08x\n",
         icr, state->ims_reg, mask_int);
 
-  void (*callback)(nk_net_dev_status_t, void*) = NULL;
-  void *context = NULL;
-  nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
-
-  if (mask_int & (E1000E_ICR_TXDW | E1000E_ICR_TXQ0)) {
-    
-    which_op = op_tx;
-    // transmit interrupt
-    DEBUG("irq_handler fn: handle the txdw interrupt\n");
-    TIMING_GET_TSC(state->measure.tx.irq_unmap.start);
-    e1000e_unmap_callback(state->tx_map,
-                          (uint64_t **)&callback,
-                          (void **)&context);
-    TIMING_GET_TSC(state->measure.tx.irq_unmap.end);
-    
-    // if there is an error while sending a packet, set the error status
-    if (TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
-      ERROR("irq_handler fn: transmit errors\n");
-      status = NK_NET_DEV_STATUS_ERROR;
-    }
-
-    // update the head of the ring buffer
-    TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
-    DEBUG("irq_handler fn: total packet transmitted = %d\n",
-          READ_MEM(state, E1000E_TPT_OFFSET));
-  }
-
-  if (mask_int & (E1000E_ICR_RXT0 | E1000E_ICR_RXO | E1000E_ICR_RXQ0)) {
-    which_op = op_rx;
-    // receive interrupt
-    /* if (mask_int & E1000E_ICR_RXT0) { */
-    /*   DEBUG("irq_handler fn: handle the rxt0 interrupt\n"); */
-    /* } */
-
-    /* if (mask_int & E1000E_ICR_RXO) { */
-    /*   DEBUG("irq_handler fn: handle the rx0 interrupt\n"); */
-    /* } */
-   
-    // INFO("rx length %d\n", RXD_LENGTH(RXD_PREV_HEAD));
-    TIMING_GET_TSC(state->measure.rx.irq_unmap.start);
-    e1000e_unmap_callback(state->rx_map,
-                          (uint64_t **)&callback,
-                          (void **)&context);
-    TIMING_GET_TSC(state->measure.rx.irq_unmap.end);
-
-    // e1000e_interpret_ims(state);
-    // TODO: check if we need this line
-    // WRITE_MEM(state, E1000E_IMC_OFFSET, E1000E_ICR_RXO);
-    
-    // checking errors
-    if (RXD_ERRORS(RXD_PREV_HEAD)) {
-      ERROR("irq_handler fn: receive an error packet\n");
-      status = NK_NET_DEV_STATUS_ERROR;
-    }
-
-    // in the irq, update only the head of the buffer
-    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
+  if (!nk_dev_poll_claim_interrupt(&state->netdev->dev)) {
+    e1000e_reap(state, -1ULL);
   }
 
-  TIMING_GET_TSC(callback_start);
-  if (callback) {
-    DEBUG("irq_handler fn: invoke callback function callback: 0x%p\n", callback);
-    callback(status, context);
-  }
-  TIMING_GET_TSC(callback_end);
-
   DEBUG("irq_handler fn: end irq\n\n\n");
   // DO NOT DELETE THIS LINE.
   // must have this line at the end of the handler
@@ -1087,14 +1200,10 @@ static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
   // #measure
   irq_end = rdtsc();
   
-  if (which_op == op_tx) {
-    state->measure.tx.irq_callback.start = callback_start;
-    state->measure.tx.irq_callback.end = callback_end;
+  if (mask_int & (E1000E_ICR_TXDW | E1000E_ICR_TXQ0)) {
     state->measure.tx.irq.start = irq_start;
     state->measure.tx.irq.end = irq_end;
   } else {
-    state->measure.rx.irq_callback.start = callback_start;
-    state->measure.rx.irq_callback.end = callback_end;
     state->measure.rx.irq.start = irq_start;
     state->measure.rx.irq.end = irq_end;
   }
@@ -1133,6 +1242,10 @@ static struct nk_net_dev_int ops = {
   .get_characteristics = e1000e_get_characteristics,
   .post_receive        = e1000e_post_receive,
   .post_send           = e1000e_post_send,
+  .post_receive_batch  = e1000e_post_receive_batch,
+  .post_send_batch     = e1000e_post_send_batch,
+  .poll                = e1000e_poll,
+  .set_interrupts      = e1000e_set_interrupts,
 };
 
 
@@ -1176,6 +1289,8 @@ int e1000e_pci_init(struct naut_info * naut)
         }
 
         memset(state,0,sizeof(*state));
+        spinlock_init(&state->reap_lock);
+        spinlock_init(&state->post_lock);
 	
 	// We will only support MSI for now
 
@@ -25,6 +25,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/devpoll.h>
 #include <nautilus/irq.h>
 
 #include <dev/pci.h>
@@ -65,6 +66,10 @@
 #define HEADER_DESC_LEN           16  // header descriptor length
 #define STATUS_DESC_LEN           1   // status descriptor length
 
+// data segments we will build for one request - a request is split
+// into segments only when the device limits segment size (size_max)
+#define VIRTIO_BLK_MAX_SEGS       8
+
 
 
 /* Maximum size of any single segment is in "size_max" */
@@ -83,18 +88,21 @@
 #define VIRTIO_BLK_F_BLK_SIZE   	6
 
 /* Cache lush command support */
-#define VIRTIO_BLK_F_FLUSH      	9    
+#define VIRTIO_BLK_F_FLUSH      	9
 
 /* Device exports information on optimal I/O alignment. */
 #define VIRTIO_BLK_F_TOPOLOGY   	10
 
 /* Device can toggle its cache between writeback andw ritethrough modes. */
-#define VIRTIO_BLK_F_CONFIG_WCE  	11   
+#define VIRTIO_BLK_F_CONFIG_WCE  	11
+
+/* Device supports multiple request queues, count is in "num_queues" */
+#define VIRTIO_BLK_F_MQ         	12
 
 /* Legacy Interface: Feature bits */
 
-/* Host supports request barriers */ 
-#define VIRTIO_BLK_F_BARRIER		0 
+/* Host supports request barriers */
+#define VIRTIO_BLK_F_BARRIER		0
 
 /* Device supports a scsi packet commands */
 #define VIRTIO_BLK_F_SCSI       	7
@@ -106,32 +114,64 @@ struct virtio_blk_dev {
     struct nk_block_dev         *blk_dev;     // nautilus block device
     struct virtio_pci_dev       *virtio_dev;  // nautilus pci device
     struct virtio_blk_config    *blk_config;  // virtio blk configuration
-    struct virtio_blk_callb     *blk_callb;   // virtio blk callbacks
+
+    int                          indirect;    // VIRTIO_F_INDIRECT_DESC negotiated
+    int                          event_idx;   // VIRTIO_F_EVENT_IDX negotiated
+    uint32_t                     max_segs;    // data segments per request
+    uint32_t                     max_seg_len; // bytes per data segment
+
+    uint16_t                     num_queues;  // request queues in use
+    struct virtio_blk_queue     *queues;      // one per request queue
+    uint16_t                     next_poll;   // queue a poll starts with
 };
 
 struct virtio_blk_config {
     uint64_t capacity;  // device size
-    uint32_t size_max;  // max size of any single descriptor 
-    uint32_t seg_max;   // total number of descriptors 
+    uint32_t size_max;  // max size of any single descriptor
+    uint32_t seg_max;   // total number of descriptors
     struct virtio_blk_geometry {
         uint16_t cylinders;
         uint8_t heads;
         uint8_t sectors;
-    } geometry;         // device geometry 
+    } geometry;         // device geometry
     uint32_t blk_size;  // optimal sector size
+    uint16_t num_queues; // request queues (VIRTIO_BLK_F_MQ)
 };
 
+// what the device reads at the start of every request
 struct virtio_blk_req {
     uint32_t type;      // read or write request
     uint32_t reserved;  // write back feature
     uint64_t sector;    // offset for read or write to occur
-    uint8_t *data;      // ... not used
-    uint8_t status;     // written by device
-};
-
-struct virtio_blk_callb {
-    void *context;
-    void (*callback)(nk_block_dev_status_t, void *);
+} __packed;
+
+// Per-request state, preallocated for every descriptor in the
+// queue and indexed by the head descriptor of the request, which
+// is unique while the request is outstanding.  The indirect table
+// comes first to keep it 16 byte aligned.
+struct virtio_blk_slot {
+    struct virtq_desc      indirect[VIRTIO_BLK_MAX_SEGS+2];
+    struct virtio_blk_req  hdr;
+    void                 (*callback)(nk_block_dev_status_t, void *);
+    void                  *context;
+    uint8_t                status;    // written by device
+    uint8_t                busy;
+} __align(16);
+
+struct virtio_blk_queue {
+    struct virtio_blk_dev   *dev;
+    uint16_t                 qidx;
+
+    // submission side - slots, avail ring, and kicks
+    spinlock_t               lock;
+    int                      plugged;
+
+    // completion side - used ring
+    spinlock_t               used_lock;
+
+    struct virtio_blk_slot  *slots;
+
+    struct virtio_blk_stats  stats;
 };
 
 /************************************************************
@@ -146,48 +186,53 @@ static int get_characteristics(void *state, struct nk_block_dev_characteristics
 
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) state;
     c->block_size = dev->blk_config->blk_size;
-    c->num_blocks = dev->blk_config->capacity; 
+    c->num_blocks = dev->blk_config->capacity;
 
     return 0;
 }
 
-static void fill_hdr_desc(struct virtq *vq, struct virtio_blk_req *hdr, uint16_t hdr_index, uint16_t buf_index)
+static inline struct virtq *queue_vq(struct virtio_blk_queue *q)
 {
-    struct virtq_desc *hdr_desc = &vq->desc[hdr_index];
+    return &q->dev->virtio_dev->virtq[q->qidx].vq;
+}
 
-    hdr_desc->addr = (uint64_t) hdr;
-    hdr_desc->len = HEADER_DESC_LEN;
-    hdr_desc->flags = 0;
-    hdr_desc->next = buf_index;
-    hdr_desc->flags |= VIRTQ_DESC_F_NEXT;
+// requests from a CPU always go to the same queue, whose
+// interrupt is steered back to that CPU
+static inline struct virtio_blk_queue *cpu_queue(struct virtio_blk_dev *dev)
+{
+    return &dev->queues[my_cpu_id() % dev->num_queues];
 }
 
-static void fill_buf_desc(struct virtq *vq, uint32_t size, uint64_t count, uint8_t *dest, uint16_t buf_index, uint16_t stat_index, uint8_t write)
+// Call with the queue lock held
+static void kick_queue(struct virtio_blk_queue *q)
 {
-    struct virtq_desc *buf_desc = &vq->desc[buf_index];
+    struct virtio_pci_virtq *virtq = &q->dev->virtio_dev->virtq[q->qidx];
+
+    if (virtq->vq.avail->idx == virtq->kicked_idx) {
+	// nothing new since the last kick
+	return;
+    }
 
-    buf_desc->addr = (uint64_t) dest;
-    buf_desc->len = size * count;
-    buf_desc->flags |= write ? 0 : VIRTQ_DESC_F_WRITE;
-    buf_desc->next = stat_index;
-    buf_desc->flags |= VIRTQ_DESC_F_NEXT;
+    if (virtio_pci_virtqueue_kick(q->dev->virtio_dev, q->qidx)) {
+	DEBUG("[notify device] queue %u\n", q->qidx);
+	q->stats.kicks++;
+    } else {
+	q->stats.kicks_suppressed++;
+    }
 }
 
-static void fill_stat_desc(struct virtq *vq, uint8_t *status, uint16_t stat_index)
+static void fill_desc(struct virtq_desc *d, uint64_t addr, uint32_t len, uint16_t flags)
 {
-    struct virtq_desc *stat_desc = &vq->desc[stat_index];
-
-    stat_desc->addr = (uint64_t) status;  
-    stat_desc->flags = 0;
-    stat_desc->flags |= VIRTQ_DESC_F_WRITE;
-    stat_desc->len = STATUS_DESC_LEN;
-    stat_desc->next = 0;
+    d->addr = addr;
+    d->len = len;
+    // keep VIRTQ_DESC_F_NEXT and next, which the chain allocator set up
+    d->flags = (d->flags & VIRTQ_DESC_F_NEXT) | flags;
 }
 
-static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint64_t count, uint8_t *src_dest, void (*callback)(nk_block_dev_status_t, void *), void *context, uint8_t write) 
+static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint64_t count, uint8_t *src_dest, void (*callback)(nk_block_dev_status_t, void *), void *context, uint8_t write)
 {
     DEBUG("%s blocknum = %lu count = %lu buf = %p callback = %p context = %p\n", write ? "write" : "read", blocknum, count, src_dest, callback, context);
-    
+
     if (blocknum + count > dev->blk_config->capacity) {
         ERROR("request goes beyond device capacity\n");
         return -1;
@@ -198,66 +243,99 @@ static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint
 	return -1;
     }
 
-    DEBUG("[build request header]\n");
-
-    struct virtio_blk_req *hdr = malloc(sizeof(struct virtio_blk_req));
+    uint64_t len = count * dev->blk_config->blk_size;
+    uint32_t nsegs = (len + dev->max_seg_len - 1) / dev->max_seg_len;
 
-    if (!hdr) {
-	ERROR("Failed to allocate request header\n");
+    if (!nsegs || nsegs > dev->max_segs) {
+	ERROR("request of %lu bytes needs %u segments, device allows %u\n", len, nsegs, dev->max_segs);
 	return -1;
     }
-    
-    memset(hdr, 0, sizeof(struct virtio_blk_req));
 
-    hdr->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    hdr->sector = blocknum;
-    hdr->reserved = 0;
-    hdr->status = 0;
+    struct virtio_blk_queue *q = cpu_queue(dev);
+    struct virtq *vq = queue_vq(q);
+    struct virtio_blk_slot *slot;
+    uint16_t desc[VIRTIO_BLK_MAX_SEGS+2];
+    uint16_t ndesc = dev->indirect ? 1 : nsegs+2;
+    uint32_t i;
+    uint8_t flags;
 
-    DEBUG("[allocate descriptors]\n");
+    DEBUG("[allocate descriptors] queue %u, %u segments\n", q->qidx, nsegs);
 
-    uint16_t desc[3];
+    flags = spin_lock_irq_save(&q->lock);
 
-    if (virtio_pci_desc_chain_alloc(dev->virtio_dev,VIRTIO_BLK_REQUEST_QUEUE,desc,3)) {
+    if (virtio_pci_desc_chain_alloc(dev->virtio_dev,q->qidx,desc,ndesc)) {
+	// if we are holding back a batch, the device may be idle
+	// waiting for it - hand it over so descriptors come back
+	kick_queue(q);
+	spin_unlock_irq_restore(&q->lock, flags);
 	ERROR("Failed to allocate descriptor chain\n");
-	free(hdr);
 	return -1;
     }
-    
-    uint16_t hdr_index = desc[0];
-    uint16_t buf_index = desc[1];
-    uint16_t stat_index = desc[2];
 
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
+    slot = &q->slots[desc[0]];
 
-    DEBUG("[create descriptors]\n");
+    DEBUG("[build request header]\n");
+
+    slot->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    slot->hdr.reserved = 0;
+    slot->hdr.sector = blocknum;
+    slot->status = 0xff;
+    slot->callback = callback;
+    slot->context = context;
+    slot->busy = 1;
 
-    DEBUG("[create header descriptor]\n");
-    fill_hdr_desc(vq, hdr, hdr_index, buf_index);
+    DEBUG("[create descriptors]\n");
 
-    DEBUG("[create buffer descriptor]\n");
-    fill_buf_desc(vq, dev->blk_config->blk_size, count, src_dest, buf_index, stat_index, write);
+    if (dev->indirect) {
+	// the whole request is described by a table in the slot,
+	// so it costs a single descriptor in the ring
+	struct virtq_desc *t = slot->indirect;
+	uint16_t n = nsegs+2;
 
-    DEBUG("[create status descriptor]\n");
-    fill_stat_desc(vq, &hdr->status, stat_index);
+	for (i=0;i<n;i++) {
+	    t[i].flags = i<n-1 ? VIRTQ_DESC_F_NEXT : 0;
+	    t[i].next = i+1;
+	}
+	fill_desc(&t[0], (uint64_t)&slot->hdr, HEADER_DESC_LEN, 0);
+	for (i=0;i<nsegs;i++) {
+	    uint64_t off = (uint64_t)i * dev->max_seg_len;
+	    fill_desc(&t[i+1], (uint64_t)(src_dest + off),
+		      len-off < dev->max_seg_len ? len-off : dev->max_seg_len,
+		      write ? 0 : VIRTQ_DESC_F_WRITE);
+	}
+	fill_desc(&t[n-1], (uint64_t)&slot->status, STATUS_DESC_LEN, VIRTQ_DESC_F_WRITE);
 
-    dev->blk_callb[hdr_index].callback = callback;
-    dev->blk_callb[hdr_index].context = context;
+	vq->desc[desc[0]].addr = (uint64_t)t;
+	vq->desc[desc[0]].len = n * sizeof(struct virtq_desc);
+	vq->desc[desc[0]].flags = VIRTQ_DESC_F_INDIRECT;
+    } else {
+	fill_desc(&vq->desc[desc[0]], (uint64_t)&slot->hdr, HEADER_DESC_LEN, 0);
+	for (i=0;i<nsegs;i++) {
+	    uint64_t off = (uint64_t)i * dev->max_seg_len;
+	    fill_desc(&vq->desc[desc[i+1]], (uint64_t)(src_dest + off),
+		      len-off < dev->max_seg_len ? len-off : dev->max_seg_len,
+		      write ? 0 : VIRTQ_DESC_F_WRITE);
+	}
+	fill_desc(&vq->desc[desc[ndesc-1]], (uint64_t)&slot->status, STATUS_DESC_LEN, VIRTQ_DESC_F_WRITE);
+    }
 
-    DEBUG("request in indexes: header = %d, buffer = %d, status = %d\n", hdr_index, buf_index, stat_index);
+    DEBUG("request head descriptor = %u (%u descriptors)\n", desc[0], ndesc);
 
     // update avail ring
-    vq->avail->ring[vq->avail->idx % vq->qsz] = hdr_index;
+    vq->avail->ring[vq->avail->idx % vq->qsz] = desc[0];
     mbarrier();
     vq->avail->idx++;
-    mbarrier();
-    
-    DEBUG("available ring's hdr index = %d, at ring index %d\n", hdr_index, vq->avail->idx - 1);
+
+    q->stats.submits++;
+
     DEBUG("available ring's ring index for next hdr = %u\n", vq->avail->idx);
 
-    DEBUG("[notify device]\n");
-    virtio_pci_write_regw(dev->virtio_dev, QUEUE_NOTIFY, VIRTIO_BLK_REQUEST_QUEUE);
-    
+    if (!q->plugged) {
+	kick_queue(q);
+    }
+
+    spin_unlock_irq_restore(&q->lock, flags);
+
     return 0;
 }
 
@@ -275,72 +353,235 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
     return read_write_blocks(dev, blocknum, count, src, callback, context, 1);
 }
 
+// A plug covers every queue, since the plugging thread may move to
+// another CPU, and so to another queue, before it unplugs
+static int plug(void *state)
+{
+    struct virtio_blk_dev *dev = (struct virtio_blk_dev *) state;
+    struct virtio_blk_queue *q;
+    uint8_t flags;
+    uint16_t i;
+
+    for (i=0;i<dev->num_queues;i++) {
+	q = &dev->queues[i];
+	flags = spin_lock_irq_save(&q->lock);
+	q->plugged++;
+	spin_unlock_irq_restore(&q->lock, flags);
+    }
+
+    return 0;
+}
+
+static int unplug(void *state)
+{
+    struct virtio_blk_dev *dev = (struct virtio_blk_dev *) state;
+    struct virtio_blk_queue *q;
+    uint8_t flags;
+    uint16_t i;
+    int rc = 0;
+
+    for (i=0;i<dev->num_queues;i++) {
+	q = &dev->queues[i];
+	flags = spin_lock_irq_save(&q->lock);
+	if (!q->plugged) {
+	    ERROR("unplug of queue %u that is not plugged\n", q->qidx);
+	    rc = -1;
+	} else if (!--q->plugged) {
+	    kick_queue(q);
+	}
+	spin_unlock_irq_restore(&q->lock, flags);
+    }
+
+    return rc;
+}
+
+// completion side, below
+static int poll(void *state, uint64_t budget);
+static int set_interrupts(void *state, int enable);
+
 static struct nk_block_dev_int ops = {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .plug = plug,
+    .unplug = unplug,
+    .poll = poll,
+    .set_interrupts = set_interrupts,
 };
 
+int virtio_blk_get_stats(struct nk_block_dev *d, struct virtio_blk_stats *s)
+{
+    struct virtio_blk_dev *dev = (struct virtio_blk_dev *) d->dev.state;
+    uint16_t i;
+
+    if (d->dev.interface != (struct nk_dev_int *) &ops) {
+	return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+
+    for (i=0;i<dev->num_queues;i++) {
+	s->submits += dev->queues[i].stats.submits;
+	s->kicks += dev->queues[i].stats.kicks;
+	s->kicks_suppressed += dev->queues[i].stats.kicks_suppressed;
+	s->interrupts += dev->queues[i].stats.interrupts;
+	s->completions += dev->queues[i].stats.completions;
+    }
+
+    s->num_queues = dev->num_queues;
+    s->indirect = dev->indirect;
+    s->event_idx = dev->event_idx;
+
+    return 0;
+}
+
 /************************************************************
  *************** interrupt handler & callback ***************
  ************************************************************/
-static void teardown(struct virtio_pci_dev *dev) 
+static void teardown(struct virtio_pci_dev *dev)
 {
     // actually do frees... and reset device here...
     virtio_pci_virtqueue_deinit(dev);
 }
 
-static int process_used_ring(struct virtio_blk_dev *dev) 
+// Complete up to budget requests, returning how many or -1.  From
+// an interrupt (rearm), the ring is drained and interrupts are turned
+// back on once it is empty.  A poller leaves interrupts alone.
+static int process_used_ring(struct virtio_blk_queue *q, uint64_t budget, int rearm)
 {
-    uint16_t hdr_desc_idx; 
+    struct virtio_blk_dev *dev = q->dev;
+    struct virtio_pci_virtq *virtq = &dev->virtio_dev->virtq[q->qidx];
+    struct virtq *vq = &virtq->vq;
+    struct virtio_blk_slot *slot;
     void (*callback)(nk_block_dev_status_t, void *);
     void *context;
-    struct virtio_pci_virtq *virtq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE];
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
-     
-    DEBUG("[processing used ring]\n");
-    DEBUG("current virtq used index = %d\n", virtq->vq.used->idx);
-    DEBUG("last seen used index = %d\n", virtq->last_seen_used);
-     
-    for (; virtq->last_seen_used != virtq->vq.used->idx; virtq->last_seen_used++) {
-	
+    uint16_t hdr_desc_idx;
+    uint64_t done = 0;
+    uint8_t status;
+    uint8_t flags;
+
+    DEBUG("[processing used ring %u]\n", q->qidx);
+
+    while (done < budget) {
+	flags = spin_lock_irq_save(&q->used_lock);
+
+	if (virtq->last_seen_used == ((volatile struct virtq_used *)vq->used)->idx) {
+	    // drained, so we want to hear about the next completion
+	    if (!rearm || !virtio_pci_virtqueue_enable_interrupts(dev->virtio_dev, q->qidx)) {
+		spin_unlock_irq_restore(&q->used_lock, flags);
+		return done;
+	    }
+	    spin_unlock_irq_restore(&q->used_lock, flags);
+	    continue;
+	}
+
+	if (rearm) {
+	    // we will pick up whatever completes while we are draining
+	    virtio_pci_virtqueue_disable_interrupts(dev->virtio_dev, q->qidx);
+	}
+
 	// grab the head of used descriptor chain
-	hdr_desc_idx = vq->used->ring[virtq->last_seen_used % virtq->vq.qsz].id;
-	 
-	if (vq->desc[hdr_desc_idx].flags != VIRTQ_DESC_F_NEXT)  {
-	    ERROR("Huh? head in the used ring is not a header descriptor\n");
+	hdr_desc_idx = vq->used->ring[virtq->last_seen_used % vq->qsz].id;
+	virtq->last_seen_used++;
+
+	if (hdr_desc_idx >= vq->qsz || !q->slots[hdr_desc_idx].busy) {
+	    spin_unlock_irq_restore(&q->used_lock, flags);
+	    ERROR("Huh? head in the used ring (%u) is not an outstanding request\n", hdr_desc_idx);
 	    return -1;
 	}
-	 
-	struct virtq_desc *hdr_desc = &vq->desc[hdr_desc_idx];
-	struct virtio_blk_req *hdr = (struct virtio_blk_req *)hdr_desc->addr;
-	uint8_t status = hdr->status;
-	 
-	DEBUG("completion for descriptor at index %d with status: %d\n", hdr_desc_idx, status);
-	 
-	// grab corresponding callback
-	callback = dev->blk_callb[hdr_desc_idx].callback;
-	context = dev->blk_callb[hdr_desc_idx].context;
-	 
-	memset(&dev->blk_callb[hdr_desc_idx],0,sizeof(dev->blk_callb[hdr_desc_idx]));
-	 
-	free(hdr);
-
-	DEBUG("descriptor hdr index = %u, callback = %p, context = %p\n", hdr_desc_idx, callback, context);
-	 
-	DEBUG("free used descriptors\n");
-
-	if (virtio_pci_desc_chain_free(dev->virtio_dev, VIRTIO_BLK_REQUEST_QUEUE, hdr_desc_idx)) {
+
+	slot = &q->slots[hdr_desc_idx];
+	status = slot->status;
+	callback = slot->callback;
+	context = slot->context;
+	slot->busy = 0;
+
+	q->stats.completions++;
+	done++;
+
+	spin_unlock_irq_restore(&q->used_lock, flags);
+
+	DEBUG("completion for descriptor at index %d with status: %d, callback = %p, context = %p\n", hdr_desc_idx, status, callback, context);
+
+	// the slot stays ours until its descriptors are back on the free list
+	if (virtio_pci_desc_chain_free(dev->virtio_dev, q->qidx, hdr_desc_idx)) {
 	    ERROR("error freeing descriptors\n");
 	    return -1;
 	}
-	 
+
 	if (callback) {
 	    DEBUG("[issuing callback]\n");
 	    callback(status ? NK_BLOCK_DEV_STATUS_ERROR : NK_BLOCK_DEV_STATUS_SUCCESS,context);
 	}
     }
-     
+
+    return done;
+}
+
+// budget is shared by the queues, and the one we start with rotates
+// so a busy queue cannot starve the others
+static int poll(void *state, uint64_t budget)
+{
+    struct virtio_blk_dev *dev = (struct virtio_blk_dev *) state;
+    uint16_t first = dev->next_poll++ % dev->num_queues;
+    uint16_t i;
+    uint64_t done = 0;
+    int n;
+
+    for (i=0;i<dev->num_queues && done<budget;i++) {
+	n = process_used_ring(&dev->queues[(first+i) % dev->num_queues], budget-done, 0);
+	if (n<0) {
+	    return -1;
+	}
+	done += n;
+    }
+
+    return done;
+}
+
+static int set_interrupts(void *state, int enable)
+{
+    struct virtio_blk_dev *dev = (struct virtio_blk_dev *) state;
+    struct virtio_blk_queue *q;
+    uint16_t i;
+    uint8_t flags;
+    int pending = 0;
+
+    for (i=0;i<dev->num_queues;i++) {
+	q = &dev->queues[i];
+	flags = spin_lock_irq_save(&q->used_lock);
+	if (enable) {
+	    pending |= virtio_pci_virtqueue_enable_interrupts(dev->virtio_dev, q->qidx);
+	} else {
+	    virtio_pci_virtqueue_disable_interrupts(dev->virtio_dev, q->qidx);
+	}
+	spin_unlock_irq_restore(&q->used_lock, flags);
+    }
+
+    return pending;
+}
+
+// MSI-X vector of a single request queue
+static int queue_handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
+{
+    struct virtio_blk_queue *q = (struct virtio_blk_queue *) priv_data;
+
+    DEBUG("[received an interrupt for queue %u!]\n", q->qidx);
+
+    q->stats.interrupts++;
+
+    if (nk_dev_poll_claim_interrupt(&q->dev->blk_dev->dev)) {
+	IRQ_HANDLER_END();
+	return 0;
+    }
+
+    if (process_used_ring(q, -1ULL, 1) < 0) {
+	ERROR("failed to process used ring\n");
+	IRQ_HANDLER_END();
+	return -1;
+    }
+
+    IRQ_HANDLER_END();
     return 0;
 }
 
@@ -348,13 +589,15 @@ static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 {
     DEBUG("[received an interrupt!]\n");
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) priv_data;
-    
+    uint16_t i;
+    int rc = 0;
+
     // only for legacy style interrupt
     if (dev->virtio_dev->itype == VIRTIO_PCI_LEGACY_INTERRUPT) {
         DEBUG("using legacy style interrupt\n");
         // read the interrupt status register, which will reset it to zero
         uint8_t isr = virtio_pci_read_regb(dev->virtio_dev, ISR_STATUS);
-	
+
         // if the lower bit is not set, not my interrupt
         if (!(isr & 0x1))  {
 	    DEBUG("not my interrupt\n");
@@ -362,21 +605,24 @@ static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 	    return 0;
         }
     }
-    
-    if (process_used_ring(dev)) {
-	ERROR("failed to process used ring\n");
+
+    if (nk_dev_poll_claim_interrupt(&dev->blk_dev->dev)) {
 	IRQ_HANDLER_END();
-	return -1;
-    } 
+	return 0;
+    }
 
-    // print used for test
-    //DEBUG("free count after = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
-    //uint8_t used_index = dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq.used->idx;
-    //DEBUG("used ring next index = %d\n", used_index);
+    // shared interrupt, so any queue may have completions
+    for (i=0;i<dev->num_queues;i++) {
+	dev->queues[i].stats.interrupts++;
+	if (process_used_ring(&dev->queues[i], -1ULL, 1) < 0) {
+	    ERROR("failed to process used ring %u\n", i);
+	    rc = -1;
+	}
+    }
 
     DEBUG("[interrupt handler finished]\n");
     IRQ_HANDLER_END();
-    return 0;
+    return rc;
 }
 
 /*************************************************
@@ -484,6 +730,7 @@ uint64_t select_features(uint64_t features)
     DEBUG_FBIT(features, VIRTIO_BLK_F_FLUSH);
     DEBUG_FBIT(features, VIRTIO_BLK_F_TOPOLOGY);
     DEBUG_FBIT(features, VIRTIO_BLK_F_CONFIG_WCE);
+    DEBUG_FBIT(features, VIRTIO_BLK_F_MQ);
     DEBUG_FBIT(features, VIRTIO_BLK_F_BARRIER);
     DEBUG_FBIT(features, VIRTIO_BLK_F_SCSI);
     DEBUG_FBIT(features, VIRTIO_F_NOTIFY_ON_EMPTY);
@@ -499,6 +746,11 @@ uint64_t select_features(uint64_t features)
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_GEOMETRY);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_RO);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_BLK_SIZE);
+    FBIT_SETIF(accepted,features,VIRTIO_F_INDIRECT_DESC);
+    FBIT_SETIF(accepted,features,VIRTIO_F_EVENT_IDX);
+#ifdef NAUT_CONFIG_VIRTIO_BLK_MQ
+    FBIT_SETIF(accepted,features,VIRTIO_BLK_F_MQ);
+#endif
     
     DEBUG("features accepted: 0x%0lx\n", accepted);
     return accepted;
@@ -512,22 +764,25 @@ static void parse_config(struct virtio_blk_dev *d)
     
     // must have capacity...
     d->blk_config->capacity = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 0);
-    if (dev->feat_accepted & VIRTIO_BLK_F_SIZE_MAX) { 
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_SIZE_MAX)) { 
 	d->blk_config->size_max = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 8);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_SEG_MAX) { 
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_SEG_MAX)) { 
 	d->blk_config->seg_max = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 12);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_GEOMETRY) { 
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_GEOMETRY)) { 
 	d->blk_config->geometry.cylinders = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 16);
 	d->blk_config->geometry.heads = virtio_pci_read_regb(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 18);
 	d->blk_config->geometry.sectors = virtio_pci_read_regb(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 19);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_BLK_SIZE) { 
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_BLK_SIZE)) { 
 	d->blk_config->blk_size = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 20);
     } else {
 	d->blk_config->blk_size = 512; // presumably...
     }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_MQ)) {
+	d->blk_config->num_queues = virtio_pci_read_regw(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 34);
+    }
     
     DEBUG("block device configuration layout\n");
     DEBUG("capacity           = %d\n", d->blk_config->capacity);
@@ -537,6 +792,92 @@ static void parse_config(struct virtio_blk_dev *d)
     DEBUG("geometry_heads     = %d\n", d->blk_config->geometry.heads);
     DEBUG("geometry_sectors   = %d\n", d->blk_config->geometry.sectors);
     DEBUG("blk_size           = %d\n", d->blk_config->blk_size);
+    DEBUG("num_queues         = %d\n", d->blk_config->num_queues);
+}
+
+static void free_queues(struct virtio_blk_dev *d)
+{
+    uint16_t i;
+
+    for (i=0;i<d->num_queues;i++) {
+	free(d->queues[i].slots);
+    }
+    free(d->queues);
+    d->queues = 0;
+    d->num_queues = 0;
+}
+
+static int setup_queues(struct virtio_blk_dev *d)
+{
+    struct virtio_pci_dev *dev = d->virtio_dev;
+    uint16_t n = 1;
+    uint16_t i;
+
+    if (!dev->num_virtqs) {
+	ERROR("device has no virtqueues\n");
+	return -1;
+    }
+
+    // no point in more queues than CPUs to submit on them
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_MQ) && d->blk_config->num_queues > 1) {
+	n = d->blk_config->num_queues;
+	if (n > dev->num_virtqs) {
+	    n = dev->num_virtqs;
+	}
+	if (n > nk_get_num_cpus()) {
+	    n = nk_get_num_cpus();
+	}
+    }
+
+    // largest data segment we will hand the device
+    d->max_seg_len = 0x80000000U;
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_SIZE_MAX) &&
+	d->blk_config->size_max >= d->blk_config->blk_size) {
+	d->max_seg_len = d->blk_config->size_max - (d->blk_config->size_max % d->blk_config->blk_size);
+    }
+
+    d->max_segs = VIRTIO_BLK_MAX_SEGS;
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_BLK_F_SEG_MAX) &&
+	d->blk_config->seg_max && d->blk_config->seg_max < d->max_segs) {
+	d->max_segs = d->blk_config->seg_max;
+    }
+
+    d->queues = malloc(n * sizeof(struct virtio_blk_queue));
+
+    if (!d->queues) {
+	ERROR("cannot allocate %u queues\n", n);
+	return -1;
+    }
+
+    memset(d->queues, 0, n * sizeof(struct virtio_blk_queue));
+
+    for (i=0;i<n;i++) {
+	struct virtio_blk_queue *q = &d->queues[i];
+	uint64_t size = dev->virtq[i].vq.qsz * sizeof(struct virtio_blk_slot);
+
+	q->dev = d;
+	q->qidx = i;
+	spinlock_init(&q->lock);
+	spinlock_init(&q->used_lock);
+
+	// one slot per descriptor, so a request never waits for a header
+	q->slots = malloc(size);
+
+	if (!q->slots) {
+	    ERROR("cannot allocate request slots for queue %u\n", i);
+	    d->num_queues = i;
+	    free_queues(d);
+	    return -1;
+	}
+
+	memset(q->slots, 0, size);
+
+	DEBUG("queue %u: %u slots at %p\n", i, dev->virtq[i].vq.qsz, q->slots);
+    }
+
+    d->num_queues = n;
+
+    return 0;
 }
 
 int virtio_blk_init(struct virtio_pci_dev *dev)
@@ -589,33 +930,32 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     dev->state = d;
     dev->teardown = teardown;
     d->virtio_dev = dev;
-    
-    // allocate callback array
-    d->blk_callb = malloc(dev->virtq[0].vq.qsz * sizeof(struct virtio_blk_callb));
-    
-    DEBUG("allocated %d callbacks at %p\n", dev->virtq[0].vq.qsz, d->blk_callb);
-    
-    if (!d->blk_callb) {
-	ERROR("failed to allocate callback array\n");
-	virtio_pci_virtqueue_deinit(dev);
-	free(d);
-	return -1;
-    }
+
+    d->indirect = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_F_INDIRECT_DESC);
+    d->event_idx = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_F_EVENT_IDX);
     
     // allocate virtio block configuration
     d->blk_config = malloc(sizeof(struct virtio_blk_config));
     
-    DEBUG("allocated virtio block config struct at %p for %hhx bytes\n", d->blk_callb, sizeof(struct virtio_blk_config));
+    DEBUG("allocated virtio block config struct at %p for %hhx bytes\n", d->blk_config, sizeof(struct virtio_blk_config));
     
     if (!d->blk_config) {
 	ERROR("failed to allocate virtio block config struct\n");
 	virtio_pci_virtqueue_deinit(dev);
-	free(d->blk_callb);
 	free(d);
 	return -1;
     }
     
     parse_config(d);
+
+    // allocate request queues and their request slots
+    if (setup_queues(d)) {
+	ERROR("failed to set up request queues\n");
+	virtio_pci_virtqueue_deinit(dev);
+	free(d->blk_config);
+	free(d);
+	return -1;
+    }
     
     // register virtio block device
     snprintf(buf,DEV_NAME_LEN,"virtio-blk%u",__sync_fetch_and_add(&num_devs,1));
@@ -624,8 +964,8 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     if (!d->blk_dev) {
 	ERROR("failed to register block device\n");
 	virtio_pci_virtqueue_deinit(dev);
+	free_queues(d);
 	free(d->blk_config);
-	free(d->blk_callb);
 	free(d);
 	return -1;
     }
@@ -646,18 +986,18 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 	DEBUG("setting up interrupts via MSI-X\n");
 	
 	if (dev->num_virtqs != p->msix.size) {
-	    ERROR("weird mismatch: numqueues=%u msixsize=%u\n", dev->num_virtqs, p->msix.size);
-	    // continue for now...
-	    // return -1;
+	    DEBUG("numqueues=%u msixsize=%u\n", dev->num_virtqs, p->msix.size);
 	}
 	
-	// this should really go by virtqueue, not entry
-	// and ideally pulled into a per-queue setup routine
-	// in virtio_pci...
 	uint16_t num_vec = p->msix.size;
         
 	// now fill out the device's MSI-X table
 	for (i=0;i<num_vec;i++) {
+	    // request queue i is used by CPU i (and any CPU
+	    // congruent to it), so its completions go there;
+	    // anything else lands on CPU 0 and polls every queue
+	    int cpu = i < d->num_queues ? i : 0;
+	    
 	    // find a free vector
 	    // note that prioritization here is your problem
 	    if (idt_find_and_reserve_range(1,0,&vec)) {
@@ -665,13 +1005,16 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 		return -1;
 	    }
 	    // register your handler for that vector
-	    if (register_int_handler(vec, handler, d)) {
+	    if (i < d->num_queues ?
+		register_int_handler(vec, queue_handler, &d->queues[i]) :
+		register_int_handler(vec, handler, d)) {
 		ERROR("failed to register int handler\n");
 		return -1;
 		// failed....
 	    }
 	    // set the table entry to point to your handler
-	    if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
+	    // (the entry targets an APIC id, not a CPU number)
+	    if (pci_dev_set_msi_x_entry(p,i,vec,per_cpu_get(system)->cpus[cpu]->lapic_id)) {
 		ERROR("failed to set MSI-X entry\n");
 		return -1;
 	    }
@@ -680,7 +1023,7 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 		ERROR("failed to unmask entry\n");
 		return -1;
 	    }
-	    DEBUG("finished setting up entry %d for vector %u on cpu 0\n",i,vec);
+	    DEBUG("finished setting up entry %d for vector %u on cpu %d\n",i,vec,cpu);
 	}
 	
 	// unmask entire function
@@ -709,6 +1052,15 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
         pci_dev_cfg_writew(p,0x4,cmd);
 	
     }
+
+    if (virtio_pci_start_device(dev)) {
+	ERROR("failed to start device\n");
+	return -1;
+    }
+
+    INFO("%s: %u request queues, %u segments of up to %u bytes per request, indirect descriptors %s, event index %s\n",
+	 buf, d->num_queues, d->max_segs, d->max_seg_len,
+	 d->indirect ? "on" : "off", d->event_idx ? "on" : "off");
     
     DEBUG("device inited\n");
     
@@ -25,6 +25,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/netdev.h>
+#include <nautilus/devpoll.h>
 #include <nautilus/irq.h>
 #include <nautilus/backtrace.h>
 
@@ -53,15 +54,18 @@
 
 #define MIN_TU 48
 #define MAX_TU 1522
+// largest frame we hand the device for segmentation
+#define MAX_TSO 65536
 
-// virtqueue indices
-#define VIRTIO_NET_RECVQ_IDX  0
-#define VIRTIO_NET_SENDQ_IDX  1
-#define VIRTIO_NET_CTRLQ_IDX  2
+// virtqueue indices - receive and send queues come in pairs,
+// and the control queue follows the last pair the device offers
+#define VIRTIO_NET_RECVQ_IDX(p)  (2*(p))
+#define VIRTIO_NET_SENDQ_IDX(p)  (2*(p)+1)
 
 // legacy register offsets
 #define VIRTIO_NET_OFF_MAC(v)     (virtio_pci_device_regs_start_legacy(v) + 0)
 #define VIRTIO_NET_OFF_STATUS(v)  (virtio_pci_device_regs_start_legacy(v) + 6)
+#define VIRTIO_NET_OFF_MAX_PAIRS(v) (virtio_pci_device_regs_start_legacy(v) + 8)
 
 // feature bits
 
@@ -140,14 +144,68 @@ struct virtio_net_hdr {
     uint16_t csum_offset;
 } __packed;
 
+// header used when VIRTIO_NET_F_MRG_RXBUF is negotiated, in both directions
+struct virtio_net_hdr_mrg_rxbuf {
+    struct virtio_net_hdr hdr;
+    uint16_t num_buffers;
+} __packed;
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+
+#define VIRTIO_NET_HDR_GSO_NONE      0
+#define VIRTIO_NET_HDR_GSO_TCPV4     1
+#define VIRTIO_NET_HDR_GSO_TCPV6     4
+
+// control virtqueue commands
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} __packed;
+
+#define VIRTIO_NET_CTRL_MQ               4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET  0
+
+#define VIRTIO_NET_OK     0
+
+// largest command payload ctrl_command passes to the device
+#define VIRTIO_NET_CTRL_DATA_MAX  8
+
+// how long to wait for the device to answer a control command
+#define VIRTIO_NET_CTRL_SPINS  100000000ULL
+
 
 // our state
 
 static uint64_t num_devs=0;
 
-struct callback_info {
-    void *context;
-    void (*callback)(nk_net_dev_status_t status, void *context);
+// Per-packet state, preallocated for every descriptor in a queue and
+// indexed by the head descriptor of the packet, which is unique while
+// the packet is outstanding.  The indirect table comes first to keep
+// it 16 byte aligned.
+struct virtio_net_slot {
+    struct virtq_desc                indirect[2];
+    struct virtio_net_hdr_mrg_rxbuf  hdr;
+    uint8_t                         *buf;
+    void                           (*callback)(nk_net_dev_status_t status, void *context);
+    void                            *context;
+    uint8_t                          busy;
+} __align(16);
+
+struct virtio_net_queue {
+    struct virtio_net_dev   *dev;
+    uint16_t                 qidx;
+    int                      send;
+
+    // posting side - slots, avail ring, and kicks
+    spinlock_t               lock;
+
+    // completion side - used ring
+    spinlock_t               used_lock;
+
+    struct virtio_net_slot  *slots;
+
+    struct virtio_net_stats  stats;
 };
 
 struct virtio_net_dev {
@@ -155,7 +213,25 @@ struct virtio_net_dev {
     struct virtio_pci_dev *virtio_dev;
 
     uint8_t mac[ETHER_MAC_LEN];
-    struct callback_info *callbacks[2];
+
+    int      indirect;     // VIRTIO_F_INDIRECT_DESC negotiated
+    int      mrg_rxbuf;    // VIRTIO_NET_F_MRG_RXBUF negotiated
+    uint32_t hdr_len;      // header bytes in front of every packet
+    uint64_t offloads;     // NK_NET_DEV_OFFLOAD_*
+
+    uint16_t num_pairs;    // queue pairs in use
+    uint16_t max_pairs;    // queue pairs the device offers
+    struct virtio_net_queue *recvq;   // num_pairs of each
+    struct virtio_net_queue *sendq;
+    uint32_t next_recvq;   // receive buffers are spread over the pairs
+    uint16_t next_poll;    // pair a poll starts with
+
+    // control command buffers, which the device may still use after
+    // ctrl_command gives up on it, so they cannot live on its stack
+    struct virtio_net_ctrl_hdr ctrl_hdr;
+    uint8_t                    ctrl_data[VIRTIO_NET_CTRL_DATA_MAX];
+    volatile uint8_t           ctrl_ack;
+    int                        ctrl_stuck;  // a command timed out
 };
 
 
@@ -185,87 +261,231 @@ static int get_characteristics(void *state, struct nk_net_dev_characteristics *c
     c->min_tu = MIN_TU;
     c->max_tu = MAX_TU;
     c->packet_size_to_buffer_size = packet_size_to_buffer_size;
+    c->offloads = d->offloads;
+    c->max_tso = d->offloads & (NK_NET_DEV_OFFLOAD_TSO4 | NK_NET_DEV_OFFLOAD_TSO6) ? MAX_TSO : 0;
+    c->num_queues = d->num_pairs;
 
     return 0;
 }
 
-static int post(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+// Call with the queue lock held
+static void kick_queue(struct virtio_net_queue *q)
 {
-    uint16_t qidx = send ? VIRTIO_NET_SENDQ_IDX : VIRTIO_NET_RECVQ_IDX;
-    struct virtio_net_dev *d = (struct virtio_net_dev *) state;
-    struct virtq *vq = &d->virtio_dev->virtq[qidx].vq;
+    struct virtio_pci_virtq *virtq = &q->dev->virtio_dev->virtq[q->qidx];
 
-    // alloc descriptor for header
-    uint16_t header_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &header_idx)) {
-        ERROR("descriptor alloc failed\n");
-        return -1;
+    if (virtq->vq.avail->idx == virtq->kicked_idx) {
+	return;
     }
-    DEBUG("allocated descriptor %d\n", header_idx);
 
-    // alloc descriptor for packet
-    uint16_t packet_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &packet_idx)) {
-        ERROR("descriptor alloc failed\n");
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
-        return -1;
+    if (virtio_pci_virtqueue_kick(q->dev->virtio_dev, q->qidx)) {
+	q->stats.kicks++;
+    } else {
+	q->stats.kicks_suppressed++;
     }
-    DEBUG("allocated descriptor %d\n", packet_idx);
+}
 
-    // create buffer for header
-    uint8_t *header = malloc(sizeof(struct virtio_net_hdr));
-    if (!header) {
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
-        virtio_pci_desc_free(d->virtio_dev, qidx, packet_idx);
-        ERROR("couldn't allocate buffer for virtio-net header\n");
-        return -1;
+static int fill_offload_hdr(struct virtio_net_dev *d, struct virtio_net_hdr *h, uint64_t len, struct nk_net_dev_tx_offload *o)
+{
+    if (!o) {
+	return 0;
     }
-    memset(header, 0, sizeof(struct virtio_net_hdr));
-    DEBUG("malloc header %x\n", (uint64_t) header);
 
-    // setup header descriptor
-    struct virtq_desc *header_desc = &vq->desc[header_idx];
-    header_desc->addr = (uint64_t) header;
-    header_desc->len = sizeof(struct virtio_net_hdr);
-    header_desc->flags = VIRTQ_DESC_F_NEXT;
-    if (!send) {
-        header_desc->flags |= VIRTQ_DESC_F_WRITE;
+    if (o->csum) {
+	if (!(d->offloads & NK_NET_DEV_OFFLOAD_TX_CSUM) ||
+	    (uint64_t)o->csum_start + o->csum_offset + 2 > len) {
+	    ERROR("bad or unsupported checksum offload\n");
+	    return -1;
+	}
+	h->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	h->csum_start = o->csum_start;
+	h->csum_offset = o->csum_offset;
+    }
+
+    switch (o->gso_type) {
+    case NK_NET_DEV_GSO_NONE:
+	if (len > MAX_TU) {
+	    ERROR("packet too large without segmentation offload\n");
+	    return -1;
+	}
+	return 0;
+    case NK_NET_DEV_GSO_TCPV4:
+	if (!(d->offloads & NK_NET_DEV_OFFLOAD_TSO4)) {
+	    ERROR("TSO4 is not available\n");
+	    return -1;
+	}
+	h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+	break;
+    case NK_NET_DEV_GSO_TCPV6:
+	if (!(d->offloads & NK_NET_DEV_OFFLOAD_TSO6)) {
+	    ERROR("TSO6 is not available\n");
+	    return -1;
+	}
+	h->gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+	break;
+    default:
+	ERROR("unknown segmentation offload %u\n", o->gso_type);
+	return -1;
+    }
+
+    // segmentation needs the device to produce the checksums
+    if (!o->csum || !o->mss || !o->hdr_len || len > MAX_TSO) {
+	ERROR("bad segmentation offload\n");
+	return -1;
+    }
+
+    h->hdr_len = o->hdr_len;
+    h->gso_size = o->mss;
+
+    return 0;
+}
+
+// Call with the queue lock held - this places the buffer in the
+// avail ring, but does not notify the device.  Returns 1 if the
+// ring is full.
+static int post_locked(struct virtio_net_queue *q, uint8_t *buf, uint64_t len, struct nk_net_dev_tx_offload *o, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    struct virtio_net_dev *d = q->dev;
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    struct virtio_net_slot *slot;
+    struct virtq_desc *hdr_desc, *packet_desc;
+    uint16_t write = q->send ? 0 : VIRTQ_DESC_F_WRITE;
+    uint16_t desc[2];
+
+    // the pair was dropped after the caller picked it
+    if (!q->slots) {
+	return -1;
+    }
+
+    // with indirect descriptors a packet costs a single ring entry
+    if (virtio_pci_desc_chain_alloc(d->virtio_dev, q->qidx, desc, d->indirect ? 1 : 2)) {
+        return 1;
+    }
+    DEBUG("allocated head descriptor %d on virtq %u\n", desc[0], q->qidx);
+
+    slot = &q->slots[desc[0]];
+
+    // the header lives in the slot, so there is nothing to allocate
+    memset(&slot->hdr, 0, sizeof(slot->hdr));
+
+    if (q->send && fill_offload_hdr(d, &slot->hdr.hdr, len, o)) {
+	virtio_pci_desc_chain_free(d->virtio_dev, q->qidx, desc[0]);
+	return -1;
     }
-    header_desc->next = packet_idx;
+
+    if (d->indirect) {
+	hdr_desc = &slot->indirect[0];
+	packet_desc = &slot->indirect[1];
+    } else {
+	hdr_desc = &vq->desc[desc[0]];
+	packet_desc = &vq->desc[desc[1]];
+    }
+
+    // setup header descriptor
+    hdr_desc->addr = (uint64_t) &slot->hdr;
+    hdr_desc->len = d->hdr_len;
+    hdr_desc->flags = VIRTQ_DESC_F_NEXT | write;
+    hdr_desc->next = d->indirect ? 1 : desc[1];
 
     // setup packet descriptor
-    struct virtq_desc *packet_desc = &vq->desc[packet_idx];
     packet_desc->addr = (uint64_t) buf;
     packet_desc->len = len;
-    if (!send) {
-        packet_desc->flags = VIRTQ_DESC_F_WRITE;
-    }
+    packet_desc->flags = write;
     packet_desc->next = 0;
 
+    if (d->indirect) {
+	vq->desc[desc[0]].addr = (uint64_t) slot->indirect;
+	vq->desc[desc[0]].len = sizeof(slot->indirect);
+	vq->desc[desc[0]].flags = VIRTQ_DESC_F_INDIRECT;
+    }
+
     // stash the callback and context
-    d->callbacks[qidx][header_idx].callback = callback;
-    d->callbacks[qidx][header_idx].context = context;
-    
+    slot->buf = buf;
+    slot->callback = callback;
+    slot->context = context;
+    slot->busy = 1;
+
     // put header descriptor in virtq
-    vq->avail->ring[vq->avail->idx % vq->qsz] = header_idx;
+    vq->avail->ring[vq->avail->idx % vq->qsz] = desc[0];
     mbarrier();
     vq->avail->idx++;
-    mbarrier();
 
-    // notify device (needs to be turned off for recv?)
-    virtio_pci_write_regw(d->virtio_dev, QUEUE_NOTIFY, qidx);
+    q->stats.posts++;
 
     return 0;
 }
 
+static int post(struct virtio_net_queue *q, uint8_t *buf, uint64_t len, struct nk_net_dev_tx_offload *o, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    uint8_t flags;
+    int rc;
+
+    flags = spin_lock_irq_save(&q->lock);
+
+    rc = post_locked(q, buf, len, o, callback, context);
+
+    if (!rc) {
+	kick_queue(q);
+    }
+
+    spin_unlock_irq_restore(&q->lock, flags);
+
+    if (rc > 0) {
+        ERROR("descriptor alloc failed\n");
+    }
+
+    return rc ? -1 : 0;
+}
+
+// a whole batch goes in under one lock acquisition and costs at
+// most one notification - returns how many were posted
+static int post_batch(struct virtio_net_queue *q, struct nk_net_dev_buf *bufs, uint64_t num)
+{
+    uint64_t i;
+    uint8_t flags;
+    int rc = 0;
+
+    flags = spin_lock_irq_save(&q->lock);
+
+    for (i=0;i<num;i++) {
+	if ((rc = post_locked(q, bufs[i].buf, bufs[i].len, 0, bufs[i].callback, bufs[i].context))) {
+	    break;
+	}
+    }
+
+    kick_queue(q);
+
+    spin_unlock_irq_restore(&q->lock, flags);
+
+    if (rc < 0 && !i) {
+	return -1;
+    }
+
+    DEBUG("posted %lu of %lu on virtq %u\n", i, num, q->qidx);
+
+    return i;
+}
+
+// sends go out on the queue pair of the CPU we are running on
+static inline struct virtio_net_queue *send_queue(struct virtio_net_dev *d)
+{
+    return &d->sendq[my_cpu_id() % d->num_pairs];
+}
+
+// we do not know which pair the device will deliver a packet to,
+// so receive buffers are dealt out to all of them
+static inline struct virtio_net_queue *recv_queue(struct virtio_net_dev *d)
+{
+    return &d->recvq[__sync_fetch_and_add(&d->next_recvq,1) % d->num_pairs];
+}
+
 static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
 {
     DEBUG("post_receive\n");
 
-    if (post(state, dest, len, callback, context, 0)) {
+    if (post(recv_queue((struct virtio_net_dev *) state), dest, len, 0, callback, context)) {
         return -1;
     }
-    
+
     return 0;
 }
 
@@ -273,83 +493,305 @@ static int post_send(void *state, uint8_t *src, uint64_t len, void (*callback)(n
 {
     DEBUG("post_send\n");
 
-    if (post(state, src, len, callback, context, 1)) {
+    if (post(send_queue((struct virtio_net_dev *) state), src, len, 0, callback, context)) {
         return -1;
     }
 
     return 0;
 }
 
+static int post_send_offload(void *state, uint8_t *src, uint64_t len, struct nk_net_dev_tx_offload *o, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    DEBUG("post_send_offload\n");
+
+    if (post(send_queue((struct virtio_net_dev *) state), src, len, o, callback, context)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int post_send_batch(void *state, struct nk_net_dev_buf *bufs, uint64_t num)
+{
+    DEBUG("post_send_batch\n");
+
+    return post_batch(send_queue((struct virtio_net_dev *) state), bufs, num);
+}
+
+// receive buffers are dealt out to the pairs in contiguous runs, so
+// what was posted is still a prefix of bufs
+static int post_receive_batch(void *state, struct nk_net_dev_buf *bufs, uint64_t num)
+{
+    struct virtio_net_dev *d = (struct virtio_net_dev *) state;
+    uint64_t done = 0, run, i;
+    int rc;
+
+    DEBUG("post_receive_batch\n");
+
+    for (i=0;i<d->num_pairs && done<num;i++) {
+	run = (num - done + (d->num_pairs - i) - 1) / (d->num_pairs - i);
+	rc = post_batch(recv_queue(d), bufs + done, run);
+	if (rc < 0) {
+	    return done ? done : -1;
+	}
+	done += rc;
+	if (rc < run) {
+	    break;
+	}
+    }
+
+    return done;
+}
+
+// completion side, below
+static int poll(void *state, uint64_t budget);
+static int set_interrupts(void *state, int enable);
+
 static struct nk_net_dev_int ops =  {
     .get_characteristics = get_characteristics,
     .post_receive = post_receive,
     .post_send = post_send,
+    .post_send_offload = post_send_offload,
+    .post_receive_batch = post_receive_batch,
+    .post_send_batch = post_send_batch,
+    .poll = poll,
+    .set_interrupts = set_interrupts,
 };
 
+int virtio_net_get_stats(struct nk_net_dev *n, struct virtio_net_stats *s)
+{
+    struct virtio_net_dev *d = (struct virtio_net_dev *) n->dev.state;
+    uint16_t i;
+
+    if (n->dev.interface != (struct nk_dev_int *) &ops) {
+	return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+
+    for (i=0;i<d->num_pairs;i++) {
+	struct virtio_net_queue *q[2] = { &d->recvq[i], &d->sendq[i] };
+	int j;
+	for (j=0;j<2;j++) {
+	    s->posts += q[j]->stats.posts;
+	    s->kicks += q[j]->stats.kicks;
+	    s->kicks_suppressed += q[j]->stats.kicks_suppressed;
+	    s->interrupts += q[j]->stats.interrupts;
+	    s->completions += q[j]->stats.completions;
+	    s->csum_fixups += q[j]->stats.csum_fixups;
+	}
+    }
+
+    s->num_queues = d->num_pairs;
+
+    return 0;
+}
+
 
 // interrupt handling
 
-static int process_used_ring(struct virtio_net_dev *d, int qidx)
+// The host handed us a packet whose TCP/UDP checksum it never computed
+// (VIRTIO_NET_HDR_F_NEEDS_CSUM) - the checksum field holds the pseudo
+// header sum, so summing from csum_start to the end of the packet and
+// storing the result completes it
+static int finish_checksum(uint8_t *pkt, uint64_t len, struct virtio_net_hdr *h)
 {
-    uint16_t curr_idx, desc_idx, len;
-    uint32_t i;
-    uint8_t *header;
-    struct virtq_desc *head, *body;
-    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[qidx];
+    uint64_t i, sum = 0;
 
-    mbarrier();
+    if ((uint64_t)h->csum_start + h->csum_offset + 2 > len) {
+	return -1;
+    }
 
-    DEBUG("processing used ring for virtq %d\n", qidx);
-    DEBUG("used idx = %d\n", virtq->vq.used->idx);
-    DEBUG("last seen used = %d\n", virtq->last_seen_used);
+    for (i=h->csum_start;i+1<len;i+=2) {
+	sum += (pkt[i]<<8) | pkt[i+1];
+    }
+    if (i<len) {
+	sum += pkt[i]<<8;
+    }
+    while (sum>>16) {
+	sum = (sum & 0xffff) + (sum>>16);
+    }
+    sum = ~sum & 0xffff;
 
-    for (; virtq->last_seen_used != virtq->vq.used->idx; virtq->last_seen_used++) {
-        curr_idx = virtq->last_seen_used % virtq->vq.qsz;
-        desc_idx = (uint16_t) virtq->vq.used->ring[curr_idx].id;
-        len = (uint16_t) virtq->vq.used->ring[curr_idx].len;
+    pkt[h->csum_start+h->csum_offset] = sum>>8;
+    pkt[h->csum_start+h->csum_offset+1] = sum & 0xff;
 
-        head = &virtq->vq.desc[desc_idx];
-        header = (uint8_t *) head->addr;
-        if (!(head->flags & VIRTQ_DESC_F_NEXT)) {
-            ERROR("head in used ring does not have next flag\n");
-            return -1;
-        }
-        body = &virtq->vq.desc[head->next];
+    return 0;
+}
 
-        DEBUG("head = %d\n", desc_idx);
-        DEBUG("body = %d\n", head->next);
-        DEBUG("len = %d\n", len);
-#ifdef NAUT_CONFIG_DEBUG_VIRTIO_NET
-        //nk_dump_mem((uint8_t *) body->addr, len - sizeof(struct virtio_net_hdr));
-#endif
-        // free the header buffer (this is the only buffer we allocated)
-        free(header);
+// Complete up to budget packets, returning how many or -1.  From
+// an interrupt (rearm), the ring is drained and interrupts are turned
+// back on once it is empty.  A poller leaves interrupts alone.
+static int process_used_ring(struct virtio_net_queue *q, uint64_t budget, int rearm)
+{
+    struct virtio_net_dev *d = q->dev;
+    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[q->qidx];
+    struct virtio_net_slot *slot;
+    void (*callback)(nk_net_dev_status_t, void *);
+    void *context;
+    nk_net_dev_status_t status;
+    uint16_t curr_idx, desc_idx;
+    uint64_t done = 0;
+    uint32_t len;
+    uint8_t flags;
 
-	// grab the callback info
-        void (*callback)(nk_net_dev_status_t, void *) = d->callbacks[qidx][desc_idx].callback;
-        void *context = d->callbacks[qidx][desc_idx].context;
+    DEBUG("processing used ring for virtq %d\n", q->qidx);
 
-        memset(&d->callbacks[qidx][desc_idx], 0, sizeof(struct callback_info));
+    while (done < budget) {
+	flags = spin_lock_irq_save(&q->used_lock);
+
+	if (virtq->last_seen_used == ((volatile struct virtq_used *)virtq->vq.used)->idx) {
+	    // drained, so we want to hear about the next one
+	    if (!rearm || !virtio_pci_virtqueue_enable_interrupts(d->virtio_dev, q->qidx)) {
+		spin_unlock_irq_restore(&q->used_lock, flags);
+		return done;
+	    }
+	    spin_unlock_irq_restore(&q->used_lock, flags);
+	    continue;
+	}
+
+	if (rearm) {
+	    // we will pick up whatever completes while we are draining
+	    virtio_pci_virtqueue_disable_interrupts(d->virtio_dev, q->qidx);
+	}
+
+        curr_idx = virtq->last_seen_used % virtq->vq.qsz;
+        desc_idx = (uint16_t) virtq->vq.used->ring[curr_idx].id;
+        len = virtq->vq.used->ring[curr_idx].len;
+	virtq->last_seen_used++;
+
+	if (desc_idx >= virtq->vq.qsz || !q->slots[desc_idx].busy) {
+	    spin_unlock_irq_restore(&q->used_lock, flags);
+	    ERROR("head in used ring (%u) is not an outstanding packet\n", desc_idx);
+	    return -1;
+	}
+
+	slot = &q->slots[desc_idx];
+	callback = slot->callback;
+	context = slot->context;
+	status = NK_NET_DEV_STATUS_SUCCESS;
+
+	if (!q->send) {
+	    DEBUG("received %u bytes on virtq %u\n", len, q->qidx);
+	    if (d->mrg_rxbuf && slot->hdr.num_buffers != 1) {
+		// our buffers hold a whole frame, so this cannot be one
+		ERROR("received packet spans %u buffers\n", slot->hdr.num_buffers);
+		status = NK_NET_DEV_STATUS_ERROR;
+	    } else if ((slot->hdr.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) &&
+		       (len < d->hdr_len || finish_checksum(slot->buf, len - d->hdr_len, &slot->hdr.hdr))) {
+		ERROR("cannot complete checksum of received packet\n");
+		status = NK_NET_DEV_STATUS_ERROR;
+	    } else if (slot->hdr.hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		q->stats.csum_fixups++;
+	    }
+	}
+
+	slot->busy = 0;
+	q->stats.completions++;
+	done++;
+
+	spin_unlock_irq_restore(&q->used_lock, flags);
 
         // free the descriptor chain
-        if (virtio_pci_desc_chain_free(d->virtio_dev, qidx, desc_idx)) {
+        if (virtio_pci_desc_chain_free(d->virtio_dev, q->qidx, desc_idx)) {
             ERROR("error freeing descriptors\n");
             return -1;
         }
 
         // call the corresponding callback
         if (callback) {
-            callback(NK_NET_DEV_STATUS_SUCCESS, context);
+            callback(status, context);
         }
     }
 
-    return 0;
+    return done;
+}
+
+// budget is shared by all the queues, and the pair we start with
+// rotates so a busy pair cannot starve the others
+static int poll(void *state, uint64_t budget)
+{
+    struct virtio_net_dev *d = (struct virtio_net_dev *) state;
+    uint16_t first = d->next_poll++ % d->num_pairs;
+    uint16_t i, p;
+    uint64_t done = 0;
+    int n;
+
+    for (i=0;i<d->num_pairs && done<budget;i++) {
+	p = (first+i) % d->num_pairs;
+	// reap sends first, since they free buffers the stack may be waiting on
+	if ((n = process_used_ring(&d->sendq[p], budget-done, 0)) < 0) {
+	    return -1;
+	}
+	done += n;
+	if ((n = process_used_ring(&d->recvq[p], budget-done, 0)) < 0) {
+	    return -1;
+	}
+	done += n;
+    }
+
+    return done;
+}
+
+static int set_queue_interrupts(struct virtio_net_queue *q, int enable)
+{
+    uint8_t flags = spin_lock_irq_save(&q->used_lock);
+    int pending = 0;
+
+    if (enable) {
+	pending = virtio_pci_virtqueue_enable_interrupts(q->dev->virtio_dev, q->qidx);
+    } else {
+	virtio_pci_virtqueue_disable_interrupts(q->dev->virtio_dev, q->qidx);
+    }
+
+    spin_unlock_irq_restore(&q->used_lock, flags);
+
+    return pending;
+}
+
+static int set_interrupts(void *state, int enable)
+{
+    struct virtio_net_dev *d = (struct virtio_net_dev *) state;
+    uint16_t i;
+    int pending = 0;
+
+    for (i=0;i<d->num_pairs;i++) {
+	pending |= set_queue_interrupts(&d->recvq[i], enable);
+	pending |= set_queue_interrupts(&d->sendq[i], enable);
+    }
+
+    return pending;
+}
+
+// MSI-X vector of a single queue
+static int queue_handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *) priv_data;
+    int rc = 0;
+
+    DEBUG("interrupt for virtq %u\n", q->qidx);
+
+    q->stats.interrupts++;
+
+    if (nk_dev_poll_claim_interrupt(&q->dev->net_dev->dev)) {
+	IRQ_HANDLER_END();
+	return 0;
+    }
+
+    if (process_used_ring(q, -1ULL, 1) < 0) {
+        ERROR("error processing used ring for virtq %u\n", q->qidx);
+	rc = -1;
+    }
+
+    IRQ_HANDLER_END();
+    return rc;
 }
 
 static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 {
     int rc = 0;
-    
+    uint16_t i;
+
     DEBUG("interrupt\n");
 
     struct virtio_net_dev *d = (struct virtio_net_dev *) priv_data;
@@ -368,14 +810,23 @@ static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
         // need to check bit 1 for config change
     }
 
-    // scan used rings
-    if (process_used_ring(d, VIRTIO_NET_RECVQ_IDX)) {
-        ERROR("error processing used ring for recvq\n");
-	rc = -1;
+    if (nk_dev_poll_claim_interrupt(&d->net_dev->dev)) {
+	IRQ_HANDLER_END();
+	return 0;
     }
-    if (process_used_ring(d, VIRTIO_NET_SENDQ_IDX)) {
-        ERROR("error processing used ring for sendq\n");
-	rc = -1;
+
+    // scan used rings
+    for (i=0;i<d->num_pairs;i++) {
+	d->recvq[i].stats.interrupts++;
+	if (process_used_ring(&d->recvq[i], -1ULL, 1) < 0) {
+	    ERROR("error processing used ring for recvq %u\n", i);
+	    rc = -1;
+	}
+	d->sendq[i].stats.interrupts++;
+	if (process_used_ring(&d->sendq[i], -1ULL, 1) < 0) {
+	    ERROR("error processing used ring for sendq %u\n", i);
+	    rc = -1;
+	}
     }
 
     DEBUG("interrupt done\n");
@@ -427,6 +878,28 @@ static uint64_t select_features(uint64_t features)
     uint64_t accepted = 0;
 
     FBIT_SETIF(accepted,features,VIRTIO_NET_F_MAC);
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_MRG_RXBUF);
+    FBIT_SETIF(accepted,features,VIRTIO_F_INDIRECT_DESC);
+    FBIT_SETIF(accepted,features,VIRTIO_F_EVENT_IDX);
+
+    // we finish partially checksummed packets we receive, but
+    // our receive buffers are too small for the guest TSO features
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_GUEST_CSUM);
+
+    // send offloads, segmentation depends on checksumming
+    if (FBIT_ISSET(features,VIRTIO_NET_F_CSUM)) {
+	FBIT_SETIF(accepted,features,VIRTIO_NET_F_CSUM);
+	FBIT_SETIF(accepted,features,VIRTIO_NET_F_HOST_TSO4);
+	FBIT_SETIF(accepted,features,VIRTIO_NET_F_HOST_TSO6);
+    }
+
+#ifdef NAUT_CONFIG_VIRTIO_NET_MQ
+    // queue pairs are enabled through the control queue
+    if (FBIT_ISSET(features,VIRTIO_NET_F_CTRL_VQ) && FBIT_ISSET(features,VIRTIO_NET_F_MQ)) {
+	FBIT_SETIF(accepted,features,VIRTIO_NET_F_CTRL_VQ);
+	FBIT_SETIF(accepted,features,VIRTIO_NET_F_MQ);
+    }
+#endif
 
     DEBUG("features accepted: 0x%0lx\n", accepted);
 
@@ -543,6 +1016,210 @@ static int check_int(struct virtio_net_dev *d)
     return 0;
 }
 
+// Issue a command on the control queue and spin until the device
+// answers.  Only used during bringup, when nothing else is using the
+// control queue.
+static int ctrl_command(struct virtio_net_dev *d, uint8_t class, uint8_t cmd, void *data, uint32_t len)
+{
+    struct virtio_pci_dev *dev = d->virtio_dev;
+    uint16_t qidx = 2*d->max_pairs;
+    struct virtio_pci_virtq *virtq = &dev->virtq[qidx];
+    uint64_t spins;
+    uint16_t desc[3];
+
+    if (qidx >= dev->num_virtqs) {
+	ERROR("device has no control queue\n");
+	return -1;
+    }
+
+    if (d->ctrl_stuck) {
+	ERROR("control queue is stuck on an earlier command\n");
+	return -1;
+    }
+
+    if (len > VIRTIO_NET_CTRL_DATA_MAX) {
+	ERROR("control command %u:%u has %u bytes of data\n", class, cmd, len);
+	return -1;
+    }
+
+    d->ctrl_hdr.class = class;
+    d->ctrl_hdr.cmd = cmd;
+    memcpy(d->ctrl_data, data, len);
+    d->ctrl_ack = ~VIRTIO_NET_OK;
+
+    if (virtio_pci_desc_chain_alloc(dev, qidx, desc, 3)) {
+	ERROR("cannot allocate control descriptors\n");
+	return -1;
+    }
+
+    virtq->vq.desc[desc[0]].addr = (uint64_t) &d->ctrl_hdr;
+    virtq->vq.desc[desc[0]].len = sizeof(d->ctrl_hdr);
+    virtq->vq.desc[desc[1]].addr = (uint64_t) d->ctrl_data;
+    virtq->vq.desc[desc[1]].len = len;
+    virtq->vq.desc[desc[2]].addr = (uint64_t) &d->ctrl_ack;
+    virtq->vq.desc[desc[2]].len = sizeof(d->ctrl_ack);
+    virtq->vq.desc[desc[2]].flags = VIRTQ_DESC_F_WRITE;
+
+    virtq->vq.avail->ring[virtq->vq.avail->idx % virtq->vq.qsz] = desc[0];
+    mbarrier();
+    virtq->vq.avail->idx++;
+    mbarrier();
+    virtio_pci_virtqueue_notify(dev, qidx);
+
+    for (spins=0;
+	 virtq->last_seen_used == ((volatile struct virtq_used *)virtq->vq.used)->idx;
+	 spins++) {
+	if (spins == VIRTIO_NET_CTRL_SPINS) {
+	    // the descriptors and buffers stay with the device
+	    d->ctrl_stuck = 1;
+	    ERROR("control command %u:%u timed out\n", class, cmd);
+	    return -1;
+	}
+    }
+
+    virtq->last_seen_used++;
+
+    virtio_pci_desc_chain_free(dev, qidx, desc[0]);
+
+    if (d->ctrl_ack != VIRTIO_NET_OK) {
+	ERROR("control command %u:%u failed (%u)\n", class, cmd, d->ctrl_ack);
+	return -1;
+    }
+
+    return 0;
+}
+
+static void free_queues(struct virtio_net_dev *d)
+{
+    uint16_t i;
+
+    for (i=0;i<d->num_pairs;i++) {
+	free(d->recvq[i].slots);
+	free(d->sendq[i].slots);
+    }
+    free(d->recvq);
+    free(d->sendq);
+    d->recvq = d->sendq = 0;
+    d->num_pairs = 0;
+}
+
+// Give back the buffers posted to a queue the device will no longer
+// use, failing their callbacks, and free its slots
+static void drop_queue(struct virtio_net_queue *q)
+{
+    uint16_t qsz = q->dev->virtio_dev->virtq[q->qidx].vq.qsz;
+    struct virtio_net_slot *slots;
+    uint8_t flags;
+    uint16_t i;
+
+    // posts that still pick this queue will now fail
+    flags = spin_lock_irq_save(&q->lock);
+    slots = q->slots;
+    q->slots = 0;
+    spin_unlock_irq_restore(&q->lock, flags);
+
+    for (i=0;i<qsz;i++) {
+	if (slots[i].busy && slots[i].callback) {
+	    slots[i].callback(NK_NET_DEV_STATUS_ERROR, slots[i].context);
+	}
+    }
+
+    free(slots);
+}
+
+// Shrink to the first n pairs.  The queue arrays stay as they are,
+// since MSI-X handlers point into them
+static void drop_pairs(struct virtio_net_dev *d, uint16_t n)
+{
+    uint16_t old = d->num_pairs;
+    uint16_t i;
+
+    // new posts only pick from the remaining pairs
+    d->num_pairs = n;
+    mbarrier();
+
+    for (i=n;i<old;i++) {
+	drop_queue(&d->recvq[i]);
+	drop_queue(&d->sendq[i]);
+    }
+}
+
+static int setup_queue(struct virtio_net_dev *d, struct virtio_net_queue *q, uint16_t qidx, int send)
+{
+    uint64_t size = d->virtio_dev->virtq[qidx].vq.qsz * sizeof(struct virtio_net_slot);
+
+    q->dev = d;
+    q->qidx = qidx;
+    q->send = send;
+    spinlock_init(&q->lock);
+    spinlock_init(&q->used_lock);
+
+    // one slot per descriptor, so a packet never waits for a header
+    q->slots = malloc(size);
+
+    if (!q->slots) {
+	ERROR("cannot allocate packet slots for virtq %u\n", qidx);
+	return -1;
+    }
+
+    memset(q->slots, 0, size);
+
+    return 0;
+}
+
+static int setup_queues(struct virtio_net_dev *d)
+{
+    struct virtio_pci_dev *dev = d->virtio_dev;
+    uint16_t n = 1;
+    uint16_t i;
+
+    d->max_pairs = 1;
+
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MQ)) {
+	d->max_pairs = virtio_pci_read_regw(dev, VIRTIO_NET_OFF_MAX_PAIRS(dev));
+	if (!d->max_pairs || 2*d->max_pairs >= dev->num_virtqs) {
+	    ERROR("device offers %u queue pairs but has %u virtqueues\n", d->max_pairs, dev->num_virtqs);
+	    return -1;
+	}
+	// no point in more pairs than CPUs to send on them
+	n = d->max_pairs;
+	if (n > nk_get_num_cpus()) {
+	    n = nk_get_num_cpus();
+	}
+    }
+
+    if (dev->num_virtqs < 2) {
+	ERROR("device has %u virtqueues\n", dev->num_virtqs);
+	return -1;
+    }
+
+    d->recvq = malloc(n * sizeof(struct virtio_net_queue));
+    d->sendq = malloc(n * sizeof(struct virtio_net_queue));
+
+    if (!d->recvq || !d->sendq) {
+	ERROR("cannot allocate %u queue pairs\n", n);
+	free(d->recvq);
+	free(d->sendq);
+	return -1;
+    }
+
+    memset(d->recvq, 0, n * sizeof(struct virtio_net_queue));
+    memset(d->sendq, 0, n * sizeof(struct virtio_net_queue));
+
+    for (i=0;i<n;i++) {
+	if (setup_queue(d, &d->recvq[i], VIRTIO_NET_RECVQ_IDX(i), 0) ||
+	    setup_queue(d, &d->sendq[i], VIRTIO_NET_SENDQ_IDX(i), 1)) {
+	    d->num_pairs = i+1;
+	    free_queues(d);
+	    return -1;
+	}
+    }
+
+    d->num_pairs = n;
+
+    return 0;
+}
+
 int virtio_net_init(struct virtio_pci_dev *dev)
 {
     char buf[DEV_NAME_LEN];
@@ -551,7 +1228,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
 	ERROR("currently only supported with legacy model\n");
 	return -1;
     }
-    
+
     DEBUG("init device\n");
 
     // allocate memory for state
@@ -590,36 +1267,34 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         return -1;
     }
 
-    // allocate memory for callbacks (this memory leaks, needs to be freed)
-    uint32_t send_callbacks_size = sizeof(struct callback_info) * dev->virtq[VIRTIO_NET_SENDQ_IDX].vq.qsz;
-    uint32_t recv_callbacks_size = sizeof(struct callback_info) * dev->virtq[VIRTIO_NET_RECVQ_IDX].vq.qsz;
+    // fill out pci dev state
+    dev->state = d;
+    dev->teardown = teardown;
 
-    d->callbacks[VIRTIO_NET_SENDQ_IDX] = malloc(send_callbacks_size);
-    if (!d->callbacks[VIRTIO_NET_SENDQ_IDX]) {
-        ERROR("can't allocate send callbacks\n");
-	virtio_pci_virtqueue_deinit(dev);
-        free(d);
-        return -1;
+    d->virtio_dev = dev;
+
+    d->indirect = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_F_INDIRECT_DESC);
+    d->mrg_rxbuf = !!FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MRG_RXBUF);
+    d->hdr_len = d->mrg_rxbuf ? sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
+
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_CSUM)) {
+	d->offloads |= NK_NET_DEV_OFFLOAD_TX_CSUM;
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_HOST_TSO4)) {
+	d->offloads |= NK_NET_DEV_OFFLOAD_TSO4;
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_HOST_TSO6)) {
+	d->offloads |= NK_NET_DEV_OFFLOAD_TSO6;
     }
 
-    d->callbacks[VIRTIO_NET_RECVQ_IDX] = malloc(recv_callbacks_size);
-    if (!d->callbacks[VIRTIO_NET_RECVQ_IDX]) {
-        ERROR("can't allocate recv callbacks\n");
+    // allocate queue pairs and their packet slots
+    if (setup_queues(d)) {
+        ERROR("Failed to set up queues\n");
 	virtio_pci_virtqueue_deinit(dev);
-        free(d->callbacks[VIRTIO_NET_SENDQ_IDX]);
         free(d);
         return -1;
     }
 
-    memset(d->callbacks[VIRTIO_NET_SENDQ_IDX], 0, send_callbacks_size);
-    memset(d->callbacks[VIRTIO_NET_RECVQ_IDX], 0, recv_callbacks_size);
-
-    // fill out pci dev state
-    dev->state = d;
-    dev->teardown = teardown;
-
-    d->virtio_dev = dev;
-
     // register net dev
     snprintf(buf,DEV_NAME_LEN,"virtio-net%u",__sync_fetch_and_add(&num_devs,1));
     d->net_dev = nk_net_dev_register(buf,0,&ops,d);
@@ -627,8 +1302,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
     if (!d->net_dev) {
         ERROR("Failed to register network device\n");
         virtio_pci_virtqueue_deinit(dev);
-	free(d->callbacks[VIRTIO_NET_RECVQ_IDX]);
-	free(d->callbacks[VIRTIO_NET_SENDQ_IDX]);
+	free_queues(d);
         free(d);
         return -1;
     }
@@ -651,15 +1325,23 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         DEBUG("setting up interrupts via MSI-X\n");
 
         if (dev->num_virtqs != num_vec) {
-            ERROR("weird mismatch: numqueues=%u msixsize=%u\n",
+            DEBUG("numqueues=%u msixsize=%u\n",
                 dev->num_virtqs, p->msix.size);
-            //continue for now...
-	    //return -1;
-	    
         }
 
         // now fill out the device's MSI-X table
         for (i=0;i<num_vec;i++) {
+	    // both queues of pair i are used by CPU i, so their
+	    // completions go there, anything else lands on CPU 0
+	    // and scans every queue
+	    struct virtio_net_queue *q = 0;
+	    int cpu = 0;
+
+	    if (i < 2*d->num_pairs) {
+		q = i&1 ? &d->sendq[i/2] : &d->recvq[i/2];
+		cpu = i/2;
+	    }
+
             // find a free vector
             // note that prioritization here is your problem
             if (idt_find_and_reserve_range(1,0,&vec)) {
@@ -667,13 +1349,15 @@ int virtio_net_init(struct virtio_pci_dev *dev)
                 return -1;
             }
             // register your handler for that vector
-            if (register_int_handler(vec, handler, d)) {
+            if (q ? register_int_handler(vec, queue_handler, q) :
+		register_int_handler(vec, handler, d)) {
                 ERROR("Failed to register int handler\n");
                 return -1;
                 // failed....
             }
             // set the table entry to point to your handler
-            if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
+            // (the entry targets an APIC id, not a CPU number)
+            if (pci_dev_set_msi_x_entry(p,i,vec,per_cpu_get(system)->cpus[cpu]->lapic_id)) {
                 ERROR("Failed to set MSI-X entry\n");
                 return -1;
             }
@@ -682,7 +1366,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
                 ERROR("Failed to unmask entry\n");
                 return -1;
             }
-            DEBUG("Finished setting up entry %d for vector %u on cpu 0\n",i,vec);
+            DEBUG("Finished setting up entry %d for vector %u on cpu %d\n",i,vec,cpu);
         }
 
         // unmask entire function
@@ -690,9 +1374,9 @@ int virtio_net_init(struct virtio_pci_dev *dev)
             ERROR("Failed to unmask device\n");
             return -1;
         }
-	
+
     } else {
-	
+
         DEBUG("setting up interrupts via legacy path at 0x%x\n",HACKED_LEGACY_VECTOR);
 	INFO("THIS HACKED LEGACY INTERRUPT SETUP IS PROBABLY NOT WHAT YOU WANT\n");
 
@@ -704,7 +1388,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
 	nk_unmask_irq(HACKED_LEGACY_IRQ);
 
 	// for (i=0; i<256; i++) { nk_umask_irq(i); }
-	
+
         // enable interrupts in PCI space
         uint16_t cmd = pci_dev_cfg_readw(p,0x4);
         cmd &= ~0x0400;
@@ -717,7 +1401,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
             d->mac[i] = virtio_pci_read_regb(dev,VIRTIO_NET_OFF_MAC(dev)+i);
         }
     }
-    
+
     DEBUG("device mac address: %x:%x:%x:%x:%x:%x\n",
         d->mac[0], d->mac[1], d->mac[2],
         d->mac[3], d->mac[4], d->mac[5]);
@@ -728,6 +1412,16 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         return -1;
     }
 
+    // the device only uses the first pair until told otherwise
+    if (d->num_pairs > 1) {
+	uint16_t pairs = d->num_pairs;
+	if (ctrl_command(d, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs))) {
+	    ERROR("Failed to enable %u queue pairs, using one\n", pairs);
+	    // packets can only arrive on the first pair now
+	    drop_pairs(d, 1);
+	}
+    }
+
     // now try to poke device
     // test_send(d);
     // for (i = 0; i < 128; i++) {
@@ -735,7 +1429,14 @@ int virtio_net_init(struct virtio_pci_dev *dev)
     // }
     // check_int(d);
 
-    DEBUG("device inited\n");    
+    INFO("%s: %u queue pairs, offloads%s%s%s, merged receive buffers %s, indirect descriptors %s\n",
+	 buf, d->num_pairs,
+	 d->offloads & NK_NET_DEV_OFFLOAD_TX_CSUM ? " csum" : "",
+	 d->offloads & NK_NET_DEV_OFFLOAD_TSO4 ? " tso4" : "",
+	 d->offloads & NK_NET_DEV_OFFLOAD_TSO6 ? " tso6" : "",
+	 d->mrg_rxbuf ? "on" : "off", d->indirect ? "on" : "off");
+
+    DEBUG("device inited\n");
 
     return 0;
 }
@@ -593,6 +593,7 @@ static int virtqueue_init_legacy(struct virtio_pci_dev *dev)
         
         // init last seen used
         dev->virtq[i].last_seen_used = 0;
+        dev->virtq[i].kicked_idx = 0;
 
         DEBUG("virtq allocation at %p for 0x%lx bytes\n", dev->virtq[i].data,alloc_size);
         DEBUG("virtq data at %p\n", dev->virtq[i].aligned_data);
@@ -692,6 +693,7 @@ static int virtqueue_init_modern(struct virtio_pci_dev *dev)
 
         // init last seen used
         dev->virtq[i].last_seen_used = 0;
+        dev->virtq[i].kicked_idx = 0;
 
         DEBUG("virtq allocation at %p for 0x%lx bytes\n", dev->virtq[i].data,alloc_size);
         DEBUG("virtq data at %p\n", dev->virtq[i].aligned_data);
@@ -1044,6 +1046,63 @@ int virtio_pci_virtqueue_notify(struct virtio_pci_dev *dev, uint16_t qidx)
 }
 
 
+#define EVENT_IDX(dev) ((dev)->feat_accepted & (0x1ULL << VIRTIO_F_EVENT_IDX))
+
+int virtio_pci_virtqueue_kick(struct virtio_pci_dev *dev, uint16_t qidx)
+{
+    struct virtio_pci_virtq *virtq = &dev->virtq[qidx];
+    struct virtq *vq = &virtq->vq;
+    uint16_t new_idx = vq->avail->idx;
+    uint16_t old_idx = virtq->kicked_idx;
+    int need;
+
+    if (new_idx == old_idx) {
+	return 0;
+    }
+
+    // avail->idx must be visible before we look at the suppression state
+    mbarrier();
+
+    if (EVENT_IDX(dev)) {
+	need = virtq_need_event(*(volatile le16 *)virtq_avail_event(vq), new_idx, old_idx);
+    } else {
+	need = !(((volatile struct virtq_used *)vq->used)->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    virtq->kicked_idx = new_idx;
+
+    if (need) {
+	virtio_pci_virtqueue_notify(dev, qidx);
+    }
+
+    return need;
+}
+
+void virtio_pci_virtqueue_disable_interrupts(struct virtio_pci_dev *dev, uint16_t qidx)
+{
+    // with event indices, the used event we last set is already behind
+    if (!EVENT_IDX(dev)) {
+	dev->virtq[qidx].vq.avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+int virtio_pci_virtqueue_enable_interrupts(struct virtio_pci_dev *dev, uint16_t qidx)
+{
+    struct virtio_pci_virtq *virtq = &dev->virtq[qidx];
+    struct virtq *vq = &virtq->vq;
+
+    if (EVENT_IDX(dev)) {
+	*(volatile le16 *)virtq_used_event(vq) = virtq->last_seen_used;
+    } else {
+	vq->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+
+    // the device must see this before we recheck
+    mbarrier();
+
+    return virtq->last_seen_used != ((volatile struct virtq_used *)vq->used)->idx;
+}
+
 					 
 static int bringup_device(struct virtio_pci_dev *dev)
 {
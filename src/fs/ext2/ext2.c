@@ -26,6 +26,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/bcache.h>
 #include <nautilus/fs.h>
 
 #include <fs/ext2/ext2.h>
@@ -53,6 +54,7 @@ struct ext2_state {
     struct nk_block_dev *dev;
     struct nk_fs        *fs;
     struct ext2_super_block super;
+    int                 cached;  // attached to the buffer cache
 };
 
 #include "ext2_access.c"
@@ -518,6 +520,13 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     uint32_t cur_logical_block;
     uint32_t cur_physical_block;
 
+    // complete blocks are gathered into runs of physically contiguous
+    // blocks, each transferred directly to/from srcdest
+    struct ext2_io io = { .fs = fs, .pending = 0, .errors = 0 };
+    uint32_t run_start = 0, run_len = 0;
+    uint64_t run_bytes = 0;
+    uint64_t max_run = MAX(1,MAX_RUN_BYTES/block_size);
+
     DEBUG("logical blocks [%lu,%lu), first_offset=%lu first=%lu middle=%lu, last=%lu\n",
 	  logical_block_start, logical_block_start+num_blocks,
 	  offset_into_first_block, bytes_from_last_block);
@@ -527,10 +536,17 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     for (cur_logical_block = logical_block_start;
 	 cur_logical_block < logical_block_start + num_blocks;
 	 cur_logical_block++) {
+
+	// a cache buffer filled below could hold a stale copy of blocks
+	// our direct writes still have in flight, so writes wait for them
+	if (write && io.pending && ext2_io_wait(&io)) {
+	    ERROR("Failed to write middle blocks due to device error\n");
+	    goto out_err;
+	}
 	
 	if (map_logical_to_physical_get(fs,inode_num,&inode,cur_logical_block,&cur_physical_block)) { 
 	    ERROR("Unable to map logical block %lu\n", cur_logical_block);
-	    return -1;
+	    goto out_err;
 	}
 	
 	DEBUG("mapped logical block %lu to physical block %lu\n", cur_logical_block, cur_physical_block);
@@ -539,7 +555,7 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	    // first block (partial)
 	    if (read_block(fs,cur_physical_block,buf)) {
 		ERROR("Failed to read first partial physical block %lu\n",cur_physical_block);
-		return -1;
+		goto out_err;
 	    } 
 	    if (!write) { 
 		// read - copy-out
@@ -549,7 +565,7 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 		memcpy(buf+offset_into_first_block,srcdest+bytes,bytes_from_first_block);
 		if (write_block(fs,cur_physical_block,buf)) { 
 		    ERROR("Failed to write first partial physical block %lu\n",cur_physical_block);
-		    return -1;
+		    goto out_err;
 		}
 	    }
 	    bytes += bytes_from_first_block;
@@ -560,7 +576,7 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 	    // last block (partial)
 	    if (read_block(fs,cur_physical_block,buf)) {
 		ERROR("Failed to read last partial physical block %lu\n",cur_physical_block);
-		return -1;
+		goto out_err;
 	    } 
 	    if (!write) { 
 		// read - copy-out
@@ -570,31 +586,37 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 		memcpy(buf,srcdest+bytes,bytes_from_last_block);
 		if (write_block(fs,cur_physical_block,buf)) { 
 		    ERROR("Failed to write first partial physical block %lu\n",cur_physical_block);
-		    return -1;
+		    goto out_err;
 		}
 	    }
 	    bytes += bytes_from_last_block;
 	    continue;
 	}
 	
-	// common case - r/w complete blocks
-	if (!write) {
-	    if (read_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to read middle block %lu\n",cur_physical_block);
-		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
-	    }
+	// common case - complete blocks, extending the current run if
+	// this one follows it on disk
+	if (run_len && cur_physical_block==run_start+run_len && run_len<max_run) {
+	    run_len++;
 	} else {
-	    if (write_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to write middle block %lu\n",cur_physical_block);
-		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
+	    if (run_len && read_write_run(&io,run_start,run_len,srcdest+run_bytes,write)) {
+		ERROR("Failed to %s middle blocks %u..%u\n",rw[write],run_start,run_start+run_len-1);
+		goto out_err;
 	    }
+	    run_start = cur_physical_block;
+	    run_len = 1;
+	    run_bytes = bytes;
 	}
+	bytes += block_size;
+    }
+
+    if (run_len && read_write_run(&io,run_start,run_len,srcdest+run_bytes,write)) {
+	ERROR("Failed to %s middle blocks %u..%u\n",rw[write],run_start,run_start+run_len-1);
+	goto out_err;
+    }
+
+    if (ext2_io_wait(&io)) {
+	ERROR("Failed to %s middle blocks due to device error\n",rw[write]);
+	return -1;
     }
 
     if (bytes != num_bytes) { 
@@ -605,6 +627,11 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     DEBUG("%s request done\n", rw[write]);
 
     return bytes;
+
+ out_err:
+    // nothing may still be landing in srcdest
+    ext2_io_wait(&io);
+    return -1;
 }
 
 
@@ -1271,6 +1298,13 @@ static int ext2_stat_path(void *state, char *path, struct nk_fs_stat *st)
 }
 
 
+static int ext2_sync(void *state)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+
+    return nk_bcache_sync(fs->dev);
+}
+
 static struct nk_fs_int ext2_inter = {
     .stat_path = ext2_stat_path,
     .create_file = ext2_create_file,
@@ -1283,6 +1317,7 @@ static struct nk_fs_int ext2_inter = {
     .close_file = ext2_close,
     .read_file = ext2_read,
     .write_file = ext2_write,
+    .sync = ext2_sync,
 };
 
 
@@ -1314,10 +1349,17 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 
     DEBUG("Device %s has block size %lu and numblocks %lu\n",dev->dev.name, s->chars.block_size, s->chars.num_blocks);
 
+    // filesystem metadata and data both go through the cache - a
+    // device that cannot be cached is used directly
+    s->cached = !nk_bcache_attach(dev);
+
     // stash away superblock for later use
     // any modifier is responsible for writing it as well
     if (read_superblock(s)) {
 	ERROR("Cannot read superblock for fs %s on device %s\n", fsname, devname);
+	if (s->cached) {
+	    nk_bcache_detach(dev);
+	}
 	free(s);
 	return -1;
     }
@@ -1326,6 +1368,9 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 
     if (!s->fs) { 
 	ERROR("Unable to register filesystem %s\n", fsname);
+	if (s->cached) {
+	    nk_bcache_detach(dev);
+	}
 	free(s);
 	return -1;
     }
@@ -1338,11 +1383,24 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 int nk_fs_ext2_detach(char *fsname)
 {
     struct nk_fs *fs = nk_fs_find(fsname);
+    struct ext2_state *s;
+    int rc;
+
     if (!fs) { 
 	return -1;
-    } else {
-	return nk_fs_unregister(fs);
     }
+
+    s = (struct ext2_state *)fs->state;
+
+    // unregister first, it waits for any nk_fs_sync still using the cache
+    rc = nk_fs_unregister(fs);
+
+    // the last detach writes back whatever is still dirty
+    if (s->cached) {
+	nk_bcache_detach(s->dev);
+    }
+
+    return rc;
 }
 
 /*
@@ -75,10 +75,10 @@ static int read_write_superblock(struct ext2_state *fs, int write)
 	  rw[write], SUPERBLOCK_OFFSET, SUPERBLOCK_SIZE, fs->fs->name, fs->chars.block_size, dev_offset, dev_num);
 
     if (write) { 
-	rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,&fs->super,NK_DEV_REQ_BLOCKING,0,0); 
+	rc = nk_bcache_write(fs->dev,dev_offset,dev_num,&fs->super); 
 	// TODO: write shadow copies
     } else {
-	rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,&fs->super,NK_DEV_REQ_BLOCKING,0,0);
+	rc = nk_bcache_read(fs->dev,dev_offset,dev_num,&fs->super);
     }
     
     if (rc) { 
@@ -116,9 +116,9 @@ static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *sr
 	  rw[write], block_num, fs->fs->name, fs->dev->dev.name, block_size, dev_offset, dev_num);
 
     if (write) { 
-	rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0); 
+	rc = nk_bcache_write(fs->dev,dev_offset,dev_num,srcdest); 
     } else {
-	rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0);
+	rc = nk_bcache_read(fs->dev,dev_offset,dev_num,srcdest);
     }
     
     if (rc) { 
@@ -134,6 +134,109 @@ static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *sr
 #define write_block(fs,block_num,src)  read_write_block(fs,block_num,src,1)
 
 
+//
+// Multi-block transfers of file data.  A run of physically contiguous
+// blocks goes to the device as one request, straight to or from the
+// caller's buffer.  Long runs bypass the buffer cache and are submitted
+// asynchronously so several can be in flight; ext2_io_wait() collects
+// them.  Short runs go through the cache.
+//
+#define DIRECT_MIN_BYTES (64*1024)
+#define MAX_RUN_BYTES    (256*1024)
+
+struct ext2_io {
+    struct ext2_state *fs;
+    volatile uint64_t  pending;
+    volatile uint64_t  errors;
+};
+
+static void ext2_io_done(nk_block_dev_status_t status, void *context)
+{
+    struct ext2_io *io = (struct ext2_io *)context;
+    // io lives on the waiter's stack and is gone once pending drops
+    struct nk_dev *dev = (struct nk_dev *)io->fs->dev;
+
+    if (status!=NK_BLOCK_DEV_STATUS_SUCCESS) {
+	__sync_fetch_and_add(&io->errors,1);
+    }
+    __sync_fetch_and_sub(&io->pending,1);
+    nk_dev_signal(dev);
+}
+
+static int ext2_io_idle(void *state)
+{
+    return !((struct ext2_io *)state)->pending;
+}
+
+static int ext2_io_wait(struct ext2_io *io)
+{
+    while (io->pending) {
+	nk_dev_wait((struct nk_dev *)io->fs->dev,ext2_io_idle,io);
+    }
+    return io->errors ? -1 : 0;
+}
+
+static int read_write_run(struct ext2_io *io, uint32_t block_num, uint32_t count, void *srcdest, int write)
+{
+    struct ext2_state *fs = io->fs;
+    uint64_t block_size = get_block_size(fs);
+    uint64_t dev_offset = FLOOR_DIV(block_num*block_size,fs->chars.block_size);
+    uint64_t dev_num    = FLOOR_DIV(count*block_size,fs->chars.block_size);
+    int rc;
+
+    write &= 0x1;
+
+    DEBUG("%sing %u blocks from block %u on fs %s / dev %s, dev_off=%lu, dev_num=%lu\n",
+	  rw[write], count, block_num, fs->fs->name, fs->dev->dev.name, dev_offset, dev_num);
+
+    if (count*block_size < DIRECT_MIN_BYTES) {
+	if (write) {
+	    rc = nk_bcache_write(fs->dev,dev_offset,dev_num,srcdest);
+	} else {
+	    rc = nk_bcache_read(fs->dev,dev_offset,dev_num,srcdest);
+	}
+	if (rc) {
+	    ERROR("Failed to %s blocks %u..%u due to device error\n",rw[write],block_num,block_num+count-1);
+	    return -1;
+	}
+	return 0;
+    }
+
+    if (nk_bcache_prepare_direct(fs->dev,dev_offset,dev_num,write)) {
+	ERROR("Failed to %s blocks %u..%u as cached data cannot be written back\n",rw[write],block_num,block_num+count-1);
+	return -1;
+    }
+
+    __sync_fetch_and_add(&io->pending,1);
+
+    if (write) {
+	rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_CALLBACK,ext2_io_done,io);
+    } else {
+	rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_CALLBACK,ext2_io_done,io);
+    }
+
+    if (rc) {
+	// the device is probably full up - let what is in flight
+	// drain and do this one synchronously
+	__sync_fetch_and_sub(&io->pending,1);
+	if (ext2_io_wait(io)) {
+	    return -1;
+	}
+	if (write) {
+	    rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0);
+	} else {
+	    rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0);
+	}
+	if (rc) {
+	    ERROR("Failed to %s blocks %u..%u due to device error\n",rw[write],block_num,block_num+count-1);
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+
 #define blocks_per_group(sb) ((sb)->s_blocks_per_group)
 #define inodes_per_group(sb) ((sb)->s_inodes_per_group)
 #define num_block_groups(sb) ((sb)->s_blocks_count/(sb)->s_blocks_per_group)
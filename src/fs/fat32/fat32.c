@@ -27,6 +27,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/bcache.h>
 #include <nautilus/fs.h>
 
 #include <fs/fat32/fat32.h>
@@ -127,14 +128,14 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
         if (offset + num_bytes < file_size ) {  //don't need to allocate new block 
             //update file content
             do {
-                if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+                if (nk_bcache_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf)) {
                     ERROR("Failed to read block.\n");
 		    // should really unwind here
 		    return -1;
                 }
                 memcpy(buf+remainder, srcdest + src_off, MIN(cluster_size - remainder, num_bytes-src_off));
                 DEBUG("Num Bytes to be written: %d\n", MIN(cluster_size - remainder, num_bytes-src_off));
-                if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+                if (nk_bcache_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf)) {
                     ERROR("Failed to write block.\n");
 		    // should really unwind here
 		    return -1;
@@ -152,14 +153,14 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
             uint32_t next = cluster_num;
             while( ! (next >= EOC_MIN && next <= EOC_MAX) ) {
                 cluster_num = next;
-                if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+                if (nk_bcache_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf)) {
                     ERROR("Failed to read on block.\n");
 		    // should really unwind here
 		    return -1;
                 }
                 memcpy(buf+remainder, srcdest + src_off, MIN(cluster_size - remainder, num_bytes-src_off));
                 DEBUG("Num Bytes to be written: %d\n", MIN(cluster_size - remainder, num_bytes-src_off));
-                if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+                if (nk_bcache_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf)) {
                     ERROR("Failed to write on block.\n");
 		    // should really unwind here
 		    return -1;
@@ -188,7 +189,7 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
                     memset(buf, '\0', cluster_size);
                     memcpy(buf, srcdest + src_off, MIN(cluster_size, num_bytes-src_off));
                     DEBUG("Num Bytes to be written: %d\n", MIN(cluster_size, num_bytes-src_off));
-                    if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+                    if (nk_bcache_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf)) {
                         //TODO: RESTORE THE FILE
                         ERROR("Failed to write block.\n");
 			// unwind... 
@@ -201,7 +202,7 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
 
             //Update directory entry
             dir_entry dir_buf[fs->bootrecord.directory_entry_num];
-            if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, dir_buf, NK_DEV_REQ_BLOCKING,0,0)) {
+            if (nk_bcache_read(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, dir_buf)) {
                 ERROR("Failed to read block.\n");
 		// unwind... 
 		return -1;
@@ -210,7 +211,7 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
             uint32_t new_file_size = offset + num_bytes; 
             dir_buf[dir_num].size = new_file_size; 
 
-            if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, dir_buf, NK_DEV_REQ_BLOCKING,0,0)) {
+            if (nk_bcache_write(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, dir_buf)) {
                 ERROR("Failed to write block.\n");
 		// unwind... 
 		return -1;
@@ -223,7 +224,7 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
         long dest_off = 0;
         
         do {
-            if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+            if (nk_bcache_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf)) {
 		ERROR("Failed to read block\n");
 		return -1;
 	    }
@@ -329,7 +330,7 @@ static void *fat32_create(void *state, char *path, int isdir)
 	    free_split_path(parts,num_parts);
             return NULL;
         }
-        if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
+        if (nk_bcache_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) { 
 	    ERROR("block read failed\n");
 	    free_split_path(parts,num_parts);
 	    return NULL;
@@ -348,7 +349,7 @@ static void *fat32_create(void *state, char *path, int isdir)
 
     dir_entry full_dirs2[num_dir_entry_per_file]; // last cluster of c
     DEBUG("end of dir_cluster_num (c) is %d\n", cluster_num);
-    if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), 1, full_dirs2, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_read(fs->dev, get_sector_num(cluster_num, fs), 1, full_dirs2)) {
 	ERROR("block read failed\n");
 	free_split_path(parts,num_parts);
 	return NULL;
@@ -367,7 +368,7 @@ static void *fat32_create(void *state, char *path, int isdir)
         }
         cluster_num = fat[cluster_num]; // advance to the allocated cluster
         i = 0; // start of cluster
-        if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), 1, full_dirs2, NK_DEV_REQ_BLOCKING,0,0)) { // read the new cluster of c
+        if (nk_bcache_read(fs->dev, get_sector_num(cluster_num, fs), 1, full_dirs2)) { // read the new cluster of c
 	    ERROR("Failed to read block\n");
 	    free_split_path(parts,num_parts);
             return NULL;
@@ -406,14 +407,14 @@ static void *fat32_create(void *state, char *path, int isdir)
     int rc;
     if (path_without_name[0] != 0) { // make sure path not like "/name"
         dir_ent.size += sizeof(dir_entry); // increment size of c in (dir entry of c in b)
-        if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) {
+        if (nk_bcache_write(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, full_dirs)) {
             ERROR("Failed to write block for full_dirs.\n");
 	    free_split_path(parts,num_parts);
 	    return NULL;
         }
     }
     
-    if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, full_dirs2, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, full_dirs2)) {
         ERROR("Failed to write on block for full_dirs2.\n");
 	free_split_path(parts,num_parts);
 	return NULL;
@@ -479,25 +480,25 @@ int fat32_remove(void *state, char *path)
     } while (! (cluster_num >= EOC_MIN && cluster_num <= EOC_MAX) );
 
     fs->table_chars.FAT32_begin[cluster_num] = FREE_CLUSTER; 
-    if (nk_block_dev_write(fs->dev, fs->bootrecord.reservedblock_size, fat_size, fat, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_write(fs->dev, fs->bootrecord.reservedblock_size, fat_size, fat)) {
 	ERROR("Failed to write block\n");
 	return -1;
     }
 
-    if (nk_block_dev_write(fs->dev, fs->bootrecord.reservedblock_size + fat_size, fat_size, fat, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_write(fs->dev, fs->bootrecord.reservedblock_size + fat_size, fat_size, fat)) {
 	ERROR("Failed to write block\n");
 	return -1;
     }
 
     //remove the directory entry
     dir_entry full_dirs[FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry))];
-    if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
+    if (nk_bcache_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) { 
 	ERROR("Failed to read block\n");
 	return -1;
     }
     DEBUG("dir_num is %d\n", dir_num);
     memset(full_dirs + dir_num, 0, sizeof(dir_entry));
-    if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_write(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) {
 	ERROR("Failed to write block\n");
 	return -1;
     }
@@ -571,13 +572,13 @@ static int fat32_truncate(void *state, void *file, off_t len)
             size -= cluster_size;
         }
         char file_content[cluster_size];
-        if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), 1, file_content, NK_DEV_REQ_BLOCKING,0,0)) {
+        if (nk_bcache_read(fs->dev, get_sector_num(cluster_num, fs), 1, file_content)) {
 	    ERROR("Failed to read block\n");
 	    return -1;
 	}
 
         memset(file_content + size - 1, '\0', cluster_size - size + 1);
-        if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), 1, file_content, NK_DEV_REQ_BLOCKING,0,0)) { 
+        if (nk_bcache_write(fs->dev, get_sector_num(cluster_num, fs), 1, file_content)) { 
 	    ERROR("Failed to write block\n");
 	    return -1;
 	}
@@ -618,13 +619,13 @@ static int fat32_truncate(void *state, void *file, off_t len)
     //set new file size and write directory entry back 
     dir_entry full_dirs[FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry))];
     
-    if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
+    if (nk_bcache_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) { 
 	ERROR("FAiled to read block\n");
 	return -1;
     }
     full_dirs[dir_num].size = (uint32_t) new_file_size; 
 
-    if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
+    if (nk_bcache_write(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) { 
 	ERROR("Failed to write block\n");
 	return -1;
     }
@@ -646,6 +647,13 @@ static void fat32_close(void *state, void *file)
     }
 }
 
+static int fat32_sync(void *state)
+{
+    struct fat32_state *fs = (struct fat32_state *)state;
+
+    return nk_bcache_sync(fs->dev);
+}
+
 static struct nk_fs_int fat32_inter = {
     .stat_path = fat32_stat_path,
     .create_file = fat32_create_file,
@@ -658,6 +666,7 @@ static struct nk_fs_int fat32_inter = {
     .close_file = fat32_close,
     .read_file = fat32_read,
     .write_file = fat32_write,
+    .sync = fat32_sync,
 };
 
 static void fat32_demo(struct fat32_state *s)
@@ -710,16 +719,26 @@ int nk_fs_fat32_attach(char *devname, char *fsname, int readonly)
     }
 
     DEBUG("Device %s has block size %lu and numblocks %lu\n",dev->dev.name, s->chars.block_size, s->chars.num_blocks);
+
+    // filesystem metadata and data both go through the cache - a
+    // device that cannot be cached is used directly
+    s->cached = !nk_bcache_attach(dev);
     
     //read reserved block(boot record)
     if (read_bootrecord(s)) {
         ERROR("Cannot read bootrecord for fs FAT32 %s on device %s\n", fsname, devname);
+        if (s->cached) {
+            nk_bcache_detach(dev);
+        }
         free(s);
         return -1;
     }
     
     if (read_FAT(s)){
         ERROR("Cannot load FAT into memory");
+        if (s->cached) {
+            nk_bcache_detach(dev);
+        }
         free(s);
         return -1;
     }
@@ -743,6 +762,9 @@ int nk_fs_fat32_attach(char *devname, char *fsname, int readonly)
 
     if (!s->fs) { 
 	ERROR("Unable to register filesystem %s\n", fsname);
+	if (s->cached) {
+	    nk_bcache_detach(dev);
+	}
 	free(s);
 	return -1;
     }
@@ -757,9 +779,22 @@ int nk_fs_fat32_attach(char *devname, char *fsname, int readonly)
 int nk_fs_fat32_detach(char *fsname)
 {
     struct nk_fs *fs = nk_fs_find(fsname);
+    struct fat32_state *s;
+    int rc;
+
     if (!fs) {
         return -1;
-    } else {
-        return nk_fs_unregister(fs);
     }
+
+    s = (struct fat32_state *)fs->state;
+
+    // unregister first, it waits for any nk_fs_sync still using the cache
+    rc = nk_fs_unregister(fs);
+
+    // the last detach writes back whatever is still dirty
+    if (s->cached) {
+        nk_bcache_detach(s->dev);
+    }
+
+    return rc;
 }
@@ -48,6 +48,7 @@ struct fat32_state {
     struct nk_fs        *fs;
     struct fat32_bootrecord bootrecord;
     struct fat32_char	table_chars;
+    int                 cached;  // attached to the buffer cache
 };
 
 
@@ -29,6 +29,7 @@
 #include <nautilus/idt.h>
 
 #include <nautilus/aspace.h>
+#include <nautilus/tlb.h>
 
 #ifndef NAUT_CONFIG_DEBUG_ASPACES
 #undef DEBUG_PRINT
@@ -240,8 +241,10 @@ int nk_aspace_move_thread(nk_aspace_t *aspace)
 	BOILERPLATE_DO(t->aspace,remove_thread);
     }
 
-    // new address space is gaining it
-    BOILERPLATE_DO(aspace,add_thread);
+    // new address space is gaining it, unless it is the default
+    if (aspace) {
+	BOILERPLATE_DO(aspace,add_thread);
+    }
 
     
     DEBUG("Doing switch to %p\n",aspace);
@@ -252,7 +255,7 @@ int nk_aspace_move_thread(nk_aspace_t *aspace)
 
     t->aspace = aspace;
 
-    DEBUG("thread %d (%s) is now in %p (%s)\n",t->tid,t->name, t->aspace,t->aspace->name);
+    DEBUG("thread %d (%s) is now in %p (%s)\n",t->tid,t->name, t->aspace,AS_NAME(t->aspace));
 
     irq_enable_restore(flags);
     
@@ -269,7 +272,7 @@ int  nk_aspace_remove_region(nk_aspace_t *aspace, nk_aspace_region_t *region)
     BOILERPLATE_LEAVE(aspace,remove_region,region);
 }
 
-int  nk_aspace_protect_region(nk_aspace_t *aspace, nk_aspace_region_t *region, nk_aspace_protection_t *prot)
+int  nk_aspace_protect(nk_aspace_t *aspace, nk_aspace_region_t *region, nk_aspace_protection_t *prot)
 {
     BOILERPLATE_LEAVE(aspace,protect_region,region,prot);
 }
@@ -287,6 +290,11 @@ int nk_aspace_exception(excp_entry_t *entry, excp_vec_t vec, void *priv_data)
     struct cpu *cpu  = get_cpu();
     nk_aspace_t *cur = cpu->cur_aspace;
 
+    if (!cur) {
+	// default address space
+	return -1;
+    }
+
     if (vec==PF_EXCP) {
 	if (cur->flags & NK_ASPACE_HOOK_PF) {
 	    return cur->interface->exception(cur->state,entry,vec);
@@ -317,6 +325,10 @@ int nk_aspace_init()
     INIT_LIST_HEAD(&aspace_list);
     spinlock_init(&state_lock);
 
+    if (nk_tlb_init()) {
+	ERROR("Cannot set up TLB shootdowns - changes to aspaces will not reach other CPUs\n");
+    }
+
     nk_aspace_base_init();
 
     return 0;
@@ -0,0 +1,926 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/list.h>
+#include <nautilus/dev.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/bcache.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/timer.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+#ifndef NAUT_CONFIG_DEBUG_FILESYSTEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("bcache: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("bcache: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("bcache: " fmt, ##args)
+
+#define BUF_SIZE       4096
+#define RA_BUFS        NAUT_CONFIG_FS_BUFFER_CACHE_READAHEAD
+#define WB_BATCH       16                // writes submitted per plug
+#define FLUSH_STEP_NS  10000000ULL       // flusher looks for work this often
+#define FLUSH_NS       (NAUT_CONFIG_FS_BUFFER_CACHE_FLUSH_MS*1000000ULL)
+#define FLUSH_HIGH_PCT 50                // dirty share that wakes the flusher early
+
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+// buffer flags
+#define BC_VALID 0x1   // holds the device's data, or newer
+#define BC_DIRTY 0x2   // holds newer data than the device
+#define BC_BUSY  0x4   // I/O in flight, which owns the data
+#define BC_REF   0x8   // used since the clock hand last passed
+#define BC_RA    0x10  // read ahead and not yet used
+
+struct bc_sync {
+    volatile uint64_t pending;
+    volatile uint64_t errors;
+};
+
+struct bc_buf {
+    struct list_head   hash_node;  // empty if the buffer holds nothing
+    struct nk_bcache  *cache;
+    volatile uint32_t  flags;
+    uint32_t           nblocks;    // device blocks held
+    uint64_t           index;      // first device block / blocks per buffer
+    struct bc_sync    *sync;       // write-back in flight
+    uint8_t           *data;
+};
+
+struct nk_bcache {
+    struct list_head     node;
+    struct nk_block_dev *dev;
+    int                  refcount;  // attaches
+    volatile int         users;     // lookups still using the cache
+
+    spinlock_t           lock;     // buffer metadata - never held across I/O
+
+    uint64_t             block_size;
+    uint64_t             num_blocks;
+    uint64_t             blocks_per_buf;
+    uint64_t             max_index;  // buffers needed to cover the device
+
+    uint64_t             num_bufs;
+    struct bc_buf       *bufs;
+    uint8_t             *data;
+    uint64_t             hash_size;
+    struct list_head    *hash;
+
+    uint64_t             hand;       // CLOCK
+    uint64_t             next_seq;   // index a sequential reader wants next
+    uint64_t             dirty;
+
+    volatile int         flusher_running;
+    volatile int         flusher_stop;
+    volatile int         flusher_kick;
+
+    struct nk_bcache_stats stats;
+};
+
+static spinlock_t state_lock;
+static LIST_HEAD(cache_list);
+
+#define STATE_LOCK_CONF uint8_t _state_lock_flags
+#define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
+#define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
+
+#define CACHE_LOCK(c) spin_lock_irq_save(&(c)->lock)
+#define CACHE_UNLOCK(c,f) spin_unlock_irq_restore(&(c)->lock,f)
+
+
+static struct nk_bcache *__find_cache(struct nk_block_dev *dev)
+{
+    struct list_head *cur;
+
+    list_for_each(cur,&cache_list) {
+	struct nk_bcache *c = list_entry(cur,struct nk_bcache,node);
+	if (c->dev==dev) {
+	    return c;
+	}
+    }
+    return 0;
+}
+
+// the cache returned stays allocated until put_cache
+static struct nk_bcache *find_cache(struct nk_block_dev *dev)
+{
+    STATE_LOCK_CONF;
+    struct nk_bcache *c;
+
+    STATE_LOCK();
+    c = __find_cache(dev);
+    if (c) {
+	__sync_fetch_and_add(&c->users,1);
+    }
+    STATE_UNLOCK();
+    return c;
+}
+
+static void put_cache(struct nk_bcache *c)
+{
+    __sync_fetch_and_sub(&c->users,1);
+}
+
+static inline uint64_t buf_blocks(struct nk_bcache *c, uint64_t index)
+{
+    return MIN(c->blocks_per_buf, c->num_blocks - index*c->blocks_per_buf);
+}
+
+static struct bc_buf *hash_find(struct nk_bcache *c, uint64_t index)
+{
+    struct list_head *cur;
+
+    list_for_each(cur,&c->hash[index % c->hash_size]) {
+	struct bc_buf *b = list_entry(cur,struct bc_buf,hash_node);
+	if (b->index==index) {
+	    return b;
+	}
+    }
+    return 0;
+}
+
+// give an idle buffer a new identity, busy until its data arrives
+static void assign(struct nk_bcache *c, struct bc_buf *b, uint64_t index)
+{
+    if (b->flags & BC_VALID) {
+	c->stats.evictions++;
+    }
+    list_del_init(&b->hash_node);
+    b->index = index;
+    b->nblocks = buf_blocks(c,index);
+    b->flags = BC_BUSY;
+    list_add(&b->hash_node,&c->hash[index % c->hash_size]);
+}
+
+static void forget(struct nk_bcache *c, struct bc_buf *b)
+{
+    list_del_init(&b->hash_node);
+    b->flags = 0;
+}
+
+// CLOCK, with the lock held - returns a clean idle buffer to reuse,
+// or 0, in which case *dirty may point to a dirty one that could be
+// written back and reused instead
+static struct bc_buf *victim(struct nk_bcache *c, struct bc_buf **dirty)
+{
+    uint64_t i;
+
+    *dirty = 0;
+
+    for (i=0;i<2*c->num_bufs;i++) {
+	struct bc_buf *b = &c->bufs[c->hand];
+
+	c->hand = (c->hand+1) % c->num_bufs;
+
+	if (b->flags & BC_BUSY) {
+	    continue;
+	}
+	if (b->flags & BC_REF) {
+	    b->flags &= ~BC_REF;
+	    continue;
+	}
+	if (b->flags & BC_DIRTY) {
+	    if (!*dirty) {
+		*dirty = b;
+	    }
+	    continue;
+	}
+	return b;
+    }
+
+    return 0;
+}
+
+static int buf_io(struct nk_bcache *c, struct bc_buf *b, int write)
+{
+    uint64_t blocknum = b->index*c->blocks_per_buf;
+
+    if (write) {
+	return nk_block_dev_write(c->dev,blocknum,b->nblocks,b->data,NK_DEV_REQ_BLOCKING,0,0);
+    } else {
+	return nk_block_dev_read(c->dev,blocknum,b->nblocks,b->data,NK_DEV_REQ_BLOCKING,0,0);
+    }
+}
+
+static int buf_idle(void *state)
+{
+    return !(((struct bc_buf *)state)->flags & BC_BUSY);
+}
+
+static void wait_buf(struct nk_bcache *c, struct bc_buf *b)
+{
+    nk_dev_wait((struct nk_dev *)c->dev,buf_idle,b);
+}
+
+static void signal_waiters(struct nk_bcache *c)
+{
+    nk_dev_signal((struct nk_dev *)c->dev);
+}
+
+//
+// Find the buffer for index, reading it from the device unless the
+// caller will overwrite all of it (fill==0).  On success, the cache is
+// locked (flags in *fl) and the buffer is idle, and valid if filled.
+// *ra is set if the access should start read-ahead.
+//
+static struct bc_buf *get_buf(struct nk_bcache *c, uint64_t index, int fill, int *ra, uint8_t *fl)
+{
+    struct bc_buf *b, *d;
+    int rc;
+
+    *ra = 0;
+
+ again:
+    *fl = CACHE_LOCK(c);
+
+    b = hash_find(c,index);
+
+    if (b) {
+	if (b->flags & BC_BUSY) {
+	    c->stats.waits++;
+	    CACHE_UNLOCK(c,*fl);
+	    wait_buf(c,b);
+	    goto again;
+	}
+	c->stats.hits++;
+	if (b->flags & BC_RA) {
+	    // keep the read-ahead window moving
+	    b->flags &= ~BC_RA;
+	    c->stats.readahead_hits++;
+	    *ra = 1;
+	}
+	b->flags |= BC_REF;
+	c->next_seq = index+1;
+	return b;
+    }
+
+    b = victim(c,&d);
+
+    if (!b && d) {
+	// everything reusable is dirty - write one back and look again
+	d->flags |= BC_BUSY;
+	CACHE_UNLOCK(c,*fl);
+	rc = buf_io(c,d,1);
+	*fl = CACHE_LOCK(c);
+	d->flags &= ~BC_BUSY;
+	if (!rc) {
+	    d->flags &= ~BC_DIRTY;
+	    c->dirty--;
+	    c->stats.writebacks++;
+	    c->stats.dirty_evictions++;
+	}
+	CACHE_UNLOCK(c,*fl);
+	signal_waiters(c);
+	if (rc) {
+	    ERROR("%s: failed to write back buffer %lu\n", c->dev->dev.name, d->index);
+	    return 0;
+	}
+	goto again;
+    }
+
+    if (!b) {
+	// everything is in flight
+	c->stats.waits++;
+	CACHE_UNLOCK(c,*fl);
+	nk_yield();
+	goto again;
+    }
+
+    c->stats.misses++;
+    *ra = fill && index==c->next_seq;
+    c->next_seq = index+1;
+
+    assign(c,b,index);
+
+    if (!fill) {
+	b->flags = BC_REF;
+	return b;
+    }
+
+    CACHE_UNLOCK(c,*fl);
+
+    rc = buf_io(c,b,0);
+
+    *fl = CACHE_LOCK(c);
+
+    if (rc) {
+	forget(c,b);
+	CACHE_UNLOCK(c,*fl);
+	signal_waiters(c);
+	ERROR("%s: failed to read buffer %lu\n", c->dev->dev.name, index);
+	return 0;
+    }
+
+    b->flags = BC_VALID | BC_REF;
+    signal_waiters(c);
+
+    return b;
+}
+
+// read-ahead completion, possibly in interrupt context
+static void ra_done(nk_block_dev_status_t status, void *context)
+{
+    struct bc_buf *b = (struct bc_buf *)context;
+    struct nk_bcache *c = b->cache;
+    uint8_t fl = CACHE_LOCK(c);
+
+    if (status==NK_BLOCK_DEV_STATUS_SUCCESS) {
+	b->flags = BC_VALID | BC_RA;
+    } else {
+	forget(c,b);
+    }
+
+    CACHE_UNLOCK(c,fl);
+    signal_waiters(c);
+}
+
+// start reading the buffers after index that are not cached, using
+// only clean buffers, and without waiting for them
+static void readahead(struct nk_bcache *c, uint64_t index)
+{
+    struct bc_buf *issue[RA_BUFS], *b, *d;
+    uint64_t i, n=0;
+    uint8_t fl;
+
+    fl = CACHE_LOCK(c);
+
+    for (i=index+1; i<=index+RA_BUFS && i<c->max_index; i++) {
+	if (hash_find(c,i)) {
+	    continue;
+	}
+	if (!(b = victim(c,&d))) {
+	    break;
+	}
+	assign(c,b,i);
+	issue[n++] = b;
+    }
+
+    c->stats.readaheads += n;
+
+    CACHE_UNLOCK(c,fl);
+
+    if (!n) {
+	return;
+    }
+
+    DEBUG("%s: read ahead %lu buffers after %lu\n", c->dev->dev.name, n, index);
+
+    nk_block_dev_plug(c->dev);
+    for (i=0;i<n;i++) {
+	b = issue[i];
+	if (nk_block_dev_read(c->dev,b->index*c->blocks_per_buf,b->nblocks,b->data,
+			      NK_DEV_REQ_CALLBACK,ra_done,b)) {
+	    ra_done(NK_BLOCK_DEV_STATUS_ERROR,b);
+	}
+    }
+    nk_block_dev_unplug(c->dev);
+}
+
+static int cache_rw(struct nk_bcache *c, uint64_t blocknum, uint64_t count, uint8_t *buf, int write)
+{
+    struct bc_buf *b;
+    uint8_t fl;
+    int ra;
+
+    if (blocknum+count > c->num_blocks || blocknum+count < blocknum) {
+	ERROR("%s: blocks %lu..%lu are beyond the device\n", c->dev->dev.name, blocknum, blocknum+count);
+	return -1;
+    }
+
+    while (count) {
+	uint64_t index = blocknum / c->blocks_per_buf;
+	uint64_t first = blocknum % c->blocks_per_buf;
+	uint64_t nb = MIN(count, c->blocks_per_buf - first);
+	uint64_t off = first*c->block_size;
+	uint64_t len = nb*c->block_size;
+
+	b = get_buf(c,index,!write || first || nb!=buf_blocks(c,index),&ra,&fl);
+
+	if (!b) {
+	    return -1;
+	}
+
+	if (write) {
+	    memcpy(b->data+off,buf,len);
+	    if (!(b->flags & BC_DIRTY)) {
+		c->dirty++;
+		if (c->dirty*100 > c->num_bufs*FLUSH_HIGH_PCT) {
+		    c->flusher_kick = 1;
+		}
+	    }
+	    b->flags |= BC_VALID | BC_DIRTY;
+	} else {
+	    memcpy(buf,b->data+off,len);
+	}
+
+	CACHE_UNLOCK(c,fl);
+
+	if (ra && RA_BUFS) {
+	    readahead(c,index);
+	}
+
+	buf += len;
+	blocknum += nb;
+	count -= nb;
+    }
+
+    return 0;
+}
+
+// write-back completion, possibly in interrupt context
+static void wb_done(nk_block_dev_status_t status, void *context)
+{
+    struct bc_buf *b = (struct bc_buf *)context;
+    struct nk_bcache *c = b->cache;
+    struct bc_sync *s = b->sync;
+    uint8_t fl = CACHE_LOCK(c);
+
+    b->flags &= ~BC_BUSY;
+    b->sync = 0;
+
+    if (status==NK_BLOCK_DEV_STATUS_SUCCESS) {
+	b->flags &= ~BC_DIRTY;
+	c->dirty--;
+	c->stats.writebacks++;
+    } else {
+	s->errors++;
+    }
+
+    CACHE_UNLOCK(c,fl);
+
+    __sync_fetch_and_sub(&s->pending,1);
+    signal_waiters(c);
+}
+
+static int sync_done(void *state)
+{
+    return !((struct bc_sync *)state)->pending;
+}
+
+//
+// Write back every dirty buffer, a batch at a time.  With wait set,
+// buffers someone else is writing are waited for, so everything dirty
+// on entry is on the device on return.
+//
+static int write_back(struct nk_bcache *c, int wait)
+{
+    struct bc_sync s;
+    struct bc_buf *b;
+    uint64_t i, batch, busy;
+    uint8_t fl;
+    int failed;
+
+    s.errors = 0;
+
+    do {
+	busy = 0;
+	i = 0;
+
+	while (i<c->num_bufs) {
+	    s.pending = 0;
+	    batch = 0;
+	    failed = 0;
+
+	    nk_block_dev_plug(c->dev);
+
+	    for (; i<c->num_bufs && batch<WB_BATCH; i++) {
+		b = &c->bufs[i];
+
+		fl = CACHE_LOCK(c);
+		if (!(b->flags & BC_DIRTY)) {
+		    CACHE_UNLOCK(c,fl);
+		    continue;
+		}
+		if (b->flags & BC_BUSY) {
+		    busy++;
+		    CACHE_UNLOCK(c,fl);
+		    continue;
+		}
+		b->flags |= BC_BUSY;
+		b->sync = &s;
+		__sync_fetch_and_add(&s.pending,1);
+		CACHE_UNLOCK(c,fl);
+
+		if (nk_block_dev_write(c->dev,b->index*c->blocks_per_buf,b->nblocks,b->data,
+				       NK_DEV_REQ_CALLBACK,wb_done,b)) {
+		    // probably out of device slots - undo, and retry
+		    // this one once the batch drains
+		    fl = CACHE_LOCK(c);
+		    b->flags &= ~BC_BUSY;
+		    b->sync = 0;
+		    CACHE_UNLOCK(c,fl);
+		    __sync_fetch_and_sub(&s.pending,1);
+		    failed = 1;
+		    break;
+		}
+		batch++;
+	    }
+
+	    nk_block_dev_unplug(c->dev);
+
+	    while (s.pending) {
+		nk_dev_wait((struct nk_dev *)c->dev,sync_done,&s);
+	    }
+
+	    if (failed && !batch) {
+		// nothing else in flight, so a real failure
+		ERROR("%s: failed to write back buffer %lu\n", c->dev->dev.name, c->bufs[i].index);
+		s.errors++;
+		i++;
+	    }
+	}
+
+	if (busy && wait) {
+	    nk_yield();
+	}
+
+    } while (busy && wait && !s.errors);
+
+    if (s.errors) {
+	ERROR("%s: %lu buffers could not be written back\n", c->dev->dev.name, s.errors);
+	return -1;
+    }
+
+    return 0;
+}
+
+static void flusher(void *in, void **out)
+{
+    struct nk_bcache *c = (struct nk_bcache *)in;
+    uint64_t last = nk_sched_get_realtime();
+    uint64_t now;
+    char name[32];
+
+    snprintf(name,32,"bcache-%s",c->dev->dev.name);
+    nk_thread_name(get_cur_thread(),name);
+
+    while (!c->flusher_stop) {
+	nk_sleep(FLUSH_STEP_NS);
+
+	now = nk_sched_get_realtime();
+
+	if (!c->flusher_kick && now-last < FLUSH_NS) {
+	    continue;
+	}
+
+	c->flusher_kick = 0;
+	last = now;
+
+	if (c->dirty) {
+	    DEBUG("%s: flushing %lu dirty buffers\n", c->dev->dev.name, c->dirty);
+	    write_back(c,0);
+	    c->stats.flushes++;
+	}
+    }
+
+    c->flusher_running = 0;
+}
+
+static void free_cache(struct nk_bcache *c)
+{
+    free(c->hash);
+    free(c->data);
+    free(c->bufs);
+    free(c);
+}
+
+int nk_bcache_attach(struct nk_block_dev *dev)
+{
+    STATE_LOCK_CONF;
+    struct nk_block_dev_characteristics chars;
+    struct nk_bcache *c, *other;
+    uint64_t i;
+
+    STATE_LOCK();
+    if ((c = __find_cache(dev))) {
+	c->refcount++;
+	STATE_UNLOCK();
+	return 0;
+    }
+    STATE_UNLOCK();
+
+    if (nk_block_dev_get_characteristics(dev,&chars)) {
+	ERROR("cannot get characteristics of %s\n", dev->dev.name);
+	return -1;
+    }
+
+    if (!chars.block_size || chars.block_size>BUF_SIZE || BUF_SIZE % chars.block_size) {
+	INFO("%s has %lu byte blocks, so is not cached\n", dev->dev.name, chars.block_size);
+	return -1;
+    }
+
+    c = malloc(sizeof(*c));
+
+    if (!c) {
+	ERROR("cannot allocate cache for %s\n", dev->dev.name);
+	return -1;
+    }
+
+    memset(c,0,sizeof(*c));
+
+    c->dev = dev;
+    c->refcount = 1;
+    c->block_size = chars.block_size;
+    c->num_blocks = chars.num_blocks;
+    c->blocks_per_buf = BUF_SIZE / chars.block_size;
+    c->max_index = (chars.num_blocks + c->blocks_per_buf - 1) / c->blocks_per_buf;
+    c->num_bufs = MIN(NAUT_CONFIG_FS_BUFFER_CACHE_SIZE*1024ULL/BUF_SIZE, c->max_index);
+    c->hash_size = c->num_bufs;
+    c->stats.num_bufs = c->num_bufs;
+    c->stats.buf_size = BUF_SIZE;
+
+    c->bufs = malloc(c->num_bufs*sizeof(struct bc_buf));
+    c->data = malloc(c->num_bufs*BUF_SIZE);
+    c->hash = malloc(c->hash_size*sizeof(struct list_head));
+
+    if (!c->num_bufs || !c->bufs || !c->data || !c->hash) {
+	ERROR("cannot allocate %lu buffers for %s\n", c->num_bufs, dev->dev.name);
+	free_cache(c);
+	return -1;
+    }
+
+    memset(c->bufs,0,c->num_bufs*sizeof(struct bc_buf));
+
+    for (i=0;i<c->num_bufs;i++) {
+	INIT_LIST_HEAD(&c->bufs[i].hash_node);
+	c->bufs[i].cache = c;
+	c->bufs[i].data = c->data + i*BUF_SIZE;
+    }
+
+    for (i=0;i<c->hash_size;i++) {
+	INIT_LIST_HEAD(&c->hash[i]);
+    }
+
+    spinlock_init(&c->lock);
+
+    STATE_LOCK();
+    if ((other = __find_cache(dev))) {
+	// lost a race with another attach
+	other->refcount++;
+	STATE_UNLOCK();
+	free_cache(c);
+	return 0;
+    }
+    list_add(&c->node,&cache_list);
+    STATE_UNLOCK();
+
+    c->flusher_running = 1;
+
+    if (nk_thread_start(flusher, c, 0, 1, TSTACK_DEFAULT, 0, CPU_ANY)) {
+	ERROR("cannot start flusher for %s - dirty buffers are only written on sync\n", dev->dev.name);
+	c->flusher_running = 0;
+    }
+
+    INFO("%s: %lu buffers of %d bytes, read-ahead %d\n", dev->dev.name, c->num_bufs, BUF_SIZE, RA_BUFS);
+
+    return 0;
+}
+
+int nk_bcache_detach(struct nk_block_dev *dev)
+{
+    STATE_LOCK_CONF;
+    struct nk_bcache *c;
+    int rc;
+
+    STATE_LOCK();
+    c = __find_cache(dev);
+    if (!c) {
+	STATE_UNLOCK();
+	return -1;
+    }
+    if (--c->refcount) {
+	STATE_UNLOCK();
+	return write_back(c,1);
+    }
+    list_del(&c->node);
+    STATE_UNLOCK();
+
+    // no new lookups can find it now, so wait out the current ones
+    while (c->users) {
+	nk_yield();
+    }
+
+    c->flusher_stop = 1;
+    while (c->flusher_running) {
+	nk_yield();
+    }
+
+    rc = write_back(c,1);
+
+    INFO("%s: detached, %lu hits, %lu misses\n", dev->dev.name, c->stats.hits, c->stats.misses);
+
+    spinlock_deinit(&c->lock);
+    free_cache(c);
+
+    return rc;
+}
+
+int nk_bcache_read(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *dest)
+{
+    struct nk_bcache *c = find_cache(dev);
+    int rc;
+
+    if (!c) {
+	return nk_block_dev_read(dev,blocknum,count,dest,NK_DEV_REQ_BLOCKING,0,0);
+    }
+
+    rc = cache_rw(c,blocknum,count,(uint8_t *)dest,0);
+    put_cache(c);
+    return rc;
+}
+
+int nk_bcache_write(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void *src)
+{
+    struct nk_bcache *c = find_cache(dev);
+    int rc;
+
+    if (!c) {
+	return nk_block_dev_write(dev,blocknum,count,src,NK_DEV_REQ_BLOCKING,0,0);
+    }
+
+    rc = cache_rw(c,blocknum,count,(uint8_t *)src,1);
+    put_cache(c);
+    return rc;
+}
+
+int nk_bcache_sync(struct nk_block_dev *dev)
+{
+    struct nk_bcache *c = find_cache(dev);
+    int rc;
+
+    if (!c) {
+	return 0;
+    }
+
+    rc = write_back(c,1);
+    put_cache(c);
+    return rc;
+}
+
+int nk_bcache_prepare_direct(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, int write)
+{
+    struct nk_bcache *c;
+    struct bc_buf *b;
+    uint64_t index, first, last;
+    int covered, rc;
+    uint8_t fl;
+
+    if (!count || !(c = find_cache(dev))) {
+	return 0;
+    }
+
+    first = blocknum / c->blocks_per_buf;
+    last = (blocknum+count-1) / c->blocks_per_buf;
+
+    for (index=first; index<=last; index++) {
+
+    again:
+	fl = CACHE_LOCK(c);
+
+	if (!(b = hash_find(c,index))) {
+	    CACHE_UNLOCK(c,fl);
+	    continue;
+	}
+
+	if (b->flags & BC_BUSY) {
+	    CACHE_UNLOCK(c,fl);
+	    wait_buf(c,b);
+	    goto again;
+	}
+
+	// a write replaces a buffer it covers, so that one's dirty
+	// data need not go out first
+	covered = write && index*c->blocks_per_buf >= blocknum
+	    && index*c->blocks_per_buf + b->nblocks <= blocknum+count;
+
+	if ((b->flags & BC_DIRTY) && !covered) {
+	    b->flags |= BC_BUSY;
+	    CACHE_UNLOCK(c,fl);
+	    rc = buf_io(c,b,1);
+	    fl = CACHE_LOCK(c);
+	    b->flags &= ~BC_BUSY;
+	    if (!rc) {
+		b->flags &= ~BC_DIRTY;
+		c->dirty--;
+		c->stats.writebacks++;
+	    }
+	    CACHE_UNLOCK(c,fl);
+	    signal_waiters(c);
+	    if (rc) {
+		ERROR("%s: failed to write back buffer %lu\n", dev->dev.name, index);
+		put_cache(c);
+		return -1;
+	    }
+	    goto again;
+	}
+
+	if (write) {
+	    if (b->flags & BC_DIRTY) {
+		c->dirty--;
+	    }
+	    forget(c,b);
+	}
+
+	CACHE_UNLOCK(c,fl);
+    }
+
+    put_cache(c);
+
+    return 0;
+}
+
+int nk_bcache_get_stats(struct nk_block_dev *dev, struct nk_bcache_stats *s)
+{
+    struct nk_bcache *c = find_cache(dev);
+    uint64_t i;
+    uint8_t fl;
+
+    if (!c) {
+	return -1;
+    }
+
+    fl = CACHE_LOCK(c);
+
+    *s = c->stats;
+    s->valid_bufs = 0;
+    s->dirty_bufs = c->dirty;
+    for (i=0;i<c->num_bufs;i++) {
+	s->valid_bufs += !!(c->bufs[i].flags & BC_VALID);
+    }
+
+    CACHE_UNLOCK(c,fl);
+
+    put_cache(c);
+
+    return 0;
+}
+
+
+static int
+handle_bcache (char * buf, void * priv)
+{
+    char name[32];
+    struct nk_block_dev *d;
+    struct nk_bcache_stats s;
+    uint64_t lookups;
+
+    if (sscanf(buf,"bcache %s",name)!=1) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return 0;
+    }
+
+    if (!(d=nk_block_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return 0;
+    }
+
+    if (nk_bcache_get_stats(d,&s)) {
+	nk_vc_printf("%s is not cached\n",name);
+	return 0;
+    }
+
+    lookups = s.hits + s.misses;
+
+    nk_vc_printf("%s: %lu buffers of %lu bytes, %lu valid, %lu dirty\n",
+		 name, s.num_bufs, s.buf_size, s.valid_bufs, s.dirty_bufs);
+    nk_vc_printf("  %lu hits %lu misses (%lu%% hit rate) %lu waits\n",
+		 s.hits, s.misses, lookups ? (s.hits*100)/lookups : 0, s.waits);
+    nk_vc_printf("  %lu read ahead, %lu used\n", s.readaheads, s.readahead_hits);
+    nk_vc_printf("  %lu writebacks %lu flushes %lu evictions %lu dirty evictions\n",
+		 s.writebacks, s.flushes, s.evictions, s.dirty_evictions);
+
+    return 0;
+}
+
+static struct shell_cmd_impl bcache_impl = {
+    .cmd      = "bcache",
+    .help_str = "bcache blockdev",
+    .handler  = handle_bcache,
+};
+nk_register_shell_cmd(bcache_impl);
@@ -73,7 +73,7 @@ struct nk_block_dev * nk_block_dev_find(char *name)
 {
     DEBUG("find %s\n",name);
     struct nk_dev *d = nk_dev_find(name);
-    if (d->type!=NK_DEV_BLK) {
+    if (!d || d->type!=NK_DEV_BLK) {
 	DEBUG("%s not found\n",name);
 	return 0;
     } else {
@@ -245,6 +245,37 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 
 }
 
+int nk_block_dev_plug(struct nk_block_dev *dev)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+    DEBUG("plug %s\n", d->name);
+    return di->plug ? di->plug(d->state) : 0;
+}
+
+int nk_block_dev_unplug(struct nk_block_dev *dev)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+    DEBUG("unplug %s\n", d->name);
+    return di->unplug ? di->unplug(d->state) : 0;
+}
+
+// no debug output - these are called in a loop
+int nk_block_dev_poll(struct nk_block_dev *dev, uint64_t budget)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+    return di->poll ? di->poll(d->state,budget) : -1;
+}
+
+int nk_block_dev_set_interrupts(struct nk_block_dev *dev, int enable)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+    return di->set_interrupts ? di->set_interrupts(d->state,enable) : -1;
+}
+
 static int 
 handle_blktest (char * buf, void * priv)
 {
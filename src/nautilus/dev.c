@@ -24,6 +24,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/dev.h>
+#include <nautilus/devpoll.h>
 #include <nautilus/thread.h>
 #include <nautilus/waitqueue.h>
 #include <nautilus/shell.h>
@@ -111,6 +112,8 @@ int            nk_dev_unregister(struct nk_dev *d)
     list_del(&d->dev_list_node);
     STATE_UNLOCK();
 
+    nk_dev_poll_free(d);
+
     nk_wait_queue_wake_all(d->waiting_threads);
     nk_wait_queue_destroy(d->waiting_threads);
     INFO("Unregistered device %s\n",d->name);
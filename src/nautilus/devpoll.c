@@ -0,0 +1,464 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/dev.h>
+#include <nautilus/devpoll.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/netdev.h>
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+#ifndef NAUT_CONFIG_DEBUG_DEV
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("devpoll: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("devpoll: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("devpoll: " fmt, ##args)
+
+#define DEFAULT_BUDGET  64
+#define DEFAULT_IDLE_NS 50000ULL
+
+static spinlock_t state_lock; // zero is unlocked
+
+#define STATE_LOCK_CONF uint8_t _state_lock_flags
+#define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
+#define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
+
+// allocated on first use and kept until the device goes away, so
+// an interrupt handler never sees it freed underneath it
+struct nk_dev_poller {
+    struct nk_dev     *dev;
+    nk_wait_queue_t   *wait;
+
+    volatile int       running;  // poller thread exists
+    volatile int       active;   // poller owns completions
+    volatile int       stop;
+    volatile int       armed;    // interrupts on, poller asleep or about to be
+
+    volatile uint64_t  claim_time;
+
+    struct nk_dev_poll_stats stats;
+};
+
+
+void nk_dev_poll_hist_add(struct nk_dev_poll_hist *h, uint64_t val)
+{
+    int i = val ? 63 - __builtin_clzll(val) : 0;
+
+    if (i >= NK_DEV_POLL_HIST_BUCKETS) {
+	i = NK_DEV_POLL_HIST_BUCKETS-1;
+    }
+
+    h->bucket[i]++;
+    h->count++;
+    h->sum += val;
+    if (val > h->max) {
+	h->max = val;
+    }
+}
+
+void nk_dev_poll_hist_print(struct nk_dev_poll_hist *h, char *what, char *unit)
+{
+    int i;
+
+    nk_vc_printf("%s: %lu samples, avg %lu %s, max %lu %s\n", what, h->count,
+		 h->count ? h->sum/h->count : 0, unit, h->max, unit);
+
+    for (i=0;i<NK_DEV_POLL_HIST_BUCKETS;i++) {
+	if (!h->bucket[i]) {
+	    continue;
+	}
+	if (i==NK_DEV_POLL_HIST_BUCKETS-1) {
+	    nk_vc_printf("  %10lu and up    %s: %lu\n", 1ULL<<i, unit, h->bucket[i]);
+	} else {
+	    nk_vc_printf("  %10lu - %10lu %s: %lu\n", i ? 1ULL<<i : 0, (1ULL<<(i+1))-1, unit, h->bucket[i]);
+	}
+    }
+}
+
+
+static int dev_poll(struct nk_dev *d, uint64_t budget)
+{
+    switch (d->type) {
+    case NK_DEV_NET:
+	return nk_net_dev_poll((struct nk_net_dev *)d, budget);
+    case NK_DEV_BLK:
+	return nk_block_dev_poll((struct nk_block_dev *)d, budget);
+    default:
+	return -1;
+    }
+}
+
+static int dev_set_interrupts(struct nk_dev *d, int enable)
+{
+    switch (d->type) {
+    case NK_DEV_NET:
+	return nk_net_dev_set_interrupts((struct nk_net_dev *)d, enable);
+    case NK_DEV_BLK:
+	return nk_block_dev_set_interrupts((struct nk_block_dev *)d, enable);
+    default:
+	return -1;
+    }
+}
+
+// whether the device can turn its interrupts off and back on, which
+// the poller needs both to take completions and to give them back
+static int dev_has_interrupt_control(struct nk_dev *d)
+{
+    switch (d->type) {
+    case NK_DEV_NET:
+	return ((struct nk_net_dev_int *)d->interface)->set_interrupts != 0;
+    case NK_DEV_BLK:
+	return ((struct nk_block_dev_int *)d->interface)->set_interrupts != 0;
+    default:
+	return 0;
+    }
+}
+
+static int poller_wake_check(void *state)
+{
+    struct nk_dev_poller *p = (struct nk_dev_poller *)state;
+
+    return !p->armed || p->stop;
+}
+
+static void poller(void *in, void **out)
+{
+    struct nk_dev_poller *p = (struct nk_dev_poller *)in;
+    struct nk_dev *d = p->dev;
+    uint64_t idle_start = 0;
+    uint64_t now;
+    char name[32];
+    int n;
+
+    snprintf(name,32,"poll-%s",d->name);
+    nk_thread_name(get_cur_thread(),name);
+
+    DEBUG("%s polling on cpu %d\n", d->name, my_cpu_id());
+
+    dev_set_interrupts(d,0);
+
+    while (!p->stop) {
+	n = dev_poll(d,p->stats.budget);
+	p->stats.polls++;
+
+	if (n<0) {
+	    ERROR("poll of %s failed, returning it to interrupts\n", d->name);
+	    break;
+	}
+
+	if (n>0) {
+	    p->stats.completions += n;
+	    nk_dev_poll_hist_add(&p->stats.batch,n);
+	    idle_start = 0;
+	    continue;
+	}
+
+	p->stats.empty_polls++;
+
+	if (p->stats.mode!=NK_DEV_POLL_ADAPTIVE) {
+	    continue;
+	}
+
+	now = nk_sched_get_realtime();
+
+	if (!idle_start) {
+	    idle_start = now;
+	    continue;
+	}
+
+	if (now - idle_start < p->stats.idle_ns) {
+	    continue;
+	}
+
+	// idle long enough - let the next interrupt wake us
+	p->armed = 1;
+	__sync_synchronize();
+
+	if (dev_set_interrupts(d,1)>0 && __sync_bool_compare_and_swap(&p->armed,1,0)) {
+	    // work raced with unmasking and no interrupt claimed it
+	    dev_set_interrupts(d,0);
+	    idle_start = 0;
+	    continue;
+	}
+
+	p->stats.sleeps++;
+
+	nk_wait_queue_sleep_extended(p->wait, poller_wake_check, p);
+
+	if (p->armed) {
+	    // stopping
+	    break;
+	}
+
+	p->stats.wakeups++;
+	nk_dev_poll_hist_add(&p->stats.wake,nk_sched_get_realtime() - p->claim_time);
+
+	dev_set_interrupts(d,0);
+	idle_start = 0;
+    }
+
+    p->active = 0;
+    p->armed = 0;
+    __sync_synchronize();
+
+    // anything that finished while interrupts were off will not raise one
+    if (dev_set_interrupts(d,1)>0) {
+	while (dev_poll(d,p->stats.budget)>0) {
+	}
+    }
+
+    DEBUG("%s back on interrupts\n", d->name);
+
+    p->running = 0;
+}
+
+int nk_dev_poll_claim_interrupt(struct nk_dev *d)
+{
+    struct nk_dev_poller *p = d->poller;
+
+    if (!p || !p->active) {
+	return 0;
+    }
+
+    __sync_fetch_and_add(&p->stats.interrupts,1);
+
+    if (p->armed) {
+	p->claim_time = nk_sched_get_realtime();
+	if (__sync_bool_compare_and_swap(&p->armed,1,0)) {
+	    nk_wait_queue_wake_all(p->wait);
+	}
+    }
+
+    return 1;
+}
+
+static struct nk_dev_poller *poller_create(struct nk_dev *d)
+{
+    struct nk_dev_poller *p = malloc(sizeof(*p));
+    char buf[NK_WAIT_QUEUE_NAME_LEN];
+
+    if (!p) {
+	return 0;
+    }
+
+    memset(p,0,sizeof(*p));
+
+    snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"%s-poll", d->name);
+    p->wait = nk_wait_queue_create(buf);
+
+    if (!p->wait) {
+	free(p);
+	return 0;
+    }
+
+    p->dev = d;
+
+    return p;
+}
+
+int nk_dev_poll_start(struct nk_dev *d, nk_dev_poll_mode_t mode, int cpu, uint64_t budget, uint64_t idle_ns)
+{
+    STATE_LOCK_CONF;
+    struct nk_dev_poller *p;
+
+    if (mode!=NK_DEV_POLL_BUSY && mode!=NK_DEV_POLL_ADAPTIVE) {
+	ERROR("unknown poll mode %d\n", mode);
+	return -1;
+    }
+
+    // a zero budget completes nothing, so this only checks support
+    if (dev_poll(d,0)<0) {
+	ERROR("%s does not support polling\n", d->name);
+	return -1;
+    }
+
+    if (!dev_has_interrupt_control(d)) {
+	ERROR("%s cannot turn its interrupts off for polling\n", d->name);
+	return -1;
+    }
+
+    STATE_LOCK();
+
+    if (!d->poller && !(d->poller = poller_create(d))) {
+	STATE_UNLOCK();
+	ERROR("cannot allocate poller for %s\n", d->name);
+	return -1;
+    }
+
+    p = d->poller;
+
+    if (p->running) {
+	STATE_UNLOCK();
+	ERROR("%s is already being polled\n", d->name);
+	return -1;
+    }
+
+    memset(&p->stats,0,sizeof(p->stats));
+    p->stats.mode = mode;
+    p->stats.cpu = cpu;
+    p->stats.budget = budget ? budget : DEFAULT_BUDGET;
+    p->stats.idle_ns = idle_ns ? idle_ns : DEFAULT_IDLE_NS;
+    p->stop = 0;
+    p->armed = 0;
+    p->active = 1;
+    p->running = 1;
+
+    STATE_UNLOCK();
+
+    if (nk_thread_start(poller, p, 0, 1, TSTACK_DEFAULT, 0, cpu)) {
+	ERROR("cannot start poller for %s\n", d->name);
+	p->active = 0;
+	p->running = 0;
+	return -1;
+    }
+
+    INFO("%s %s polling on cpu %d, budget %lu\n", d->name,
+	 mode==NK_DEV_POLL_BUSY ? "busy" : "adaptive", cpu, p->stats.budget);
+
+    return 0;
+}
+
+int nk_dev_poll_stop(struct nk_dev *d)
+{
+    STATE_LOCK_CONF;
+    struct nk_dev_poller *p;
+
+    STATE_LOCK();
+
+    p = d->poller;
+
+    if (!p || !p->running || p->stop) {
+	STATE_UNLOCK();
+	return -1;
+    }
+
+    p->stop = 1;
+    nk_wait_queue_wake_all(p->wait);
+
+    STATE_UNLOCK();
+
+    while (p->running) {
+	nk_yield();
+    }
+
+    INFO("%s back on interrupts\n", d->name);
+
+    return 0;
+}
+
+int nk_dev_poll_get_stats(struct nk_dev *d, struct nk_dev_poll_stats *s)
+{
+    struct nk_dev_poller *p = d->poller;
+
+    if (!p) {
+	return -1;
+    }
+
+    *s = p->stats;
+
+    if (!p->running) {
+	s->mode = NK_DEV_POLL_OFF;
+    }
+
+    return 0;
+}
+
+void nk_dev_poll_free(struct nk_dev *d)
+{
+    if (!d->poller) {
+	return;
+    }
+
+    nk_dev_poll_stop(d);
+    nk_wait_queue_destroy(d->poller->wait);
+    free(d->poller);
+    d->poller = 0;
+}
+
+
+static int
+handle_devpoll (char * buf, void * priv)
+{
+    char name[32], mode[16];
+    int cpu = CPU_ANY;
+    uint64_t budget = 0, idle_us = 0;
+    struct nk_dev_poll_stats s;
+    struct nk_dev *d;
+    int n;
+
+    if ((n = sscanf(buf,"devpoll %s %s %d %lu %lu",name,mode,&cpu,&budget,&idle_us))<1) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return 0;
+    }
+
+    if (!(d = nk_dev_find(name)) || (d->type!=NK_DEV_NET && d->type!=NK_DEV_BLK)) {
+	nk_vc_printf("Can't find block or network device %s\n",name);
+	return 0;
+    }
+
+    if (n==1) {
+	if (nk_dev_poll_get_stats(d,&s)) {
+	    nk_vc_printf("%s has never been polled\n",name);
+	    return 0;
+	}
+	nk_vc_printf("%s: %s, cpu %d, budget %lu, idle %lu ns\n", name,
+		     s.mode==NK_DEV_POLL_BUSY ? "busy" :
+		     s.mode==NK_DEV_POLL_ADAPTIVE ? "adaptive" : "off",
+		     s.cpu, s.budget, s.idle_ns);
+	nk_vc_printf("%lu polls (%lu empty), %lu completions, %lu interrupts, %lu sleeps, %lu wakeups\n",
+		     s.polls, s.empty_polls, s.completions, s.interrupts, s.sleeps, s.wakeups);
+	nk_dev_poll_hist_print(&s.batch,"completions per poll","reqs");
+	nk_dev_poll_hist_print(&s.wake,"interrupt to poller","ns");
+	return 0;
+    }
+
+    if (!strcmp(mode,"off")) {
+	if (nk_dev_poll_stop(d)) {
+	    nk_vc_printf("%s is not being polled\n",name);
+	}
+    } else if (!strcmp(mode,"busy") || !strcmp(mode,"adaptive")) {
+	if (nk_dev_poll_start(d, !strcmp(mode,"busy") ? NK_DEV_POLL_BUSY : NK_DEV_POLL_ADAPTIVE,
+			      cpu, budget, idle_us*1000)) {
+	    nk_vc_printf("Cannot poll %s\n",name);
+	}
+    } else {
+	nk_vc_printf("Don't understand %s\n",buf);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl devpoll_impl = {
+    .cmd      = "devpoll",
+    .help_str = "devpoll dev [busy|adaptive [cpu] [budget] [idle us] | off]",
+    .handler  = handle_devpoll,
+};
+nk_register_shell_cmd(devpoll_impl);
@@ -42,6 +42,7 @@
 #include <nautilus/random.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/cpu_state.h>
+#include <nautilus/numa.h>
 
 #ifndef NAUT_CONFIG_DEBUG_FIBERS
 #undef  DEBUG_PRINT
@@ -63,7 +64,9 @@
 #define _GET_FIBER_STATE() get_cpu()->f_state
 #define _NK_IDLE_FIBER() get_cpu()->f_state->idle_fiber
 #define _GET_FIBER_THREAD() get_cpu()->f_state->fiber_thread
+#ifndef NAUT_CONFIG_FIBER_WORK_STEALING
 #define _GET_SCHED_HEAD() &(get_cpu()->f_state->f_sched_queue)
+#endif
  
 /* Macros for locking and unlocking fibers */
 #define _LOCK_SCHED_QUEUE(state) spin_lock(&(state->lock)) 
@@ -71,19 +74,57 @@
 #define _LOCK_FIBER(f) spin_lock(&(f->lock))
 #define _UNLOCK_FIBER(f) spin_unlock(&(f->lock))
 
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+/*
+ * Bounded multi-producer, multi-consumer ring (Vyukov).  Each cell
+ * carries a sequence number that says whether it is ready to be
+ * pushed into (seq == pos) or popped from (seq == pos+1) at ring
+ * position pos.  Producers and consumers each claim positions with a
+ * CAS on tail or head, so the owning CPU, remote nk_fiber_run()s and
+ * thieves can all use the ring at once without a lock.
+ */
+struct fiber_queue_cell {
+    volatile uint64_t seq;
+    nk_fiber_t * volatile fiber;
+};
+
+struct fiber_queue {
+    uint64_t mask;
+    struct fiber_queue_cell *cells;
+    volatile uint64_t head __align(64); /* next position to pop */
+    volatile uint64_t tail __align(64); /* next position to push */
+};
+
+/* How many CPUs nk_fiber_run looks at when kicking a thief awake */
+#define FIBER_WAKE_SCAN 4
+#endif
+
 /* Each CPU has a fiber state associated with it */
 typedef struct nk_fiber_percpu_state {
     spinlock_t  lock; /* lock for the entire fiber percpu state */
     nk_thread_t *fiber_thread; /* Points to the CPU's Fiber thread which is created at bootup */
     nk_fiber_t *curr_fiber; /* points to the fiber currently running on this CPU */
     nk_fiber_t *idle_fiber; /* points to this CPU's idle fiber */
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+    struct fiber_queue queue; /* sched queue for fibers on this CPU (can be accessed by other CPUs) */
+    struct fiber_queue pinned; /* pinned fibers on this CPU, never stolen */
+    int pinned_turn;  /* which queue the next dequeue tries first */
+    volatile int pinned_live; /* live fibers pinned here, kept below the pinned ring's size */
+    int *steal_order; /* other CPUs, nearest first, built on first steal */
+    int num_victims;
+    int wake_cursor;  /* where the next thief wakeup scan starts */
+#else
     struct list_head f_sched_queue; /* sched queue for fibers on this CPU (can be accessed by other CPUs) */
+#endif
     struct nk_wait_queue *waitq; /* Wait queue that the fiber thread can sleep on */
     int fork_cpu; /* Determines which CPU forked fibers will be placed on. Default => curr CPU */
+    int cpu;      /* CPU this state belongs to */
+    nk_fiber_t *zombie; /* exited fiber whose stack is freed on the next switch */
+    struct nk_fiber_stats stats;
 } fiber_state;
 
 /* These functions are implemented in assembly. Can be found in src/asm/fiber_lowlevel.S */
-extern void _nk_fiber_context_switch(nk_fiber_t *f_to);
+extern void _nk_fiber_context_switch(nk_fiber_t *f_to, nk_fiber_t *f_from);
 extern void _nk_fiber_context_switch_early(nk_fiber_t* f_to);
 extern void _nk_exit_switch(nk_fiber_t *next);
 extern nk_fiber_t *nk_fiber_fork();
@@ -124,11 +165,13 @@ static nk_thread_t *_get_fiber_thread()
   return _get_fiber_state()->fiber_thread;
 }
 
+#ifndef NAUT_CONFIG_FIBER_WORK_STEALING
 // returns the current CPU's sched queue head
 static struct list_head* _get_sched_head()
 {
   return &(_get_fiber_state()->f_sched_queue); 
 }
+#endif
 
 // returns the current CPU's fiber sched queue lock
 static spinlock_t *_get_sched_queue_lock()
@@ -143,12 +186,27 @@ static void _fiber_push(nk_fiber_t * f, uint64_t x)
     *(uint64_t*)(f->rsp) = x;
 }
 
-// Round Robin policy for fibers. Returns the first fiber in the curr CPU's sched queue
-// Returns NULL if no fiber is available in the curr CPU's sched queue
-static nk_fiber_t* _rr_policy()
+// Waits until f has been switched away from on whatever CPU last ran
+// it, then marks it as running here.  A fiber is queued before the
+// switch away from it completes, so another CPU can pick it up while
+// its registers are still being saved.
+static inline void _fiber_set_on_cpu(nk_fiber_t *f)
+{
+  while (f->on_cpu) {
+    __asm__ __volatile__ ("pause");
+  }
+  f->on_cpu = 1;
+}
+
+#ifndef NAUT_CONFIG_FIBER_WORK_STEALING
+
+// Round Robin policy for fibers. Returns the first fiber in the CPU's sched queue
+// Returns NULL if no fiber is available in the CPU's sched queue
+// Caller must hold the sched queue lock
+static nk_fiber_t* _rr_policy(fiber_state *state)
 {
   // Grab the first fiber from the sched queue
-  struct list_head *f_queue = _GET_SCHED_HEAD(); 
+  struct list_head *f_queue = &(state->f_sched_queue); 
   nk_fiber_t *fiber_to_schedule = list_first_entry(f_queue, nk_fiber_t, sched_node); 
   
   // If sched queue not empty, fiber_to_schedule != NULL
@@ -159,25 +217,417 @@ static nk_fiber_t* _rr_policy()
 
   //DEBUG: prints the fiber that was just dequeued and indicates current and idle fiber
   FIBER_DEBUG("_rr_policy() : just dequeued a fiber : %p\n", fiber_to_schedule);
-  FIBER_DEBUG("_rr_policy() : current fiber is %p and idle fiber is %p\n", _GET_FIBER_STATE()->curr_fiber,_GET_FIBER_STATE()->idle_fiber); 
+  FIBER_DEBUG("_rr_policy() : current fiber is %p and idle fiber is %p\n", state->curr_fiber, state->idle_fiber); 
 
   // Returns the fiber to schedule (or NULL if no fiber to schedule)
   return fiber_to_schedule;
 }
 
+// Marks f ready and adds it to the tail of state's sched queue
+static void _fiber_enqueue(fiber_state *state, nk_fiber_t *f)
+{
+  _LOCK_FIBER(f);
+  f->curr_cpu = state->cpu;
+  f->f_status = READY;
+  _LOCK_SCHED_QUEUE(state);
+  list_add_tail(&(f->sched_node), &(state->f_sched_queue));
+  _UNLOCK_SCHED_QUEUE(state);
+  _UNLOCK_FIBER(f);
+}
+
+// Takes the next fiber off this CPU's sched queue, NULL if there is none
+static nk_fiber_t *_fiber_dequeue(fiber_state *state)
+{
+  _LOCK_SCHED_QUEUE(state);
+  nk_fiber_t *f = _rr_policy(state);
+  _UNLOCK_SCHED_QUEUE(state);
+  return f;
+}
+
+// Checks if to_del is on a sched queue (ready to be switched to) and takes it off
+// returns -EINVAL if not ready, otherwise returns 0
+static int _fiber_claim(nk_fiber_t *to_del)
+{
+  _LOCK_FIBER(to_del);
+  // If the fiber isn't ready to switch to, indicate failure.
+  if (to_del->f_status != READY || to_del->curr_cpu < 0) {
+     FIBER_DEBUG("_fiber_claim() : to_del's status is %d\n", to_del->f_status);
+     _UNLOCK_FIBER(to_del);
+     return -EINVAL;
+  }
+  // The fiber is ready, so we will take it from its queue so we can use it
+  fiber_state *state = per_cpu_get(system)->cpus[to_del->curr_cpu]->f_state;
+  _LOCK_SCHED_QUEUE(state);
+  list_del_init(&(to_del->sched_node));
+  _UNLOCK_SCHED_QUEUE(state);
+  _UNLOCK_FIBER(to_del);
+  return 0;
+}
+
+static inline int _fiber_work_available(fiber_state *state)
+{
+  return !list_empty_careful(&(state->f_sched_queue));
+}
+
+// Frees an exited fiber's struct
+static inline void _fiber_release(nk_fiber_t *f)
+{
+  free(f);
+}
+
+#else
+
+static int _fiber_queue_init(struct fiber_queue *q, int cpu)
+{
+  uint64_t n = 1;
+  uint64_t i;
+
+  while (n < NAUT_CONFIG_FIBER_QUEUE_SIZE) {
+    n <<= 1;
+  }
+
+  q->cells = malloc_specific(n*sizeof(struct fiber_queue_cell), cpu);
+  if (!q->cells) {
+    return -1;
+  }
+
+  for (i=0;i<n;i++) {
+    q->cells[i].seq = i;
+    q->cells[i].fiber = 0;
+  }
+
+  q->mask = n - 1;
+  q->head = 0;
+  q->tail = 0;
+
+  return 0;
+}
+
+// returns -1 if the queue is full
+static int _fq_push(struct fiber_queue *q, nk_fiber_t *f)
+{
+  uint64_t pos = q->tail;
+
+  while (1) {
+    struct fiber_queue_cell *c = &q->cells[pos & q->mask];
+    sint64_t dif = (sint64_t)(c->seq - pos);
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&q->tail, pos, pos+1)) {
+        c->fiber = f;
+        // publish the cell to poppers (stores are not reordered on x86)
+        c->seq = pos + 1;
+        return 0;
+      }
+      pos = q->tail;
+    } else if (dif < 0) {
+      // a whole lap behind: full
+      return -1;
+    } else {
+      // another pusher got this position first
+      pos = q->tail;
+    }
+  }
+}
+
+// returns NULL if the queue is empty
+static nk_fiber_t *_fq_pop(struct fiber_queue *q)
+{
+  uint64_t pos = q->head;
+
+  while (1) {
+    struct fiber_queue_cell *c = &q->cells[pos & q->mask];
+    sint64_t dif = (sint64_t)(c->seq - (pos + 1));
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&q->head, pos, pos+1)) {
+        nk_fiber_t *f = c->fiber;
+        // hand the cell back to pushers for the next lap
+        c->seq = pos + q->mask + 1;
+        return f;
+      }
+      pos = q->head;
+    } else if (dif < 0) {
+      // not yet pushed: empty
+      return 0;
+    } else {
+      // another popper got this position first
+      pos = q->head;
+    }
+  }
+}
+
+static inline int _fq_empty(struct fiber_queue *q)
+{
+  return q->head == q->tail;
+}
+
+static inline uint64_t _fq_depth(struct fiber_queue *q)
+{
+  return q->tail - q->head;
+}
+
+// Each queue entry holds a reference to its fiber, and a live fiber
+// holds one on itself.  yield_to takes a fiber by clearing its queued
+// flag and leaves the entry behind, so an exited fiber may still be
+// referred to by stale entries.  Whoever drops the last reference
+// frees the struct.
+static void _fiber_put(nk_fiber_t *f)
+{
+  if (__sync_sub_and_fetch(&f->refs, 1) == 0) {
+    free(f);
+  }
+}
+
+static inline void _fiber_release(nk_fiber_t *f)
+{
+  _fiber_put(f);
+}
+
+// Marks f ready and pushes it on state's queue, spilling over to the
+// following CPUs if it is full.  Someone is always popping, so this
+// only spins if every queue in the system is full.
+//
+// A pinned fiber goes on its home CPU's pinned queue instead, and never
+// spills.  nk_fiber_run admits fewer pinned fibers than that queue
+// holds, and yield_to does not leave stale entries of pinned fibers
+// behind, so a push there can only fail while a pop is finishing.
+static void _fiber_enqueue(fiber_state *state, nk_fiber_t *f)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  fiber_state *target;
+  int i = 0;
+
+  if (f->pinned) {
+    state = sys->cpus[f->pin_cpu]->f_state;
+  }
+  target = state;
+
+  _LOCK_FIBER(f);
+  f->curr_cpu = state->cpu;
+  f->f_status = READY;
+  _UNLOCK_FIBER(f);
+
+  __sync_fetch_and_add(&f->refs, 1);
+  f->queued = 1;
+
+  if (f->pinned) {
+    PAUSE_WHILE(_fq_push(&state->pinned, f));
+    return;
+  }
+
+  while (_fq_push(&target->queue, f)) {
+    i = (i + 1) % sys->num_cpus;
+    target = sys->cpus[(state->cpu + i) % sys->num_cpus]->f_state;
+  }
+}
+
+// Turns a popped entry into a fiber to run, NULL if yield_to got it
+// first.  A pinned fiber popped on another CPU is sent back home.
+static nk_fiber_t *_fiber_take(fiber_state *state, nk_fiber_t *f)
+{
+  int live = __sync_bool_compare_and_swap(&f->queued, 1, 0);
+
+  if (!live) {
+    state->stats.stale++;
+  } else if (f->pinned && f->pin_cpu != state->cpu) {
+    _fiber_enqueue(state, f);
+    live = 0;
+  }
+
+  // a live fiber still holds its own reference, so this cannot free it
+  _fiber_put(f);
+
+  return live ? f : 0;
+}
+
+// Takes a specific fiber for yield_to, its queue entry goes stale
+// returns -EINVAL if it is not queued or is pinned, otherwise returns 0
+static int _fiber_claim(nk_fiber_t *f)
+{
+  // a stale entry would hold a slot in the pinned queue that the
+  // admission count in nk_fiber_run does not know about
+  if (f->pinned) {
+    return -EINVAL;
+  }
+  return __sync_bool_compare_and_swap(&f->queued, 1, 0) ? 0 : -EINVAL;
+}
+
+// How far away another CPU is, for ordering steal victims: hyperthread
+// sibling, same package, same NUMA domain, then other domains by distance
+static int _fiber_cpu_distance(struct cpu *me, struct cpu *other)
+{
+  struct domain_adj_entry *ent;
+  int rank = 3;
+
+  if (me->coord && other->coord && me->coord->pkg_id == other->coord->pkg_id) {
+    return me->coord->core_id == other->coord->core_id ? 0 : 1;
+  }
+
+  if (!me->domain || !other->domain || me->domain == other->domain) {
+    return 2;
+  }
+
+  list_for_each_entry(ent, &(me->domain->adj_list), list_ent) {
+    if (ent->domain == other->domain) {
+      return rank;
+    }
+    rank++;
+  }
+
+  return rank;
+}
+
+// Built the first time this CPU goes looking for work, so that the
+// topology of all CPUs is known by then
+static int _fiber_build_steal_order(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int n = sys->num_cpus;
+  int *order = malloc_specific(n*sizeof(int), state->cpu);
+  int *rank = malloc(n*sizeof(int));
+  int i, j, k = 0;
+
+  if (!order || !rank) {
+    FIBER_ERROR("Cannot allocate steal order for CPU %d\n", state->cpu);
+    free(order);
+    free(rank);
+    return -1;
+  }
+
+  // insertion sort by distance, CPUs at the same distance are visited
+  // starting with the next CPU up so that thieves spread out
+  for (i=1;i<n;i++) {
+    int c = (state->cpu + i) % n;
+    int r = _fiber_cpu_distance(sys->cpus[state->cpu], sys->cpus[c]);
+    for (j=k; j>0 && rank[j-1]>r; j--) {
+      order[j] = order[j-1];
+      rank[j] = rank[j-1];
+    }
+    order[j] = c;
+    rank[j] = r;
+    k++;
+  }
+
+  free(rank);
+
+  state->num_victims = k;
+  // other CPUs read the order when kicking thieves
+  __sync_synchronize();
+  state->steal_order = order;
+
+  return 0;
+}
+
+static nk_fiber_t *_fiber_steal(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  fiber_state *victim;
+  nk_fiber_t *f;
+  int i;
+
+  if (!state->steal_order && _fiber_build_steal_order(state)) {
+    return 0;
+  }
+
+  for (i=0;i<state->num_victims;i++) {
+    victim = sys->cpus[state->steal_order[i]]->f_state;
+    if (!victim) {
+      continue;
+    }
+    while ((f = _fq_pop(&(victim->queue)))) {
+      if (_fiber_take(state, f)) {
+        FIBER_DEBUG("_fiber_steal() : stole fiber %p from CPU %d\n", f, victim->cpu);
+        state->stats.steals++;
+        return f;
+      }
+    }
+  }
+
+  state->stats.steal_fails++;
+
+  return 0;
+}
+
+// Takes the next fiber off this CPU's queue.  If there is none and
+// we are idle, try to steal one.  Busy CPUs do not steal, so their
+// fibers stay where their data is.
+static nk_fiber_t *_fiber_dequeue(fiber_state *state)
+{
+  struct fiber_queue *q[2] = { &(state->queue), &(state->pinned) };
+  nk_fiber_t *f;
+  int i;
+
+  // alternate which queue goes first so neither starves the other
+  state->pinned_turn = !state->pinned_turn;
+
+  for (i=0;i<2;i++) {
+    while ((f = _fq_pop(q[i ^ state->pinned_turn]))) {
+      if (_fiber_take(state, f)) {
+        return f;
+      }
+    }
+  }
+
+  if (state->curr_fiber->is_idle) {
+    return _fiber_steal(state);
+  }
+
+  return 0;
+}
+
+// Whether this CPU has something to run or something it could steal
+static int _fiber_work_available(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  fiber_state *victim;
+  int i;
+
+  if (!_fq_empty(&(state->queue)) || !_fq_empty(&(state->pinned))) {
+    return 1;
+  }
+
+  if (state->steal_order) {
+    for (i=0;i<state->num_victims;i++) {
+      victim = sys->cpus[state->steal_order[i]]->f_state;
+      if (victim && !_fq_empty(&(victim->queue))) {
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+#endif
+
+// Frees the stack and struct of the fiber that last exited on this
+// CPU.  _nk_fiber_exit cannot do it, since it is running on that stack.
+static void _fiber_reap(fiber_state *state)
+{
+  nk_fiber_t *z = state->zombie;
+
+  if (z) {
+    state->zombie = 0;
+    free(z->stack);
+    _fiber_release(z);
+  }
+}
+
 // Cleans up an exiting fiber. Frees fiber struct and fiber's stack, cleans up fiber's wait queue
 // Exiting fiber must be running when this is called because a context switch is performed at the end
 static void _nk_fiber_exit(nk_fiber_t *f)
 {
+  // Grab the fiber state of the current cpu
+  fiber_state *state = _GET_FIBER_STATE();
+
+  // Finish cleaning up the last fiber to exit here (we are on a different stack now)
+  _fiber_reap(state);
+
   // Acquire the exiting fiber's lock
   _LOCK_FIBER(f);
 
   // Set status of fiber to exiting
   f->f_status = EXIT;
 
-  // Grab the fiber state of the current cpu
-  fiber_state *state = _GET_FIBER_STATE();
-
   // next will be the fiber we switch to (might be idle fiber)
   nk_fiber_t *next = NULL;
   
@@ -211,21 +661,27 @@ static void _nk_fiber_exit(nk_fiber_t *f)
   // Mark the current fiber as done (since we are exiting)
   f->is_done = 1;
 
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+  // Give the fiber's slot in its home's pinned queue back
+  if (f->pinned && f->pin_cpu >= 0) {
+    __sync_fetch_and_sub(&per_cpu_get(system)->cpus[f->pin_cpu]->f_state->pinned_live, 1);
+  }
+#endif
+
+  // Unlock the fiber before it is freed
+  _UNLOCK_FIBER(f);
+
   // Picks fiber to switch to and updates fiber state
-  _LOCK_SCHED_QUEUE(state);
-  next = _rr_policy();
+  next = _fiber_dequeue(state);
   if (!(next)) {
     next = state->idle_fiber;
   }
   state->curr_fiber = next;
-  _UNLOCK_SCHED_QUEUE(state);
-  
-  // Unlock the fiber before free (in case we implement reaping)
-  _UNLOCK_FIBER(f);
+  _fiber_set_on_cpu(next);
 
-  // Free the current fiber's memory (stack and fiber structure)
-  free(f->stack);
-  free(f);
+  // We are still on the current fiber's stack, so its memory (stack and
+  // fiber structure) is freed by the next fiber switch on this CPU
+  state->zombie = f;
   
   // Switch back to the idle fiber using special exit function
   // Jumps to exit switch so we avoid pushing return addr to freed stack
@@ -368,6 +824,7 @@ __attribute__((noreturn)) static void _nk_fiber_yield_helper(nk_fiber_t *f_to, f
   
   // Unlock fibers and perform context switch
   _UNLOCK_FIBER(f_to);
+  _fiber_set_on_cpu(f_to);
 
   // Change the vc of the current thread if we aren't switching away from the idle fiber
   // TODO: MAC: Might not do what I think it does
@@ -382,24 +839,14 @@ __attribute__((noreturn)) static void _nk_fiber_yield_helper(nk_fiber_t *f_to, f
   
   // Enqueue the current fiber (if it is not the idle fiber)
   if (!(f_from->is_idle)) {
-    // Gets the sched queue for the current CPU
-    _LOCK_SCHED_QUEUE(state);
-    struct list_head *fiber_sched_queue = &(state->f_sched_queue);
-     
     // DEBUG: Prints the fiber that's about to be enqueued
     FIBER_DEBUG("_nk_fiber_yield_helper() : About to enqueue fiber: %p \n", f_from);
     
-    _LOCK_FIBER(f_from);
-    f_from->f_status = READY;
-    f_from->curr_cpu = my_cpu_id();
-    _UNLOCK_FIBER(f_from);
-
     // Adds fiber we're switching away from to the current CPU's fiber queue
-    list_add_tail(&(f_from->sched_node), fiber_sched_queue);
-    _UNLOCK_SCHED_QUEUE(state);
+    _fiber_enqueue(state, f_from);
   }
   // Begin context switch (register saving and stack switch)
-  _nk_fiber_context_switch(f_to);
+  _nk_fiber_context_switch(f_to, f_from);
 
   // Tells compiler this point is unreachable, stops compiler warning
   __builtin_unreachable();
@@ -418,17 +865,17 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
   // Adjust f_from's stack ptr
   f_from->rsp = rsp;
 
+  _fiber_reap(state);
+
   // get next fiber to yield to
-  _LOCK_SCHED_QUEUE(state);
-  nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
+  nk_fiber_t *f_to = _fiber_dequeue(state);
   if (!(f_to)) { 
     if (f_from->is_idle) {
       // Should never come from the idle fiber
       panic("Attempted to call yield_to from idle fiber. Should never happen!\n");
       *(uint64_t*)(rsp+GPR_RAX_OFFSET) = -1;
       //_nk_fiber_context_switch_early(f_from);
-      _nk_fiber_context_switch(f_from);
+      _nk_fiber_context_switch(f_from, 0);
     } else {
         f_to = state->idle_fiber;
     }
@@ -445,10 +892,11 @@ __attribute__((noreturn)) void __nk_fiber_join_yield(uint64_t rsp, uint64_t offs
   f_to->curr_cpu = my_cpu_id();
   f_to->f_status = RUN;
   _UNLOCK_FIBER(f_to);
+  _fiber_set_on_cpu(f_to);
 
   // Begin context switch (register saving and stack change)
   *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
-  _nk_fiber_context_switch(f_to);
+  _nk_fiber_context_switch(f_to, f_from);
   
   // Tells compiler this point is unreachable, stops compiler warning
   __builtin_unreachable();
@@ -506,6 +954,7 @@ static nk_thread_t *_get_random_fiber_thread()
   return sys->cpus[random_cpu]->f_state->fiber_thread;
 }
 
+#ifndef NAUT_CONFIG_FIBER_WORK_STEALING
 // Returns a random CPU's fiber state
 static fiber_state *_get_random_fiber_state()
 {
@@ -514,33 +963,35 @@ static fiber_state *_get_random_fiber_state()
   int random_cpu = (int)(_get_random() % sys->num_cpus);
   return sys->cpus[random_cpu]->f_state;
 }
+#else
+// Wakes the fiber thread of an idle CPU near state so that it can steal
+// work that state's CPU will not get to right away.  The scan starts
+// where the last one left off so wakeups are spread over the neighbors.
+static void _fiber_kick_thief(fiber_state *state)
+{
+  struct sys_info *sys = per_cpu_get(system);
+  int *order = state->steal_order;
+  int n = state->num_victims;
+  fiber_state *thief;
+  int i, c;
+
+  // not built until state's CPU has first gone idle
+  if (!order) {
+    return;
+  }
 
-// Checks if to_del is on a sched queue (ready to be switched to)
-// returns -EINVAL if not ready, otherwise returns 0
-static int _check_yield_to(nk_fiber_t *to_del) {
-  _LOCK_FIBER(to_del);
-  // If the fiber isn't ready to switch to, indicate failure.
-  if (to_del->f_status != READY) {
-     FIBER_DEBUG("_check_yield_to() : to_del's status is %s\n", to_del->f_status);
-     _UNLOCK_FIBER(to_del);
-     return -EINVAL;
-  } else { /* The fiber is ready, so we will take it from its queue so we can use it */
-      // Gets the fiber state of the CPU of the target fiber
-      fiber_state *state = per_cpu_get(system)->cpus[to_del->curr_cpu]->f_state;
-      
-      // Prevents deadlock by avoiding lock if to_del is on own queue (would spin forever)
-      if (state == _GET_FIBER_STATE()) {
-        list_del_init(&(to_del->sched_node));
-        _UNLOCK_FIBER(to_del);
-      } else { 
-      _LOCK_SCHED_QUEUE(state);
-      list_del_init(&(to_del->sched_node));
-      _UNLOCK_FIBER(to_del);
-      _UNLOCK_SCHED_QUEUE(state);
-      }
-      return 0;
+  for (i=0;i<FIBER_WAKE_SCAN && i<n;i++) {
+    c = order[(state->wake_cursor + i) % n];
+    thief = sys->cpus[c]->f_state;
+    if (thief && thief->curr_fiber && thief->curr_fiber->is_idle &&
+        _fq_empty(&(thief->queue)) && _fq_empty(&(thief->pinned))) {
+      state->wake_cursor = (state->wake_cursor + i + 1) % n;
+      _wake_fiber_thread(thief);
+      return;
+    }
   }
 }
+#endif
 
 // sets up fiber state for current CPU
 static struct nk_fiber_percpu_state *init_local_fiber_state()
@@ -556,11 +1007,25 @@ static struct nk_fiber_percpu_state *init_local_fiber_state()
     
     spinlock_init(&(state->lock));
      
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+    if (_fiber_queue_init(&(state->queue), my_cpu_id())) {
+        ERROR("Could not allocate fiber queue\n");
+        goto fail_free;
+    }
+    if (_fiber_queue_init(&(state->pinned), my_cpu_id())) {
+        ERROR("Could not allocate pinned fiber queue\n");
+        free(state->queue.cells);
+        goto fail_free;
+    }
+#else
     INIT_LIST_HEAD(&(state->f_sched_queue));
+#endif
     
     state->waitq = nk_wait_queue_create("fib");
     
     state->fork_cpu = F_CURR_CPU;
+
+    state->cpu = my_cpu_id();
  
     return state;
 
@@ -607,7 +1072,7 @@ int nk_fiber_init()
 static int _check_empty(void *s) 
 {
   fiber_state *state = (fiber_state*)s;
-  return (!(list_empty(&(state->f_sched_queue)) && state->curr_fiber->is_idle));
+  return (_fiber_work_available(state) && state->curr_fiber->is_idle);
 }
 
 // The idle fiber has different behavior depending on those chosen Kconfig option.
@@ -627,7 +1092,7 @@ static void __nk_fiber_idle(void *in, void **out)
     // If we have fiber thread sleep enabled
     #ifdef NAUT_CONFIG_FIBER_ENABLE_SLEEP  
     nk_fiber_yield();
-    if (list_empty_careful(_GET_SCHED_HEAD())){
+    if (!_fiber_work_available(_GET_FIBER_STATE())){
       FIBER_DEBUG("nk_fiber_idle() : fiber thread going to sleep\n");
       nk_sleep(NAUT_CONFIG_FIBER_THREAD_SLEEP_TIME);
       FIBER_DEBUG("nk_fiber-idle() : fiber thread waking up\n");
@@ -695,6 +1160,7 @@ static void __fiber_thread(void *in, void **out)
 
   // Updating current cpu info
   idle_fiber_ptr->curr_cpu = my_cpu_id();
+  idle_fiber_ptr->on_cpu = 1;
 
   // For FPU Debugging, prints Xsave configuration
   #if (0 && defined(NAUT_CONFIG_DEBUG_FPU))
@@ -755,6 +1221,7 @@ static void _debug_yield(nk_fiber_t *f_to)
     //DEBUG: Indicates what fiber was picked to schedule
     FIBER_DEBUG("nk_fiber_yield() : The fiber picked to schedule is %p\n", f_to); 
   
+#ifndef NAUT_CONFIG_FIBER_WORK_STEALING
     //DEBUG: Will print out the fiber queue for this CPU's fiber thread
     nk_fiber_t *f_iter = NULL;
     struct list_head *f_sched = _GET_SCHED_HEAD();
@@ -763,6 +1230,7 @@ static void _debug_yield(nk_fiber_t *f_to)
     }
     //DEBUG: Will indicate when fiber queue is done printing (to indicate whether queue is finite)
     FIBER_DEBUG("nk_fiber_yield() : Done printing out the fiber queue.\n");
+#endif
   }
 }
 #endif
@@ -897,6 +1365,17 @@ int nk_fiber_create(nk_fiber_fun_t fun,
   INIT_LIST_HEAD(&(fiber->fiber_children));
   INIT_LIST_HEAD(&(fiber->child_node));
 
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+  // The fiber's reference on itself, dropped once it has exited
+  fiber->refs = 1;
+  fiber->pin_cpu = -1;
+#endif
+
+  fiber_state *state = _GET_FIBER_STATE();
+  if (state) {
+    __sync_fetch_and_add(&(state->stats.spawns), 1);
+  }
+
   return 0;
 }
 
@@ -907,16 +1386,17 @@ int nk_fiber_create(nk_fiber_fun_t fun,
  *
  * @f: the fiber to add to the sched queue
  * @target_cpu: which CPU to start the fiber on. F_CURR_CPU => run on current CPU,
- *              F_RAND_CPU => run on random CPU. 
+ *              F_RAND_CPU => run on random CPU. A pinned fiber that has
+ *              run before ignores this and goes back to its own CPU.
  *
- * on error (invalid target_cpu), returns -EINVAL, otherwise 0.
+ * on error (invalid target_cpu), returns -EINVAL, if target_cpu has no
+ * room for another pinned fiber, returns -EBUSY, otherwise 0.
  */
 int nk_fiber_run(nk_fiber_t *f, int target_cpu)
 { 
   // system info gathered
   struct sys_info * sys = per_cpu_get(system);
   int num_cpus = sys->num_cpus;
-  int t_cpu = 0;
  
   // by default, the state is set to the current cpu's fiber state
   // This means we only have to update state if target_cpu != F_CURR_CPU (3 cases)
@@ -930,32 +1410,45 @@ int nk_fiber_run(nk_fiber_t *f, int target_cpu)
       //state is is set to the f_state of target_cpu
       state = sys->cpus[target_cpu]->f_state;
   } else if(target_cpu == F_RAND_CPU) { /* RAND and CURR are only choices left */
+#ifndef NAUT_CONFIG_FIBER_WORK_STEALING
       // Random fiber state selected
       state = _get_random_fiber_state();
+#endif
+      // With work stealing, the fiber is queued here and idle CPUs take it from us
   } /* if target_cpu != RAND, then it must be CURR. Fiber state is already set to CURR CPU by default */
 
-  // t_cpu is updated to the cpu number of the selected state 
-  t_cpu = state->fiber_thread->current_cpu;
- 
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+  // The first run of a pinned fiber picks its home CPU, which must
+  // have room for it in its pinned queue.  Later runs go back there.
+  if (f->pinned && f->pin_cpu < 0) {
+    if (__sync_add_and_fetch(&state->pinned_live, 1) > state->pinned.mask) {
+      __sync_fetch_and_sub(&state->pinned_live, 1);
+      FIBER_ERROR("nk_fiber_run() : too many pinned fibers on cpu %d\n", state->cpu);
+      return -EBUSY;
+    }
+    f->pin_cpu = state->cpu;
+  }
+  if (f->pinned) {
+    state = sys->cpus[f->pin_cpu]->f_state;
+  }
+#endif
+
   //DEBUG: Prints the fiber that is about to be enqueued and the CPU it will be enqueued on
-  FIBER_DEBUG("nk_fiber_run() : about to enqueue a fiber: %p on cpu: %d\n", f, state->fiber_thread->current_cpu); 
-  
-  // Lock the fiber, change it's curr cpu, and change status to ready (since we are about to queue it)
-  _LOCK_FIBER(f);
-  f->curr_cpu = t_cpu;
-  f->f_status = READY;
+  FIBER_DEBUG("nk_fiber_run() : about to enqueue a fiber: %p on cpu: %d\n", f, state->cpu); 
   
-  // Lock the CPU fiber state and enqueue the fiber into sched queue 
-  _LOCK_SCHED_QUEUE(state);
-  list_add_tail(&(f->sched_node), &(state->f_sched_queue));
-  
-  // Unlock CPU fiber state and f
-  _UNLOCK_SCHED_QUEUE(state);
-  _UNLOCK_FIBER(f);
+  // Change f's curr cpu and status to ready, and enqueue it into the sched queue
+  _fiber_enqueue(state, f);
  
   // Wake up fiber thread for selected CPU (or do nothing if it is already awake)
   _wake_fiber_thread(state); 
 
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+  // If the selected CPU is busy or has a backlog, get a neighbor to help
+  if (_fq_depth(&(state->queue)) > 1 || (state->curr_fiber && !state->curr_fiber->is_idle)) {
+    _fiber_kick_thief(state);
+  }
+#endif
+
   return 0;
 }
 
@@ -1024,14 +1517,17 @@ __attribute__((noreturn)) void _nk_fiber_yield(uint64_t rsp, uint64_t offset)
   if (state->fiber_thread != get_cur_thread()) {
     // Abort yield somehow. Subtract from RSP and retq?
     *(uint64_t*)(rsp+GPR_RAX_OFFSET) = -1; 
-    _nk_fiber_context_switch(curr_fiber);
+    _nk_fiber_context_switch(curr_fiber, 0);
   }
-  
-  // Pick a random fiber to yield to (NULL if no fiber in queue)
 
-  _LOCK_SCHED_QUEUE(state);
-  nk_fiber_t *f_to = _rr_policy();
-  _UNLOCK_SCHED_QUEUE(state);
+  _fiber_reap(state);
+
+  if (!curr_fiber->is_idle) {
+    state->stats.yields++;
+  }
+  
+  // Pick the next fiber to yield to (NULL if no fiber in queue)
+  nk_fiber_t *f_to = _fiber_dequeue(state);
   
   #if NAUT_CONFIG_DEBUG_FIBERS
   //_debug_yield(f_to);
@@ -1044,7 +1540,7 @@ __attribute__((noreturn)) void _nk_fiber_yield(uint64_t rsp, uint64_t offset)
     if (curr_fiber->is_idle) {
       //Abort yield somehow? Subtract from RSP and retq?
       *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 1; 
-      _nk_fiber_context_switch(curr_fiber);
+      _nk_fiber_context_switch(curr_fiber, 0);
     } else {
         f_to = state->idle_fiber;
     }
@@ -1086,27 +1582,29 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
   curr_fiber->fpu_state_offset = offset;
   #endif
 
-  // Locks fiber state
-  _LOCK_SCHED_QUEUE(state);
-  // Remove f_to from its respective fiber queue (need to check all CPUs)
-  // This is currently not safe, fiber may be running and therefore not in sched queue
-  if (_check_yield_to(f_to) < 0){
+  _fiber_reap(state);
+
+  if (!curr_fiber->is_idle) {
+    state->stats.yields++;
+  }
+
+  // Remove f_to from its respective fiber queue (whichever CPU's it is on)
+  // Fails if f_to is not queued, for example because it is running
+  if (_fiber_claim(f_to) < 0){
     //DEBUG: Will indicate whether the fiber we're attempting to yield to was not found
     FIBER_DEBUG("nk_fiber_yield_to() : Failed to find fiber in queues :(\n");
     
     // If early ret flag is set, we will indicate failure instead of yielding to random fiber
     if (earlyRetFlag) {
-      _UNLOCK_SCHED_QUEUE(state);
       *(uint64_t*)(rsp+GPR_RAX_OFFSET) = -1;
-      _nk_fiber_context_switch(curr_fiber);
+      _nk_fiber_context_switch(curr_fiber, 0);
       FIBER_DEBUG("nk_fiber_yield_to() : early ret flag set, returning early\n");
     }
     
-    // early ret flag not set, so we find a random fiber to yield to instead
-    nk_fiber_t *new_to = _rr_policy();
-    _UNLOCK_SCHED_QUEUE(state);
+    // early ret flag not set, so we find another fiber to yield to instead
+    nk_fiber_t *new_to = _fiber_dequeue(state);
     
-    // Checks to see if we received a valid fiber from _rr_policy (NULL = no fibers to schedule)
+    // Checks to see if we received a valid fiber from the queue (NULL = no fibers to schedule)
     if (!(new_to)) { 
       if (curr_fiber->is_idle) { /* if no fiber to sched and curr idle, no reason to switch */
         *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
@@ -1122,7 +1620,6 @@ __attribute__((noreturn)) void _nk_fiber_yield_to(nk_fiber_t *f_to, int earlyRet
   }
 
   // Use utility function to perform rest of yield 
-  _UNLOCK_SCHED_QUEUE(state);
   *(uint64_t*)(rsp+GPR_RAX_OFFSET) = 0;
   _nk_fiber_yield_helper(f_to, state, curr_fiber);
 }
@@ -1377,6 +1874,51 @@ nk_fiber_t *__nk_fiber_fork(uint64_t rsp0, uint64_t offset)
   return new;
 }
 
+/* 
+ * nk_fiber_get_stats
+ *
+ * Copies out the fiber scheduling counters of a CPU
+ *
+ * @cpu: the CPU whose counters are wanted
+ * @stats: where to put them
+ *
+ * returns -1 on an invalid CPU, 0 otherwise
+ */
+int nk_fiber_get_stats(int cpu, struct nk_fiber_stats *stats)
+{
+  struct sys_info * sys = per_cpu_get(system);
+
+  if (cpu < 0 || cpu >= sys->num_cpus || !sys->cpus[cpu]->f_state) {
+    return -1;
+  }
+
+  *stats = sys->cpus[cpu]->f_state->stats;
+
+  return 0;
+}
+
+/* 
+ * nk_fiber_set_pinned
+ *
+ * Keeps a fiber on the CPU it is first run on.  With work stealing, a
+ * pinned fiber is queued where thieves do not look, and later runs
+ * and wakeups send it back to that CPU whatever CPU they ask for.
+ * nk_fiber_run fails with -EBUSY if that CPU already has as many
+ * pinned fibers as its pinned queue holds, and nk_fiber_yield_to
+ * will not switch to a pinned fiber.
+ *
+ * @f: a fiber that has been created but not yet run
+ * @pinned: 1 => pin, 0 => let it be stolen
+ *
+ */
+void nk_fiber_set_pinned(nk_fiber_t *f, int pinned)
+{
+  f->pinned = !!pinned;
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+  f->pin_cpu = -1;
+#endif
+}
+
 /* 
  * nk_fiber_set_vc
  *
@@ -87,6 +87,15 @@
 
 extern uint8_t cpu_info_ready;
 
+uint8_t  nk_fpu_save_mode = NK_FPU_FXSAVE;
+uint8_t  nk_fpu_has_xinuse = 0;
+uint64_t nk_fpu_lazy_restores = 0;
+
+#ifdef NAUT_CONFIG_FPU_LAZY
+// in src/asm/thread_lowlevel.S
+extern int nk_fpu_nm_handler(excp_entry_t *, excp_vec_t, void *);
+#endif
+
 static inline uint16_t
 get_x87_status (void)
 {
@@ -342,6 +351,18 @@ get_xsave_features (void)
     return r.a;
 }
 
+// CPUID leaf 0xd, subleaf 1, eax
+#define XSAVE_EXT_XSAVEOPT 0x1
+#define XSAVE_EXT_XGETBV1  0x4
+
+static uint32_t
+get_xsave_ext_features (void)
+{
+    cpuid_ret_t r;
+    cpuid_sub(0x0d, 1, &r);
+    return r.a;
+}
+
 static void
 set_osxsave (void)
 {
@@ -506,6 +527,15 @@ fpu_init_common (struct naut_info * naut)
         asm volatile ("xor %%rcx, %%rcx ;"
                       "xsetbv ;"
                       : : "a"(xsave_support) : "rcx", "memory");
+
+        /* Threads switch with XSAVE only if it saves at least what FXSAVE does */
+        if ((xsave_support & 0x3) == 0x3) {
+            uint32_t ext = get_xsave_ext_features();
+            nk_fpu_save_mode = (ext & XSAVE_EXT_XSAVEOPT) ? NK_FPU_XSAVEOPT : NK_FPU_XSAVE;
+            nk_fpu_has_xinuse = !!(ext & XSAVE_EXT_XGETBV1);
+            FPU_DEBUG("\tThread FPU state saved with %s\n",
+                      nk_fpu_save_mode == NK_FPU_XSAVEOPT ? "XSAVEOPT" : "XSAVE");
+        }
     }
     #endif
 }
@@ -545,5 +575,14 @@ fpu_init (struct naut_info * naut, int is_ap)
             return;
         }
 
+#ifdef NAUT_CONFIG_FPU_LAZY
+        // context switches set CR0.TS, and a thread's first FPU
+        // instruction afterwards lands here to load its state
+        if (register_int_handler(NM_EXCP, nk_fpu_nm_handler, NULL) != 0) {
+            ERROR_PRINT("Could not register excp handler for NM\n");
+            return;
+        }
+#endif
+
     }
 }
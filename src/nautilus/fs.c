@@ -28,6 +28,7 @@
 #include <nautilus/testfs.h>
 #include <nautilus/shell.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/thread.h>
 
 #define INFO(fmt, args...)  INFO_PRINT("fs: " fmt, ##args)
 #define DEBUG(fmt, args...) DEBUG_PRINT("fs: " fmt, ##args)
@@ -164,6 +165,15 @@ static inline ssize_t file_write(nk_fs_fd_t fd, char *buf, size_t num_bytes)
 }
 
 
+static int fs_sync(struct nk_fs *fs)
+{
+    if (fs && fs->interface && fs->interface->sync) {
+	return fs->interface->sync(fs->state);
+    } else {
+	return 0;
+    }
+}
+
 static int exists(struct nk_fs *fs, char *path) 
 {
     //    DEBUG("Exists (%s, %s)\n",fs->name,path);
@@ -241,6 +251,10 @@ int            nk_fs_unregister(struct nk_fs *f)
     STATE_LOCK();
     list_del(&f->fs_list_node);
     STATE_UNLOCK();
+    // nk_fs_sync can no longer find it, but may still be syncing it
+    while (__sync_fetch_and_add(&f->refcount,0)) {
+	nk_yield();
+    }
     INFO("Unregistered filesystem %s\n",f->name);
     free(f);
     return 0;
@@ -454,7 +468,7 @@ ssize_t nk_fs_write(nk_fs_fd_t fd, void *buf, size_t num_bytes)
     }
 
     FILE_LOCK(fd);
-    ssize_t n = file_read(fd, buf, num_bytes);
+    ssize_t n = file_write(fd, buf, num_bytes);
     if (n>=0) {fd->position += n; }
     FILE_UNLOCK(fd);
 
@@ -523,6 +537,58 @@ ssize_t nk_fs_tell(nk_fs_fd_t fd)
     return fd->position; 
 }
 
+int nk_fs_sync(void)
+{
+    STATE_LOCK_CONF;
+    struct list_head *cur;
+    struct nk_fs **fses;
+    int i, n=0, rc=0;
+
+    // syncing does I/O, so it cannot happen under the state lock
+    STATE_LOCK();
+    list_for_each(cur,&fs_list) {
+	n++;
+    }
+    STATE_UNLOCK();
+
+    if (!n) {
+	return 0;
+    }
+
+    fses = malloc(n*sizeof(struct nk_fs *));
+
+    if (!fses) {
+	ERROR("Cannot allocate for sync\n");
+	return -1;
+    }
+
+    i = 0;
+    STATE_LOCK();
+    list_for_each(cur,&fs_list) {
+	if (i<n) {
+	    fses[i] = list_entry(cur,struct nk_fs,fs_list_node);
+	    // keeps a concurrent unregister from freeing it under us
+	    __sync_fetch_and_add(&fses[i]->refcount,1);
+	    i++;
+	}
+    }
+    STATE_UNLOCK();
+
+    n = i;
+
+    for (i=0;i<n;i++) {
+	if (fs_sync(fses[i])) {
+	    ERROR("Failed to sync filesystem %s\n", fses[i]->name);
+	    rc = -1;
+	}
+	__sync_fetch_and_sub(&fses[i]->refcount,1);
+    }
+
+    free(fses);
+
+    return rc;
+}
+
 
 void nk_fs_dump_filesystems()
 {
@@ -762,6 +828,15 @@ handle_cat (char * buf, void * priv)
     return 0;
 }
 
+static int
+handle_sync (char * buf, void * priv)
+{
+    if (nk_fs_sync()) {
+        nk_vc_printf("Sync failed\n");
+    }
+    return 0;
+}
+
 static struct shell_cmd_impl fses_impl = {
     .cmd      = "fses",
     .help_str = "fses",
@@ -783,3 +858,10 @@ static struct shell_cmd_impl cat_impl = {
 };
 nk_register_shell_cmd(cat_impl);
 
+
+static struct shell_cmd_impl sync_impl = {
+    .cmd      = "sync",
+    .help_str = "sync",
+    .handler  = handle_sync,
+};
+nk_register_shell_cmd(sync_impl);
@@ -27,6 +27,8 @@
 #include <nautilus/thread.h>
 #include <nautilus/task.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/paging.h>
+#include <nautilus/mwait.h>
 
 #ifndef NAUT_CONFIG_DEBUG_SCHED
 #undef DEBUG_PRINT
@@ -58,6 +60,13 @@ idle (void * in, void ** out)
     uint64_t last_steal = nk_sched_get_runtime(get_cur_thread());
     uint64_t runtime;
     uint64_t numstolen;
+#ifdef NAUT_CONFIG_TICKLESS_IDLE
+    uint8_t use_mwait = has_mwait();
+#endif
+#ifdef NAUT_CONFIG_LOAD_BALANCE
+    uint64_t last_balance = nk_sched_get_realtime();
+    uint64_t now, numpulled;
+#endif
 
     while (1) {
 	if (!irqs_enabled()) { 
@@ -83,6 +92,19 @@ idle (void * in, void ** out)
 	    preempt_enable();
 #endif
 	} while (task);
+
+	// then help out a neighbor with one of its tasks
+#ifdef NAUT_CONFIG_TASK_IN_IDLE_NOPREEMPT
+	preempt_disable();
+#endif
+	if ((task = nk_task_try_consume(-1,0,0))) {
+	    DEBUG_PRINT("idle consuming stolen task %p\n",task);
+	    void *output = task->func(task->input);
+	    nk_task_complete(task, output);
+	}
+#ifdef NAUT_CONFIG_TASK_IN_IDLE_NOPREEMPT
+	preempt_enable();
+#endif
 #endif
 	
 #if NAUT_CONFIG_WORK_STEALING
@@ -96,6 +118,28 @@ idle (void * in, void ** out)
 	    preempt_enable();
 	}
 #endif
+
+#ifdef NAUT_CONFIG_LOAD_BALANCE
+	now = nk_sched_get_realtime();
+	if ((now - last_balance) > (NAUT_CONFIG_LOAD_BALANCE_INTERVAL_MS*1000000ULL)) {
+	    preempt_disable();
+	    nk_sched_balance(&numpulled);
+	    DEBUG_PRINT("CPU %d pulled %lu threads\n",my_cpu_id(),numpulled);
+	    last_balance = now;
+	    preempt_enable();
+	}
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+	// with nothing else to do, pre-zero a block for kmem_mallocz
+	if (!nk_sched_cpu_has_work()) {
+	    kmem_zero_pool_fill();
+	}
+#endif
+
+	// finish guard page shootdowns that could not wait on
+	// other CPUs when the guards were set
+	nk_paging_guard_flush_deferred();
 	    
 
         nk_yield();
@@ -109,6 +153,25 @@ idle (void * in, void ** out)
 #ifdef NAUT_CONFIG_HALT_WHILE_IDLE
         sti();
         halt();
+#elif defined(NAUT_CONFIG_TICKLESS_IDLE)
+	// sleep until the next event if we have nothing to do;
+	// the sti takes effect after the hlt/mwait begins, so a wakeup
+	// that arrives after our check will still end the sleep.
+	// The monitor is armed before the check, so a remote task
+	// enqueue also ends an mwait without needing a kick
+	cli();
+	if (use_mwait) {
+	    nk_monitor((addr_t)nk_sched_cpu_wake_addr(),0,0);
+	}
+	if (!nk_sched_cpu_has_work()) {
+	    if (use_mwait) {
+		nk_sti_mwait(0,0);
+	    } else {
+		__asm__ __volatile__ ("sti; hlt" : : : "memory");
+	    }
+	} else {
+	    sti();
+	}
 #endif
     }
 }
@@ -373,6 +373,27 @@ idt_assign_entry (ulong_t entry, ulong_t handler_addr, ulong_t state_addr)
     return 0;
 }
 
+/*
+ * idt_assign_ist
+ *
+ * deliver this vector on one of the interrupt stacks
+ * of the current CPU's TSS (1-7), or on the interrupted
+ * stack (0)
+ *
+ */
+int
+idt_assign_ist (ulong_t entry, uint8_t ist)
+{
+    if (entry >= NUM_IDT_ENTRIES || ist > 7) {
+        ERROR_PRINT("Assigning invalid IST to IDT entry\n");
+        return -1;
+    }
+
+    idt64[entry].ist = ist;
+
+    return 0;
+}
+
 int
 idt_get_entry (ulong_t entry, ulong_t *handler_addr, ulong_t *state_addr)
 {
@@ -395,6 +395,8 @@ buddy_free(
 
         /* OK, we're good to go... buddy merge! */
         list_del_init(&buddy->link);
+        /* only the heads of free blocks are tagged available */
+        mark_allocated(mp, buddy);
         if (buddy < block) {
             block = buddy;
 	}
@@ -425,6 +427,128 @@ buddy_free(
 }
 
 
+/**
+ * Returns the order of the largest block that starts at addr
+ * and does not extend beyond end.
+ */
+static inline ulong_t
+range_order (struct buddy_mempool *mp, ulong_t addr, ulong_t end)
+{
+    ulong_t off = addr - mp->base_addr;
+    ulong_t order = off ? __builtin_ctzl(off) : mp->pool_order;
+
+    if (order > mp->pool_order) {
+        order = mp->pool_order;
+    }
+
+    while ((1UL << order) > end - addr) {
+        --order;
+    }
+
+    return order;
+}
+
+
+/**
+ * Returns the free block that contains addr, or NULL if addr
+ * is not in a free block.  Relies on only the heads of free
+ * blocks being tagged available.
+ */
+static struct block *
+find_free_block (struct buddy_mempool *mp, ulong_t addr)
+{
+    ulong_t order;
+    struct block *block;
+
+    for (order = mp->min_order; order <= mp->pool_order; order++) {
+        block = (struct block *)(mp->base_addr + 
+                                 ((addr - mp->base_addr) & ~((1UL << order) - 1)));
+        if (is_available(mp, block) && block->order == order) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Returns an arbitrary range of allocated memory to the buddy
+ * system, which need not be a single block.  The range is split
+ * into the largest aligned blocks possible.  Both ends must be 
+ * aligned to the minimum block size.  The caller holds the lock.
+ */
+void
+buddy_free_range (struct buddy_mempool *mp, void *addr, ulong_t len)
+{
+    ulong_t cur = (ulong_t)addr;
+    ulong_t end = cur + len;
+    ulong_t order;
+
+    ASSERT(!(len & ((1UL << mp->min_order) - 1)));
+
+    while (cur < end) {
+        order = range_order(mp, cur, end);
+        buddy_free(mp, (void *)cur, order);
+        cur += 1UL << order;
+    }
+}
+
+
+/**
+ * Allocates a specific range of memory, which must be entirely
+ * free.  The free blocks that overlap the range are removed from 
+ * the free lists and the parts of them outside of the range are 
+ * given back.  Both ends must be aligned to the minimum block size.
+ * The caller holds the lock.
+ *
+ * Returns:
+ *       Success: 0
+ *       Failure: -1 and the pool is unchanged
+ */
+int
+buddy_claim_range (struct buddy_mempool *mp, void *addr, ulong_t len)
+{
+    ulong_t start = (ulong_t)addr;
+    ulong_t end = start + len;
+    ulong_t cur, bstart, bend;
+    struct block *block;
+
+    ASSERT(!(len & ((1UL << mp->min_order) - 1)));
+
+    if (start < mp->base_addr || end > mp->base_addr + (1UL << mp->pool_order)) {
+        return -1;
+    }
+
+    /* Check the whole range before changing anything */
+    for (cur = start; cur < end; cur = (ulong_t)block + (1UL << block->order)) {
+        if (!(block = find_free_block(mp, cur))) {
+            BUDDY_DEBUG("claim of %p-%p fails at %p\n", (void*)start, (void*)end, (void*)cur);
+            return -1;
+        }
+    }
+
+    for (cur = start; cur < end; cur = bend) {
+        block = find_free_block(mp, cur);
+        bstart = (ulong_t)block;
+        bend = bstart + (1UL << block->order);
+
+        list_del_init(&block->link);
+        mark_allocated(mp, block);
+
+        /* Give back what lies outside of the range */
+        if (bstart < cur) {
+            buddy_free_range(mp, (void *)bstart, cur - bstart);
+        }
+        if (bend > end) {
+            buddy_free_range(mp, (void *)end, bend - end);
+        }
+    }
+
+    return 0;
+}
+
+
 /*
   Sanity-checks and gets statistics of the buddy pool
  */
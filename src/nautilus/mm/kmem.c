@@ -36,6 +36,8 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/percpu.h>
 #include <nautilus/shell.h>
+#include <nautilus/stackpool.h>
+#include <nautilus/rbtree.h>
 
 #include <dev/gpio.h>
 
@@ -62,20 +64,17 @@
 #endif	
 
 #define KMEM_ERROR_BACKTRACE() BACKTRACE(KMEM_ERROR,3)
+
+extern uint8_t cpu_info_ready;
 	    
 
 /**
  * This specifies the minimum sized memory block to request from the underlying
  * buddy system memory allocator, 2^MIN_ORDER bytes. It must be at least big
- * enough to hold a 'struct kmem_block_hdr'.
+ * enough to hold a buddy allocator free block header.
  */
 #define MIN_ORDER   5  /* 32 bytes */
 
-// The factor by which to reduce the hash table size
-// next_prime(total_mem >> 5 / BLOAT) is the maximum number of
-// blocks we can allocate with malloc
-#define BLOAT  1024
-
 
 /**
  *  * Total number of bytes in the kernel memory pool.
@@ -94,149 +93,231 @@ static struct list_head glob_zone_list;
 
 
 /**
- * Each block of memory allocated from the kernel memory pool has 
- * associated with it one of these structures.   The structure 
- * maps the address handed out by malloc to the order of the block
- * that was allocated and the buddy allocator that provided the
- * block 
+ * Each zone has a page map with one byte for each 2^MIN_ORDER bytes
+ * of the zone.  The byte that corresponds to the first address of 
+ * an allocated block records the block's order and flags.  All other 
+ * bytes are zero.  This lets free find the order of a block in O(1),
+ * and lets the GC support functions find the allocated blocks by 
+ * scanning the page maps.  There is no limit on the number of 
+ * live allocations other than memory itself.
+ *
+ * The map costs 1/32 of each zone, so it is kept to a byte per entry:
+ *
+ *   bits 0-5  order of the block starting here (0 => none)
+ *   bit  6    PMAP_CACHED - the block is parked in a CPU cache
+ *   bit  7    the single user flag (KMEM_USER_FLAGS_MASK)
+ *
+ * The second entry of a large block, which has no order of its own,
+ * reuses bit 6 as PMAP_LARGE.  There is no room for more user flags,
+ * and the functions that take them reject any outside of the mask.
  */
-struct kmem_block_hdr {
-    void *   addr;   /* address of block */
-    uint64_t order;  /* order of the block allocated from buddy system */
-                     /* order>=MIN_ORDER => in use, safe to examine */
-                     /* order==0 => unallocated header */
-                     /* order==1 => allocation in progress, unsafe */
-    struct buddy_mempool * zone; /* zone to which this block belongs */
-    uint64_t flags;  /* flags for this allocated block */
-} __packed __attribute((aligned(8)));
-
-
-static struct kmem_block_hdr *block_hash_entries=0;
-static uint64_t               block_hash_num_entries=0;
-
-// roughly power-of-two primes
-static const uint64_t primes[] = 
-{ 
-    53, 97, 193, 389,
-    769, 1543, 3079, 6151,
-    12289, 24593, 49157, 98317,
-    196613, 393241, 786433, 1572869,
-    3145739, 6291469, 12582917, 25165843,
-    50331653, 100663319, 201326611, 402653189,
-    805306457, 1610612741 
-};
+#define PMAP_ORDER_MASK   0x3f  /* block order, 0 => not the start of a block */
+#define PMAP_CACHED       0x40  /* block is free, but parked in a CPU cache */
+#define PMAP_USER_SHIFT   7     /* user flags live above this bit */
+#define PMAP_LARGE        0x40  /* in the second entry of a block (order 0): 
+				   the block is the head of a large block */
 
-static uint64_t next_prime(uint64_t n)
+static inline uint64_t pmap_user_flags(uint8_t e)
 {
-  uint64_t i;
-  for (i=0;i<sizeof(primes)/sizeof(primes[0]);i++) {
-    if (primes[i]>=n) { 
-      return primes[i];
-    }
-  }
-  KMEM_DEBUG("next_prime: %lu is too big, returning maximum prime in table (%lu)\n",primes[i-1]);
+    return (e >> PMAP_USER_SHIFT) & KMEM_USER_FLAGS_MASK;
+}
 
-  return primes[i-1];
+// find the zone whose memory includes addr
+static inline struct mem_region *zone_of(void *addr)
+{
+    struct mem_region *region = NULL;
+    list_for_each_entry(region, &glob_zone_list, glob_link) {
+	addr_t base = region->mm_state->base_addr;
+        if ((addr_t)addr >= base && (addr_t)addr < base + region->len) {
+            return region;
+        }
+    }
+    return NULL;
 }
 
-static int block_hash_init(uint64_t bytes)
+static inline uint8_t *pmap_entry(struct mem_region *region, void *addr)
 {
-  uint64_t num_entries = next_prime((bytes >> MIN_ORDER) / BLOAT);
-  uint64_t entry_size = sizeof(*block_hash_entries);
-  
-  KMEM_DEBUG("block_hash_init with %lu entries each of size %lu bytes (%lu bytes)\n",
-	     num_entries, entry_size, num_entries*entry_size);
+    return &region->mm_pmap[((addr_t)addr - region->mm_state->base_addr) >> MIN_ORDER];
+}
 
-  block_hash_entries = mm_boot_alloc(num_entries*entry_size);
 
-  if (!block_hash_entries) { 
-    KMEM_ERROR("block_hash_init failed\n");
-    return -1;
-  }
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
 
-  memset(block_hash_entries,0,num_entries*entry_size);
-  
-  block_hash_num_entries = num_entries;
+#if KMEM_CACHE_MIN_ORDER != MIN_ORDER
+#error "KMEM_CACHE_MIN_ORDER must match MIN_ORDER"
+#endif
+
+/*
+ * Per-CPU caches of small blocks
+ *
+ * Each CPU has a magazine (a LIFO stack of free blocks) for each
+ * small size class.  A cached block is still allocated as far as 
+ * the buddy allocator is concerned, but its page map entry is 
+ * flagged PMAP_CACHED so that the GC support functions treat it 
+ * as free.  While cached, the first word of the block points to
+ * its zone.
+ *
+ * A magazine is only ever touched by its own CPU with interrupts
+ * off, so no locks are needed.  Zone locks are only taken when a
+ * magazine is refilled or drained, and then once per batch.
+ */
 
-  return 0;
+#define CACHED_ZONE(b) (*(struct mem_region **)(b))
+
+static inline struct kmem_data *cache_local_kmem(void)
+{
+    return &(nk_get_nautilus_info()->sys.cpus[my_cpu_id()]->kmem);
 }
 
-static inline uint64_t block_hash_hash(const void *ptr)
+static inline struct kmem_cache_mag *cache_mag(struct kmem_data *k, uint64_t order)
 {
-  uint64_t n = ((uint64_t) ptr)>>MIN_ORDER;
+    return &k->mags[order-KMEM_CACHE_MIN_ORDER];
+}
 
-  n =  n ^ (n>>1) ^ (n<<2) ^ (n>>3) ^ (n<<5) ^ (n>>7)
-    ^ (n<<11) ^ (n>>13) ^ (n<<17) ^ (n>>19) ^ (n<<23) 
-    ^ (n>>29) ^ (n<<31) ^ (n>>37) ^ (n<<41) ^ (n>>43)
-    ^ (n<<47) ^ (n<<53) ^ (n>>59) ^ (n<<61);
+// return a cached block to its zone - interrupts must be off
+static void cache_release_block(void *block, uint64_t order)
+{
+    struct mem_region *region = CACHED_ZONE(block);
+    struct buddy_mempool *zone = region->mm_state;
 
-  n = n % block_hash_num_entries;
+    *pmap_entry(region,block) = 0;
 
-  KMEM_DEBUG("hash of %p returns 0x%lx\n",ptr, n);
-  
-  return n;
+    spin_lock(&zone->lock);
+    kmem_bytes_allocated -= (1UL << order);
+    buddy_free(zone, block, order);
+    spin_unlock(&zone->lock);
 }
-    
-static inline struct kmem_block_hdr * block_hash_find_entry(const void *ptr)
+
+// drain the n oldest blocks of a magazine - interrupts must be off
+static void cache_drain_mag(struct kmem_data *k, uint64_t order, uint64_t n)
 {
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
-  
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (block_hash_entries[i].order>=MIN_ORDER && block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", i-start+1);
-      return &block_hash_entries[i];
+    struct kmem_cache_mag *mag = cache_mag(k,order);
+    uint64_t i;
+
+    if (n > mag->count) {
+	n = mag->count;
     }
-  }
-  for (i=0;i<start;i++) { 
-    if (block_hash_entries[i].order>=MIN_ORDER && block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
+
+    for (i=0;i<n;i++) {
+	cache_release_block(mag->blocks[i],order);
     }
-  }
-  return 0;
+
+    memmove(&mag->blocks[0], &mag->blocks[n], (mag->count-n)*sizeof(void*));
+    mag->count -= n;
+    k->cache_drains += n;
 }
 
-static inline struct kmem_block_hdr * block_hash_alloc(void *ptr)
+// Refill an empty magazine with a batch of blocks from the first
+// zone in affinity order that can supply any.  One block is handed
+// back for the caller's use.  Interrupts must be off.
+static void *cache_refill(struct kmem_data *k, uint64_t order)
 {
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
-  
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", i-start+1);
-      return &block_hash_entries[i];
-    }
-  }
-  for (i=0;i<start;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
+    struct kmem_cache_mag *mag = cache_mag(k,order);
+    struct mem_reg_entry *reg = NULL;
+    void *blocks[KMEM_CACHE_BATCH];
+    uint64_t i, n = 0;
+
+    list_for_each_entry(reg, &(k->ordered_regions), mem_ent) {
+	struct buddy_mempool *zone = reg->mem->mm_state;
+
+	spin_lock(&zone->lock);
+	while (n<KMEM_CACHE_BATCH && (blocks[n] = buddy_alloc(zone,order))) {
+	    n++;
+	}
+	kmem_bytes_allocated += n << order;
+	spin_unlock(&zone->lock);
+
+	if (!n) {
+	    continue;
+	}
+
+	*pmap_entry(reg->mem,blocks[0]) = order;
+
+	for (i=1;i<n;i++) {
+	    CACHED_ZONE(blocks[i]) = reg->mem;
+	    *pmap_entry(reg->mem,blocks[i]) = order | PMAP_CACHED;
+	    mag->blocks[mag->count++] = blocks[i];
+	}
+
+	return blocks[0];
     }
-  }
-  return 0;
+
+    return 0;
 }
 
-static inline void block_hash_free_entry(struct kmem_block_hdr *b)
+// cpu<0 => any cpu is fine, otherwise only serve if it is the local cpu
+static void *cache_alloc(int cpu, uint64_t order)
 {
-  b->addr = 0;
-  b->zone = 0;
-  b->flags = 0;
-  __sync_fetch_and_and (&b->order,0);
+    uint8_t flags = irq_disable_save();
+    struct kmem_data *k;
+    struct kmem_cache_mag *mag;
+    void *block;
+
+    if (cpu>=0 && cpu!=my_cpu_id()) {
+	irq_enable_restore(flags);
+	return 0;
+    }
+
+    k = cache_local_kmem();
+    mag = cache_mag(k,order);
+
+    if (mag->count) {
+	block = mag->blocks[--mag->count];
+	*pmap_entry(CACHED_ZONE(block),block) = order;
+	k->cache_alloc_hits++;
+    } else {
+	block = cache_refill(k,order);
+	k->cache_alloc_misses++;
+    }
+
+    irq_enable_restore(flags);
+
+    return block;
 }
 
-static inline int block_hash_free(void *ptr)
+// returns nonzero if the block is already cached (a double free)
+static int cache_free(void *block, struct mem_region *region, uint8_t *entry, uint8_t e)
 {
-  struct kmem_block_hdr *b = block_hash_find_entry(ptr);
+    uint64_t order = e & PMAP_ORDER_MASK;
+    uint8_t flags = irq_disable_save();
+    struct kmem_data *k = cache_local_kmem();
+    struct kmem_cache_mag *mag = cache_mag(k,order);
+
+    // claim the block, which fails on a racing double free
+    if (!__sync_bool_compare_and_swap(entry, e, order | PMAP_CACHED)) {
+	irq_enable_restore(flags);
+	return -1;
+    }
+
+    if (mag->count == KMEM_CACHE_MAG_SIZE) {
+	cache_drain_mag(k,order,KMEM_CACHE_BATCH);
+    }
+
+    CACHED_ZONE(block) = region;
+    mag->blocks[mag->count++] = block;
+    k->cache_free_hits++;
+
+    irq_enable_restore(flags);
 
-  if (!b) { 
-    return -1;
-  } else {
-    block_hash_free_entry(b);
     return 0;
-  }
 }
 
+#endif
+
+void kmem_cache_drain_local(void)
+{
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    uint8_t flags = irq_disable_save();
+    struct kmem_data *k = cache_local_kmem();
+    uint64_t i;
+
+    for (i=KMEM_CACHE_MIN_ORDER;i<=KMEM_CACHE_MAX_ORDER;i++) {
+	cache_drain_mag(k,i,KMEM_CACHE_MAG_SIZE);
+    }
+
+    irq_enable_restore(flags);
+#endif
+}
 
 struct mem_region *
 kmem_get_base_zone (void)
@@ -299,6 +380,23 @@ create_zone (struct mem_region * region)
             region->domain_id);
     }
 
+    /* allocate the zone's page map, one byte per minimum-sized block */
+    region->mm_pmap = mm_boot_alloc((region->len + (1UL << MIN_ORDER) - 1) >> MIN_ORDER);
+    if (!region->mm_pmap) {
+        KMEM_ERROR("Could not allocate page map for region at %p\n", region->base_addr);
+        return NULL;
+    }
+    memset(region->mm_pmap, 0, (region->len + (1UL << MIN_ORDER) - 1) >> MIN_ORDER);
+
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+    region->mm_zero = mm_boot_alloc(sizeof(struct kmem_zero_pool));
+    if (!region->mm_zero) {
+        KMEM_ERROR("Could not allocate zero pool for region at %p\n", region->base_addr);
+        return NULL;
+    }
+    memset(region->mm_zero, 0, sizeof(struct kmem_zero_pool));
+#endif
+
     /* add this region to the global region list */
     list_add(&(region->glob_link), &glob_zone_list);
 
@@ -451,12 +549,6 @@ nk_kmem_init (void)
 
     KMEM_PRINT("Malloc configured to support a maximum of: 0x%lx bytes of physical memory\n", total_phys_mem);
 
-    if (block_hash_init(total_phys_mem)) { 
-      KMEM_ERROR("Failed to initialize block hash\n");
-      return -1;
-    }
-
-
     // the assumption here is that no further boot_mm allocations will
     // be made by kmem from this point on
     kmem_private_end = boot_mm_get_cur_top();
@@ -481,6 +573,562 @@ void kmem_inform_boot_allocation(void *low, void *high)
 }
 
 
+// account a successful allocation to the local CPU - not atomic, 
+// so the counts are approximate, which is fine for stats
+static inline void kmem_count(uint64_t requested, uint64_t granted)
+{
+    struct kmem_data *k = &(nk_get_nautilus_info()->sys.cpus[my_cpu_id()]->kmem);
+
+    k->bytes_requested += requested;
+    k->bytes_granted += granted;
+}
+
+// mask of the domain ids that exist (and fit in a nodemask)
+static inline uint64_t domains_present(void)
+{
+    unsigned n = nk_get_num_domains();
+
+    return n>=64 ? KMEM_NODEMASK_ALL : (1ULL<<n)-1;
+}
+
+static inline int region_in_mask(struct mem_region *mem, uint64_t mask)
+{
+    return mem->domain_id<64 && ((mask>>mem->domain_id) & 0x1);
+}
+
+static uint64_t interleave_count;
+
+// pick the next domain of the mask in round-robin order
+static uint64_t interleave_next(uint64_t mask)
+{
+    uint64_t n = __sync_fetch_and_add(&interleave_count,1) % __builtin_popcountl(mask);
+
+    while (n--) {
+	mask &= mask-1;   // drop the lowest domain
+    }
+
+    return mask & -mask;
+}
+
+// Translate a policy into the sequence of domain masks that
+// the region scan tries in turn.  Returns the number of passes.
+static int policy_masks(int policy, uint64_t nodemask, uint64_t masks[2])
+{
+    nodemask &= domains_present();
+
+    if (!nodemask) {
+	// nothing usable in the mask - behave as the default
+	// policy, except for bind which must fail
+	if (policy==KMEM_POLICY_BIND) {
+	    return 0;
+	}
+	masks[0] = KMEM_NODEMASK_ALL;
+	return 1;
+    }
+
+    switch (policy) {
+    case KMEM_POLICY_PREFERRED:
+	masks[0] = nodemask;
+	masks[1] = KMEM_NODEMASK_ALL;
+	return 2;
+    case KMEM_POLICY_BIND:
+	masks[0] = nodemask;
+	return 1;
+    case KMEM_POLICY_INTERLEAVE:
+	masks[0] = interleave_next(nodemask);
+	masks[1] = nodemask;
+	return 2;
+    default:
+	masks[0] = KMEM_NODEMASK_ALL;
+	return 1;
+    }
+}
+
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+
+/*
+ * Pre-zeroed pools
+ *
+ * Each zone keeps up to KMEM_ZERO_POOL_BLOCKS free blocks of each
+ * order from 4 KB to 2 MB that have already been zeroed, so that
+ * a zeroed allocation of one of these sizes can skip its memset.
+ * Idle CPUs refill the pools of their own domain, using non-temporal
+ * stores so that zeroing does not evict the cache.  Like a block in
+ * a per-CPU cache, a pooled block is still allocated as far as the 
+ * buddy allocator is concerned, and its page map entry is flagged 
+ * PMAP_CACHED.  A pool is linked through the first word of each 
+ * block, which is cleared again when the block is handed out.  The
+ * zone lock protects the pool.
+ */
+
+#define ZERO_NEXT(b) (*(void **)(b))
+
+static inline int zero_pool_order(uint64_t order)
+{
+    return order >= KMEM_ZERO_MIN_ORDER && order <= KMEM_ZERO_MAX_ORDER;
+}
+
+// caller holds the zone lock
+static void *zero_pool_get(struct mem_region *region, uint64_t order)
+{
+    struct kmem_zero_pool *zp = region->mm_zero;
+    uint64_t i = order - KMEM_ZERO_MIN_ORDER;
+    void *block = zp->head[i];
+
+    if (block) {
+	zp->head[i] = ZERO_NEXT(block);
+	zp->count[i]--;
+	ZERO_NEXT(block) = 0;
+	*pmap_entry(region,block) = order;
+    }
+
+    return block;
+}
+
+// caller holds the zone lock
+static void zero_pool_put(struct mem_region *region, void *block, uint64_t order)
+{
+    struct kmem_zero_pool *zp = region->mm_zero;
+    uint64_t i = order - KMEM_ZERO_MIN_ORDER;
+
+    ZERO_NEXT(block) = zp->head[i];
+    zp->head[i] = block;
+    zp->count[i]++;
+}
+
+// return every pooled block to the buddy zones
+static void zero_pool_drain(void)
+{
+    struct mem_region *region;
+    uint64_t i;
+    void *block;
+
+    list_for_each_entry(region, &glob_zone_list, glob_link) {
+	struct buddy_mempool *zone = region->mm_state;
+	uint8_t flags = spin_lock_irq_save(&zone->lock);
+	for (i=KMEM_ZERO_MIN_ORDER;i<=KMEM_ZERO_MAX_ORDER;i++) {
+	    while ((block = zero_pool_get(region,i))) {
+		*pmap_entry(region,block) = 0;
+		buddy_free(zone,block,i);
+	    }
+	}
+	spin_unlock_irq_restore(&zone->lock, flags);
+    }
+}
+
+static void zero_nt(void *addr, uint64_t len)
+{
+    uint64_t *p = addr;
+    uint64_t *end = addr + len;
+
+    for (; p < end; p += 4) {
+	__asm__ __volatile__ ("movnti %1, 0(%0)\n\t"
+			      "movnti %1, 8(%0)\n\t"
+			      "movnti %1, 16(%0)\n\t"
+			      "movnti %1, 24(%0)\n\t"
+			      : : "r"(p), "r"(0UL) : "memory");
+    }
+
+    __asm__ __volatile__ ("sfence" : : : "memory");
+}
+
+int kmem_zero_pool_fill(void)
+{
+    struct kmem_data *my_kmem = &(nk_get_nautilus_info()->sys.cpus[my_cpu_id()]->kmem);
+    unsigned my_domain = nk_my_numa_node();
+    struct mem_reg_entry *reg;
+    uint64_t order;
+    void *block;
+
+    list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
+	struct mem_region *region = reg->mem;
+	struct buddy_mempool *zone = region->mm_state;
+	struct kmem_zero_pool *zp = region->mm_zero;
+
+	if (region->domain_id != my_domain) {
+	    // leave remote zones to their own CPUs
+	    continue;
+	}
+
+	for (order=KMEM_ZERO_MIN_ORDER;order<=KMEM_ZERO_MAX_ORDER;order++) {
+	    if (zp->count[order-KMEM_ZERO_MIN_ORDER] >= NAUT_CONFIG_KMEM_ZERO_POOL_BLOCKS) {
+		continue;
+	    }
+
+	    uint8_t flags = spin_lock_irq_save(&zone->lock);
+	    if ((block = buddy_alloc(zone,order))) {
+		*pmap_entry(region,block) = order | PMAP_CACHED;
+	    }
+	    spin_unlock_irq_restore(&zone->lock, flags);
+
+	    if (!block) {
+		// the zone is short of memory, so leave it alone
+		break;
+	    }
+
+	    // zero without the lock held
+	    zero_nt(block, 1UL << order);
+
+	    flags = spin_lock_irq_save(&zone->lock);
+	    zero_pool_put(region,block,order);
+	    spin_unlock_irq_restore(&zone->lock, flags);
+
+	    my_kmem->zero_fills++;
+
+	    return 1;
+	}
+    }
+
+    return 0;
+}
+
+#else
+
+int kmem_zero_pool_fill(void)
+{
+    return 0;
+}
+
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+static void kmem_cache_drain_xcall(void *arg)
+{
+    kmem_cache_drain_local();
+}
+
+// Drain the magazines of every CPU, returning how many could not be.
+// Other CPUs can only be waited on from an interruptible thread, so
+// otherwise only the local magazines are drained.
+static int kmem_cache_drain_all(void)
+{
+    int i, failed = 0;
+
+    if (!cpu_info_ready || !irqs_enabled() || in_interrupt_context()) {
+	kmem_cache_drain_local();
+	return 0;
+    }
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	if (smp_xcall(i,kmem_cache_drain_xcall,0,1)) {
+	    failed++;
+	}
+    }
+
+    return failed;
+}
+#endif
+
+// get memory back from wherever it is parked before failing an allocation
+static void kmem_reclaim(void)
+{
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    kmem_cache_drain_all();
+#endif
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+    zero_pool_drain();
+#endif
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+    nk_stack_pool_drain();
+#endif
+    nk_sched_reap(1);
+}
+
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+
+/*
+ * Large blocks
+ *
+ * A large block is an exact multiple of the page size rather than a
+ * power of two.  It is carved from a buddy block of the next power
+ * of two, whose tail is given straight back, or, failing that, from
+ * a block of half that size and the free memory just after it.  To
+ * the buddy allocator a large block is simply a range of allocated
+ * memory.  Its page map records the order of the largest aligned
+ * block at its head, with PMAP_LARGE in the following entry, and 
+ * nothing for the rest.  The exact length is kept in a descriptor
+ * in large_tree, ordered by address, so that finding the block that
+ * contains an address - which the GC support functions do for nearly
+ * every word they look at - takes O(log n) rather than a walk of
+ * every large block.
+ */
+
+struct kmem_large {
+    void              *addr;
+    uint64_t           len;        // bytes held, a multiple of the page size
+    uint64_t           requested;  // bytes asked for
+    struct mem_region *region;
+    struct rb_node     node;
+};
+
+static struct rb_root large_tree = RB_ROOT;
+static spinlock_t large_lock;
+
+#define LARGE_ALIGN        PAGE_SIZE_4KB
+#define LARGE_LEN(s)       (((s) + LARGE_ALIGN - 1) & ~(LARGE_ALIGN - 1))
+#define IS_LARGE(s,order)  ((order) > KMEM_LARGE_MIN_ORDER && (s) != (1UL << (order)))
+
+// a large block's head is always bigger than the minimum block, so
+// its second page map entry is its own
+static inline int is_large(struct mem_region *region, void *block)
+{
+    uint8_t *entry = pmap_entry(region,block);
+
+    return (entry[0] & PMAP_ORDER_MASK) > MIN_ORDER && entry[1] == PMAP_LARGE;
+}
+
+// order of the largest aligned block at the start of [block,block+len)
+static inline uint64_t large_head_order(struct mem_region *region, void *block, uint64_t len)
+{
+    addr_t off = (addr_t)block - region->mm_state->base_addr;
+    uint64_t order = ilog2(len);
+
+    if (off && __builtin_ctzl(off) < order) {
+	order = __builtin_ctzl(off);
+    }
+
+    return order;
+}
+
+static inline void large_mark(struct mem_region *region, void *block, uint64_t len)
+{
+    uint8_t *entry = pmap_entry(region,block);
+
+    // keep any user flags
+    entry[0] = (entry[0] & ~PMAP_ORDER_MASK) | large_head_order(region,block,len);
+    entry[1] = PMAP_LARGE;
+}
+
+// caller holds large_lock
+static void large_insert(struct kmem_large *l)
+{
+    struct rb_node **link = &large_tree.rb_node, *parent = 0;
+
+    while (*link) {
+	parent = *link;
+	if (l->addr < rb_entry(parent, struct kmem_large, node)->addr) {
+	    link = &parent->rb_left;
+	} else {
+	    link = &parent->rb_right;
+	}
+    }
+
+    rb_link_node(&l->node, parent, link);
+    nk_rb_insert_color(&l->node, &large_tree);
+}
+
+// the large block with the highest address at or below addr -
+// caller holds large_lock
+static struct kmem_large *large_floor(void *addr)
+{
+    struct rb_node *n = large_tree.rb_node;
+    struct kmem_large *best = 0;
+
+    while (n) {
+	struct kmem_large *l = rb_entry(n, struct kmem_large, node);
+	if (addr < l->addr) {
+	    n = n->rb_left;
+	} else {
+	    best = l;
+	    n = n->rb_right;
+	}
+    }
+
+    return best;
+}
+
+// find the descriptor of a large block, optionally unlinking it
+static struct kmem_large *large_find(void *addr, int remove)
+{
+    struct kmem_large *l;
+    uint8_t flags = spin_lock_irq_save(&large_lock);
+
+    if ((l = large_floor(addr)) && l->addr == addr) {
+	if (remove) {
+	    nk_rb_erase(&l->node, &large_tree);
+	}
+    } else {
+	l = 0;
+    }
+
+    spin_unlock_irq_restore(&large_lock, flags);
+    return l;
+}
+
+// find the large block, if any, that contains addr
+static struct kmem_large *large_find_containing(void *addr)
+{
+    struct kmem_large *l;
+    uint8_t flags;
+
+    // the common case for a GC, and no lock needed to see it
+    if (RB_EMPTY_ROOT(&large_tree)) {
+	return 0;
+    }
+
+    flags = spin_lock_irq_save(&large_lock);
+
+    if ((l = large_floor(addr)) && addr >= l->addr + l->len) {
+	l = 0;
+    }
+
+    spin_unlock_irq_restore(&large_lock, flags);
+    return l;
+}
+
+// carve len bytes from a zone - caller holds the zone lock
+static void *large_carve(struct buddy_mempool *zone, uint64_t len)
+{
+    uint64_t order = ilog2(roundup_pow_of_two(len));
+    void *block;
+
+    if ((block = buddy_alloc(zone, order))) {
+	buddy_free_range(zone, block + len, (1UL << order) - len);
+	return block;
+    }
+
+    // no block big enough, so try half of one plus what follows it
+    if ((block = buddy_alloc(zone, order-1))) {
+	if (!buddy_claim_range(zone, block + (1UL << (order-1)), len - (1UL << (order-1)))) {
+	    return block;
+	}
+	buddy_free(zone, block, order-1);
+    }
+
+    return 0;
+}
+
+static void *large_alloc(struct kmem_data *my_kmem, size_t size, uint64_t masks[2], int num_passes)
+{
+    uint64_t len = LARGE_LEN(size);
+    struct mem_reg_entry *reg;
+    struct kmem_large *l;
+    void *block = 0;
+    int pass;
+
+    if (!(l = kmem_malloc_specific(sizeof(*l),my_cpu_id(),0))) {
+	return 0;
+    }
+
+    for (pass=0; !block && pass<num_passes; pass++) {
+	list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
+	    struct buddy_mempool *zone = reg->mem->mm_state;
+
+	    if (!region_in_mask(reg->mem, masks[pass])) {
+		continue;
+	    }
+
+	    uint8_t flags = spin_lock_irq_save(&zone->lock);
+	    block = large_carve(zone, len);
+	    if (block) {
+		kmem_bytes_allocated += len;
+	    }
+	    spin_unlock_irq_restore(&zone->lock, flags);
+
+	    if (block) {
+		l->addr = block;
+		l->len = len;
+		l->requested = size;
+		l->region = reg->mem;
+		large_mark(reg->mem, block, len);
+		break;
+	    }
+	}
+    }
+
+    if (!block) {
+	kmem_free(l);
+	return 0;
+    }
+
+    uint8_t flags = spin_lock_irq_save(&large_lock);
+    large_insert(l);
+    spin_unlock_irq_restore(&large_lock, flags);
+
+    KMEM_DEBUG("large malloc succeeded: size %lu len %lu -> %p\n", size, len, block);
+
+    return block;
+}
+
+static void large_free(struct mem_region *region, void *addr)
+{
+    struct buddy_mempool *zone = region->mm_state;
+    struct kmem_large *l;
+    uint8_t *entry = pmap_entry(region,addr);
+
+    // unlinking the descriptor claims the block
+    if (!(l = large_find(addr,1))) {
+	KMEM_ERROR("Likely double free of large block ignored - addr=%p\n", addr);
+	BACKTRACE(KMEM_ERROR,3);
+	return;
+    }
+
+    entry[0] = 0;
+    entry[1] = 0;
+
+    uint8_t flags = spin_lock_irq_save(&zone->lock);
+    kmem_bytes_allocated -= l->len;
+    buddy_free_range(zone, addr, l->len);
+    spin_unlock_irq_restore(&zone->lock, flags);
+
+    KMEM_DEBUG("large free succeeded: addr=%p len=%lu\n", addr, l->len);
+
+    kmem_free(l);
+}
+
+// resize a large block in place, returns nonzero if it cannot be
+static int large_resize(struct mem_region *region, void *addr, size_t size)
+{
+    struct buddy_mempool *zone = region->mm_state;
+    struct kmem_large *l;
+    uint64_t len = LARGE_LEN(size);
+    int rc = 0;
+
+    if (!(l = large_find(addr,0))) {
+	return -1;
+    }
+
+    uint8_t flags = spin_lock_irq_save(&zone->lock);
+    if (len < l->len) {
+	buddy_free_range(zone, addr + len, l->len - len);
+	kmem_bytes_allocated -= l->len - len;
+    } else if (len > l->len) {
+	if (addr + len > (void*)zone->base_addr + region->len ||
+	    buddy_claim_range(zone, addr + l->len, len - l->len)) {
+	    rc = -1;
+	} else {
+	    kmem_bytes_allocated += len - l->len;
+	}
+    }
+    spin_unlock_irq_restore(&zone->lock, flags);
+
+    if (!rc) {
+	KMEM_DEBUG("large realloc in place: addr=%p len %lu -> %lu\n", addr, l->len, len);
+	l->len = len;
+	l->requested = size;
+	large_mark(region, addr, len);
+    }
+
+    return rc;
+}
+
+static void large_stats(struct kmem_stats *stats)
+{
+    struct rb_node *n;
+    uint8_t flags = spin_lock_irq_save(&large_lock);
+
+    for (n = nk_rb_first(&large_tree); n; n = nk_rb_next(n)) {
+	struct kmem_large *l = rb_entry(n, struct kmem_large, node);
+	stats->large_blocks++;
+	stats->large_bytes += l->len;
+	stats->large_slack += l->len - l->requested;
+    }
+
+    spin_unlock_irq_restore(&large_lock, flags);
+}
+
+#endif
+
 /**
  * Allocates memory from the kernel memory pool. This will return a memory
  * region that is at least 16-byte aligned. The memory returned is 
@@ -490,21 +1138,25 @@ void kmem_inform_boot_allocation(void *low, void *high)
  *       [IN] size: Amount of memory to allocate in bytes.
  *       [IN] cpu:  affinity cpu (-1 => current cpu)
  *       [IN] zero: Whether to zero the whole allocated block
+ *       [IN] policy: NUMA placement policy (KMEM_POLICY_*)
+ *       [IN] nodemask: domains the policy applies to
  *
  * Returns:
  *       Success: Pointer to the start of the allocated memory.
  *       Failure: NULL
  */
 static void *
-_kmem_malloc (size_t size, int cpu, int zero)
+_kmem_malloc (size_t size, int cpu, int zero, int policy, uint64_t nodemask)
 {
     NK_GPIO_OUTPUT_MASK(0x20,GPIO_OR);
     int first = 1;
     void *block = 0;
-    struct kmem_block_hdr *hdr = NULL;
     struct mem_reg_entry * reg = NULL;
     ulong_t order;
     cpu_id_t my_id;
+    uint64_t masks[2];
+    int pass, num_passes;
+    int zeroed = 0;
 
     if (cpu<0 || cpu>= nk_get_num_cpus()) {
 	my_id = my_cpu_id();
@@ -530,46 +1182,78 @@ _kmem_malloc (size_t size, int cpu, int zero)
         order = MIN_ORDER;
     }
 
+    num_passes = policy_masks(policy, nodemask, masks);
+
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+    if (IS_LARGE(size,order)) {
+	if (!(block = large_alloc(my_kmem, size, masks, num_passes))) {
+	    KMEM_DEBUG("large malloc initially failed for size %lu attempting reap\n",size);
+	    kmem_reclaim();
+	    block = large_alloc(my_kmem, size, masks, num_passes);
+	}
+	if (block) {
+	    kmem_count(size, LARGE_LEN(size));
+	    if (zero) {
+		memset(block,0,LARGE_LEN(size));
+	    }
+	}
+	NK_GPIO_OUTPUT_MASK(~0x20,GPIO_AND);
+	return block;
+    }
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    // the per-CPU caches hold blocks from any domain, so they
+    // can only serve the default policy
+    if (policy==KMEM_POLICY_DEFAULT && order <= KMEM_CACHE_MAX_ORDER) {
+	block = cache_alloc(cpu<0 || cpu>=nk_get_num_cpus() ? -1 : cpu, order);
+	if (block) {
+	    KMEM_DEBUG("malloc succeeded from cache: size %lu order %lu -> 0x%lx\n",size, order, block);
+	    goto out;
+	}
+    }
+#endif
+
  retry:
 
-    /* scan the blocks in order of affinity */
-    list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
-        struct buddy_mempool * zone = reg->mem->mm_state;
+    /* scan the blocks in order of affinity, restricted to the
+       domains each pass of the policy allows */
+    for (pass=0; !block && pass<num_passes; pass++) {
+	list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
+	    struct buddy_mempool * zone = reg->mem->mm_state;
 
-        /* Allocate memory from the underlying buddy system */
-        uint8_t flags = spin_lock_irq_save(&zone->lock);
-        block = buddy_alloc(zone, order);
-        spin_unlock_irq_restore(&zone->lock, flags);
+	    if (!region_in_mask(reg->mem, masks[pass])) {
+		continue;
+	    }
 
-	if (block) {
-	  hdr = block_hash_alloc(block);
-	  if (!hdr) {
-            KMEM_DEBUG("malloc cannot allocate header, releasing block\n");
-	    flags = spin_lock_irq_save(&zone->lock);
-	    buddy_free(zone,block,order);
+	    /* Allocate memory from the underlying buddy system, or
+	       from the zone's pre-zeroed blocks if we need zeroing */
+	    uint8_t flags = spin_lock_irq_save(&zone->lock);
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+	    if (zero && zero_pool_order(order) && (block = zero_pool_get(reg->mem, order))) {
+		zeroed = 1;
+		spin_unlock_irq_restore(&zone->lock, flags);
+		break;
+	    }
+#endif
+	    block = buddy_alloc(zone, order);
 	    spin_unlock_irq_restore(&zone->lock, flags);
-	    block=0;
-	  }
-	}
 
-        if (hdr) {
-	    hdr->addr = block;
-            hdr->zone = zone;
-	    // force a software barrier here, since our next write must come last
-	    __asm__ __volatile__ ("" :::"memory");
-	    hdr->order = order; // allocation complete
-            break;
-        }
-        
+	    if (block) {
+		// record the block in the page map (allocation complete)
+		*pmap_entry(reg->mem, block) = order;
+		break;
+	    }
+	}
     }
 
-    if (hdr) {
+    if (block) {
         kmem_bytes_allocated += (1UL << order);
     } else {
 	// attempt to get memory back by reaping threads now...
 	if (first) {
 	    KMEM_DEBUG("malloc initially failed for size %lu order %lu attempting reap\n",size,order);
-	    nk_sched_reap(1);
+	    kmem_reclaim();
 	    first=0;
 	    goto retry;
 	}
@@ -579,9 +1263,25 @@ _kmem_malloc (size_t size, int cpu, int zero)
     }
 
     KMEM_DEBUG("malloc succeeded: size %lu order %lu -> 0x%lx\n",size, order, block);
- 
-    if (zero) { 
-	memset(block,0,1ULL << hdr->order);
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+ out:
+#endif
+    kmem_count(size, 1ULL << order);
+
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+    if (zero && zero_pool_order(order)) {
+	struct kmem_data *k = &(nk_get_nautilus_info()->sys.cpus[my_cpu_id()]->kmem);
+	if (zeroed) {
+	    k->zero_hits++;
+	} else {
+	    k->zero_misses++;
+	}
+    }
+#endif
+
+    if (zero && !zeroed) { 
+	memset(block,0,1ULL << order);
     }
      
 #if SANITY_CHECK_PER_OP
@@ -598,19 +1298,94 @@ _kmem_malloc (size_t size, int cpu, int zero)
 }
 
 
+// the calling thread's default policy, if there is a thread yet
+static inline void thread_policy(int *policy, uint64_t *nodemask)
+{
+    struct nk_thread *t = get_cur_thread();
+
+    if (t) {
+	*policy = t->kmem_policy;
+	*nodemask = t->kmem_nodemask;
+    } else {
+	*policy = KMEM_POLICY_DEFAULT;
+	*nodemask = KMEM_NODEMASK_ALL;
+    }
+}
+
 void *kmem_malloc(size_t size)
 {
-    return _kmem_malloc(size,-1,0);
+    int policy;
+    uint64_t nodemask;
+
+    thread_policy(&policy,&nodemask);
+
+    return _kmem_malloc(size,-1,0,policy,nodemask);
 }
 
 void *kmem_mallocz(size_t size)
 {
-    return _kmem_malloc(size,-1,1);
+    int policy;
+    uint64_t nodemask;
+
+    thread_policy(&policy,&nodemask);
+
+    return _kmem_malloc(size,-1,1,policy,nodemask);
 }
 
+// an explicit cpu overrides the thread's policy
 void *kmem_malloc_specific(size_t size, int cpu, int zero)
 {
-    return _kmem_malloc(size,cpu,zero);
+    int policy;
+    uint64_t nodemask;
+
+    if (cpu<0 || cpu>=nk_get_num_cpus()) {
+	thread_policy(&policy,&nodemask);
+    } else {
+	policy = KMEM_POLICY_DEFAULT;
+	nodemask = KMEM_NODEMASK_ALL;
+    }
+
+    return _kmem_malloc(size,cpu,zero,policy,nodemask);
+}
+
+void *kmem_malloc_policy(size_t size, int policy, uint64_t nodemask)
+{
+    if (policy<KMEM_POLICY_DEFAULT || policy>KMEM_POLICY_INTERLEAVE) {
+	KMEM_ERROR("Unknown allocation policy %d\n",policy);
+	return 0;
+    }
+
+    return _kmem_malloc(size,-1,0,policy,nodemask);
+}
+
+int kmem_set_thread_policy(int policy, uint64_t nodemask)
+{
+    struct nk_thread *t = get_cur_thread();
+
+    if (!t) {
+	KMEM_ERROR("No current thread to set policy on\n");
+	return -1;
+    }
+
+    if (policy<KMEM_POLICY_DEFAULT || policy>KMEM_POLICY_INTERLEAVE) {
+	KMEM_ERROR("Unknown allocation policy %d\n",policy);
+	return -1;
+    }
+
+    if (policy!=KMEM_POLICY_DEFAULT && !(nodemask & domains_present())) {
+	KMEM_ERROR("Nodemask 0x%lx names no existing domain\n",nodemask);
+	return -1;
+    }
+
+    t->kmem_policy = policy;
+    t->kmem_nodemask = nodemask;
+
+    return 0;
+}
+
+void kmem_get_thread_policy(int *policy, uint64_t *nodemask)
+{
+    thread_policy(policy,nodemask);
 }
 
 /**
@@ -619,16 +1394,17 @@ void *kmem_malloc_specific(size_t size, int cpu, int zero)
  * Arguments:
  *       [IN] addr: Address of the memory region to free.
  *
- * NOTE: The size of the memory region being freed is assumed to be in a
- *       'struct kmem_block_hdr' header located immediately before the address
- *       passed in by the caller. This header is created and initialized by
- *       kmem_alloc().
+ * NOTE: The size of the memory region being freed is found in the
+ *       page map entry of the zone it belongs to.   This entry is
+ *       created by kmem_alloc().
  */
 void
 kmem_free (void * addr)
 {
-    struct kmem_block_hdr *hdr;
+    struct mem_region * region;
     struct buddy_mempool * zone;
+    uint8_t *entry;
+    uint8_t e;
     uint64_t order;
 
     KMEM_DEBUG("free of address %p from:\n", addr);
@@ -646,32 +1422,53 @@ kmem_free (void * addr)
     }
 
 
-    // Note that if the user is doing a double-free, it is possible
-    // that we race on the block hash entry and so could end up invoking
-    // the buddy free more than once
-
-    hdr = block_hash_find_entry(addr);
+    region = zone_of(addr);
 
-    if (!hdr) { 
-      KMEM_ERROR("Failed to find entry for block %p in kmem_free()\n",addr);
+    if (!region || ((addr_t)addr & ((1UL << MIN_ORDER) - 1))) { 
+      KMEM_ERROR("Address %p in kmem_free() is not a kmem block\n",addr);
       KMEM_ERROR_BACKTRACE();
       return;
     }
 
-    zone = hdr->zone;
-    order = hdr->order;
+    zone = region->mm_state;
+    entry = pmap_entry(region, addr);
+    e = *entry;
+    order = e & PMAP_ORDER_MASK;
 
     // Sanity check things here
-    // this will in some cases catch a double free that is causing a
-    // race on the header
-    if (!zone || order<MIN_ORDER) {
-	KMEM_ERROR("Likely double free ignored- addr=%p, zone=%p order=%lu, hdr=%p, hdr->addr=%p, hdr->order=%lu\n", addr,zone, order, hdr,hdr->addr,hdr->order);
+    // this will catch most double frees
+    if (order<MIN_ORDER || (e & PMAP_CACHED)) {
+	KMEM_ERROR("Likely double free ignored- addr=%p, zone=%p entry=0x%x\n", addr, zone, e);
 	BACKTRACE(KMEM_ERROR,3);
-	// avoid freeing the header a second time
-	// block_hash_free_entry(hdr);
 	return;
     }
 
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+    if (is_large(region,addr)) {
+	large_free(region,addr);
+	return;
+    }
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    if (order <= KMEM_CACHE_MAX_ORDER) {
+	if (cache_free(addr,region,entry,e)) {
+	    KMEM_ERROR("Racing double free ignored - addr=%p, zone=%p order=%lu\n", addr, zone, order);
+	    BACKTRACE(KMEM_ERROR,3);
+	} else {
+	    KMEM_DEBUG("free succeeded to cache: addr=0x%lx order=%lu\n",addr,order);
+	}
+	return;
+    }
+#endif
+
+    // Claim the entry - if the user is doing a double free, only 
+    // one of the racing frees will get past here
+    if (!__sync_bool_compare_and_swap(entry, e, 0)) {
+	KMEM_ERROR("Racing double free ignored - addr=%p, zone=%p order=%lu\n", addr, zone, order);
+	BACKTRACE(KMEM_ERROR,3);
+	return;
+    }
     
     /* Return block to the underlying buddy system */
     uint8_t flags = spin_lock_irq_save(&zone->lock);
@@ -679,7 +1476,6 @@ kmem_free (void * addr)
     buddy_free(zone, addr, order);
     spin_unlock_irq_restore(&zone->lock, flags);
     KMEM_DEBUG("free succeeded: addr=0x%lx order=%lu\n",addr,order);
-    block_hash_free_entry(hdr);
 
 #if SANITY_CHECK_PER_OP
     if (kmem_sanity_check()) { 
@@ -696,11 +1492,15 @@ kmem_free (void * addr)
  * malloc a new block of memory, copy as much of the old data as it can, and free the
  * old block. If ptr is NULL, this is equivalent to a malloc for the specified size.
  *
+ * A block that already fits the new size without wasting more than half of 
+ * itself is returned as is, and a large block is grown or shrunk in place 
+ * when possible.
  */
 void * 
 kmem_realloc (void * ptr, size_t size)
 {
-	struct kmem_block_hdr *hdr;
+	struct mem_region *region;
+	uint8_t e;
 	size_t old_size;
 	void * tmp = NULL;
 
@@ -709,14 +1509,33 @@ kmem_realloc (void * ptr, size_t size)
 		return kmem_malloc(size);
 	}
 
-	hdr = block_hash_find_entry(ptr);
+	region = zone_of(ptr);
+	e = region ? *pmap_entry(region, ptr) : 0;
 
-	if (!hdr) {
+	if ((e & PMAP_ORDER_MASK) < MIN_ORDER || (e & PMAP_CACHED)) {
 		KMEM_DEBUG("Realloc failed to find entry for block %p\n", ptr);
 		return NULL;
 	}
 
-	old_size = 1 << hdr->order;
+	old_size = 1ULL << (e & PMAP_ORDER_MASK);
+
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+	if (is_large(region,ptr)) {
+		if (size > (1UL << KMEM_LARGE_MIN_ORDER) && !large_resize(region,ptr,size)) {
+			return ptr;
+		}
+		struct kmem_large *l = large_find(ptr,0);
+		if (!l) {
+			KMEM_DEBUG("Realloc failed to find large block %p\n", ptr);
+			return NULL;
+		}
+		old_size = l->len;
+	} else
+#endif
+	if (size <= old_size && size > old_size/2) {
+		return ptr;
+	}
+
 	tmp = kmem_malloc(size);
 	if (!tmp) {
 		panic("Realloc failed\n");
@@ -773,6 +1592,43 @@ static uint64_t _kmem_stats(struct kmem_stats *stats, stat_type_t what)
     }
     if (what==GET) {
 	stats->total_num_pools=cur;
+	struct sys_info *si = &(nk_get_nautilus_info()->sys);
+	uint64_t c;
+	for (c=0;c<si->num_cpus;c++) {
+	    stats->bytes_requested += si->cpus[c]->kmem.bytes_requested;
+	    stats->bytes_granted += si->cpus[c]->kmem.bytes_granted;
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+	    stats->zero_hits += si->cpus[c]->kmem.zero_hits;
+	    stats->zero_misses += si->cpus[c]->kmem.zero_misses;
+	    stats->zero_fills += si->cpus[c]->kmem.zero_fills;
+#endif
+	}
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+	struct mem_region *zr;
+	list_for_each_entry(zr, &glob_zone_list, glob_link) {
+	    for (c=0;c<KMEM_ZERO_NUM_ORDERS;c++) {
+		stats->zero_bytes += zr->mm_zero->count[c] << (c+KMEM_ZERO_MIN_ORDER);
+	    }
+	}
+#endif
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+	large_stats(stats);
+#endif
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+	struct sys_info *sys = &(nk_get_nautilus_info()->sys);
+	uint64_t i, j;
+	// unsynchronized reads of other CPUs' counters, good enough for stats
+	for (i=0;i<sys->num_cpus;i++) {
+	    struct kmem_data *k = &(sys->cpus[i]->kmem);
+	    stats->cache_alloc_hits += k->cache_alloc_hits;
+	    stats->cache_alloc_misses += k->cache_alloc_misses;
+	    stats->cache_free_hits += k->cache_free_hits;
+	    stats->cache_drains += k->cache_drains;
+	    for (j=0;j<KMEM_CACHE_NUM_CLASSES;j++) {
+		stats->cache_bytes += k->mags[j].count << (j+KMEM_CACHE_MIN_ORDER);
+	    }
+	}
+#endif
     }
     return cur;
 }
@@ -813,17 +1669,44 @@ void  kmem_get_internal_pointer_range(void **start, void **end)
     *end = kmem_private_end;
 }
 
+// Scan a zone's page map for the next allocated block (that is not
+// sitting in a CPU cache) at or after index *idx.  Runs of free memory
+// are skipped a word of the page map at a time.   
+static uint8_t *pmap_next_block(struct mem_region *region, uint64_t *idx)
+{
+    uint64_t n = (region->len + (1UL << MIN_ORDER) - 1) >> MIN_ORDER;
+    uint8_t *pmap = region->mm_pmap;
+    uint64_t i = *idx;
+    uint8_t e;
+
+    while (i < n) {
+	if (!(i & 0x7) && (i+8) <= n && !*(uint64_t *)(pmap+i)) {
+	    i += 8;
+	    continue;
+	}
+	e = pmap[i];
+	if (!(e & PMAP_ORDER_MASK)) {
+	    i++;
+	} else if (e & PMAP_CACHED) {
+	    i += 1UL << ((e & PMAP_ORDER_MASK) - MIN_ORDER);
+	} else {
+	    *idx = i;
+	    return &pmap[i];
+	}
+    }
+
+    return 0;
+}
+
 int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags)
 {
-    uint64_t i;
     uint64_t order;
     addr_t   zone_base;
-    uint64_t zone_min_order;
     uint64_t zone_max_order;
     addr_t   any_offset;
     struct mem_region *reg;
 
-    if (!(reg = kmem_get_region_by_addr((addr_t)any_addr))) {
+    if (!(reg = zone_of(any_addr))) {
 	// not in any region we manage
 	return -1;
     }
@@ -838,24 +1721,43 @@ int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, ui
     }
 
     zone_base = reg->mm_state->base_addr;
-    zone_min_order = reg->mm_state->min_order;
     zone_max_order = reg->mm_state->pool_order;
 
     any_offset = (addr_t)any_addr - (addr_t)zone_base;
     
-    for (order=zone_min_order;order<=zone_max_order;order++) {
+    // the enclosing block must start at any_addr rounded down to its order
+    for (order=MIN_ORDER;order<=zone_max_order;order++) {
 	addr_t mask = ~((1ULL << order)-1);
 	void *search_addr = (void*)(zone_base + (any_offset & mask));
-	struct kmem_block_hdr *hdr = block_hash_find_entry(search_addr);
+	uint8_t e = *pmap_entry(reg, search_addr);
 	// must exist and must be allocated
-	if (hdr && hdr->order>=MIN_ORDER) { 
+	if ((e & PMAP_ORDER_MASK) == order) { 
+	    if (e & PMAP_CACHED) {
+		// free block sitting in a CPU cache
+		return -1;
+	    }
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+	    if (is_large(reg, search_addr)) {
+		break;
+	    }
+#endif
 	    *block_addr = search_addr;
-	    *block_size = 0x1ULL<<hdr->order;
-	    *flags = hdr->flags;
+	    *block_size = 0x1ULL<<order;
+	    *flags = pmap_user_flags(e);
 	    return 0;
-	    
 	}
     }
+
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+    // the page map only describes the head of a large block
+    struct kmem_large *l = large_find_containing(any_addr);
+    if (l) {
+	*block_addr = l->addr;
+	*block_size = l->len;
+	*flags = pmap_user_flags(*pmap_entry(reg, l->addr));
+	return 0;
+    }
+#endif
     return -1;
 }
 
@@ -869,12 +1771,19 @@ int  kmem_set_block_flags(void *block_addr, uint64_t flags)
 
     } else {
 
-	struct kmem_block_hdr *h =  block_hash_find_entry(block_addr);
+	struct mem_region *reg = zone_of(block_addr);
+	uint8_t *entry;
+
+	if (!reg || (flags & ~KMEM_USER_FLAGS_MASK)) { 
+	    return -1;
+	}
+
+	entry = pmap_entry(reg, block_addr);
 	
-	if (!h || h->order<MIN_ORDER) { 
+	if ((*entry & PMAP_ORDER_MASK)<MIN_ORDER || (*entry & PMAP_CACHED)) { 
 	    return -1;
 	} else {
-	    h->flags = flags;
+	    *entry = (*entry & ~(KMEM_USER_FLAGS_MASK << PMAP_USER_SHIFT)) | (flags << PMAP_USER_SHIFT);
 	    return 0;
 	}
     }
@@ -883,21 +1792,31 @@ int  kmem_set_block_flags(void *block_addr, uint64_t flags)
 // applies only to allocated blocks
 int  kmem_mask_all_blocks_flags(uint64_t mask, int or)
 {
+    struct mem_region *reg;
+    uint8_t *entry;
+    uint8_t bits = (mask & KMEM_USER_FLAGS_MASK) << PMAP_USER_SHIFT;
     uint64_t i;
 
+    if (or && (mask & ~KMEM_USER_FLAGS_MASK)) {
+	return -1;
+    }
+
     if (!or) { 
 	boot_flags &= mask;
-	for (i=0;i<block_hash_num_entries;i++) { 
-	    if (block_hash_entries[i].order>=MIN_ORDER) { 
-		block_hash_entries[i].flags &= mask;
-	    }
-	}
+	bits |= ~(KMEM_USER_FLAGS_MASK << PMAP_USER_SHIFT);
     } else {
 	boot_flags |= mask;
-	for (i=0;i<block_hash_num_entries;i++) { 
-	    if (block_hash_entries[i].order>=MIN_ORDER) { 
-		block_hash_entries[i].flags |= mask;
+    }
+
+    list_for_each_entry(reg, &glob_zone_list, glob_link) {
+	i = 0;
+	while ((entry = pmap_next_block(reg,&i))) {
+	    if (!or) {
+		*entry &= bits;
+	    } else {
+		*entry |= bits;
 	    }
+	    i += 1UL << ((*entry & PMAP_ORDER_MASK) - MIN_ORDER);
 	}
     }
 
@@ -906,7 +1825,15 @@ int  kmem_mask_all_blocks_flags(uint64_t mask, int or)
     
 int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(void *block, void *state), void *state)
 {
+    struct mem_region *reg;
+    uint8_t *entry;
+    uint8_t e;
     uint64_t i;
+
+    if (flags & ~(mask & KMEM_USER_FLAGS_MASK)) {
+	// could never match
+	return -1;
+    }
     
     if (((boot_flags & mask) == flags)) {
 	if (func(boot_start,state)) { 
@@ -914,10 +1841,15 @@ int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(vo
 	}
     }
 
-    for (i=0;i<block_hash_num_entries;i++) { 
-	if (block_hash_entries[i].order>=MIN_ORDER) { 
-	    if ((block_hash_entries[i].flags & mask) == flags) {
-		if (func(block_hash_entries[i].addr,state)) { 
+    list_for_each_entry(reg, &glob_zone_list, glob_link) {
+	i = 0;
+	while ((entry = pmap_next_block(reg,&i))) {
+	    void *block = (void*)(reg->mm_state->base_addr + (i << MIN_ORDER));
+	    e = *entry;
+	    // step past the block now since func may free it
+	    i += 1UL << ((e & PMAP_ORDER_MASK) - MIN_ORDER);
+	    if ((pmap_user_flags(e) & mask) == flags) {
+		if (func(block,state)) { 
 		    return -1;
 		}
 	    }
@@ -926,6 +1858,60 @@ int  kmem_apply_to_matching_blocks(uint64_t mask, uint64_t flags, int (*func)(vo
     
     return 0;
 }
+
+// Bytes of [start,start+len) that are not free in the buddy allocator,
+// that is, allocated or parked in a cache.  Memory kmem does not
+// manage, and the boot block, count as used.  No locks are taken, so
+// unless the world is stopped the answer is only a hint.
+uint64_t kmem_range_used_bytes(void *start, uint64_t len)
+{
+    struct mem_region *reg = zone_of(start);
+    addr_t base, addr = (addr_t)start, end = (addr_t)start + len;
+    void *block;
+    uint64_t size, flags, used = 0, i, n;
+    uint8_t *pmap, e;
+
+    if (!reg || end > reg->mm_state->base_addr + reg->len ||
+	(start < boot_end && (void*)end > boot_start)) {
+	return len;
+    }
+
+    // a block that begins before the range
+    if (!kmem_find_block(start,&block,&size,&flags) && block < start) {
+	addr = (addr_t)block + size;
+	used += (addr < end ? addr : end) - (addr_t)start;
+    }
+
+    base = reg->mm_state->base_addr;
+    pmap = reg->mm_pmap;
+    n = (end - base + (1UL << MIN_ORDER) - 1) >> MIN_ORDER;
+
+    for (i = (addr - base) >> MIN_ORDER; i < n; ) {
+	if (!(i & 0x7) && (i+8) <= n && !*(uint64_t *)(pmap+i)) {
+	    i += 8;
+	    continue;
+	}
+	e = pmap[i];
+	if (!(e & PMAP_ORDER_MASK)) {
+	    i++;
+	    continue;
+	}
+	addr = base + (i << MIN_ORDER);
+	size = 1UL << (e & PMAP_ORDER_MASK);
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+	if (!(e & PMAP_CACHED) && is_large(reg,(void*)addr)) {
+	    struct kmem_large *l = large_find((void*)addr,0);
+	    if (l) {
+		size = l->len;
+	    }
+	}
+#endif
+	used += addr + size < end ? size : end - addr;
+	i += size >> MIN_ORDER;
+    }
+
+    return used;
+}
     
 
 // We also create malloc, etc, functions to link to
@@ -1006,6 +1992,22 @@ handle_meminfo (char * buf, void * priv)
 
     nk_vc_printf("%lu pools %lu blks free %lu bytes free\n", s->total_num_pools, s->total_blocks_free, s->total_bytes_free);
     nk_vc_printf("  %lu bytes min %lu bytes max\n", s->min_alloc_size, s->max_alloc_size);
+    nk_vc_printf("  internal fragmentation: %lu bytes requested %lu bytes granted (%lu%% waste)\n",
+		 s->bytes_requested, s->bytes_granted,
+		 s->bytes_granted ? ((s->bytes_granted - s->bytes_requested)*100)/s->bytes_granted : 0);
+#ifdef NAUT_CONFIG_KMEM_LARGE_ALLOC
+    nk_vc_printf("  large: %lu blocks %lu bytes %lu bytes slack\n",
+		 s->large_blocks, s->large_bytes, s->large_slack);
+#endif
+#ifdef NAUT_CONFIG_KMEM_ZERO_POOL
+    nk_vc_printf("  zero pools: %lu hits %lu misses %lu fills %lu bytes pooled\n",
+		 s->zero_hits, s->zero_misses, s->zero_fills, s->zero_bytes);
+#endif
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+    nk_vc_printf("  cache: %lu alloc hits %lu alloc misses %lu free hits %lu drains %lu bytes cached\n",
+		 s->cache_alloc_hits, s->cache_alloc_misses, s->cache_free_hits,
+		 s->cache_drains, s->cache_bytes);
+#endif
 
     free(s);
 
@@ -1020,6 +2022,51 @@ static struct shell_cmd_impl meminfo_impl = {
 };
 nk_register_shell_cmd(meminfo_impl);
 
+#ifdef NAUT_CONFIG_KMEM_PERCPU_CACHE
+static int
+handle_kmemcache (char * buf, void * priv)
+{
+    struct sys_info *sys = &(nk_get_nautilus_info()->sys);
+    char what[16];
+    uint64_t i, j;
+
+    if (sscanf(buf,"kmemcache %15s",what)==1) {
+	if (!strcmp(what,"flush")) {
+	    if ((i = kmem_cache_drain_all())) {
+		nk_vc_printf("Failed to flush the caches of %lu cpus\n",i);
+	    } else {
+		nk_vc_printf("Flushed all kmem caches\n");
+	    }
+	    return 0;
+	}
+	nk_vc_printf("unknown kmemcache request\n");
+	return 0;
+    }
+
+    for (i=0;i<sys->num_cpus;i++) {
+	struct kmem_data *k = &(sys->cpus[i]->kmem);
+	uint64_t hits = k->cache_alloc_hits;
+	uint64_t misses = k->cache_alloc_misses;
+	uint64_t bytes = 0;
+	for (j=0;j<KMEM_CACHE_NUM_CLASSES;j++) {
+	    bytes += k->mags[j].count << (j+KMEM_CACHE_MIN_ORDER);
+	}
+	nk_vc_printf("cpu %lu: %lu hits %lu misses (%lu%% hit) %lu frees %lu drains %lu bytes cached\n",
+		     i, hits, misses, hits+misses ? (100*hits)/(hits+misses) : 0,
+		     k->cache_free_hits, k->cache_drains, bytes);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl kmemcache_impl = {
+    .cmd      = "kmemcache",
+    .help_str = "kmemcache [flush]",
+    .handler  = handle_kmemcache,
+};
+nk_register_shell_cmd(kmemcache_impl);
+#endif
+
 
 #define BYTES_PER_LINE 16
 
@@ -72,7 +72,7 @@ struct nk_net_dev * nk_net_dev_find(char *name)
 {
     DEBUG("find %s\n",name);
     struct nk_dev *d = nk_dev_find(name);
-    if (d->type!=NK_DEV_NET) {
+    if (!d || d->type!=NK_DEV_NET) {
 	DEBUG("%s not found\n",name);
 	return 0;
     } else {
@@ -87,6 +87,9 @@ int nk_net_dev_get_characteristics(struct nk_net_dev *dev, struct nk_net_dev_cha
     struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
 
     DEBUG("get characteristics of %s\n",d->name);
+    // drivers only fill in what they know about
+    memset(c,0,sizeof(*c));
+    c->num_queues = 1;
     return di->get_characteristics(d->state,c);
 }
 
@@ -123,39 +126,45 @@ static int generic_cond_check(void* state)
 }
 
 
-int nk_net_dev_send_packet(struct nk_net_dev *dev, 
-			   uint8_t *src, 
-			   uint64_t len, 
-			   nk_dev_request_type_t type,
-			   void (*callback)(nk_net_dev_status_t status, void *state),
-			   void *state)
+static int post_send(struct nk_net_dev_int *di, void *state, uint8_t *src, uint64_t len, struct nk_net_dev_tx_offload *o, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    if (o) {
+	return di->post_send_offload(state,src,len,o,callback,context);
+    } else {
+	return di->post_send(state,src,len,callback,context);
+    }
+}
+
+int nk_net_dev_send_packet_offload(struct nk_net_dev *dev, 
+				   uint8_t *src, 
+				   uint64_t len, 
+				   struct nk_net_dev_tx_offload *o,
+				   nk_dev_request_type_t type,
+				   void (*callback)(nk_net_dev_status_t status, void *state),
+				   void *state)
 {
     struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
     struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
-    DEBUG("send packet on %s (len=%lu, type=%lx)\n", d->name,len,type);
+    DEBUG("send packet on %s (len=%lu, type=%lx, offload=%p)\n", d->name,len,type,o);
+    if (o ? !di->post_send_offload : !di->post_send) { 
+	DEBUG("packet send not possible\n");
+	return -1;
+    }
     switch (type) {
     case NK_DEV_REQ_CALLBACK:
-	if (!di->post_send) { 
-	    DEBUG("packet send not possible\n");
-	    return -1;
-	} else {
-	    return di->post_send(d->state,src,len,callback,state);
-	}
+	return post_send(di,d->state,src,len,o,callback,state);
 	break;
     case NK_DEV_REQ_BLOCKING:
     case NK_DEV_REQ_NONBLOCKING:
-	if (!di->post_send) { 
-	    DEBUG("packet send not possible\n");
-	    return -1;
-	} else {
-	    volatile struct op o;
+	{
+	    volatile struct op op;
 
-	    o.completed = 0;
-	    o.status = 0;
-	    o.dev = dev;
+	    op.completed = 0;
+	    op.status = 0;
+	    op.dev = dev;
 
 	    if (type==NK_DEV_REQ_NONBLOCKING) { 
-		if (di->post_send(d->state,src,len,0,0)) { 
+		if (post_send(di,d->state,src,len,o,0,0)) { 
 		    ERROR("Failed to launch send\n");
 		    return -1;
 		} else {
@@ -163,16 +172,16 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
 		    return 0;
 		}
 	    } else {
-		if (di->post_send(d->state,src,len,generic_send_callback,(void*)&o)) { 
+		if (post_send(di,d->state,src,len,o,generic_send_callback,(void*)&op)) { 
 		    ERROR("Failed to launch send\n");
 		    return -1;
 		} else {
 		    DEBUG("Packet launch started, waiting for completion\n");
-		    while (!o.completed) {
-			nk_dev_wait((struct nk_dev *)dev, generic_cond_check, (void*)&o);
+		    while (!op.completed) {
+			nk_dev_wait((struct nk_dev *)dev, generic_cond_check, (void*)&op);
 		    }
 		    DEBUG("Packet launch completed\n");
-		    return o.status;
+		    return op.status;
 		}
 	    }
 	
@@ -183,6 +192,16 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
     }
 }
 
+int nk_net_dev_send_packet(struct nk_net_dev *dev, 
+			   uint8_t *src, 
+			   uint64_t len, 
+			   nk_dev_request_type_t type,
+			   void (*callback)(nk_net_dev_status_t status, void *state),
+			   void *state)
+{
+    return nk_net_dev_send_packet_offload(dev,src,len,0,type,callback,state);
+}
+
 int nk_net_dev_receive_packet(struct nk_net_dev *dev, 
 			      uint8_t *dest, 
 			      uint64_t len, 
@@ -242,3 +261,56 @@ int nk_net_dev_receive_packet(struct nk_net_dev *dev,
 	return -1;
     }
 }
+
+static int post_batch(struct nk_net_dev *dev, struct nk_net_dev_buf *bufs, uint64_t num, int send)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    int (*batch)(void *, struct nk_net_dev_buf *, uint64_t) = send ? di->post_send_batch : di->post_receive_batch;
+    int (*single)(void *, uint8_t *, uint64_t, void (*)(nk_net_dev_status_t, void *), void *) = send ? di->post_send : di->post_receive;
+    uint64_t i;
+
+    DEBUG("%s batch of %lu on %s\n", send ? "send" : "receive", num, d->name);
+
+    if (batch) {
+	return batch(d->state,bufs,num);
+    }
+
+    if (!single) {
+	DEBUG("packet %s not possible\n", send ? "send" : "receive");
+	return -1;
+    }
+
+    for (i=0;i<num;i++) {
+	if (single(d->state,bufs[i].buf,bufs[i].len,bufs[i].callback,bufs[i].context)) {
+	    break;
+	}
+    }
+
+    return (i || !num) ? (int)i : -1;
+}
+
+int nk_net_dev_receive_batch(struct nk_net_dev *dev, struct nk_net_dev_buf *bufs, uint64_t num)
+{
+    return post_batch(dev,bufs,num,0);
+}
+
+int nk_net_dev_send_batch(struct nk_net_dev *dev, struct nk_net_dev_buf *bufs, uint64_t num)
+{
+    return post_batch(dev,bufs,num,1);
+}
+
+// no debug output - these are called in a loop
+int nk_net_dev_poll(struct nk_net_dev *dev, uint64_t budget)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    return di->poll ? di->poll(d->state,budget) : -1;
+}
+
+int nk_net_dev_set_interrupts(struct nk_net_dev *dev, int enable)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    return di->set_interrupts ? di->set_interrupts(d->state,enable) : -1;
+}
@@ -35,6 +35,7 @@
 #include <nautilus/mm.h>
 #include <lib/bitmap.h>
 #include <nautilus/percpu.h>
+#include <nautilus/smp.h>
 
 #ifdef NAUT_CONFIG_XEON_PHI
 #include <nautilus/sfi.h>
@@ -46,6 +47,11 @@
 
 #ifdef NAUT_CONFIG_ASPACES
 #include <nautilus/aspace.h>
+#include <nautilus/tlb.h>
+#endif
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+#include <nautilus/stackpool.h>
 #endif
 
 #ifndef NAUT_CONFIG_DEBUG_PAGING
@@ -317,6 +323,285 @@ nk_map_page_nocache (addr_t paddr, uint64_t flags, page_size_t ps)
 }
 
 
+/*
+ * split_large_entry
+ *
+ * replace a 1GB pdpte or a 2MB pde with a table of 512 entries
+ * mapping the same range with the next smaller page size
+ *
+ * @entry: the large page entry to split
+ * @small: size of the pages in the new table
+ *
+ * returns -ENOMEM on error, 0 on success
+ *
+ */
+static int
+split_large_entry (ulong_t * entry, ulong_t small)
+{
+    ulong_t base  = PTE_ADDR(*entry) & ~PTE_NX_BIT & ~(small*NUM_PT_ENTRIES-1);
+    ulong_t flags = (*entry & 0xfffUL) | (*entry & PTE_NX_BIT);
+    ulong_t * table;
+    int i;
+
+    // the PAT bit of a large page lives at bit 12 and would land in
+    // the address of the smaller entries, so it must not carry over
+    if (*entry & PTE_PAT_BIT) {
+        ERROR_PRINT("Cannot split large page %p with PAT set\n", (void*)base);
+        return -ENOMEM;
+    }
+
+    if (small == PAGE_SIZE_4KB) {
+        flags &= ~PTE_PAGE_SIZE_BIT;
+    }
+
+    table = (ulong_t*)malloc(PAGE_SIZE_4KB);
+
+    if (!table || ((ulong_t)table & (PAGE_SIZE_4KB-1))) {
+        ERROR_PRINT("Cannot allocate page table to split large page %p\n", (void*)base);
+        if (table) {
+            free(table);
+        }
+        return -ENOMEM;
+    }
+
+    for (i = 0; i < NUM_PT_ENTRIES; i++) {
+        table[i] = (base + i*small) | flags;
+    }
+
+    // the new table maps exactly what the large page did, so stale
+    // TLB entries for the large page remain correct
+    *entry = (ulong_t)table | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+
+    return 0;
+}
+
+
+static spinlock_t guard_lock;
+
+// guards set where we could not wait on other CPUs, whose
+// translations are still to be shot down
+#define GUARD_DEFERRED_MAX 64
+static addr_t guard_deferred[GUARD_DEFERRED_MAX];
+static volatile int guard_deferred_count;
+
+#ifndef NAUT_CONFIG_ASPACES
+static void
+guard_flush (void * arg)
+{
+    invlpg((addr_t)arg);
+}
+#endif
+
+static void
+guard_flush_remote (addr_t vaddr)
+{
+#ifdef NAUT_CONFIG_ASPACES
+    // address spaces may have the page cached under other PCIDs
+    nk_tlb_flush_kernel(vaddr, PAGE_SIZE_4KB);
+#else
+    int i;
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+        if (i != my_cpu_id()) {
+            smp_xcall(i, guard_flush, (void*)vaddr, 1);
+        }
+    }
+#endif
+}
+
+
+/*
+ * nk_paging_guard_flush_deferred
+ *
+ * shoot down the guards that nk_paging_guard_page had to defer.
+ * does nothing unless called from thread context with interrupts on
+ *
+ */
+void
+nk_paging_guard_flush_deferred (void)
+{
+    addr_t va[GUARD_DEFERRED_MAX];
+    uint8_t flags;
+    int i, n;
+
+    if (!guard_deferred_count || !irqs_enabled() || in_interrupt_context()) {
+        return;
+    }
+
+    flags = spin_lock_irq_save(&guard_lock);
+    n = guard_deferred_count;
+    memcpy(va, guard_deferred, n*sizeof(addr_t));
+    guard_deferred_count = 0;
+    spin_unlock_irq_restore(&guard_lock, flags);
+
+    for (i = 0; i < n; i++) {
+        guard_flush_remote(va[i]);
+    }
+}
+
+
+/*
+ * nk_paging_guard_page
+ *
+ * make a 4KB page of the kernel identity map inaccessible,
+ * or accessible again, so that it can act as a guard page.
+ * the large page that covers it is split into 4KB pages
+ * on first use and stays split thereafter
+ *
+ * setting a guard must shoot down other CPUs' translations, which
+ * cannot be waited on with interrupts off or in interrupt context.
+ * there the shootdown is queued for nk_paging_guard_flush_deferred,
+ * and the guard is refused with -EAGAIN if the queue is full
+ *
+ * @vaddr: the page to change (must be 4KB aligned)
+ * @guard: 1 => unmap the page, 0 => map it again
+ *
+ * returns -EINVAL, -ENOMEM, or -EAGAIN on error, 0 on success
+ *
+ */
+int
+nk_paging_guard_page (addr_t vaddr, int guard)
+{
+    pml4e_t * pml = (pml4e_t*)nk_paging_default_cr3();
+    pdpte_t * pdpt;
+    pde_t   * pd;
+    pte_t   * pt;
+    uint8_t flags;
+    int rc = -EINVAL;
+    // a non-present entry is never cached, so only setting a guard
+    // needs other CPUs to drop their translations
+    int remote = guard && cpu_info_ready && nk_get_num_cpus() > 1;
+    int defer = remote && (!irqs_enabled() || in_interrupt_context());
+
+    if (!pml || (vaddr & (PAGE_SIZE_4KB-1))) {
+        return -EINVAL;
+    }
+
+    if (remote && !defer) {
+        // do not let earlier deferred guards wait behind this one
+        nk_paging_guard_flush_deferred();
+    }
+
+    flags = spin_lock_irq_save(&guard_lock);
+
+    if (!PML4E_PRESENT(pml[PADDR_TO_PML4_IDX(vaddr)])) {
+        goto out;
+    }
+
+    pdpt = (pdpte_t*)PTE_ADDR(pml[PADDR_TO_PML4_IDX(vaddr)]);
+
+    if (!PDPTE_PRESENT(pdpt[PADDR_TO_PDPT_IDX(vaddr)])) {
+        goto out;
+    }
+
+    if (pdpt[PADDR_TO_PDPT_IDX(vaddr)] & PTE_PAGE_SIZE_BIT) {
+        if (!guard) {
+            // still covered by a large page, so it is mapped
+            rc = 0;
+            goto out;
+        }
+        if ((rc = split_large_entry(&pdpt[PADDR_TO_PDPT_IDX(vaddr)], PAGE_SIZE_2MB))) {
+            goto out;
+        }
+        rc = -EINVAL;
+    }
+
+    pd = (pde_t*)PTE_ADDR(pdpt[PADDR_TO_PDPT_IDX(vaddr)]);
+
+    if (!PDE_PRESENT(pd[PADDR_TO_PD_IDX(vaddr)])) {
+        goto out;
+    }
+
+    if (pd[PADDR_TO_PD_IDX(vaddr)] & PTE_PAGE_SIZE_BIT) {
+        if (!guard) {
+            rc = 0;
+            goto out;
+        }
+        if ((rc = split_large_entry(&pd[PADDR_TO_PD_IDX(vaddr)], PAGE_SIZE_4KB))) {
+            goto out;
+        }
+    }
+
+    pt = (pte_t*)PTE_ADDR(pd[PADDR_TO_PD_IDX(vaddr)]);
+
+    if (defer) {
+        if (guard_deferred_count == GUARD_DEFERRED_MAX) {
+            rc = -EAGAIN;
+            goto out;
+        }
+        guard_deferred[guard_deferred_count++] = vaddr;
+    }
+
+    if (guard) {
+        pt[PADDR_TO_PT_IDX(vaddr)] &= ~PTE_PRESENT_BIT;
+    } else {
+        pt[PADDR_TO_PT_IDX(vaddr)] |= PTE_PRESENT_BIT;
+    }
+
+    invlpg(vaddr);
+
+    rc = 0;
+
+ out:
+    spin_unlock_irq_restore(&guard_lock, flags);
+
+    if (rc) {
+        ERROR_PRINT("Cannot %s guard page at %p\n", guard ? "set" : "clear", (void*)vaddr);
+        return rc;
+    }
+
+    if (remote && !defer) {
+        guard_flush_remote(vaddr);
+    }
+
+    return 0;
+}
+
+
+/*
+ * nk_paging_guard_page_armed
+ *
+ * is a 4KB page of the kernel identity map currently a guard page?
+ *
+ * @vaddr: the page to check (must be 4KB aligned)
+ *
+ * returns 1 if it is unmapped by nk_paging_guard_page, 0 otherwise
+ *
+ */
+int
+nk_paging_guard_page_armed (addr_t vaddr)
+{
+    pml4e_t * pml = (pml4e_t*)nk_paging_default_cr3();
+    pdpte_t * pdpt;
+    pde_t   * pd;
+    pte_t   * pt;
+
+    if (!pml || (vaddr & (PAGE_SIZE_4KB-1)) ||
+        !PML4E_PRESENT(pml[PADDR_TO_PML4_IDX(vaddr)])) {
+        return 0;
+    }
+
+    pdpt = (pdpte_t*)PTE_ADDR(pml[PADDR_TO_PML4_IDX(vaddr)]);
+
+    // a guard always splits the large pages above it
+    if (!PDPTE_PRESENT(pdpt[PADDR_TO_PDPT_IDX(vaddr)]) ||
+        (pdpt[PADDR_TO_PDPT_IDX(vaddr)] & PTE_PAGE_SIZE_BIT)) {
+        return 0;
+    }
+
+    pd = (pde_t*)PTE_ADDR(pdpt[PADDR_TO_PDPT_IDX(vaddr)]);
+
+    if (!PDE_PRESENT(pd[PADDR_TO_PD_IDX(vaddr)]) ||
+        (pd[PADDR_TO_PD_IDX(vaddr)] & PTE_PAGE_SIZE_BIT)) {
+        return 0;
+    }
+
+    pt = (pte_t*)PTE_ADDR(pd[PADDR_TO_PD_IDX(vaddr)]);
+
+    return !(pt[PADDR_TO_PT_IDX(vaddr)] & PTE_PRESENT_BIT);
+}
+
+
 /*
  * nk_pf_handler
  *
@@ -344,6 +629,10 @@ nk_pf_handler (excp_entry_t * excp,
     }
 #endif
 
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    nk_stack_guard_check(fault_addr);
+#endif
+
 #ifdef NAUT_CONFIG_ENABLE_MONITOR
     int nk_monitor_excp_entry(excp_entry_t * excp,
 			      excp_vec_t vector,
@@ -257,11 +257,21 @@ static void       rt_queue_dump(rt_queue *queue, char *pre);
 //   Runnable:  deadline (EDF queue)
 //   Pending:   arrival time 
 //   Aperiodic: priority 
+//
+// Each thread records its index in the heap (q_index) so that
+// removal is O(log n).   The heap array grows with the number of
+// threads in the system, see rt_priority_queue_grow().  Growth
+// happens outside of the scheduler locks (it allocates), and assures
+// that every queue has room for every thread, so enqueue, which is done
+// with the lock held, cannot run out of room.
+
+#define RT_QUEUE_INIT_CAPACITY MIN(64,MAX_QUEUE)
 
 typedef struct rt_priority_queue {
     queue_type type;
     uint64_t   size;
-    rt_thread *threads[MAX_QUEUE];
+    uint64_t   capacity;
+    rt_thread **threads;
 } rt_priority_queue ;
 
 static int        rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread);
@@ -270,6 +280,9 @@ static rt_thread* rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos)
 static rt_thread* rt_priority_queue_remove(rt_priority_queue *queue, rt_thread *thread);
 static int        rt_priority_queue_empty(rt_priority_queue *queue);
 static void       rt_priority_queue_dump(rt_priority_queue *queue, char *pre);
+static int        rt_priority_queue_init(rt_priority_queue *queue, queue_type type, uint64_t capacity);
+static uint64_t   rt_priority_queue_capacity_for(uint64_t need);
+static int        rt_priority_queues_grow(uint64_t need);
 
 //
 // Per-CPU scheduler state - hangs off off global cpu struct
@@ -281,18 +294,57 @@ typedef struct tsc_info {
     uint64_t set_time;    // time when the next timer interrupt should occur
     uint64_t start_time;  // time from when the current thread starts running (exit from need_resched())
     uint64_t end_time;    // to when it stops (entry to need_resched())
+#if NAUT_CONFIG_TIMER_COALESCE
+    uint64_t armed_time;  // when the timer we last programmed will fire
+    uint64_t armed_count; //   valid only if no timer interrupt since (apic timer_count)
+#endif
 } tsc_info;
 
 
+// Unsized tasks produced on a cpu go onto that cpu's Chase-Lev deque.
+// The owner pushes and pops at the bottom (LIFO) with interrupts off,
+// while other cpus steal from the top (FIFO) with a CAS on top.
+// The deque has a fixed capacity; when it is full, tasks overflow
+// into the locked unsized queue, which is also where tasks placed
+// on a cpu by some other cpu go.
+#define TASK_DEQUE_SIZE     1024   // must be a power of two
+#define TASK_POOL_SIZE      256    // free task descriptors kept per cpu
+#define TASK_STEAL_ATTEMPTS 4      // victims tried per steal, half of them near
+
+// Sized tasks are kept in log-scaled buckets: bucket i holds the
+// tasks whose size is in [2^i, 2^(i+1)) ns, in FIFO order, and
+// a bitmap records which buckets are nonempty.   Every task in a
+// bucket below that of the available time fits, so a fit is found
+// with a short scan of one bucket and a bit search.
+#define TASK_SIZE_BUCKETS   64
+#define TASK_SIZE_BUCKET(s) (63 - __builtin_clzl(s))
+
+typedef struct nk_sched_task_deque {
+    volatile sint64_t   top;              // next slot to steal
+    volatile sint64_t   bottom;           // next slot to push
+    struct nk_task    *buf[TASK_DEQUE_SIZE];
+} task_deque;
+
 typedef struct nk_sched_task_state {
     spinlock_t  lock;
     nk_wait_queue_t   *waitq;            // where the task thread blocks ultimately
     uint64_t           sized_enqueued;   // number of sized tasks enqueued
     uint64_t           sized_dequeued;   //   and dequeued (locally or remotely)
-    struct list_head   sized_queue;      // tasks with known sizes
-    uint64_t           unsized_enqueued; // number of unsized tasks enqueud
-    uint64_t           unsized_dequeued; //   and dequeued (locally or remotely)
-    struct list_head   unsized_queue;    // tasks with unknown sizes;
+    uint64_t           sized_mask;       // which sized buckets are nonempty
+    struct list_head   sized_queue[TASK_SIZE_BUCKETS]; // tasks with known sizes
+    uint64_t           unsized_enqueued; // number of unsized tasks enqueud (atomic)
+    uint64_t           unsized_dequeued; //   and dequeued (locally or remotely, atomic)
+    struct list_head   unsized_queue;    // tasks with unknown sizes placed remotely, or overflow
+    task_deque         deque;            // tasks with unknown sizes produced locally
+    volatile int       steal_hint;       // another cpu has surplus tasks; wakes the task thread
+    uint64_t           steals;           // tasks this cpu has stolen from others (atomic)
+    uint64_t           rand;             // xorshift state for victim selection
+    uint32_t           next_hint;        // next near victim to hint
+    uint32_t           num_victims;      // all other cpus
+    uint32_t           num_near;         //   of which these are in the nearest domains
+    int               *victims;          // other cpus, sorted by NUMA distance
+    uint32_t           pool_count;       // free descriptors, owner only with interrupts off
+    struct nk_task    *pool[TASK_POOL_SIZE];
 } task_info;
 
 typedef struct nk_sched_percpu_state {
@@ -320,6 +372,20 @@ typedef struct nk_sched_percpu_state {
 
     uint64_t num_thefts;   // how many threads I've successfully stolen
 
+#if NAUT_CONFIG_TICKLESS_IDLE
+    uint64_t tickless_count;  // how many times we have idled without a tick
+#endif
+#if NAUT_CONFIG_TIMER_COALESCE
+    uint64_t coalesce_count;  // how many times we have deferred to an armed timer
+#endif
+
+#if NAUT_CONFIG_LOAD_BALANCE
+    uint64_t lb_load;      // moving average of aperiodic queue length (fixed point)
+    uint64_t lb_runs;      // balancing passes run on this cpu
+    uint64_t lb_pulls;     // threads pulled to this cpu
+    uint64_t lb_fails;     // threads we tried but failed to pull
+#endif
+
     uint64_t reinject_count;  // how many timer/kick interrupts I've had to reinject
 
 #if INSTRUMENT
@@ -383,6 +449,27 @@ typedef struct nk_sched_percpu_state {
 #endif
 
 
+#if NAUT_CONFIG_TICKLESS_IDLE
+// how long an idle cpu may go without a timer interrupt; periodic
+// idle-time work, if any, must still get to run
+#if NAUT_CONFIG_LOAD_BALANCE
+#define TICKLESS_SLEEP_NS (MIN(NAUT_CONFIG_LOAD_BALANCE_INTERVAL_MS,NAUT_CONFIG_TICKLESS_IDLE_MAX_SLEEP_MS)*1000000ULL)
+#elif NAUT_CONFIG_WORK_STEALING
+#define TICKLESS_SLEEP_NS (MIN(NAUT_CONFIG_WORK_STEALING_INTERVAL_MS,NAUT_CONFIG_TICKLESS_IDLE_MAX_SLEEP_MS)*1000000ULL)
+#else
+#define TICKLESS_SLEEP_NS (NAUT_CONFIG_TICKLESS_IDLE_MAX_SLEEP_MS*1000000ULL)
+#endif
+#endif
+
+#if NAUT_CONFIG_LOAD_BALANCE
+#define LB_SHIFT 8   // fraction bits of the load average
+#define LB_EWMA  3   // a new sample has weight 1/2^LB_EWMA
+// fold the current aperiodic queue length into the load average
+#define lb_sample(s) ((s)->lb_load = (s)->lb_load - ((s)->lb_load >> LB_EWMA) + ((SIZE_APERIODIC(s) << LB_SHIFT) >> LB_EWMA))
+#else
+#define lb_sample(s)
+#endif
+
 #if NAUT_CONFIG_APERIODIC_ROUND_ROBIN || NAUT_CONFIG_APERIODIC_LOTTERY
 // This handles the special case where the idle thread is at the
 // head of the queue, but there is another thread behind it
@@ -487,6 +574,8 @@ typedef struct nk_sched_thread_state {
     rt_status status;
     // which queue the thread is currently on
     queue_type q_type;
+    // and its position there if it is a priority queue
+    uint64_t   q_index;
     
     int      is_intr;      // this is an interrupt thread
     int      is_task;      // this is a task thread
@@ -516,6 +605,10 @@ typedef struct nk_sched_thread_state {
     // the thread node in a thread list (the global thread list)
     struct rt_node   *list; 
 
+#if NAUT_CONFIG_LOAD_BALANCE
+    uint64_t lb_time;      // when the load balancer last moved the thread
+#endif
+
 } rt_thread ;
 
 static void       rt_thread_dump(rt_thread *thread, char *prefix);
@@ -655,13 +748,13 @@ void nk_sched_dump_cores(int cpu_arg)
 
     for (cpu=0;cpu<sys->num_cpus;cpu++) { 
 	if (cpu_arg<0 || cpu_arg==cpu) {
-	    char buf[256];
+	    char buf[320];
 	    struct apic_dev *apic = sys->cpus[cpu]->apic;
 	    struct nk_aspace *aspace = sys->cpus[cpu]->cur_aspace;
 
 	    s = sys->cpus[cpu]->sched_state;
 	    LOCAL_LOCK(s);
-	    snprintf(buf,256,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd) (%luapic) [%s]\n",
+	    snprintf(buf,320,"%dc %s %unl %luin %luex %luri %lut %s %utp %lup %lur %lua %lum (%s) (%luul %lusp %luap %luaq %luadp) (%luste %lustd %luute %luutd %lutst) (%luapic) [%s]\n",
 		     cpu, 
 		     intr_model,
 		     sys->cpus[cpu]->interrupt_nesting_level,
@@ -693,18 +786,45 @@ void nk_sched_dump_cores(int cpu_arg)
 		     s->cfg.sporadic_reservation, s->cfg.aperiodic_reservation, 
 		     s->cfg.aperiodic_quantum, s->cfg.aperiodic_default_priority,
 		     s->tasks.sized_enqueued, s->tasks.sized_dequeued,
-		     s->tasks.unsized_enqueued, s->tasks.unsized_dequeued,
+		     s->tasks.unsized_enqueued, s->tasks.unsized_dequeued, s->tasks.steals,
 		     apic->timer_count,
 		     aspace ? aspace->name : "default");
 #if INSTRUMENT
 	    char buf2[256];
             INST_DUMP(s,buf2,256);
+#endif
+#if NAUT_CONFIG_TICKLESS_IDLE || NAUT_CONFIG_TIMER_COALESCE
+	    char buf4[128];
+	    snprintf(buf4,128,"+ timer:(tickless=%lu coalesced=%lu)\n",
+#if NAUT_CONFIG_TICKLESS_IDLE
+		     s->tickless_count,
+#else
+		     0UL,
+#endif
+#if NAUT_CONFIG_TIMER_COALESCE
+		     s->coalesce_count
+#else
+		     0UL
+#endif
+		     );
+#endif
+#if NAUT_CONFIG_LOAD_BALANCE
+	    char buf3[128];
+	    snprintf(buf3,128,"+ lb:(load=%lu.%02lu runs=%lu pulls=%lu fails=%lu)\n",
+		     s->lb_load >> LB_SHIFT, ((s->lb_load & ((1ULL<<LB_SHIFT)-1))*100) >> LB_SHIFT,
+		     s->lb_runs, s->lb_pulls, s->lb_fails);
 #endif
 	    LOCAL_UNLOCK(s);
 
 	    nk_vc_printf(buf);
 #if INSTRUMENT
 	    nk_vc_printf(buf2);
+#endif
+#if NAUT_CONFIG_LOAD_BALANCE
+	    nk_vc_printf(buf3);
+#endif
+#if NAUT_CONFIG_TICKLESS_IDLE || NAUT_CONFIG_TIMER_COALESCE
+	    nk_vc_printf(buf4);
 #endif
 	}
     }
@@ -1128,6 +1248,16 @@ int nk_sched_thread_post_create(nk_thread_t * t)
     
     GLOBAL_UNLOCK();
 
+    // the new thread is not runnable yet, so we can now make room for it,
+    // and anyone counted before it, in the run queues
+    if (rt_priority_queues_grow(__sync_fetch_and_add(&global_sched_state.num_threads,0))) {
+	GLOBAL_LOCK();
+	rt_list_remove(global_sched_state.thread_list,t->sched_state->list);
+	global_sched_state.num_threads--;
+	GLOBAL_UNLOCK();
+	return -1;
+    }
+
     return 0;
 }
 
@@ -1658,9 +1788,58 @@ static void rt_priority_queue_dump(rt_priority_queue *queue, char *pre)
     DEBUG("======%s==END=====\n",pre);
 }
 
+static int rt_priority_queue_init(rt_priority_queue *queue, queue_type type, uint64_t capacity)
+{
+    queue->type = type;
+    queue->size = 0;
+    queue->capacity = capacity;
+    queue->threads = (rt_thread **) MALLOC(capacity*sizeof(rt_thread *));
+
+    return queue->threads ? 0 : -1;
+}
+
+// move thread up from the hole at pos toward the root
+static inline void rt_priority_queue_sift_up(rt_priority_queue *queue, uint64_t pos, rt_thread *thread)
+{
+    while (pos && queue->threads[parent(pos)]->deadline > thread->deadline) {
+	queue->threads[pos] = queue->threads[parent(pos)];
+	queue->threads[pos]->q_index = pos;
+	pos = parent(pos);
+    }
+
+    queue->threads[pos] = thread;
+    thread->q_index = pos;
+}
+
+// move thread down from the hole at pos toward the leaves
+static inline void rt_priority_queue_sift_down(rt_priority_queue *queue, uint64_t pos, rt_thread *thread)
+{
+    uint64_t child;
+
+    for (; left_child(pos) < queue->size; pos = child) {
+	
+	child = left_child(pos);
+
+	if (right_child(pos) < queue->size && 
+	    queue->threads[right_child(pos)]->deadline < queue->threads[child]->deadline)  {
+	    child = right_child(pos);
+	}
+            
+	if (thread->deadline > queue->threads[child]->deadline) {
+	    queue->threads[pos] = queue->threads[child];
+	    queue->threads[pos]->q_index = pos;
+	} else {
+	    break;
+	}
+    }
+        
+    queue->threads[pos] = thread;
+    thread->q_index = pos;
+}
+
 static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread)
 {
-    if (queue->size == MAX_QUEUE)        {
+    if (queue->size == queue->capacity)        {
 	ERROR("Too many threads for priority queue %s\n", 
 	      queue->type==RUNNABLE_QUEUE ? "Runnable" :
 	      queue->type==PENDING_QUEUE ? "Pending" :
@@ -1669,19 +1848,10 @@ static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread
 	return -1;
     }
         
-    uint64_t pos = queue->size++;
-    queue->threads[pos] = thread;
-
-    // update heap
-    while (queue->threads[parent(pos)]->deadline > thread->deadline 
-	   && pos != parent(pos))  {
-	queue->threads[pos] = queue->threads[parent(pos)];
-	pos = parent(pos);
-    }
-
     thread->q_type = queue->type;
-    queue->threads[pos] = thread;
 
+    // update heap
+    rt_priority_queue_sift_up(queue, queue->size++, thread);
 
     return 0;
 }
@@ -1711,61 +1881,117 @@ static rt_thread* rt_priority_queue_dequeue(rt_priority_queue *queue)
     }
     
     rt_thread *min, *last;
-    int now, child;
     
     // Get the entry we are about to remove (min)
     min = queue->threads[0];
     last = queue->threads[--queue->size];
         
     // update the heap
-    for (now = 0; left_child(now) < queue->size; now = child) {
-	
-	child = left_child(now);
-
-	if (child < queue->size && 
-	    queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)  {
-	    
-	    child = right_child(now);
-	}
-            
-	if (last->deadline > queue->threads[child]->deadline) {
-	    queue->threads[now] = queue->threads[child];
-	} else {
-	    break;
-	}
+    if (queue->size) {
+	rt_priority_queue_sift_down(queue, 0, last);
     }
         
-    queue->threads[now] = last;
-        
     return min;
 
 }
 
 static rt_thread* rt_priority_queue_remove(rt_priority_queue *queue, rt_thread *thread)
 {
-    // this is currently hideous beyond belief
+    uint64_t pos = thread->q_index;
+    rt_thread *last;
 
-    rt_priority_queue temp = *queue;
-    rt_thread *cur;
-    int found=0;
+    if (pos >= queue->size || queue->threads[pos] != thread) {
+	// not on this queue
+	return 0;
+    }
 
-    queue->size=0;
+    last = queue->threads[--queue->size];
+
+    if (pos == queue->size) {
+	// it was the last element
+	return thread;
+    }
+
+    // fill the hole with the last element, which may need
+    // to go either way from there
+    if (pos && queue->threads[parent(pos)]->deadline > last->deadline) {
+	rt_priority_queue_sift_up(queue, pos, last);
+    } else {
+	rt_priority_queue_sift_down(queue, pos, last);
+    }
+
+    return thread;
+}
+
+// capacity to use for a queue that must hold need threads
+static uint64_t rt_priority_queue_capacity_for(uint64_t need)
+{
+    uint64_t cap = RT_QUEUE_INIT_CAPACITY;
+
+    while (cap < need) {
+	cap *= 2;
+    }
 
-    while (!rt_priority_queue_empty(&temp)) {
-	cur=rt_priority_queue_dequeue(&temp);
-	if (cur && cur!=thread) {
-	    if (rt_priority_queue_enqueue(queue,cur)) { 
-		ERROR("Failed to re-enqueue in removal process...\n");
-	    } 
+    return MIN(cap,MAX_QUEUE);
+}
+
+// assure that the queue, which belongs to scheduler s, has room for need threads
+// must be called without the scheduler lock since it allocates
+static int rt_priority_queue_grow(rt_scheduler *s, rt_priority_queue *queue, uint64_t need)
+{
+    LOCAL_LOCK_CONF;
+
+    while (queue->capacity < need) {
+	uint64_t cap = rt_priority_queue_capacity_for(need);
+	rt_thread **n = (rt_thread **) MALLOC(cap*sizeof(rt_thread *));
+	rt_thread **old;
+
+	if (!n) {
+	    ERROR("Failed to grow priority queue to %lu threads\n", cap);
+	    return -1;
+	}
+
+	LOCAL_LOCK(s);
+	if (queue->capacity < cap) {
+	    memcpy(n, queue->threads, queue->size*sizeof(rt_thread *));
+	    old = queue->threads;
+	    queue->threads = n;
+	    queue->capacity = cap;
 	} else {
-	    found = 1;
+	    // someone else grew it meanwhile
+	    old = n;
 	}
+	LOCAL_UNLOCK(s);
+
+	FREE(old);
     }
-    if (!found) { 
-	return 0;
-    } else {
-	return thread;
+
+    return 0;
+}
+
+// assure that every priority queue on every cpu has room for need threads
+static int rt_priority_queues_grow(uint64_t need)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    rt_scheduler *s;
+    int cpu;
+
+    for (cpu=0;cpu<sys->num_cpus;cpu++) {
+	if (!(s = sys->cpus[cpu]->sched_state)) {
+	    // not up yet, and will size its queues when it comes up
+	    continue;
+	}
+	if (rt_priority_queue_grow(s,&s->runnable,need) ||
+	    rt_priority_queue_grow(s,&s->pending,need)
+#if NAUT_CONFIG_APERIODIC_DYNAMIC_LIFETIME || NAUT_CONFIG_APERIODIC_DYNAMIC_QUANTUM
+	    || rt_priority_queue_grow(s,&s->aperiodic,need)
+#endif
+	    ) {
+	    return -1;
+	}
     }
+
+    return 0;
 }
 
 static rt_thread *rt_priority_queue_peek(rt_priority_queue *queue, uint64_t pos)
@@ -1810,10 +2036,24 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 	next_arrival = PEEK_RT_PENDING(scheduler)->deadline;
     }
 
+    // our timer wheel needs the next interrupt no later than
+    // its next deadline
+    uint64_t next_timer = nk_timer_next_deadline();
+
     if (thread) { 
 	uint64_t remaining_time;
 	switch (thread->constraints.type) { 
 	case APERIODIC:
+#if NAUT_CONFIG_TICKLESS_IDLE
+	    if (thread->thread->is_idle && !SIZE_APERIODIC(scheduler) && !HAVE_RT(scheduler)) {
+		// nothing but idle is runnable, so there is no need to
+		// preempt it - we will sleep until the next real event
+		// or until we are kicked
+		next_preempt = MIN(now + TICKLESS_SLEEP_NS, next_timer);
+		scheduler->tickless_count++;
+		break;
+	    }
+#endif
 	    next_preempt = now + scheduler->cfg.aperiodic_quantum;
 	    break;
 	case SPORADIC:
@@ -1836,6 +2076,23 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 
     scheduler->tsc.start_time = now;
     scheduler->tsc.set_time = MIN(next_arrival,next_preempt);
+
+    scheduler->tsc.set_time = MIN(scheduler->tsc.set_time,next_timer);
+
+#if NAUT_CONFIG_TIMER_COALESCE
+    // If we are not committing to real-time constraints and the timer we 
+    // programmed earlier will fire only a little after we need it to, let
+    // it stand instead of reprogramming the timer for a separate interrupt
+    if (thread && thread->constraints.type==APERIODIC &&
+	scheduler->tsc.set_time != next_arrival && 
+	apic->timer_set && scheduler->tsc.armed_count == apic->timer_count &&
+	scheduler->tsc.armed_time >= scheduler->tsc.set_time &&
+	scheduler->tsc.armed_time - scheduler->tsc.set_time <= NAUT_CONFIG_TIMER_COALESCE_NS) {
+	scheduler->tsc.set_time = scheduler->tsc.armed_time;
+	scheduler->coalesce_count++;
+	return;
+    }
+#endif
     
   
     // the set time has been computed based on the "now" argument
@@ -1859,9 +2116,16 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
     //    DEBUG("Setting timer to at most %llu ns (%llu ticks)\n",scheduler->tsc.set_time - now + scheduler->slack,
     //	  apic_realtime_to_ticks(apic, scheduler->tsc.set_time - now + scheduler->slack));
 
-    apic_update_oneshot_timer(apic, 
-			      ticks,
-			      IF_EARLIER);
+    if (apic_update_oneshot_timer(apic, 
+				  ticks,
+				  IF_EARLIER)) {
+#if NAUT_CONFIG_TIMER_COALESCE
+	// only a deadline the apic was actually programmed for can
+	// be coalesced with later
+	scheduler->tsc.armed_time = scheduler->tsc.set_time;
+	scheduler->tsc.armed_count = apic->timer_count;
+#endif
+    }
 			      
 
 }
@@ -1953,6 +2217,12 @@ static int pump_sized_tasks(rt_scheduler *scheduler, rt_thread *next)
 	// consider a fraction of the available time
 	avail_time = ((next_time - current_time)*TASK_SLOP)/100;
 
+	// avoid the task lock if no bucket could hold a fitting task
+	// (unlocked read - at worst we miss a task that just arrived)
+	if (!(scheduler->tasks.sized_mask & ((2ULL << TASK_SIZE_BUCKET(avail_time)) - 1))) {
+	    return 0;
+	}
+
 	// find a sized task, on this cpu, that will fit, but don't search for too long
 	// and do not spin on any locks
 	task = nk_task_try_consume(my_cpu_id(), avail_time, TASK_LIMIT);
@@ -2074,6 +2344,8 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
     struct nk_thread *c = get_cur_thread();
     rt_thread *rt_c = c->sched_state;
 
+    lb_sample(scheduler);
+
     // optional
     stack_check(rt_c,1);
 
@@ -2854,6 +3126,25 @@ int nk_sched_thread_move(struct nk_thread *t, int new_cpu, int block)
 }
 
 
+// NUMA distance between two cpus, 0 if they are in the same domain
+static uint32_t sched_cpu_distance(int a, int b)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct numa_domain *da = sys->cpus[a]->domain;
+    struct numa_domain *db = sys->cpus[b]->domain;
+
+    if (!da || !db || da==db) {
+	return 0;
+    }
+
+    if (sys->locality_info.numa_matrix) {
+	return sys->locality_info.numa_matrix[da->id*sys->locality_info.num_domains + db->id];
+    }
+
+    // different domains, but no SLIT
+    return 1;
+}
+
 static int select_victim(int new_cpu)
 {
     int a,b;
@@ -2964,6 +3255,143 @@ int nk_sched_cpu_mug(int old_cpu, uint64_t maxcount, uint64_t *actualcount)
 }
 
 
+#if NAUT_CONFIG_LOAD_BALANCE
+
+// Periodic load balancing
+//
+// Each cpu keeps a moving average of the length of its aperiodic
+// run queue, sampled on every scheduling pass.   Periodically, the
+// idle thread of each cpu compares its average against those of the
+// other cpus, and if one is sufficiently busier, pulls some unbound
+// aperiodic threads from it.  The imbalance must be twice as large
+// for cpus in other NUMA domains.  Among the eligible threads, those
+// that have run the longest are preferred since compute-bound threads
+// gain the most from moving, while threads that have barely run or
+// that were moved during the last interval are left alone.
+
+#define LB_MIN_RUNTIME 1000000ULL  // ns a thread must have run before we move it
+
+int nk_sched_balance(uint64_t *actualcount)
+{
+    LOCAL_LOCK_CONF;
+    struct sys_info *sys = per_cpu_get(system);
+    int new_cpu = my_cpu_id();
+    int old_cpu = -1;
+    int cpu;
+    rt_scheduler *ns = sys->cpus[new_cpu]->sched_state;
+    rt_scheduler *os;
+    rt_thread *prosp[NAUT_CONFIG_LOAD_BALANCE_MAX_MOVE];
+    uint64_t now = cur_time();
+    uint64_t excess, best=0, want, count=0;
+    uint64_t cur, pos;
+
+    *actualcount = 0;
+
+    ns->lb_runs++;
+
+    // find the busiest cpu relative to us, in whole threads
+    for (cpu=0;cpu<sys->num_cpus;cpu++) {
+	os = sys->cpus[cpu]->sched_state;
+	if (cpu==new_cpu || !os || os->lb_load <= ns->lb_load) {
+	    continue;
+	}
+	excess = (os->lb_load - ns->lb_load) >> LB_SHIFT;
+	if (sched_cpu_distance(new_cpu,cpu)) {
+	    excess /= 2;
+	}
+	if (excess >= NAUT_CONFIG_LOAD_BALANCE_IMBALANCE && excess > best) {
+	    best = excess;
+	    old_cpu = cpu;
+	}
+    }
+
+    if (old_cpu<0) {
+	DEBUG("Load balance: no sufficiently busier cpu\n");
+	return 0;
+    }
+
+    // moving half the difference evens us out
+    want = MIN(MAX(best/2,1),NAUT_CONFIG_LOAD_BALANCE_MAX_MOVE);
+
+    DEBUG("Load balance: pulling up to %lu threads from cpu %d\n",want,old_cpu);
+
+    os = sys->cpus[old_cpu]->sched_state;
+
+    // phase one - grab control of the remote scheduler and
+    // pick the longest-running eligible threads
+    LOCAL_LOCK(os);
+
+    for (cur=0;cur<SIZE_APERIODIC(os);cur++) {
+	rt_thread *t = PEEK_APERIODIC(os,cur);
+	// do not move the idle thread, interrupt thread, task thread, or any bound thread
+	if (!t || t->thread->is_idle || t->is_intr || t->is_task || t->thread->bound_cpu>=0) {
+	    continue;
+	}
+	if (nk_sched_get_runtime(t->thread) < LB_MIN_RUNTIME ||
+	    (t->lb_time && (now - t->lb_time) < NAUT_CONFIG_LOAD_BALANCE_INTERVAL_MS*1000000ULL)) {
+	    continue;
+	}
+	// insert in descending order of run time
+	for (pos=count; pos>0 && nk_sched_get_runtime(prosp[pos-1]->thread) < nk_sched_get_runtime(t->thread); pos--) {
+	    if (pos<want) {
+		prosp[pos] = prosp[pos-1];
+	    }
+	}
+	if (pos<want) {
+	    prosp[pos] = t;
+	    if (count<want) {
+		count++;
+	    }
+	}
+    }
+
+    LOCAL_UNLOCK(os);
+
+    // phase two - attempt to move those threads to me
+    // as with mugging, these can fail since we are racing the remote scheduler
+    for (cur=0;cur<count;cur++) {
+	prosp[cur]->lb_time = now;
+	if (nk_sched_thread_move(prosp[cur]->thread,new_cpu,0)) {
+	    DEBUG("Load balance: could not pull thread %llu %s\n",prosp[cur]->thread->tid,prosp[cur]->thread->name);
+	    ns->lb_fails++;
+	} else {
+	    DEBUG("Load balance: pulled thread %llu %s\n",prosp[cur]->thread->tid,prosp[cur]->thread->name);
+	    (*actualcount)++;
+	}
+    }
+
+    ns->lb_pulls += *actualcount;
+
+    return 0;
+}
+
+#else
+
+int nk_sched_balance(uint64_t *actualcount)
+{
+    *actualcount = 0;
+    return 0;
+}
+
+#endif
+
+
+// does the caller's cpu have anything to do besides idling?
+// should be called with interrupts off to be meaningful
+int nk_sched_cpu_has_work()
+{
+    rt_scheduler *s = per_cpu_get(sched_state);
+
+    return SIZE_APERIODIC(s) || HAVE_RT(s) ||
+	(s->tasks.unsized_enqueued > s->tasks.unsized_dequeued) ||
+	(s->tasks.sized_enqueued > s->tasks.sized_dequeued);
+}
+
+void *nk_sched_cpu_wake_addr()
+{
+    return &per_cpu_get(sched_state)->tasks.unsized_enqueued;
+}
+
 void    nk_sched_kick_cpu(int cpu)
 {
 #ifdef NAUT_CONFIG_KICK_SCHEDULE
@@ -3583,10 +4011,160 @@ static inline uint64_t get_min_per(rt_priority_queue *runnable, rt_priority_queu
     return min_period;
 }
 
-static int task_initial_placement()
+static inline task_info *task_info_of(int cpu)
 {
     struct sys_info * sys = per_cpu_get(system);
-    return (int)(get_random() % sys->num_cpus);
+    return &sys->cpus[cpu]->sched_state->tasks;
+}
+
+// Chase-Lev deque operations
+// push and pop must only be invoked by the owning cpu with interrupts off
+// steal can be invoked from any cpu
+static inline int deque_push(task_deque *d, struct nk_task *t)
+{
+    sint64_t b = d->bottom;
+
+    if (b - d->top >= TASK_DEQUE_SIZE) {
+	// full
+	return -1;
+    }
+
+    d->buf[b & (TASK_DEQUE_SIZE-1)] = t;
+    // the slot must be written before the new bottom is visible;
+    // stores are not reordered with stores on x64
+    __asm__ __volatile__ ("" : : : "memory");
+    d->bottom = b + 1;
+
+    return 0;
+}
+
+static inline struct nk_task *deque_pop(task_deque *d)
+{
+    sint64_t b = d->bottom - 1;
+    sint64_t top;
+    struct nk_task *t = 0;
+
+    d->bottom = b;
+    // the new bottom must be visible to thieves before we look at top
+    mbarrier();
+    top = d->top;
+
+    if (top <= b) {
+	t = d->buf[b & (TASK_DEQUE_SIZE-1)];
+	if (top == b) {
+	    // last task - race any thieves for it
+	    if (!__sync_bool_compare_and_swap(&d->top, top, top+1)) {
+		t = 0;
+	    }
+	    d->bottom = b + 1;
+	}
+    } else {
+	// empty
+	d->bottom = b + 1;
+    }
+
+    return t;
+}
+
+static inline struct nk_task *deque_steal(task_deque *d)
+{
+    sint64_t top = d->top;
+    // loads are not reordered with loads on x64
+    __asm__ __volatile__ ("" : : : "memory");
+    sint64_t b = d->bottom;
+    struct nk_task *t;
+
+    if (top >= b) {
+	// empty
+	return 0;
+    }
+
+    t = d->buf[top & (TASK_DEQUE_SIZE-1)];
+
+    if (!__sync_bool_compare_and_swap(&d->top, top, top+1)) {
+	// lost to the owner or another thief
+	return 0;
+    }
+
+    return t;
+}
+
+// task descriptors are recycled through a small per-cpu pool
+static struct nk_task *task_alloc(int cpu)
+{
+    struct nk_task *t = 0;
+    uint8_t flags = irq_disable_save();
+    task_info *ti = &per_cpu_get(sched_state)->tasks;
+
+    if (ti->pool_count) {
+	t = ti->pool[--ti->pool_count];
+    }
+
+    irq_enable_restore(flags);
+
+    if (!t) {
+	t = MALLOC_SPECIFIC(sizeof(struct nk_task),cpu);
+    }
+
+    return t;
+}
+
+static void task_free(struct nk_task *t)
+{
+    uint8_t flags = irq_disable_save();
+    task_info *ti = &per_cpu_get(sched_state)->tasks;
+
+    if (ti->pool_count < TASK_POOL_SIZE) {
+	ti->pool[ti->pool_count++] = t;
+	t = 0;
+    }
+
+    irq_enable_restore(flags);
+
+    if (t) {
+	free(t);
+    }
+}
+
+static inline uint64_t task_rand(task_info *ti)
+{
+    // xorshift; concurrent use by threads on the same cpu
+    // only perturbs the sequence
+    uint64_t x = ti->rand;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    ti->rand = x;
+    return x;
+}
+
+// choose another cpu to take tasks from, either from those
+// in the nearest NUMA domains or from all of them
+// returns -1 if there are no other cpus
+static inline int task_victim(task_info *me, int near)
+{
+    uint32_t n = near ? me->num_near : me->num_victims;
+
+    if (!n) {
+	return -1;
+    }
+
+    return me->victims[task_rand(me) % n];
+}
+
+// let a nearby cpu know that we have surplus tasks so that its task
+// thread wakes up and steals some of them
+static void task_hint_thief(task_info *ti)
+{
+    if (!ti->num_near) {
+	return;
+    }
+
+    task_info *vi = task_info_of(ti->victims[ti->next_hint++ % ti->num_near]);
+
+    if (!vi->steal_hint && __sync_bool_compare_and_swap(&vi->steal_hint,0,1)) {
+	nk_wait_queue_wake_all(vi->waitq);
+    }
 }
 
 
@@ -3594,10 +4172,9 @@ struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void *(*f)(void*), vo
 {
     TASK_LOCK_CONF;
     
-    int placement_cpu = cpu>=0 ? cpu : task_initial_placement();
     uint64_t start = cur_time();
     
-    struct nk_task *t = MALLOC_SPECIFIC(sizeof(struct nk_task),placement_cpu);
+    struct nk_task *t = task_alloc(cpu>=0 ? cpu : my_cpu_id());
 
     if (!t) {
 	TASK_ERROR("Failed to allocate a task\n");
@@ -3615,42 +4192,81 @@ struct nk_task *nk_task_produce(int cpu, uint64_t size_ns, void *(*f)(void*), vo
 
     INIT_LIST_HEAD(&t->queue_node);
 
-    struct sys_info * sys = per_cpu_get(system);
-    task_info *ti = &sys->cpus[placement_cpu]->sched_state->tasks;
+    task_info *ti = 0;
+    sint64_t depth = 0;
+
+    if (!size_ns) {
+	// unsized tasks produced for ourselves go onto our deque if it has room
+	uint8_t iflags = irq_disable_save();
+	if (cpu<0 || cpu==my_cpu_id()) {
+	    task_info *mi = &per_cpu_get(sched_state)->tasks;
+	    if (!deque_push(&mi->deque,t)) {
+		__sync_fetch_and_add(&mi->unsized_enqueued,1);
+		depth = mi->deque.bottom - mi->deque.top;
+		ti = mi;
+	    }
+	}
+	irq_enable_restore(iflags);
+    }
 
-    // own the target scheduler's task queue
-    TASK_LOCK(ti);
-    if (t->stats.size_ns) {
-	list_add_tail(&t->queue_node, &ti->sized_queue);
-	ti->sized_enqueued++;
-    } else {
-	list_add_tail(&t->queue_node, &ti->unsized_queue);
-	ti->unsized_enqueued++;
+    if (!ti) {
+	// sized tasks, tasks for other cpus, and deque overflow
+	ti = task_info_of(cpu>=0 ? cpu : my_cpu_id());
+
+	// own the target scheduler's task queue
+	TASK_LOCK(ti);
+	if (t->stats.size_ns) {
+	    int b = TASK_SIZE_BUCKET(t->stats.size_ns);
+	    list_add_tail(&t->queue_node, &ti->sized_queue[b]);
+	    ti->sized_mask |= 1ULL << b;
+	    ti->sized_enqueued++;
+	} else {
+	    list_add_tail(&t->queue_node, &ti->unsized_queue);
+	    __sync_fetch_and_add(&ti->unsized_enqueued,1);
+	}
+	TASK_UNLOCK(ti);
     }
-    TASK_UNLOCK(ti);
 
     // kick any waitqueue
     nk_wait_queue_wake_all(ti->waitq);
 
+#if NAUT_CONFIG_TICKLESS_IDLE && NAUT_CONFIG_TASK_IN_IDLE
+    // the target's idle thread may be halted with no tick coming
+    if (cpu>=0 && cpu!=my_cpu_id()) {
+	nk_sched_kick_cpu(cpu);
+    }
+#endif
+
+    if (depth > 1) {
+	// more than our own task thread can take right now
+	task_hint_thief(ti);
+    }
+
     return t;
 }
 
-static int task_cpu_selection()
+// sized bucket helpers, must hold the task lock
+static inline struct nk_task *task_sized_head(task_info *ti, int b)
 {
-    struct sys_info * sys = per_cpu_get(system);
-    return (int)(get_random() % sys->num_cpus);
+    return list_entry(ti->sized_queue[b].next, struct nk_task, queue_node);
 }
 
-// dequeue a task, typically used internally
-// dequeuing a task does not execute it.
-static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t search_limit, int try)
+static inline void task_sized_del(task_info *ti, struct nk_task *t)
+{
+    int b = TASK_SIZE_BUCKET(t->stats.size_ns);
+
+    list_del_init(&t->queue_node);
+    if (list_empty(&ti->sized_queue[b])) {
+	ti->sized_mask &= ~(1ULL << b);
+    }
+    ti->sized_dequeued++;
+}
+
+// dequeue from the locked queues of the given cpu
+static struct nk_task *task_dequeue_locked(task_info *ti, uint64_t size_ns, uint64_t search_limit, int try)
 {
     TASK_LOCK_CONF;
     
-    int source_cpu = cpu>=0 ? cpu : task_cpu_selection();
-
-    struct sys_info * sys = per_cpu_get(system);
-    task_info *ti = &sys->cpus[source_cpu]->sched_state->tasks;
     struct nk_task *t = 0;
     struct list_head *cur;
 
@@ -3664,34 +4280,44 @@ static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t sear
     }
     
     if (size_ns) {
+	// the largest tasks that might fit are in the bucket of size_ns,
+	// so look through a few of them first
+	int b = TASK_SIZE_BUCKET(size_ns);
 	uint64_t count=0;
-	// search for a task that is smaller than the given size
-	// this could of course be much smarter...
-	list_for_each(cur, &ti->sized_queue) {
-	    struct nk_task *test = list_entry(cur,struct nk_task, queue_node);
-	    if (test->stats.size_ns <= size_ns) {
-		t = test;
-		list_del_init(cur);
-		ti->sized_dequeued++;
-		break;
+	if (ti->sized_mask & (1ULL << b)) {
+	    list_for_each(cur, &ti->sized_queue[b]) {
+		struct nk_task *test = list_entry(cur,struct nk_task, queue_node);
+		if (test->stats.size_ns <= size_ns) {
+		    t = test;
+		    break;
+		}
+		count++;
+		if (count >= search_limit) {
+		    break;
+		}
 	    }
-	    count++;
-	    if (count >= search_limit) {
-		break;
+	}
+	if (!t) {
+	    // otherwise the first task in the largest smaller bucket
+	    uint64_t lower = ti->sized_mask & ((1ULL << b) - 1);
+	    if (lower) {
+		t = task_sized_head(ti, 63 - __builtin_clzl(lower));
 	    }
 	}
+	if (t) {
+	    task_sized_del(ti, t);
+	}
     } else {
 	// try unsized queue first
 	if (!list_empty(&ti->unsized_queue)) {
 	    cur = ti->unsized_queue.next;
 	    t = list_entry(cur,struct nk_task, queue_node);
 	    list_del_init(cur);
-	    ti->unsized_dequeued++;
-	} else if (!list_empty(&ti->sized_queue)) {
-	    cur = ti->sized_queue.next;
-	    t = list_entry(cur,struct nk_task, queue_node);
-	    list_del_init(cur);
-	    ti->sized_dequeued++;
+	    __sync_fetch_and_add(&ti->unsized_dequeued,1);
+	} else if (ti->sized_mask) {
+	    // then the smallest sized task
+	    t = task_sized_head(ti, __builtin_ctzl(ti->sized_mask));
+	    task_sized_del(ti, t);
 	} else {
 	    // we got nuthin
 	}
@@ -3699,6 +4325,76 @@ static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t sear
 
     TASK_UNLOCK(ti);
 
+    return t;
+}
+
+// dequeue an unsized task from the given cpu, or a sized one if there are none:
+// the owner pops its deque, others steal from it
+static struct nk_task *task_take(int cpu, int try)
+{
+    task_info *ti = task_info_of(cpu);
+    struct nk_task *t;
+
+    uint8_t flags = irq_disable_save();
+    if (cpu==my_cpu_id()) {
+	t = deque_pop(&ti->deque);
+    } else {
+	t = deque_steal(&ti->deque);
+    }
+    irq_enable_restore(flags);
+
+    if (t) {
+	__sync_fetch_and_add(&ti->unsized_dequeued,1);
+	return t;
+    }
+
+    return task_dequeue_locked(ti,0,0,try);
+}
+
+// take a task from some other cpu, preferring nearby ones
+static struct nk_task *task_steal(int try)
+{
+    task_info *me = &per_cpu_get(sched_state)->tasks;
+    struct nk_task *t;
+    int i, victim;
+
+    for (i=0;i<TASK_STEAL_ATTEMPTS;i++) {
+	victim = task_victim(me, i < TASK_STEAL_ATTEMPTS/2);
+	if (victim<0) {
+	    return 0;
+	}
+	if ((t = task_take(victim,try))) {
+	    __sync_fetch_and_add(&me->steals,1);
+	    return t;
+	}
+    }
+
+    return 0;
+}
+
+// dequeue a task, typically used internally
+// dequeuing a task does not execute it.
+// cpu -1 means take the task from some other cpu
+static struct nk_task *_nk_task_consume(int cpu, uint64_t size_ns, uint64_t search_limit, int try)
+{
+    struct nk_task *t = 0;
+
+    if (size_ns) {
+	// sized tasks live only in the locked queues
+	int source_cpu = cpu;
+	if (source_cpu<0) {
+	    source_cpu = task_victim(&per_cpu_get(sched_state)->tasks,1);
+	    if (source_cpu<0) {
+		source_cpu = my_cpu_id();
+	    }
+	}
+	t = task_dequeue_locked(task_info_of(source_cpu),size_ns,search_limit,try);
+    } else if (cpu>=0) {
+	t = task_take(cpu,try);
+    } else {
+	t = task_steal(try);
+    }
+
     if (t) {
 	t->stats.dequeue_time_ns = cur_time();
     }
@@ -3721,12 +4417,15 @@ struct nk_task *nk_task_try_consume(int cpu, uint64_t size_ns, uint64_t search_l
 // this will delete the task if it's detached
 int nk_task_complete(struct nk_task *task, void *output)
 {
+    // a waiter may recycle the task as soon as it sees it completed,
+    // so everything must be read or written before the flag is set
+    uint64_t detached = task->flags & NK_TASK_DETACHED;
+
     task->output = output;
-    // setting the flag must occur *after* setting the output
-    __sync_fetch_and_or(&task->flags,NK_TASK_COMPLETED);
     task->stats.complete_time_ns = cur_time();
-    if (task->flags & NK_TASK_DETACHED) {
-	free(task);
+    __sync_fetch_and_or(&task->flags,NK_TASK_COMPLETED);
+    if (detached) {
+	task_free(task);
     }
     return 0;
 }
@@ -3778,7 +4477,7 @@ static int _nk_task_wait(struct nk_task *task, void **output, struct nk_task_sta
 	*stats = task->stats;
     }
 
-    free(task);
+    task_free(task);
 
     return 0;
 }
@@ -3795,10 +4494,55 @@ int nk_task_try_wait(struct nk_task *task, void **output, struct nk_task_stats *
 
 
 
+// order the other cpus by NUMA distance from us so that
+// thieves look to their neighbors first
+static int init_task_victims(task_info *ti)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    int me = my_cpu_id();
+    int i, j, cpu;
+
+    ti->rand = get_random() | 1;
+
+    if (sys->num_cpus < 2) {
+	return 0;
+    }
+
+    ti->victims = (int *) MALLOC_SPECIFIC(sizeof(int)*(sys->num_cpus-1),me);
+    if (!ti->victims) {
+	return -1;
+    }
+
+    for (cpu=0;cpu<sys->num_cpus;cpu++) {
+	if (cpu==me) {
+	    continue;
+	}
+	// insertion sort by distance
+	for (i=ti->num_victims;
+	     i>0 && sched_cpu_distance(me,ti->victims[i-1]) > sched_cpu_distance(me,cpu);
+	     i--) {
+	    ti->victims[i] = ti->victims[i-1];
+	}
+	ti->victims[i] = cpu;
+	ti->num_victims++;
+    }
+
+    for (j=0;
+	 j<ti->num_victims && sched_cpu_distance(me,ti->victims[j])==sched_cpu_distance(me,ti->victims[0]);
+	 j++) {
+    }
+    ti->num_near = j;
+
+    TASK_DEBUG("cpu %d has %u victims, %u near\n", me, ti->num_victims, ti->num_near);
+
+    return 0;
+}
+
 static struct nk_sched_percpu_state *init_local_state(struct nk_sched_config *cfg)
 {
     struct nk_sched_percpu_state *state = (struct nk_sched_percpu_state*)MALLOC_SPECIFIC(sizeof(struct nk_sched_percpu_state),my_cpu_id());
     char buf[NK_WAIT_QUEUE_NAME_LEN];
+    int i;
     
     if (!state) {
         ERROR("Could not allocate rt state\n");
@@ -3809,16 +4553,30 @@ static struct nk_sched_percpu_state *init_local_state(struct nk_sched_config *cf
 
 	state->cfg = *cfg;
 
-	state->runnable.type = RUNNABLE_QUEUE;
-        state->pending.type = PENDING_QUEUE;
+	uint64_t cap = rt_priority_queue_capacity_for(global_sched_state.num_threads+1);
+
+	if (rt_priority_queue_init(&state->runnable, RUNNABLE_QUEUE, cap) ||
+	    rt_priority_queue_init(&state->pending, PENDING_QUEUE, cap)) {
+	    ERROR("Could not allocate rt queues\n");
+	    goto fail_free;
+	}
+#if NAUT_CONFIG_APERIODIC_DYNAMIC_LIFETIME || NAUT_CONFIG_APERIODIC_DYNAMIC_QUANTUM
+	if (rt_priority_queue_init(&state->aperiodic, APERIODIC_QUEUE, cap)) {
+	    ERROR("Could not allocate rt queues\n");
+	    goto fail_free;
+	}
+#else
         state->aperiodic.type = APERIODIC_QUEUE;
+#endif
 
     }
     
     spinlock_init(&state->lock);
 
     spinlock_init(&state->tasks.lock);
-    INIT_LIST_HEAD(&state->tasks.sized_queue);
+    for (i=0;i<TASK_SIZE_BUCKETS;i++) {
+	INIT_LIST_HEAD(&state->tasks.sized_queue[i]);
+    }
     INIT_LIST_HEAD(&state->tasks.unsized_queue);
 
     snprintf(buf,NK_WAIT_QUEUE_NAME_LEN,"sched%d-task-wait",my_cpu_id());
@@ -3827,11 +4585,28 @@ static struct nk_sched_percpu_state *init_local_state(struct nk_sched_config *cf
 	ERROR("Could not allocate task state\n");
 	goto fail_free;
     }
+
+    if (init_task_victims(&state->tasks)) {
+	ERROR("Could not allocate task victims\n");
+	goto fail_free;
+    }
     
     return state;
 
  fail_free:
-    FREE(state); 
+    if (state) {
+	if (state->tasks.waitq) {
+	    nk_wait_queue_destroy(state->tasks.waitq);
+	}
+	// the queues are zeroed if never allocated
+	FREE(state->runnable.threads);
+	FREE(state->pending.threads);
+#if NAUT_CONFIG_APERIODIC_DYNAMIC_LIFETIME || NAUT_CONFIG_APERIODIC_DYNAMIC_QUANTUM
+	// otherwise aperiodic is an rt_queue with an inline array
+	FREE(state->aperiodic.threads);
+#endif
+	FREE(state);
+    }
 
     return 0;
 }
@@ -3896,7 +4671,7 @@ static int await_task(void *p)
 {
     task_info *ti = (task_info *) p;
 
-    return (ti->sized_enqueued > ti->sized_dequeued) || (ti->unsized_enqueued > ti->unsized_dequeued);
+    return (ti->sized_enqueued > ti->sized_dequeued) || (ti->unsized_enqueued > ti->unsized_dequeued) || ti->steal_hint;
 }
 
 static void task(void *in, void **out)
@@ -3937,6 +4712,10 @@ static void task(void *in, void **out)
 	    // no task, let's put ourselves to sleep on our own cpu's task queues
 	    struct sys_info * sys = per_cpu_get(system);
 	    task_info *ti = &sys->cpus[my_cpu_id()]->sched_state->tasks;
+	    if (__sync_lock_test_and_set(&ti->steal_hint,0)) {
+		// a neighbor asked for help while we were looking
+		continue;
+	    }
 	    nk_wait_queue_sleep_extended(ti->waitq, await_task, ti);
 	    // when we wake up, we will try again
 	}
@@ -56,6 +56,10 @@
 #include <nautilus/cachepart.h>
 #endif
 
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+#include <nautilus/stackpool.h>
+#endif
+
 
 #ifndef NAUT_CONFIG_DEBUG_SMP
 #undef DEBUG_PRINT
@@ -344,6 +348,13 @@ smp_ap_setup (struct cpu * core)
         return -1;
     }
     
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+    if (nk_stack_pool_init_ap() != 0) {
+        ERROR_PRINT("Could not setup stack pool for core %u\n", core->id);
+        return -1;
+    }
+#endif
+
     extern struct nk_sched_config sched_cfg;
 
     if (nk_sched_init_ap(&sched_cfg) != 0) {
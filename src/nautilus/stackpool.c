@@ -0,0 +1,455 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter A. Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter A. Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/percpu.h>
+#include <nautilus/mm.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/thread.h>
+#include <nautilus/stackpool.h>
+#include <nautilus/paging.h>
+#include <nautilus/idt.h>
+#include <nautilus/gdt.h>
+#include <nautilus/backtrace.h>
+
+#ifndef NAUT_CONFIG_DEBUG_THREADS
+#undef  DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("stackpool: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("stackpool: " fmt, ##args)
+#define INFO(fmt, args...)  INFO_PRINT("stackpool: " fmt, ##args)
+
+#define STACK_POOL_CLASSES (STACK_POOL_MAX_ORDER - STACK_POOL_MIN_ORDER + 1)
+
+//
+// A free stack is linked into its pool through its lowest usable
+// word, which is above the guard page if it has one.  Guards stay
+// armed while a stack is pooled.  They are only disarmed when
+// the stack goes back to the allocator.
+//
+struct stack_pool {
+    spinlock_t lock;
+    void      *head[STACK_POOL_CLASSES];
+    uint32_t   count[STACK_POOL_CLASSES];
+    uint64_t   hits;
+    uint64_t   misses;
+    uint64_t   frees;
+    uint64_t   releases;
+} __align(64);
+
+static struct stack_pool pools[NAUT_CONFIG_MAX_CPUS];
+
+static uint64_t guards_armed = 0;
+
+extern uint8_t cpu_info_ready;
+
+
+// size class of a stack, or -1 if it is too big for the pool
+static int stack_order(nk_stack_size_t size)
+{
+    int order = STACK_POOL_MIN_ORDER;
+
+    while (order <= STACK_POOL_MAX_ORDER && (1ULL << order) < size) {
+        order++;
+    }
+
+    return order > STACK_POOL_MAX_ORDER ? -1 : order;
+}
+
+static inline nk_stack_size_t guard_size(int order)
+{
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    return (1ULL << order) >= STACK_GUARD_MIN_SIZE ? STACK_GUARD_SIZE : 0;
+#else
+    return 0;
+#endif
+}
+
+static inline struct stack_pool *pool_of(int cpu)
+{
+    if (cpu < 0 || cpu >= nk_get_num_cpus()) {
+        cpu = cpu_info_ready ? my_cpu_id() : 0;
+    }
+    return &pools[cpu];
+}
+
+
+nk_stack_size_t nk_stack_size(nk_stack_size_t size)
+{
+    int order = stack_order(size);
+
+    if (order < 0) {
+        return size;
+    }
+
+    return (1ULL << order) - guard_size(order);
+}
+
+
+static void *stack_acquire(int order, int cpu)
+{
+    char *base = malloc_specific(1ULL << order, cpu);
+
+    if (!base) {
+        return 0;
+    }
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    if (guard_size(order)) {
+        // every stack of a guarded size is armed, so that
+        // release can always disarm it
+        if (nk_paging_guard_page((addr_t)base, 1)) {
+            ERROR("Cannot arm guard page for stack at %p\n", base);
+            free(base);
+            return 0;
+        }
+        __sync_fetch_and_add(&guards_armed, 1);
+    }
+#endif
+
+    return base + guard_size(order);
+}
+
+static void stack_release(void *stack, int order)
+{
+    char *base = (char *)stack - guard_size(order);
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    if (guard_size(order)) {
+        if (nk_paging_guard_page((addr_t)base, 0)) {
+            // we must not hand the allocator a page it cannot touch
+            ERROR("Cannot disarm guard page for stack at %p, leaking it\n", base);
+            return;
+        }
+        __sync_fetch_and_sub(&guards_armed, 1);
+    }
+#endif
+
+    free(base);
+}
+
+
+void *nk_stack_alloc(nk_stack_size_t size, int cpu)
+{
+    int order = stack_order(size);
+    struct stack_pool *p;
+    void *stack;
+    uint8_t flags;
+
+    if (order < 0) {
+        return malloc_specific(size, cpu);
+    }
+
+    p = pool_of(cpu);
+
+    flags = spin_lock_irq_save(&p->lock);
+    stack = p->head[order - STACK_POOL_MIN_ORDER];
+    if (stack) {
+        p->head[order - STACK_POOL_MIN_ORDER] = *(void **)stack;
+        p->count[order - STACK_POOL_MIN_ORDER]--;
+        p->hits++;
+    } else {
+        p->misses++;
+    }
+    spin_unlock_irq_restore(&p->lock, flags);
+
+    if (stack) {
+        DEBUG("Reusing pooled stack %p (order %d) for cpu %d\n", stack, order, cpu);
+        return stack;
+    }
+
+    return stack_acquire(order, cpu);
+}
+
+
+void nk_stack_free(void *stack, nk_stack_size_t size, int cpu)
+{
+    int order = stack_order(size);
+    struct stack_pool *p;
+    uint8_t flags;
+
+    if (!stack) {
+        return;
+    }
+
+    if (order < 0) {
+        free(stack);
+        return;
+    }
+
+    p = pool_of(cpu);
+
+    flags = spin_lock_irq_save(&p->lock);
+    if (p->count[order - STACK_POOL_MIN_ORDER] < NAUT_CONFIG_THREAD_STACK_POOL_DEPTH) {
+        *(void **)stack = p->head[order - STACK_POOL_MIN_ORDER];
+        p->head[order - STACK_POOL_MIN_ORDER] = stack;
+        p->count[order - STACK_POOL_MIN_ORDER]++;
+        p->frees++;
+        stack = 0;
+    } else {
+        p->releases++;
+    }
+    spin_unlock_irq_restore(&p->lock, flags);
+
+    if (stack) {
+        stack_release(stack, order);
+    }
+}
+
+
+void nk_stack_pool_drain(void)
+{
+    int cpu, c;
+    uint8_t flags;
+    void *list, *next;
+
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        struct stack_pool *p = &pools[cpu];
+        for (c = 0; c < STACK_POOL_CLASSES; c++) {
+            if (!p->count[c]) {
+                continue;
+            }
+            flags = spin_lock_irq_save(&p->lock);
+            list = p->head[c];
+            p->releases += p->count[c];
+            p->head[c] = 0;
+            p->count[c] = 0;
+            spin_unlock_irq_restore(&p->lock, flags);
+
+            for (; list; list = next) {
+                next = *(void **)list;
+                stack_release(list, c + STACK_POOL_MIN_ORDER);
+            }
+        }
+    }
+}
+
+
+void nk_stack_pool_get_stats(struct nk_stack_pool_stats *s)
+{
+    int cpu, c;
+    uint8_t flags;
+
+    memset(s, 0, sizeof(*s));
+
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        struct stack_pool *p = &pools[cpu];
+        flags = spin_lock_irq_save(&p->lock);
+        s->hits += p->hits;
+        s->misses += p->misses;
+        s->frees += p->frees;
+        s->releases += p->releases;
+        for (c = 0; c < STACK_POOL_CLASSES; c++) {
+            s->pooled += p->count[c];
+            s->bytes += p->count[c] * (1ULL << (c + STACK_POOL_MIN_ORDER));
+        }
+        spin_unlock_irq_restore(&p->lock, flags);
+    }
+
+    s->guards = guards_armed;
+}
+
+
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+
+//
+// A thread that runs into its guard page faults with its stack
+// pointer in the guard, so the page fault cannot be delivered on
+// that stack and becomes a double fault.   The double fault is
+// delivered on a separate per-CPU stack through the IST of a per-CPU
+// TSS so that we can say what happened instead of triple faulting.
+//
+
+#define DF_STACK_SIZE 0x4000
+#define DF_IST        1
+#define TSS_SEL       0x18
+
+struct tss64 {
+    uint32_t rsvd0;
+    uint64_t rsp[3];
+    uint64_t rsvd1;
+    uint64_t ist[7];
+    uint64_t rsvd2;
+    uint16_t rsvd3;
+    uint16_t iomap_base;
+} __packed;
+
+// the boot GDT (null, code, data) followed by our TSS descriptor
+struct guard_cpu {
+    uint64_t     gdt[5];
+    struct tss64 tss;
+} __packed;
+
+
+int nk_stack_guard_check(addr_t fault_addr)
+{
+    nk_thread_t *t;
+    addr_t low;
+
+    if (!cpu_info_ready || !(t = get_cur_thread()) || !t->stack) {
+        return 0;
+    }
+
+    low = (addr_t)t->stack;
+
+    if (stack_order(t->stack_size) < 0 ||
+        !guard_size(stack_order(t->stack_size)) ||
+        fault_addr < low - STACK_GUARD_SIZE || fault_addr >= low) {
+        return 0;
+    }
+
+    printk("\n+++ Stack Overflow +++\n"
+           "Thread %p (tid=%lu name=%s) ran off its stack %p-%p\n"
+           "Fault Address: %p in guard page (core=%u)\n",
+           t, t->tid, t->name[0] ? t->name : "(no name)",
+           t->stack, t->stack + t->stack_size, (void *)fault_addr, my_cpu_id());
+
+    return 1;
+}
+
+int nk_stack_guard_range(void *block, uint64_t size, addr_t *start, addr_t *end)
+{
+    int order = stack_order(size);
+
+    // stacks of a guarded class are exactly one power-of-two block
+    if (order < 0 || (1ULL << order) != size || !guard_size(order) ||
+        !nk_paging_guard_page_armed((addr_t)block)) {
+        return 0;
+    }
+
+    *start = (addr_t)block;
+    *end = (addr_t)block + guard_size(order);
+
+    return 1;
+}
+
+static int stack_df_handler(excp_entry_t *excp, excp_vec_t vector, void *state)
+{
+    addr_t fault_addr = read_cr2();
+
+    if (!nk_stack_guard_check(fault_addr)) {
+        printk("\n+++ Double Fault +++\n"
+               "RIP: %p    CR2: %p    (core=%u)\n",
+               (void *)excp->rip, (void *)fault_addr, my_cpu_id());
+    }
+
+    panic("DOUBLE FAULT. Dying.\n");
+
+    return 0;
+}
+
+static int guard_cpu_init(int cpu)
+{
+    struct gdt_desc64 cur, gdtr;
+    struct guard_cpu *g;
+    char *df_stack;
+    uint64_t base, limit;
+
+    asm volatile ("sgdt %0" : "=m"(cur));
+
+    if (cur.limit + 1 != 3 * sizeof(uint64_t)) {
+        ERROR("Unexpected GDT layout (limit %u) on cpu %d\n", cur.limit, cpu);
+        return -1;
+    }
+
+    g = malloc_specific(sizeof(*g), cpu);
+    df_stack = malloc_specific(DF_STACK_SIZE, cpu);
+
+    if (!g || !df_stack) {
+        ERROR("Cannot allocate double fault state for cpu %d\n", cpu);
+        if (g) {
+            free(g);
+        }
+        if (df_stack) {
+            free(df_stack);
+        }
+        return -1;
+    }
+
+    memset(g, 0, sizeof(*g));
+    memcpy(g->gdt, (void *)cur.base, 3 * sizeof(uint64_t));
+
+    g->tss.ist[DF_IST - 1] = (uint64_t)df_stack + DF_STACK_SIZE;
+    g->tss.iomap_base = sizeof(struct tss64);
+
+    base = (uint64_t)&g->tss;
+    limit = sizeof(struct tss64) - 1;
+
+    // available 64 bit TSS, present, DPL 0
+    g->gdt[3] = (limit & 0xffff) | ((base & 0xffffff) << 16) | (0x89ULL << 40) |
+                (((limit >> 16) & 0xf) << 48) | (((base >> 24) & 0xff) << 56);
+    g->gdt[4] = base >> 32;
+
+    gdtr.limit = sizeof(g->gdt) - 1;
+    gdtr.base = (uint64_t)g->gdt;
+
+    lgdt64(&gdtr);
+
+    asm volatile ("ltr %w0" :: "r"((uint16_t)TSS_SEL));
+
+    DEBUG("cpu %d double fault stack at %p\n", cpu, df_stack);
+
+    return 0;
+}
+
+#endif
+
+
+int nk_stack_pool_init(void)
+{
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    if (guard_cpu_init(my_cpu_id())) {
+        return -1;
+    }
+
+    if (idt_assign_ist(DF_EXCP, DF_IST) ||
+        idt_assign_entry(DF_EXCP, (ulong_t)stack_df_handler, 0)) {
+        ERROR("Cannot install double fault handler\n");
+        return -1;
+    }
+#endif
+
+    INFO("%d stacks of each size from %lu to %lu bytes per cpu%s\n",
+         NAUT_CONFIG_THREAD_STACK_POOL_DEPTH,
+         1UL << STACK_POOL_MIN_ORDER, 1UL << STACK_POOL_MAX_ORDER,
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+         ", with guard pages"
+#else
+         ""
+#endif
+        );
+
+    return 0;
+}
+
+
+int nk_stack_pool_init_ap(void)
+{
+#ifdef NAUT_CONFIG_THREAD_STACK_GUARD
+    return guard_cpu_init(my_cpu_id());
+#else
+    return 0;
+#endif
+}
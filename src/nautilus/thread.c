@@ -37,6 +37,7 @@
 #include <nautilus/list.h>
 #include <nautilus/errno.h>
 #include <nautilus/mm.h>
+#include <nautilus/stackpool.h>
 
 #ifdef NAUT_CONFIG_ENABLE_BDWGC
 #include <gc/bdwgc/bdwgc.h>
@@ -315,7 +316,7 @@ nk_thread_create (nk_thread_fun_t fun,
     struct sys_info * sys = per_cpu_get(system);
     nk_thread_t * t = NULL;
     int placement_cpu = bound_cpu<0 ? nk_sched_initial_placement() : bound_cpu;
-    nk_stack_size_t required_stack_size = stack_size ? stack_size: PAGE_SIZE;
+    nk_stack_size_t required_stack_size = nk_stack_size(stack_size ? stack_size: PAGE_SIZE);
 
     // First try to get a thread from the scheduler's pools
     if ((t=nk_sched_reanimate(required_stack_size,
@@ -343,7 +344,7 @@ nk_thread_create (nk_thread_fun_t fun,
 
 	t->stack_size = required_stack_size;
 
-	t->stack = (void*)malloc_specific(required_stack_size,placement_cpu);
+	t->stack = nk_stack_alloc(required_stack_size,placement_cpu);
 
 	if (!t->stack) {
 
@@ -367,7 +368,11 @@ nk_thread_create (nk_thread_fun_t fun,
 
     // a thread joins its creator's address space 
     t->aspace = get_cur_thread()->aspace;
-    
+
+    // as does its default memory placement policy
+    t->kmem_policy = get_cur_thread()->kmem_policy;
+    t->kmem_nodemask = get_cur_thread()->kmem_nodemask;
+
     t->fun = fun;
     t->input = input;
     t->output_loc = output;
@@ -407,7 +412,7 @@ out_err:
     // note that VC is not assigned on thread creation
     // so we do not need to clean it up
     
-    free(t->stack);
+    nk_stack_free(t->stack, t->stack_size, placement_cpu);
     free(t);
 
     return -EINVAL;
@@ -660,7 +665,7 @@ nk_thread_destroy (nk_thread_id_t t)
     nk_gc_bdwgc_thread_state_deinit(thethread);
 #endif
 
-    free(thethread->stack);
+    nk_stack_free(thethread->stack, thethread->stack_size, thethread->placement_cpu);
     free(thethread);
     
     preempt_enable();
@@ -52,18 +52,209 @@ static spinlock_t state_lock;
 #define STATE_TRY_LOCK()  spin_try_lock_irq_save(&state_lock,&_state_lock_flags)
 #define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
 
-// guards list of active timers
-static spinlock_t active_lock;
-#define ACTIVE_LOCK_CONF uint8_t _active_lock_flags
-#define ACTIVE_LOCK() _active_lock_flags = spin_lock_irq_save(&active_lock)
-#define ACTIVE_TRY_LOCK()  spin_try_lock_irq_save(&active_lock,&_active_lock_flags)
-#define ACTIVE_UNLOCK() spin_unlock_irq_restore(&active_lock, _active_lock_flags);
-
 static struct list_head timer_list;
-static struct list_head active_timer_list;
 
 static uint64_t count=0;
 
+/*
+ * Per-CPU hierarchical timer wheels
+ *
+ * Time is counted in ticks of 2^WHEEL_TICK_SHIFT ns.  Level L of a
+ * wheel has WHEEL_SIZE slots of 2^(L*WHEEL_BITS) ticks each.  A timer 
+ * expiring at tick e goes in the lowest level L for which e's level L
+ * slot is less than a full turn of the level ahead of the clock's, in
+ * slot (e >> L*WHEEL_BITS) % WHEEL_SIZE.  When the clock reaches the
+ * start of a level L slot, its timers are reinserted (cascaded), which
+ * brings them down a level or more.  Level 0 slots expire.  Start and 
+ * cancel are O(1).
+ *
+ * Each level has a bitmap of its occupied slots, so the handler can 
+ * jump the clock straight to the next tick at which a slot expires or
+ * cascades instead of walking every tick.  The next such tick is also
+ * the wheel's deadline, which tickless idle uses.
+ *
+ * A wheel is only expired by its own cpu, but other cpus may start 
+ * and cancel timers on it under its lock.
+ */
+
+#define WHEEL_TICK_SHIFT 10   // ~1 us ticks
+#define WHEEL_BITS       6
+#define WHEEL_SIZE       (1UL << WHEEL_BITS)
+#define WHEEL_MASK       (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS     6    // 2^46 ns, about 19 hours, before clamping
+
+struct timer_wheel {
+    spinlock_t        lock;
+    uint64_t          clock;       // next tick to process
+    volatile uint64_t next_tick;   // next tick to expire or cascade at, -1 if none
+    uint64_t          occupied[WHEEL_LEVELS];
+    struct list_head  slots[WHEEL_LEVELS][WHEEL_SIZE];
+
+    uint64_t          active;
+    uint64_t          starts;
+    uint64_t          cancels;
+    uint64_t          expires;
+    uint64_t          cascades;
+    uint64_t          late_sum_ns;
+    uint64_t          late_max_ns;
+};
+
+static struct timer_wheel *wheels[NAUT_CONFIG_MAX_CPUS];
+
+#define WHEEL_LOCK_CONF uint8_t _wheel_lock_flags
+#define WHEEL_LOCK(w) _wheel_lock_flags = spin_lock_irq_save(&(w)->lock)
+#define WHEEL_UNLOCK(w) spin_unlock_irq_restore(&(w)->lock, _wheel_lock_flags);
+
+static inline uint64_t ror64(uint64_t x, uint64_t r)
+{
+    return r ? (x >> r) | (x << (64 - r)) : x;
+}
+
+// tick at which a timer expires, rounded up so it is never early
+static inline uint64_t timer_tick(nk_timer_t *t)
+{
+    return (t->time_ns + (1UL << WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+}
+
+// the next tick at or after the clock at which a slot expires or
+// cascades, or -1 if the wheel is empty
+static uint64_t wheel_next(struct timer_wheel *w)
+{
+    uint64_t next = -1;
+    uint64_t shift, base, t;
+    int l;
+
+    for (l=0; l<WHEEL_LEVELS; l++) {
+	if (!w->occupied[l]) {
+	    continue;
+	}
+	shift = l*WHEEL_BITS;
+	// first slot of this level that starts at or after the clock
+	base = (w->clock + (1UL << shift) - 1) >> shift;
+	t = (base + __builtin_ctzl(ror64(w->occupied[l], base & WHEEL_MASK))) << shift;
+	if (t < next) {
+	    next = t;
+	}
+    }
+
+    return next;
+}
+
+// caller holds the wheel lock
+static void wheel_insert(struct timer_wheel *w, nk_timer_t *t)
+{
+    uint64_t e = timer_tick(t);
+    uint64_t shift;
+    uint32_t l, slot;
+
+    if (e < w->clock) {
+	e = w->clock;   // already due
+    }
+
+    for (l=0; l<WHEEL_LEVELS; l++) {
+	shift = l*WHEEL_BITS;
+	if ((e >> shift) - (w->clock >> shift) < WHEEL_SIZE) {
+	    break;
+	}
+    }
+
+    if (l==WHEEL_LEVELS) {
+	// beyond the top level - park it in the furthest top slot,
+	// it will be cascaded again when that comes around
+	l = WHEEL_LEVELS-1;
+	slot = ((w->clock >> (l*WHEEL_BITS)) + WHEEL_MASK) & WHEEL_MASK;
+    } else {
+	slot = (e >> (l*WHEEL_BITS)) & WHEEL_MASK;
+    }
+
+    t->wheel_slot = l*WHEEL_SIZE + slot;
+    list_add_tail(&t->active_node, &w->slots[l][slot]);
+    w->occupied[l] |= 1UL << slot;
+}
+
+// caller holds the wheel lock
+static void wheel_remove(struct timer_wheel *w, nk_timer_t *t)
+{
+    uint32_t l = t->wheel_slot / WHEEL_SIZE;
+    uint32_t slot = t->wheel_slot % WHEEL_SIZE;
+
+    list_del_init(&t->active_node);
+    if (list_empty(&w->slots[l][slot])) {
+	w->occupied[l] &= ~(1UL << slot);
+    }
+}
+
+// reinsert the timers of a slot - caller holds the wheel lock
+static void wheel_cascade(struct timer_wheel *w, uint32_t l, uint32_t slot)
+{
+    struct list_head temp;
+    nk_timer_t *cur, *next;
+
+    if (!(w->occupied[l] & (1UL << slot))) {
+	return;
+    }
+
+    INIT_LIST_HEAD(&temp);
+    list_splice_init(&w->slots[l][slot], &temp);
+    w->occupied[l] &= ~(1UL << slot);
+
+    list_for_each_entry_safe(cur, next, &temp, active_node) {
+	list_del_init(&cur->active_node);
+	wheel_insert(w, cur);
+	w->cascades++;
+    }
+}
+
+// process all ticks up to and including now_tick, moving the expired
+// timers to the expired list - caller holds the wheel lock
+static void wheel_advance(struct timer_wheel *w, uint64_t now_tick, struct list_head *expired)
+{
+    uint64_t next;
+    uint32_t l;
+    nk_timer_t *cur, *temp;
+
+    while (w->clock <= now_tick) {
+	next = wheel_next(w);
+	if (next > now_tick) {
+	    w->clock = now_tick + 1;
+	    break;
+	}
+	w->clock = next;
+
+	// cascade the higher level slots that start here
+	for (l=1; l<WHEEL_LEVELS && !(w->clock & ((1UL << (l*WHEEL_BITS)) - 1)); l++) {
+	    wheel_cascade(w, l, (w->clock >> (l*WHEEL_BITS)) & WHEEL_MASK);
+	}
+
+	// expire the level 0 slot
+	list_for_each_entry_safe(cur, temp, &w->slots[0][w->clock & WHEEL_MASK], active_node) {
+	    cur->state = NK_TIMER_SIGNALLED;
+	    list_del_init(&cur->active_node);
+	    list_add_tail(&cur->active_node, expired);
+	}
+	w->occupied[0] &= ~(1UL << (w->clock & WHEEL_MASK));
+
+	w->clock++;
+    }
+
+    w->next_tick = wheel_next(w);
+}
+
+// absolute expiration time of a timer set ns from now
+static inline uint64_t timer_deadline(uint64_t ns, uint64_t flags)
+{
+    uint64_t t = nk_sched_get_realtime() + ns;
+
+#if NAUT_CONFIG_TIMER_COALESCE
+    if (flags != NK_TIMER_SPIN) {
+	// round up so that nearby timers expire together
+	t = ((t + NAUT_CONFIG_TIMER_COALESCE_NS - 1) / NAUT_CONFIG_TIMER_COALESCE_NS) * NAUT_CONFIG_TIMER_COALESCE_NS;
+    }
+#endif
+
+    return t;
+}
+
 
 nk_timer_t *nk_timer_create(char *name)
 {
@@ -139,7 +330,7 @@ int nk_timer_set(nk_timer_t *t,
     }
     
     t->flags = flags ;
-    t->time_ns = nk_sched_get_realtime() + ns;
+    t->time_ns = timer_deadline(ns, flags);
     t->callback = callback;
     t->priv = p;
     t->cpu = cpu;
@@ -171,7 +362,7 @@ int nk_timer_reset(nk_timer_t *t,
 	ERROR("Weird - resetting active timer %s\n", t->name);
     }
     
-    t->time_ns = nk_sched_get_realtime() + ns;
+    t->time_ns = timer_deadline(ns, t->flags);
 
     DEBUG("reset %s : state=%s flags=0x%llx (%s), time=%lluns, callback=%p priv=%p cpu=%lu\n",
 	  t->name,
@@ -190,19 +381,45 @@ int nk_timer_reset(nk_timer_t *t,
 
 int nk_timer_start(nk_timer_t *t)
 {
-    ACTIVE_LOCK_CONF;
+    WHEEL_LOCK_CONF;
     int was_active=0;
+    int earliest=0;
+    uint32_t cpu;
+    struct timer_wheel *w;
+
+    // callbacks run on the cpu that expires the timer
+    if (t->flags == NK_TIMER_CALLBACK && t->cpu < nk_get_num_cpus()) {
+	cpu = t->cpu;
+    } else {
+	cpu = my_cpu_id();
+    }
+
+    w = wheels[cpu];
     
-    ACTIVE_LOCK();
+    WHEEL_LOCK(w);
     if (t->state == NK_TIMER_ACTIVE) {
 	// do not add it again if it's already been started...
 	was_active = 1;
     } else {
+	uint64_t old_next = w->next_tick;
 	t->state = NK_TIMER_ACTIVE;
-	list_add_tail(&t->active_node, &active_timer_list);
-	was_active = 0;
+	t->wheel_cpu = cpu;
+	wheel_insert(w, t);
+	w->next_tick = wheel_next(w);
+	earliest = w->next_tick < old_next;
+	w->active++;
+	w->starts++;
+    }
+    WHEEL_UNLOCK(w);
+
+#if NAUT_CONFIG_TICKLESS_IDLE
+    // the owning cpu may be sleeping until some later event
+    if (earliest && cpu!=my_cpu_id()) {
+	nk_sched_kick_cpu(cpu);
     }
-    ACTIVE_UNLOCK();
+#else
+    (void)earliest;
+#endif
 
     if (was_active) { 
 	ERROR("Weird:  started already active timer %s\n",t->name);
@@ -215,17 +432,30 @@ int nk_timer_start(nk_timer_t *t)
 
 int nk_timer_cancel(nk_timer_t *t)
 {
-    ACTIVE_LOCK_CONF;
+    WHEEL_LOCK_CONF;
     int was_active=0;
+    struct timer_wheel *w;
+
+    // the timer can only move to another wheel if it is restarted,
+    // so once we hold the lock of the wheel it names, it is ours
+    while (1) {
+	w = wheels[t->wheel_cpu];
+	WHEEL_LOCK(w);
+	if (w == wheels[t->wheel_cpu]) {
+	    break;
+	}
+	WHEEL_UNLOCK(w);
+    }
 
-    ACTIVE_LOCK();
     // we may not be active - only delete if we are
     if (t->state == NK_TIMER_ACTIVE) { 
-	list_del_init(&t->active_node);
+	wheel_remove(w, t);
+	w->active--;
+	w->cancels++;
 	was_active=1;
     }
     t->state = was_active ? NK_TIMER_SIGNALLED : NK_TIMER_INACTIVE;
-    ACTIVE_UNLOCK();
+    WHEEL_UNLOCK(w);
     // now do handling that does not require the lock
     if (was_active) { 
 	DEBUG("canceling %s\n",t->name);
@@ -330,7 +560,7 @@ int nk_sleep(uint64_t ns) { return _sleep(ns,0); }
 int nk_delay(uint64_t ns) { return _sleep(ns,1); }
 
 //
-// Currently, the timer handler only makes sense on cpu 0
+// The timer handler expires the timers of the calling cpu's wheel
 //
 //
 // Note that debug output here is often a bad idea since
@@ -339,32 +569,35 @@ int nk_delay(uint64_t ns) { return _sleep(ns,1); }
 // debug output if you know what you are doing
 uint64_t nk_timer_handler (void)
 {
-    if (my_cpu_id()!=0) {
-	//DEBUG("update: cpu %d - ignored/infinity\n",my_cpu_id());
+    struct timer_wheel *w = wheels[my_cpu_id()];
+
+    if (!w) {
 	return -1;  // infinitely far in the future
     }
 
-    ACTIVE_LOCK_CONF;
+    WHEEL_LOCK_CONF;
     nk_timer_t *cur, *temp;
     uint64_t now = nk_sched_get_realtime();
-    uint64_t earliest = -1;
+    uint64_t earliest;
     struct list_head expired_list;
     INIT_LIST_HEAD(&expired_list);
 
-    ACTIVE_LOCK();
+    WHEEL_LOCK(w);
     
     // first, find expired timers with lock held
-    list_for_each_entry_safe(cur, temp, &active_timer_list, active_node) {
-	//DEBUG("considering %s\n",cur->name);
-	if (now >= cur->time_ns) { 
-	    //DEBUG("found expired timer %s\n",cur->name);
-	    cur->state = NK_TIMER_SIGNALLED;
-	    list_del_init(&cur->active_node);
-	    list_add_tail(&cur->active_node, &expired_list);
+    wheel_advance(w, now >> WHEEL_TICK_SHIFT, &expired_list);
+
+    list_for_each_entry(cur, &expired_list, active_node) {
+	uint64_t late = now - cur->time_ns;
+	w->active--;
+	w->expires++;
+	w->late_sum_ns += late;
+	if (late > w->late_max_ns) {
+	    w->late_max_ns = late;
 	}
-	    
     }
-    ACTIVE_UNLOCK();
+
+    WHEEL_UNLOCK(w);
 
     // now handle expired timers without holding the lock
     // so that callbacks/etc can restart the timer if desired
@@ -381,12 +614,9 @@ uint64_t nk_timer_handler (void)
 	    nk_wait_queue_wake_all(cur->waitq);
 	    break;
 	case NK_TIMER_CALLBACK: 
-	    // launch callback, but do not wait for it
+	    // we are the cpu the callback is meant for, so just run it
 	    //DEBUG("launching callback for %s\n", cur->name);
-	    smp_xcall(cur->cpu,
-		      cur->callback,
-		      cur->priv,
-		      0);
+	    cur->callback(cur->priv);
 	    break;
 	default:
 	    //ERROR("unsupported 0x%lx\n", cur->flags);
@@ -394,29 +624,74 @@ uint64_t nk_timer_handler (void)
 	}
     }
 
-    // Now we need to scan for the earliest given that the callbacks
-    // may have started new timers, with lock held
-    ACTIVE_LOCK();
-    list_for_each_entry_safe(cur, temp, &active_timer_list, active_node) {
-	//DEBUG("check timer %s\n",cur->name);
-	if (cur->time_ns < earliest) { 
-	    earliest = cur->time_ns;
-	}
-    }
-    ACTIVE_UNLOCK();
+    // the callbacks may have started new timers, which is
+    // reflected in the wheel's next tick
+    earliest = nk_timer_next_deadline();
     
     //DEBUG("update: earliest is %llu\n",earliest);
 
-    return earliest;
+    if (earliest == -1) {
+	return -1;
+    }
+
+    // callers want the time from now
+    now = nk_sched_get_realtime();
+
+    return earliest > now ? earliest - now : 1;
+}
+
+uint64_t nk_timer_next_deadline(void)
+{
+    struct timer_wheel *w = wheels[my_cpu_id()];
+    uint64_t next = w ? w->next_tick : -1;
+
+    return next == -1 ? -1 : next << WHEEL_TICK_SHIFT;
+}
+
+int nk_timer_get_stats(int cpu, struct nk_timer_stats *s)
+{
+    struct timer_wheel *w;
+
+    if (cpu<0 || cpu>=nk_get_num_cpus() || !(w = wheels[cpu])) {
+	return -1;
+    }
+
+    // unsynchronized reads, good enough for stats
+    s->active = w->active;
+    s->starts = w->starts;
+    s->cancels = w->cancels;
+    s->expires = w->expires;
+    s->cascades = w->cascades;
+    s->late_sum_ns = w->late_sum_ns;
+    s->late_max_ns = w->late_max_ns;
+
+    return 0;
 }
 
 
 int nk_timer_init()
 {
+    int i, l, s;
+
     spinlock_init(&state_lock);
-    spinlock_init(&active_lock);
     INIT_LIST_HEAD(&timer_list);
-    INIT_LIST_HEAD(&active_timer_list);
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	struct timer_wheel *w = malloc_specific(sizeof(struct timer_wheel),i);
+	if (!w) {
+	    ERROR("Failed to allocate timer wheel for cpu %d\n",i);
+	    return -1;
+	}
+	memset(w,0,sizeof(*w));
+	spinlock_init(&w->lock);
+	w->next_tick = -1;
+	for (l=0;l<WHEEL_LEVELS;l++) {
+	    for (s=0;s<WHEEL_SIZE;s++) {
+		INIT_LIST_HEAD(&w->slots[l][s]);
+	    }
+	}
+	wheels[i] = w;
+    }
 
     INFO("Timers inited\n");
     return 0;
@@ -0,0 +1,361 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2019, Peter Dinda
+ * Copyright (c) 2019, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/idt.h>
+#include <nautilus/irq.h>
+#include <nautilus/smp.h>
+#include <nautilus/tlb.h>
+#include <dev/apic.h>
+
+#ifndef NAUT_CONFIG_DEBUG_ASPACES
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...) 
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("tlb: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("tlb: " fmt, ##args)
+#define INFO(fmt, args...)   INFO_PRINT("tlb: " fmt, ##args)
+
+// a flush in progress - lives on the initiator's stack until every
+// target has handled it
+struct tlb_req {
+    struct nk_tlb_batch *batch;
+    uint64_t             gen;
+    volatile uint64_t    pending;
+};
+
+static struct tlb_cpu {
+    struct tlb_req * volatile req;            // what this CPU is waiting on
+    volatile uint64_t from[NK_TLB_CPU_WORDS]; // CPUs with a request for us
+    struct nk_tlb_stats stats;
+} __attribute__((aligned(64))) tlb_cpus[NAUT_CONFIG_MAX_CPUS];
+
+static ulong_t tlb_vector = 0;
+
+#define CPU_BIT(id)  (1ULL<<((id)%64))
+#define CPU_WORD(id) ((id)/64)
+
+
+void nk_tlb_domain_init(struct nk_tlb_domain *d, uint64_t pcid)
+{
+    memset((void*)d,0,sizeof(*d));
+    d->pcid = pcid;
+    // no CPU has seen generation 1, so a recycled PCID is flushed
+    // everywhere on first use
+    d->gen = 1;
+}
+
+int nk_tlb_domain_enter(struct nk_tlb_domain *d)
+{
+    cpu_id_t id = my_cpu_id();
+    uint64_t gen;
+
+    // the atomic orders this against the read of the generation, so
+    // a concurrent flush either sees us active or we see its generation
+    __sync_fetch_and_or(&d->active[CPU_WORD(id)],CPU_BIT(id));
+
+    gen = d->gen;
+
+    if (d->pcid && d->cpu_gen[id]==gen) {
+	return 1;
+    }
+
+    d->cpu_gen[id] = gen;
+
+    return 0;
+}
+
+void nk_tlb_domain_leave(struct nk_tlb_domain *d)
+{
+    cpu_id_t id = my_cpu_id();
+
+    __sync_fetch_and_and(&d->active[CPU_WORD(id)],~CPU_BIT(id));
+}
+
+
+void nk_tlb_batch_init(struct nk_tlb_batch *b, struct nk_tlb_domain *d)
+{
+    b->domain = d;
+    b->full = 0;
+    b->num_pages = 0;
+    b->num_ranges = 0;
+}
+
+void nk_tlb_batch_add(struct nk_tlb_batch *b, addr_t va, uint64_t page_size)
+{
+    struct nk_tlb_range *r;
+
+    if (b->full) {
+	return;
+    }
+
+    if (++b->num_pages > NK_TLB_INVLPG_MAX) {
+	b->full = 1;
+	return;
+    }
+
+    if (b->num_ranges) {
+	r = &b->ranges[b->num_ranges-1];
+	if (r->page_size==page_size && r->va + r->num_pages*page_size == va) {
+	    r->num_pages++;
+	    return;
+	}
+    }
+
+    if (b->num_ranges==NK_TLB_BATCH_RANGES) {
+	b->full = 1;
+	return;
+    }
+
+    r = &b->ranges[b->num_ranges++];
+    r->va = va;
+    r->page_size = page_size;
+    r->num_pages = 1;
+}
+
+// drops every translation, tagged or global, for every PCID
+static void flush_all_contexts(void)
+{
+    uint64_t cr4 = read_cr4();
+
+    write_cr4(cr4 ^ CR4_PGE);
+    write_cr4(cr4);
+}
+
+static void invalidate(struct nk_tlb_batch *b, struct nk_tlb_stats *s)
+{
+    uint64_t i, j;
+
+    if (b->full) {
+	// reloading CR3 without the no-flush bit drops the current PCID
+	write_cr3(read_cr3());
+	s->full_flushes++;
+	return;
+    }
+
+    for (i=0;i<b->num_ranges;i++) {
+	for (j=0;j<b->ranges[i].num_pages;j++) {
+	    invlpg(b->ranges[i].va + j*b->ranges[i].page_size);
+	    s->invlpgs++;
+	}
+    }
+}
+
+// returns 0 if there was nothing to do here
+static int apply(struct nk_tlb_batch *b, uint64_t gen, cpu_id_t id)
+{
+    struct nk_tlb_domain *d = b->domain;
+    struct nk_tlb_stats *s = &tlb_cpus[id].stats;
+
+    if (!d) {
+	// the kernel's mappings are cached under every PCID this CPU has used
+	if (read_cr4() & CR4_PCIDE) {
+	    flush_all_contexts();
+	    s->full_flushes++;
+	} else {
+	    invalidate(b,s);
+	}
+	return 1;
+    }
+
+    if (!(d->active[CPU_WORD(id)] & CPU_BIT(id))) {
+	// INVLPG only reaches the current PCID - entering the domain
+	// again will see the new generation instead
+	return 0;
+    }
+
+    invalidate(b,s);
+
+    // batches are serialized, so if we were current before this one,
+    // we are current now
+    if (b->full ? d->cpu_gen[id] < gen : d->cpu_gen[id] == gen-1) {
+	d->cpu_gen[id] = gen;
+    }
+
+    return 1;
+}
+
+void nk_tlb_poll(void)
+{
+    cpu_id_t id = my_cpu_id();
+    struct tlb_cpu *me = &tlb_cpus[id];
+    struct tlb_req *req;
+    uint64_t bits;
+    int w, src;
+
+    for (w=0;w<NK_TLB_CPU_WORDS;w++) {
+	while ((bits = me->from[w])) {
+	    src = w*64 + __builtin_ctzll(bits);
+	    __sync_fetch_and_and(&me->from[w],~CPU_BIT(src));
+	    req = tlb_cpus[src].req;
+	    if (!apply(req->batch,req->gen,id)) {
+		me->stats.lazy++;
+	    }
+	    me->stats.handled++;
+	    // req may vanish once this drops to zero
+	    __sync_fetch_and_sub(&req->pending,1);
+	}
+    }
+}
+
+static int tlb_handler(excp_entry_t *e, excp_vec_t v, void *state)
+{
+    nk_tlb_poll();
+    IRQ_HANDLER_END();
+    return 0;
+}
+
+static void flush(struct nk_tlb_batch *b, uint64_t gen, uint64_t *targets)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct apic_dev *apic = per_cpu_get(apic);
+    cpu_id_t id = my_cpu_id();
+    struct tlb_cpu *me = &tlb_cpus[id];
+    struct tlb_req req;
+    uint64_t bits, count = 0;
+    int w, t;
+
+    apply(b,gen,id);
+    targets[CPU_WORD(id)] &= ~CPU_BIT(id);
+
+    for (w=0;w<NK_TLB_CPU_WORDS;w++) {
+	count += __builtin_popcountll(targets[w]);
+    }
+
+    if (count && tlb_vector) {
+	req.batch = b;
+	req.gen = gen;
+	req.pending = count;
+	me->req = &req;
+
+	for (w=0;w<NK_TLB_CPU_WORDS;w++) {
+	    for (bits=targets[w]; bits; bits &= bits-1) {
+		t = w*64 + __builtin_ctzll(bits);
+		__sync_fetch_and_or(&tlb_cpus[t].from[CPU_WORD(id)],CPU_BIT(id));
+		apic_ipi(apic, sys->cpus[t]->apic->id, tlb_vector);
+		me->stats.ipis++;
+	    }
+	}
+
+	// others may be waiting on us in turn
+	while (req.pending) {
+	    nk_tlb_poll();
+	    asm volatile ("pause");
+	}
+
+	me->req = 0;
+    }
+
+    me->stats.flushes++;
+}
+
+void nk_tlb_batch_flush(struct nk_tlb_batch *b)
+{
+    struct nk_tlb_domain *d = b->domain;
+    uint64_t targets[NK_TLB_CPU_WORDS];
+    uint64_t gen;
+    uint8_t flags;
+    int w;
+
+    if (!b->num_pages) {
+	return;
+    }
+
+    flags = irq_disable_save();
+
+    // the tables already changed - bumping first means a CPU entering
+    // from here on either flushes or is in the active set we read next
+    gen = __sync_add_and_fetch(&d->gen,1);
+
+    for (w=0;w<NK_TLB_CPU_WORDS;w++) {
+	targets[w] = d->active[w];
+    }
+
+    flush(b,gen,targets);
+
+    irq_enable_restore(flags);
+}
+
+void nk_tlb_flush_kernel(addr_t va, uint64_t page_size)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct nk_tlb_batch b;
+    uint64_t targets[NK_TLB_CPU_WORDS];
+    uint8_t flags;
+    int i;
+
+    nk_tlb_batch_init(&b,0);
+    nk_tlb_batch_add(&b,va,page_size);
+
+    memset(targets,0,sizeof(targets));
+
+    // the BSP never marks itself booted
+    for (i=0;i<sys->num_cpus;i++) {
+	if (i==my_cpu_id() || (sys->cpus[i] && sys->cpus[i]->booted)) {
+	    targets[CPU_WORD(i)] |= CPU_BIT(i);
+	}
+    }
+
+    flags = irq_disable_save();
+    flush(&b,0,targets);
+    irq_enable_restore(flags);
+}
+
+void nk_tlb_get_stats(struct nk_tlb_stats *s)
+{
+    int i;
+
+    memset(s,0,sizeof(*s));
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	s->flushes += tlb_cpus[i].stats.flushes;
+	s->ipis += tlb_cpus[i].stats.ipis;
+	s->handled += tlb_cpus[i].stats.handled;
+	s->lazy += tlb_cpus[i].stats.lazy;
+	s->invlpgs += tlb_cpus[i].stats.invlpgs;
+	s->full_flushes += tlb_cpus[i].stats.full_flushes;
+    }
+}
+
+int nk_tlb_init(void)
+{
+    ulong_t vec;
+
+    if (idt_find_and_reserve_range(1,0,&vec)) {
+	ERROR("Cannot get a vector for shootdowns\n");
+	return -1;
+    }
+
+    if (register_int_handler(vec,tlb_handler,0)) {
+	ERROR("Cannot register shootdown handler\n");
+	return -1;
+    }
+
+    tlb_vector = vec;
+
+    INFO("Shootdowns on vector 0x%lx\n",vec);
+
+    return 0;
+}
@@ -34,9 +34,15 @@
 
 #define MAX_AGENT_NAME 32
 
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+#define MAX(x,y) ((x)>(y) ? (x) : (y))
+
 // number of received packets that match to store
 #define MAX_DEV_RECEIVE_QUEUE 64
 
+// most buffers handed to the NIC in one batch
+#define MAX_POST_BATCH 16
+
 #ifndef NAUT_CONFIG_DEBUG_NET_ETHERNET_AGENT
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...) 
@@ -229,32 +235,66 @@ static void recv_callback(nk_net_dev_status_t status, void *state);
 
 
 // called with agent lock held
+// receives are handed to the NIC in batches, so that refilling the
+// queue costs the NIC one lock acquisition and one doorbell per batch
 static void queue_receives(struct nk_net_ethernet_agent *a)
 {
+    struct nk_net_dev_buf bufs[MAX_POST_BATCH];
+    uint64_t i, num;
+    int posted;
+
     while (a->recv_queue_num < a->recv_queue_size) {
-	nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
-	if (!p) {
+	num = MIN(a->recv_queue_size - a->recv_queue_num, MAX_POST_BATCH);
+
+	for (i=0;i<num;i++) {
+	    nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
+	    if (!p) {
+		break;
+	    }
+	    p->metadata = a;
+	    bufs[i].buf = p->raw;
+	    bufs[i].len = MAX_ETHERNET_PACKET_LEN;
+	    bufs[i].callback = recv_callback;
+	    bufs[i].context = p;
+	}
+
+	if (!i) {
 	    ERROR("Starting agent with fewer receives queued than desired\n");
 	    break;
 	}
 
-	p->metadata = a;
+	posted = nk_net_dev_receive_batch(a->netdev, bufs, i);
 
-	if (nk_net_dev_receive_packet(a->netdev,
-				      p->raw,
-				      MAX_ETHERNET_PACKET_LEN,
-				      NK_DEV_REQ_CALLBACK,
-				      recv_callback,
-				      p)) {
+	if (posted < 0) {
+	    posted = 0;
+	}
+
+	a->recv_queue_num += posted;
+
+	if (posted < i) {
 	    ERROR("Failed to queue receive - agent started with fewer receives queued than desired..\n");
-	    nk_net_ethernet_release_packet(p);
+	    for (;posted<i;posted++) {
+		nk_net_ethernet_release_packet((nk_ethernet_packet_t *)bufs[posted].context);
+	    }
+	    break;
+	}
+
+	if (i < num) {
+	    ERROR("Starting agent with fewer receives queued than desired\n");
 	    break;
-	} else {
-	    a->recv_queue_num++;
 	}
     }
 }
 
+// after the initial fill, the receive queue is topped up once a
+// quarter of it has completed, rather than one buffer at a time
+static inline int need_receives(struct nk_net_ethernet_agent *a)
+{
+    uint64_t batch = MIN(MAX(a->recv_queue_size/4,1),MAX_POST_BATCH);
+
+    return a->recv_queue_size - a->recv_queue_num >= batch;
+}
+
 static int type_filter(nk_ethernet_packet_t *p, void *state)
 {
     uint16_t type = (uint16_t)(uint64_t)state;
@@ -369,7 +409,9 @@ static void recv_callback(nk_net_dev_status_t status,
     // and queue more receives
     AGENT_LOCK(a);
     a->recv_queue_num--;
-    queue_receives(a);
+    if (need_receives(a)) {
+	queue_receives(a);
+    }
     AGENT_UNLOCK(a);
 }
 
@@ -385,7 +427,10 @@ static void send_callback(nk_net_dev_status_t status,
     // The network op is not in any list at this point
 
     if (o->interface==BUFFER) {
-	nk_net_ethernet_release_packet(p);
+	if (p) {
+	    // we copied the caller's buffer
+	    nk_net_ethernet_release_packet(p);
+	}
 	if (o->callback) {
 	    o->callback(status,o->context);
 	}
@@ -398,6 +443,8 @@ static void send_callback(nk_net_dev_status_t status,
 	    nk_net_ethernet_release_packet(p);
 	}
     }
+
+    free_op(o);
 }
 
 
@@ -411,8 +458,6 @@ static int get_characteristics(void *state, struct nk_net_dev_characteristics *c
 }
 
 
-#define MIN(x,y) ((x)<(y) ? (x) : (y))
-
 static inline int post_send_recv(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int recv)
 {
     DEV_LOCK_CONF;
@@ -426,6 +471,7 @@ static inline int post_send_recv(void *state, uint8_t *buf, uint64_t len, void (
 
     o->interface = BUFFER;
     o->type = recv ? RECEIVE : SEND;
+    o->dev = d;
     o->buf = buf;
     o->len = len;
     o->packet = 0;
@@ -458,14 +504,30 @@ static inline int post_send_recv(void *state, uint8_t *buf, uint64_t len, void (
 	void *dev_state = d->agent->netdev->dev.state;
 	struct nk_net_dev_int *dev_int = (struct nk_net_dev_int *) d->agent->netdev->dev.interface;
 
+	if (callback) {
+	    // the caller keeps the buffer until the callback, so the
+	    // device can read it in place
+	    if (dev_int->post_send(dev_state, buf, len, send_callback, o)) {
+		free_op(o);
+		return -1;
+	    }
+	    return 0;
+	}
+
 	o->packet = nk_net_ethernet_alloc_packet(-1);
 	if (!o->packet) {
+	    free_op(o);
 	    return -1;
 	}
 	memcpy(o->packet->raw,buf,len);
 	o->packet->len = len;
 
-	return dev_int->post_send(dev_state, o->packet->raw, o->packet->len, send_callback, o);
+	if (dev_int->post_send(dev_state, o->packet->raw, o->packet->len, send_callback, o)) {
+	    nk_net_ethernet_release_packet(o->packet);
+	    free_op(o);
+	    return -1;
+	}
+	return 0;
     }
 
     return 0;
@@ -482,6 +544,72 @@ static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callbac
     return post_send_recv(state,dest,len,callback,context,1);
 }
 
+// a batch of sends goes to the underlying device as a batch
+static int post_send_batch(void *state, struct nk_net_dev_buf *bufs, uint64_t num)
+{
+    struct nk_net_ethernet_agent_net_dev *d =  (struct nk_net_ethernet_agent_net_dev *) state;
+    struct nk_net_dev_buf out[MAX_POST_BATCH];
+    struct netdev_op *o;
+    uint64_t i, done = 0;
+    int posted;
+
+    while (done < num) {
+	uint64_t n = MIN(num - done, MAX_POST_BATCH);
+
+	for (i=0;i<n;i++) {
+	    if (!(o = alloc_op())) {
+		break;
+	    }
+	    // as for single sends, a buffer is only copied if the
+	    // caller cannot tell when it is free
+	    o->packet = 0;
+	    if (!bufs[done+i].callback && !(o->packet = nk_net_ethernet_alloc_packet(-1))) {
+		free_op(o);
+		break;
+	    }
+	    o->interface = BUFFER;
+	    o->type = SEND;
+	    o->dev = d;
+	    o->buf = bufs[done+i].buf;
+	    o->len = bufs[done+i].len;
+	    o->callback = bufs[done+i].callback;
+	    o->callback_packet = 0;
+	    o->context = bufs[done+i].context;
+	    if (o->packet) {
+		memcpy(o->packet->raw,o->buf,o->len);
+		o->packet->len = o->len;
+	    }
+
+	    out[i].buf = o->packet ? o->packet->raw : o->buf;
+	    out[i].len = o->len;
+	    out[i].callback = send_callback;
+	    out[i].context = o;
+	}
+
+	posted = i ? nk_net_dev_send_batch(d->agent->netdev, out, i) : 0;
+
+	if (posted < 0) {
+	    posted = 0;
+	}
+
+	done += posted;
+
+	if (posted < n) {
+	    // the device is full - give back what it did not take
+	    for (;posted<i;posted++) {
+		o = (struct netdev_op *) out[posted].context;
+		if (o->packet) {
+		    nk_net_ethernet_release_packet(o->packet);
+		}
+		free_op(o);
+	    }
+	    break;
+	}
+    }
+
+    return (done || !num) ? done : -1;
+}
+
 
 static inline int post_send_recv_packet(void *state, nk_ethernet_packet_t *packet, void (*callback)(nk_net_dev_status_t status, nk_ethernet_packet_t *packet, void *context), void *context, int recv)
 {
@@ -496,6 +624,7 @@ static inline int post_send_recv_packet(void *state, nk_ethernet_packet_t *packe
 
     o->interface = PACKET;
     o->type = recv ? RECEIVE : SEND;
+    o->dev = d;
     o->buf = 0;
     o->len = 0;
     o->packet = recv ? 0 : packet;
@@ -563,7 +692,8 @@ static struct nk_net_ethernet_agent_net_dev_int ops = {
     .netdev_int = {
 	.get_characteristics = get_characteristics,
 	.post_receive = post_receive,
-	.post_send = post_send
+	.post_send = post_send,
+	.post_send_batch = post_send_batch
     },
     .post_receive_packet = post_receive_packet,
     .post_send_packet = post_send_packet
@@ -24,21 +24,29 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/numa.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
 #include <nautilus/netdev.h>
 #include <net/ethernet/ethernet_packet.h>
 
-// right now this is a trivial implementation that just has a single pool
-// in the future, this could expand to a per-cpu pool
+// Packets come from a pool per NUMA domain, through a cache per CPU.
+//
+// A pool hands out packets from slabs, each a single allocation from
+// its domain's memory.  Slabs are never freed, so a pool only grows.
+// A CPU's cache is touched only by that CPU with interrupts off, so
+// allocating and releasing a packet normally takes no lock at all.
+// Packets move between a cache and the pools a batch at a time - an
+// empty cache is refilled from its CPU's pool, and a full cache
+// returns its oldest packets to the pools they came from.
 
 
 // not currently a Kconfig option
 #define NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE 256
 
-#define NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE 256
-
-#define POOL_INIT_START  (NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE)
-#define POOL_INIT_LOW    (POOL_INIT_START/2)
-#define POOL_INIT_HIGH   (POOL_INIT_LOW*3)
+#define SLAB_PACKETS 64    // packets per slab
+#define CACHE_SIZE   64    // packets a CPU can hold
+#define CACHE_BATCH  32    // packets moved to or from a CPU at once
 
 #ifndef NAUT_CONFIG_DEBUG_NET_ETHERNET_PACKET
 #undef DEBUG_PRINT
@@ -49,68 +57,170 @@
 #define DEBUG(fmt, args...) DEBUG_PRINT("ethernet_packet: " fmt, ##args)
 #define INFO(fmt, args...) INFO_PRINT("ethernet_packet: " fmt, ##args)
 
-static spinlock_t       lock;
-static struct list_head free_list;
-// the invariant here is that high=2*low
-static uint64_t         free_list_len, free_list_low, free_list_high;
+struct packet_slab {
+    struct list_head     node;
+    nk_ethernet_packet_t packets[SLAB_PACKETS];
+};
+
+struct packet_pool {
+    spinlock_t       lock;
+    int              cpu;        // a CPU of the domain, for allocation, or -1
+    struct list_head free_list;
+    struct list_head slab_list;
+
+    uint64_t         free;       // packets on free_list
+    uint64_t         total;      // packets in slabs
+    uint64_t         slabs;
+    uint64_t         refills;    // batches given to caches
+    uint64_t         flushes;    // batches returned by caches
+    uint64_t         grow_fails;
+} __attribute__((aligned(64)));
+
+struct packet_cache {
+    uint32_t              pool;  // our CPU's domain
+    uint32_t              count;
+    nk_ethernet_packet_t *packets[CACHE_SIZE];
+
+    uint64_t              allocs;
+    uint64_t              frees;
+    uint64_t              misses;         // allocs that found the cache empty
+    uint64_t              flushes;        // frees that found it full
+    uint64_t              remote_allocs;  // allocs for another CPU
+} __attribute__((aligned(64)));
 
-// called with lock held
-static void try_grow_if_needed()
+static struct packet_pool  *pools;
+static uint32_t             num_pools;
+static struct packet_cache *caches;
+static uint32_t             num_caches;
+
+
+static int pool_grow(struct packet_pool *pool)
 {
-    if (free_list_len<free_list_low) {
-	// We will set a new midpoint at double the old midpoint
-	// and we will double the upper and lower control thresholds
-	uint64_t needed = ((2*free_list_high-2*free_list_low)/2)-free_list_len;
-	uint64_t i;
-
-	for (i=0;i<needed;i++) {
-	    nk_ethernet_packet_t *p = malloc(sizeof(nk_ethernet_packet_t));
-	    if (!p) {
-		break;
-	    }
-	    INIT_LIST_HEAD(&p->node);
-	    list_add_tail(&p->node,&free_list);
-	    p->alloc_cpu = -1;
-	    p->refcount = 0;
-	    free_list_len++;
-	}
+    struct packet_slab *s;
+    uint32_t id = pool - pools;
+    uint8_t flags;
+    int i;
+
+    s = pool->cpu>=0 ? malloc_specific(sizeof(*s),pool->cpu) : malloc(sizeof(*s));
 
-	// we may not be able to allocate that many...
-	// i now contains the number we actually allocated, so now update
-	// the control thresholds to match
+    flags = spin_lock_irq_save(&pool->lock);
 
-	free_list_low = free_list_len/2;
-	free_list_high = free_list_len*2;
+    if (!s) {
+	pool->grow_fails++;
+	spin_unlock_irq_restore(&pool->lock,flags);
+	ERROR("Failed to grow packet pool %u\n",id);
+	return -1;
     }
+
+    for (i=0;i<SLAB_PACKETS;i++) {
+	nk_ethernet_packet_t *p = &s->packets[i];
+	p->alloc_cpu = -1;
+	p->pool = id;
+	p->refcount = 0;
+	list_add_tail(&p->node,&pool->free_list);
+    }
+
+    list_add(&s->node,&pool->slab_list);
+    pool->slabs++;
+    pool->total += SLAB_PACKETS;
+    pool->free += SLAB_PACKETS;
+
+    spin_unlock_irq_restore(&pool->lock,flags);
+
+    DEBUG("grew pool %u to %lu packets\n",id,pool->total);
+
+    return 0;
 }
-	
-nk_ethernet_packet_t *nk_net_ethernet_alloc_packet(int cpu)
+
+// take up to num packets from the pool, growing it if needed
+static uint32_t pool_get(struct packet_pool *pool, nk_ethernet_packet_t **dest, uint32_t num)
 {
-    struct list_head *cur=0;
-    nk_ethernet_packet_t *p=0;
-    int first=1;
-
- retry:
-    spin_lock(&lock);
-    if (!list_empty(&free_list)) {
-	cur = free_list.next;
+    uint32_t i;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&pool->lock);
+
+    while (pool->free < num) {
+	spin_unlock_irq_restore(&pool->lock,flags);
+	if (pool_grow(pool)) {
+	    flags = spin_lock_irq_save(&pool->lock);
+	    break;
+	}
+	flags = spin_lock_irq_save(&pool->lock);
+    }
+
+    for (i=0;i<num && !list_empty(&pool->free_list);i++) {
+	struct list_head *cur = pool->free_list.next;
 	list_del_init(cur);
-	free_list_len--;
+	dest[i] = list_entry(cur,nk_ethernet_packet_t,node);
     }
-    try_grow_if_needed();
-    spin_unlock(&lock);
-    
-    if (!cur) {
-	if (first) {
-	    first=0;
-	    goto retry;
-	} else {
-	    ERROR("Failed to grow packet pool?!\n");
-	    p = (nk_ethernet_packet_t *)malloc_specific(sizeof(nk_ethernet_packet_t),cpu);
+
+    pool->free -= i;
+
+    spin_unlock_irq_restore(&pool->lock,flags);
+
+    return i;
+}
+
+// return packets to the pools they came from, holding each pool's
+// lock for a run of its packets
+static void pool_put(nk_ethernet_packet_t **src, uint32_t num)
+{
+    struct packet_pool *pool = 0;
+    uint8_t flags = 0;
+    uint32_t i;
+
+    for (i=0;i<num;i++) {
+	if (&pools[src[i]->pool] != pool) {
+	    if (pool) {
+		spin_unlock_irq_restore(&pool->lock,flags);
+	    }
+	    pool = &pools[src[i]->pool];
+	    flags = spin_lock_irq_save(&pool->lock);
 	}
-    } else {
-	p = list_entry(cur,nk_ethernet_packet_t, node);
+	list_add(&src[i]->node,&pool->free_list);
+	pool->free++;
+    }
+
+    if (pool) {
+	spin_unlock_irq_restore(&pool->lock,flags);
     }
+}
+
+nk_ethernet_packet_t *nk_net_ethernet_alloc_packet(int cpu)
+{
+    nk_ethernet_packet_t *p = 0;
+    struct packet_cache *c;
+    int me = my_cpu_id();
+    uint8_t flags;
+
+    flags = irq_disable_save();
+
+    c = &caches[me];
+
+    if (cpu<0 || cpu==me) {
+	if (!c->count) {
+	    c->misses++;
+	    c->count = pool_get(&pools[c->pool],c->packets,CACHE_BATCH);
+	    if (c->count) {
+		// a pool's counters are only ever approximate
+		__sync_fetch_and_add(&pools[c->pool].refills,1);
+	    }
+	}
+	if (c->count) {
+	    p = c->packets[--c->count];
+	}
+    } else if (cpu<num_caches) {
+	// another CPU's cache is off limits, so go to its pool
+	c->remote_allocs++;
+	pool_get(&pools[caches[cpu].pool],&p,1);
+    }
+
+    if (p) {
+	c->allocs++;
+    }
+
+    irq_enable_restore(flags);
 
     if (!p) {
 	ERROR("Failed to allocate packet!\n");
@@ -118,6 +228,7 @@ nk_ethernet_packet_t *nk_net_ethernet_alloc_packet(int cpu)
     }
 
     INIT_LIST_HEAD(&p->node);
+    p->alloc_cpu = cpu;
     p->refcount = 1;
 
     return p;
@@ -133,55 +244,139 @@ void nk_net_ethernet_release_packet(nk_ethernet_packet_t *p)
 {
     if (__sync_fetch_and_sub(&p->refcount,1)==1) {
 	// the packet is now ready to be freed
-	spin_lock(&lock);
-	if (free_list_len<free_list_high) {
-	    // add it to the front of the list since it's probably all in
-	    // cache now, and so the next allocator will be able to take advantage
-	    list_add(&p->node,&free_list);
-	    free_list_len++;
-	    spin_unlock(&lock);
-	} else {
-	    spin_unlock(&lock);
-	    // just free it - we already have too many packets
-	    free(p);
-	    // we would possibly shrink the pool here...
+	struct packet_cache *c;
+	uint8_t flags;
+
+	flags = irq_disable_save();
+
+	c = &caches[my_cpu_id()];
+
+	if (c->count==CACHE_SIZE) {
+	    // the oldest packets are the ones least likely to be in cache
+	    c->flushes++;
+	    __sync_fetch_and_add(&pools[c->pool].flushes,1);
+	    pool_put(c->packets,CACHE_BATCH);
+	    memmove(c->packets,c->packets+CACHE_BATCH,(CACHE_SIZE-CACHE_BATCH)*sizeof(c->packets[0]));
+	    c->count -= CACHE_BATCH;
 	}
+
+	// and the newest is the first to be handed out again
+	c->packets[c->count++] = p;
+	c->frees++;
+
+	irq_enable_restore(flags);
     }
 }
 	
 
+static int
+handle_ethpool (char * buf, void * priv)
+{
+    uint32_t i;
 
+    for (i=0;i<num_pools;i++) {
+	struct packet_pool *pool = &pools[i];
+	if (!pool->total && pool->cpu<0) {
+	    continue;
+	}
+	nk_vc_printf("pool %u: %lu packets in %lu slabs, %lu free, %lu refills, %lu flushes, %lu failed grows\n",
+		     i, pool->total, pool->slabs, pool->free, pool->refills, pool->flushes, pool->grow_fails);
+    }
+
+    for (i=0;i<num_caches;i++) {
+	struct packet_cache *c = &caches[i];
+	if (!c->allocs && !c->frees) {
+	    continue;
+	}
+	nk_vc_printf("cpu %u (pool %u): %u cached, %lu allocs, %lu frees, %lu misses, %lu flushes, %lu remote allocs\n",
+		     i, c->pool, c->count, c->allocs, c->frees, c->misses, c->flushes, c->remote_allocs);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl ethpool_impl = {
+    .cmd      = "ethpool",
+    .help_str = "ethpool",
+    .handler  = handle_ethpool,
+};
+nk_register_shell_cmd(ethpool_impl);
 
 
 int  nk_net_ethernet_packet_init()
 {
-    uint64_t i;
+    struct sys_info *sys = &nk_get_nautilus_info()->sys;
+    uint64_t slabs;
+    uint32_t i, j;
 
-    spinlock_init(&lock);
-    INIT_LIST_HEAD(&free_list);
+    num_caches = nk_get_num_cpus();
+    num_pools = nk_get_num_domains();
 
-    free_list_len = 0;
-    free_list_low = POOL_INIT_LOW;
-    free_list_high = POOL_INIT_HIGH;
+    if (!num_pools) {
+	num_pools = 1;
+    }
 
-    try_grow_if_needed();
-    
-    INFO("inited and seeded with %lu packets of size %lu (low=%lu, high=%lu)\n",free_list_len, MAX_ETHERNET_PACKET_LEN, free_list_low, free_list_high);
+    pools = malloc(sizeof(struct packet_pool)*num_pools);
+    caches = malloc(sizeof(struct packet_cache)*num_caches);
+
+    if (!pools || !caches) {
+	ERROR("Cannot allocate pools\n");
+	return -1;
+    }
+
+    memset(pools,0,sizeof(struct packet_pool)*num_pools);
+    memset(caches,0,sizeof(struct packet_cache)*num_caches);
+
+    for (i=0;i<num_pools;i++) {
+	spinlock_init(&pools[i].lock);
+	INIT_LIST_HEAD(&pools[i].free_list);
+	INIT_LIST_HEAD(&pools[i].slab_list);
+	pools[i].cpu = -1;
+    }
+
+    for (i=0;i<num_caches;i++) {
+	uint32_t d = sys->cpus[i]->domain ? sys->cpus[i]->domain->id : 0;
+	caches[i].pool = d<num_pools ? d : 0;
+	if (pools[caches[i].pool].cpu<0) {
+	    pools[caches[i].pool].cpu = i;
+	}
+    }
+
+    // seed the pools of domains that have CPUs
+    slabs = (NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE/num_pools + SLAB_PACKETS - 1)/SLAB_PACKETS;
+
+    for (i=0;i<num_pools;i++) {
+	if (pools[i].cpu<0) {
+	    continue;
+	}
+	for (j=0;j<slabs;j++) {
+	    if (pool_grow(&pools[i])) {
+		break;
+	    }
+	}
+    }
+
+    INFO("inited %u pools (%lu packets of size %lu each) and %u cpu caches of %u\n",
+	 num_pools, slabs*SLAB_PACKETS, MAX_ETHERNET_PACKET_LEN, num_caches, CACHE_SIZE);
 
     return 0;
 }
 
 void nk_net_ethernet_packet_deinit()
 {
-    spin_lock(&lock);
     struct list_head *cur, *tmp;
+    uint32_t i;
 
-    list_for_each_safe(cur,tmp,&free_list) {
-	nk_ethernet_packet_t *p= list_entry(cur,nk_ethernet_packet_t,node);
-	list_del_init(cur);
-	free(p);
+    for (i=0;i<num_pools;i++) {
+	list_for_each_safe(cur,tmp,&pools[i].slab_list) {
+	    struct packet_slab *s = list_entry(cur,struct packet_slab,node);
+	    list_del_init(cur);
+	    free(s);
+	}
     }
-    INFO("deinited\n");
-}
 
+    free(caches);
+    free(pools);
 
+    INFO("deinited\n");
+}
@@ -0,0 +1,65 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Authors:   Peter Dinda  <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+
+#include "lwip/opt.h"
+#include "lwip/tcpip.h"
+#include "lwip/apps/lwiperf.h"
+
+//
+// Starts an iperf 2 server on port 5001 - run "iperf -c <ip>" on
+// the other end.  Each test is reported on the console.
+//
+
+static const char *report_type_str(enum lwiperf_report_type t)
+{
+    switch (t) {
+    case LWIPERF_TCP_DONE_SERVER:    return "done (server)";
+    case LWIPERF_TCP_DONE_CLIENT:    return "done (client)";
+    case LWIPERF_TCP_ABORTED_LOCAL:  return "aborted (local)";
+    case LWIPERF_TCP_ABORTED_LOCAL_DATAERROR: return "aborted (data error)";
+    case LWIPERF_TCP_ABORTED_LOCAL_TXERROR:   return "aborted (tx error)";
+    case LWIPERF_TCP_ABORTED_REMOTE: return "aborted (remote)";
+    default:                         return "unknown";
+    }
+}
+
+static void report(void *arg, enum lwiperf_report_type report_type,
+		   const ip_addr_t* local_addr, u16_t local_port,
+		   const ip_addr_t* remote_addr, u16_t remote_port,
+		   u32_t bytes_transferred, u32_t ms_duration, u32_t bandwidth_kbitpsec)
+{
+    INFO_PRINT("lwiperf: %s from %s:%u - %u bytes in %u ms, %u kbit/s\n",
+	       report_type_str(report_type), ipaddr_ntoa(remote_addr), remote_port,
+	       bytes_transferred, ms_duration, bandwidth_kbitpsec);
+}
+
+void lwiperf_init(void)
+{
+    LOCK_TCPIP_CORE();
+    if (!lwiperf_start_tcp_server_default(report, 0)) {
+	ERROR_PRINT("lwiperf: cannot start server\n");
+    }
+    UNLOCK_TCPIP_CORE();
+}
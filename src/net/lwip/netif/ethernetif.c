@@ -52,6 +52,7 @@
 #include "lwip/def.h"
 #include "lwip/mem.h"
 #include "lwip/pbuf.h"
+#include "lwip/memp.h"
 #include "lwip/stats.h"
 #include "lwip/snmp.h"
 #include "lwip/ethip6.h"
@@ -64,6 +65,20 @@
 #define SEND_QUEUE_SIZE 15
 #define RECEIVE_QUEUE_SIZE 15
 
+/* Received frames are handed to lwIP in place, as custom pbufs that
+ * wrap the agent's packet and release it when lwIP frees them.  This
+ * is how many can be held by lwIP at once - beyond that, frames are
+ * copied into pool pbufs as before. */
+#define RX_PBUF_COUNT 256
+
+struct rx_pbuf {
+    struct pbuf_custom    pc;
+    nk_ethernet_packet_t *packet;
+};
+
+LWIP_MEMPOOL_DECLARE(RX_PBUF, RX_PBUF_COUNT, sizeof(struct rx_pbuf), "ethernetif rx pbufs");
+static int rx_pbuf_pool_inited = 0;
+
 
 /**
  * Helper struct to hold private data used to operate your ethernet interface.
@@ -121,14 +136,11 @@ static void recv_callback(nk_net_dev_status_t status,
 
     if (status) {
 	ERROR("Bad packet receive - reissuing a receive\n");
-	goto launch_receive;
+	nk_net_ethernet_release_packet(packet);
+    } else {
+	//DEBUG("recv callback ipdev: %p\n", ethernetif->device);	
+	ethernetif_input(netif, packet); // takes the packet
     }
-    //DEBUG("recv callback ipdev: %p\n", ethernetif->device);	
-    ethernetif_input(netif, packet);
-    nk_net_ethernet_release_packet(packet);//realse packet
-
-launch_receive:
-
 
     if (nk_net_ethernet_agent_device_receive_packet(ethernetif->device,
 						    0,
@@ -221,6 +233,22 @@ low_level_init(struct netif *netif)
  *       dropped because of memory failure (except for the TCP timers).
  */
 
+/* A frame sent in place holds a reference to its pbuf until the
+ * device is done with it.  This can run in interrupt context, which
+ * is fine since SYS_ARCH_PROTECT masks interrupts and memory comes
+ * from NK's malloc. */
+static void
+tx_done(nk_net_dev_status_t status, void *state)
+{
+  struct pbuf *p = (struct pbuf *)state;
+
+  if (status) {
+    ERROR("Send of frame %p failed\n", p);
+  }
+
+  pbuf_free(p);
+}
+
 static err_t
 low_level_output(struct netif *netif, struct pbuf *p)
 {
@@ -233,24 +261,51 @@ low_level_output(struct netif *netif, struct pbuf *p)
 #if ETH_PAD_SIZE
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
-  
+
+  if (p->next == NULL) {
+    /* The frame is contiguous (always the case for TCP with
+     * LWIP_NETIF_TX_SINGLE_PBUF), so the device reads it straight
+     * out of the pbuf.  The reference we take tells TCP not to
+     * rewrite a segment that is still queued. */
+    pbuf_ref(p);
+    if (nk_net_dev_send_packet(netDevice, p->payload, p->len, NK_DEV_REQ_CALLBACK, tx_done, p)) {
+      ERROR("Fail to send a packet\n");
+      pbuf_free(p);
+#if ETH_PAD_SIZE
+      pbuf_header(p, ETH_PAD_SIZE);
+#endif
+      return ERR_MEM;
+    }
+  } else {
     nk_ethernet_packet_t *pk = nk_net_ethernet_alloc_packet(-1);
     u32_t len = 0;
-    
-  for (q = p; q != NULL; q = q->next) {
-    /* Send the data from the pbuf to the interface, one pbuf at a
-       time. The size of the data in each pbuf is kept in the ->len
-       variable. */
-    //send data from(q->payload, q->len);
+
+    if (!pk) {
+      ERROR("Fail to allocate a packet\n");
+#if ETH_PAD_SIZE
+      pbuf_header(p, ETH_PAD_SIZE);
+#endif
+      return ERR_MEM;
+    }
+
+    for (q = p; q != NULL; q = q->next) {
+      /* Send the data from the pbuf to the interface, one pbuf at a
+         time. The size of the data in each pbuf is kept in the ->len
+         variable. */
+      //send data from(q->payload, q->len);
       memcpy(pk->raw+len, q->payload, q->len);
       len+=q->len;
-  }
+    }
     pk->len = len;
 
-    if(nk_net_ethernet_agent_device_send_packet(ethernetif->device, pk, NK_DEV_REQ_NONBLOCKING, 0, 0)){
-	ERROR("Fail to send a packet\n");
-    	return ERR_MEM;	
+    if(nk_net_ethernet_agent_device_send_packet(netDevice, pk, NK_DEV_REQ_NONBLOCKING, 0, 0)){
+      ERROR("Fail to send a packet\n");
+#if ETH_PAD_SIZE
+      pbuf_header(p, ETH_PAD_SIZE);
+#endif
+      return ERR_MEM;
     }
+  }
 
   //signal that packet should be sent();
   MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
@@ -280,6 +335,15 @@ low_level_output(struct netif *netif, struct pbuf *p)
  * @return a pbuf filled with the received packet (including MAC header)
  *         NULL on memory error
  */
+static void
+rx_pbuf_free(struct pbuf *p)
+{
+  struct rx_pbuf *r = (struct rx_pbuf *)p;
+
+  nk_net_ethernet_release_packet(r->packet);
+  LWIP_MEMPOOL_FREE(RX_PBUF, r);
+}
+
 static struct pbuf *
 low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
 {
@@ -302,10 +366,29 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
   len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
 #endif
   //len += 42;
-  /* We allocate a pbuf chain of pbufs from the pool. */
-  p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+  p = NULL;
+
+#if !ETH_PAD_SIZE
+  /* Wrap the packet itself if we can - lwIP then owns it, and releases
+   * it via rx_pbuf_free() */
+  {
+    struct rx_pbuf *r = (struct rx_pbuf *)LWIP_MEMPOOL_ALLOC(RX_PBUF);
+
+    if (r != NULL) {
+      r->pc.custom_free_function = rx_pbuf_free;
+      r->packet = pk;
+      p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &r->pc, pk->raw, MAX_ETHERNET_PACKET_LEN);
+      if (p == NULL) {
+        LWIP_MEMPOOL_FREE(RX_PBUF, r);
+      }
+    }
+  }
+#endif
 
   if (p != NULL) {
+    /* in place - nothing to copy */
+  } else if ((p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL)) != NULL) {
+    /* We allocate a pbuf chain of pbufs from the pool. */
 
 #if ETH_PAD_SIZE
     pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
@@ -330,6 +413,17 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
     
     nk_net_ethernet_release_packet(pk);      
 
+#if ETH_PAD_SIZE
+    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
+  } else {
+    nk_net_ethernet_release_packet(pk);
+  }
+
+  if (p != NULL) {
+#if ETH_PAD_SIZE
+    pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
+#endif
 
     MIB2_STATS_NETIF_ADD(netif, ifinoctets, p->tot_len);
     if (((u8_t*)p->payload)[0] & 1) {
@@ -372,7 +466,8 @@ ethernetif_input(struct netif *netif, nk_ethernet_packet_t *pk)
 
   ethernetif = netif->state;
 
-  /* move received packet into a new pbuf */
+  /* wrap or copy the received packet into a pbuf - either way, the
+   * packet is no longer ours */
   p = low_level_input(netif, pk);
 
   /* if no packet could be read, silently ignore this */
@@ -405,6 +500,11 @@ ethernetif_init(struct netif *netif)
 
   LWIP_ASSERT("netif != NULL", (netif != NULL));
   
+  if (!rx_pbuf_pool_inited) {
+    LWIP_MEMPOOL_INIT(RX_PBUF);
+    rx_pbuf_pool_inited = 1;
+  }
+
   ethernetif = mem_malloc(sizeof(struct ethernetif));
   
   if (ethernetif == NULL) {
@@ -262,6 +262,15 @@ handle_net (char * buf, void * priv)
     }
 #endif
 
+#ifdef NAUT_CONFIG_NET_LWIP_APP_LWIPERF
+    if (!strcasecmp(buf,"net lwip lwiperf")) {
+        void lwiperf_init();
+        nk_vc_printf("Starting lwiperf server (port 5001)\n");
+        lwiperf_init();
+        return 0;
+    }
+#endif
+
 #ifdef NAUT_CONFIG_NET_LWIP_APP_LWIP_IPVCD
     if (!strcasecmp(buf,"net lwip ipvcd")) {
         void ipvcd_init();
@@ -0,0 +1,215 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+
+#include <nautilus/nautilus.h>
+#include <nautilus/aspace.h>
+#include <nautilus/paging.h>
+#include <nautilus/thread.h>
+#include <nautilus/cpu.h>
+#include <nautilus/irq.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Costs of a paging address space as seen by a thread running in it.
+// A buffer from the kernel heap is mapped twice at an otherwise unused
+// virtual address, once misaligned so that only 4 KB pages can map
+// it, and once with 2 MB alignment, both demand-faulted.  Touching
+// every page once measures faults (the second touch is the baseline
+// without them).  The switch test goes to the base address space and
+// back with interrupts off, then touches pages that were mapped
+// before the switch, to show what the TLB kept - the "flushed" line
+// reloads CR3 without PCID's no-flush bit for comparison.
+//
+
+#define DEFAULT_PAGES    1024
+#define DEFAULT_SWITCHES 100000
+#define DEFAULT_TOUCH    64
+
+#define BENCH_VA_4K  0x100000001000ULL  // 4 KB off of 2 MB alignment
+#define BENCH_VA_2M  0x100040000000ULL
+
+#define ROUND_UP_2MB(x) (((x) + PAGE_SIZE_2MB - 1) & ~(PAGE_SIZE_2MB - 1))
+
+// one write per 4 KB page, returns ns per page
+static uint64_t touch(volatile uint8_t *p, uint64_t pages)
+{
+    uint64_t i, start, end;
+
+    start = nk_sched_get_realtime();
+    for (i=0;i<pages;i++) {
+	p[i*PAGE_SIZE_4KB] = i;
+    }
+    end = nk_sched_get_realtime();
+
+    return (end-start)/pages;
+}
+
+static void fault_test(char *what, uint8_t *va, uint64_t pages, uint64_t faults)
+{
+    uint64_t first = touch(va,pages);
+    uint64_t second = touch(va,pages);
+
+    nk_vc_printf("%s: first touch %lu ns/page, second %lu ns/page, %lu faults, ~%lu ns/fault\n",
+		 what, first, second, faults,
+		 faults ? ((first > second ? first-second : 0)*pages)/faults : 0);
+}
+
+static uint64_t switch_test(nk_aspace_t *a, nk_aspace_t *other, uint8_t *va,
+			    uint64_t switches, uint64_t pages, int flush)
+{
+    uint64_t i, start, end;
+    uint8_t flags;
+
+    flags = irq_disable_save();
+
+    start = nk_sched_get_realtime();
+    for (i=0;i<switches;i++) {
+	nk_aspace_switch(other);
+	nk_aspace_switch(a);
+	if (flush) {
+	    write_cr3(read_cr3());
+	}
+	if (pages) {
+	    touch(va,pages);
+	}
+    }
+    end = nk_sched_get_realtime();
+
+    irq_enable_restore(flags);
+
+    return (end-start)/switches;
+}
+
+static int asbench(uint64_t pages, uint64_t switches, uint64_t touches)
+{
+    nk_thread_t *t = get_cur_thread();
+    nk_aspace_t *orig = t->aspace;
+    nk_aspace_t *base = nk_aspace_find("base");
+    nk_aspace_characteristics_t c;
+    nk_aspace_region_t r4k, r2m;
+    nk_aspace_t *a;
+    uint64_t len2m = ROUND_UP_2MB(pages*PAGE_SIZE_4KB);
+    uint8_t *buf;
+    addr_t pa;
+    int rc = -1;
+
+    if (!base) {
+	nk_vc_printf("no base address space\n");
+	return -1;
+    }
+
+    if (nk_aspace_query("paging",&c)) {
+	nk_vc_printf("paging address spaces are not available\n");
+	return -1;
+    }
+
+    if (!(buf = malloc(len2m + PAGE_SIZE_2MB))) {
+	nk_vc_printf("cannot allocate %lu bytes\n",len2m + PAGE_SIZE_2MB);
+	return -1;
+    }
+
+    // the heap is identity mapped, so this is also its physical address
+    pa = ROUND_UP_2MB((addr_t)buf);
+
+    if (!(a = nk_aspace_create("paging","asbench",&c))) {
+	nk_vc_printf("cannot create address space\n");
+	free(buf);
+	return -1;
+    }
+
+    r4k.va_start = (void*)BENCH_VA_4K;
+    r4k.pa_start = (void*)pa;
+    r4k.len_bytes = pages*PAGE_SIZE_4KB;
+    r4k.protect.flags = NK_ASPACE_READ | NK_ASPACE_WRITE;
+
+    r2m.va_start = (void*)BENCH_VA_2M;
+    r2m.pa_start = (void*)pa;
+    r2m.len_bytes = len2m;
+    r2m.protect.flags = NK_ASPACE_READ | NK_ASPACE_WRITE;
+
+    if (nk_aspace_add_region(a,&r4k) || nk_aspace_add_region(a,&r2m)) {
+	nk_vc_printf("cannot add regions\n");
+	goto out;
+    }
+
+    nk_aspace_move_thread(a);
+
+    fault_test("4K pages",(uint8_t*)BENCH_VA_4K,pages,pages);
+    fault_test("2M pages",(uint8_t*)BENCH_VA_2M,len2m/PAGE_SIZE_4KB,len2m/PAGE_SIZE_2MB);
+
+    if (touches > pages) {
+	touches = pages;
+    }
+
+    nk_vc_printf("switch to base and back: %lu ns\n",
+		 switch_test(a,base,0,switches,0,0));
+    nk_vc_printf("  + touch %lu pages: %lu ns\n", touches,
+		 switch_test(a,base,(uint8_t*)BENCH_VA_4K,switches,touches,0));
+    nk_vc_printf("  + touch %lu pages, flushed: %lu ns\n", touches,
+		 switch_test(a,base,(uint8_t*)BENCH_VA_4K,switches,touches,1));
+
+    nk_aspace_dump_aspaces(1);
+
+    nk_aspace_move_thread(orig);
+
+    rc = 0;
+
+ out:
+    if (nk_aspace_destroy(a)) {
+	nk_vc_printf("cannot destroy address space\n");
+	rc = -1;
+    }
+    free(buf);
+    return rc;
+}
+
+static int
+handle_asbench (char * buf, void * priv)
+{
+    uint64_t pages = DEFAULT_PAGES;
+    uint64_t switches = DEFAULT_SWITCHES;
+    uint64_t touches = DEFAULT_TOUCH;
+
+    sscanf(buf,"asbench %lu %lu %lu",&pages,&switches,&touches);
+
+    if (!pages || !switches) {
+	nk_vc_printf("need at least one page and one switch\n");
+	return 0;
+    }
+
+    nk_vc_printf("asbench: %lu pages, %lu switches\n",pages,switches);
+
+    nk_vc_printf("asbench %s\n", asbench(pages,switches,touches) ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl asbench_impl = {
+    .cmd      = "asbench",
+    .help_str = "asbench [pages] [switches] [pages touched per switch]",
+    .handler  = handle_asbench,
+};
+nk_register_shell_cmd(asbench_impl);
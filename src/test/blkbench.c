@@ -0,0 +1,257 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/devpoll.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+#include <nautilus/libccompat.h>
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+#include <dev/virtio_blk.h>
+#endif
+
+//
+// Block device IOPS and latency: keep a fixed number of random
+// requests outstanding, resubmitting completed ones as a batch
+// bracketed by plug/unplug so a batching driver can notify the
+// device once per batch.  Writes clobber the blocks they hit.
+// Compare completion modes by running it under "devpoll".
+//
+
+#define DEFAULT_DEPTH  32
+#define DEFAULT_OPS    100000
+#define DEFAULT_BLOCKS 1
+#define MAX_DEPTH      1024
+
+struct blk_op {
+    uint8_t           *buf;
+    uint64_t           start;
+    volatile int       done;
+    volatile int       failed;
+    volatile uint64_t  end;
+};
+
+static void blk_op_done(nk_block_dev_status_t status, void *context)
+{
+    struct blk_op *op = (struct blk_op *)context;
+
+    op->end = nk_sched_get_realtime();
+    op->failed = status != NK_BLOCK_DEV_STATUS_SUCCESS;
+    op->done = 1;
+}
+
+static int blk_op_issue(struct nk_block_dev *d, struct blk_op *op, uint64_t span, uint64_t blocks, int write)
+{
+    uint64_t block = ((uint64_t)rand() % span) * blocks;
+
+    op->done = 0;
+    op->start = nk_sched_get_realtime();
+
+    if (write) {
+	return nk_block_dev_write(d,block,blocks,op->buf,NK_DEV_REQ_CALLBACK,blk_op_done,op);
+    } else {
+	return nk_block_dev_read(d,block,blocks,op->buf,NK_DEV_REQ_CALLBACK,blk_op_done,op);
+    }
+}
+
+static int blkbench(struct nk_block_dev *d, int write, uint64_t depth, uint64_t ops, uint64_t blocks)
+{
+    struct nk_block_dev_characteristics c;
+    struct blk_op *op;
+    uint64_t span, issued = 0, completed = 0, errors = 0, batches = 0;
+    uint64_t lat_sum = 0, lat_min = -1ULL, lat_max = 0;
+    struct nk_dev_poll_hist hist;
+    uint64_t start, end, i;
+    int rc = 0;
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+    struct virtio_blk_stats before, after;
+    int have_stats;
+#endif
+
+    if (nk_block_dev_get_characteristics(d,&c)) {
+	nk_vc_printf("cannot get characteristics\n");
+	return -1;
+    }
+
+    span = c.num_blocks / blocks;
+
+    if (!span) {
+	nk_vc_printf("device is smaller than one request\n");
+	return -1;
+    }
+
+    op = malloc(depth*sizeof(struct blk_op));
+
+    if (!op) {
+	nk_vc_printf("cannot allocate requests\n");
+	return -1;
+    }
+
+    memset(op,0,depth*sizeof(struct blk_op));
+    memset(&hist,0,sizeof(hist));
+
+    for (i=0;i<depth;i++) {
+	if (!(op[i].buf = malloc(blocks*c.block_size))) {
+	    nk_vc_printf("cannot allocate buffers\n");
+	    rc = -1;
+	    goto out;
+	}
+	memset(op[i].buf,0x5a,blocks*c.block_size);
+    }
+
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+    have_stats = !virtio_blk_get_stats(d,&before);
+#endif
+
+    start = nk_sched_get_realtime();
+
+    // prime the device with a full queue
+    nk_block_dev_plug(d);
+    for (i=0;i<depth && issued<ops;i++) {
+	if (blk_op_issue(d,&op[i],span,blocks,write)) {
+	    nk_vc_printf("cannot issue request\n");
+	    op[i].done = 1;
+	    op[i].start = 0;
+	    rc = -1;
+	    break;
+	}
+	issued++;
+    }
+    nk_block_dev_unplug(d);
+    batches++;
+
+    while (completed < issued) {
+	int resubmit = 0;
+
+	for (i=0;i<depth;i++) {
+	    if (!op[i].done || !op[i].start) {
+		continue;
+	    }
+
+	    uint64_t lat = op[i].end - op[i].start;
+
+	    lat_sum += lat;
+	    lat_min = lat < lat_min ? lat : lat_min;
+	    lat_max = lat > lat_max ? lat : lat_max;
+	    nk_dev_poll_hist_add(&hist,lat);
+	    errors += op[i].failed;
+	    completed++;
+	    op[i].start = 0;
+
+	    if (issued < ops && !rc) {
+		if (!resubmit) {
+		    nk_block_dev_plug(d);
+		    resubmit = 1;
+		}
+		if (blk_op_issue(d,&op[i],span,blocks,write)) {
+		    nk_vc_printf("cannot issue request\n");
+		    op[i].done = 1;
+		    op[i].start = 0;
+		    rc = -1;
+		} else {
+		    issued++;
+		}
+	    }
+	}
+
+	if (resubmit) {
+	    nk_block_dev_unplug(d);
+	    batches++;
+	}
+    }
+
+    end = nk_sched_get_realtime();
+
+    if (completed) {
+	nk_vc_printf("%lu %s of %lu bytes in %lu ns: %lu IOPS, %lu MB/s\n",
+		     completed, write ? "writes" : "reads", blocks*c.block_size, end-start,
+		     (completed*1000000000ULL)/((end-start) ? (end-start) : 1),
+		     (completed*blocks*c.block_size*1000ULL)/((end-start) ? (end-start) : 1));
+	nk_vc_printf("latency: avg %lu ns min %lu ns max %lu ns, %lu errors, %lu batches of %lu requests\n",
+		     lat_sum/completed, lat_min, lat_max, errors, batches, issued/batches);
+	nk_dev_poll_hist_print(&hist,"latency","ns");
+    }
+
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+    if (have_stats && !virtio_blk_get_stats(d,&after)) {
+	nk_vc_printf("virtio: %u queues, indirect %s, event index %s\n",
+		     after.num_queues, after.indirect ? "on" : "off", after.event_idx ? "on" : "off");
+	nk_vc_printf("virtio: %lu submits %lu kicks %lu kicks suppressed %lu interrupts %lu completions\n",
+		     after.submits-before.submits, after.kicks-before.kicks,
+		     after.kicks_suppressed-before.kicks_suppressed,
+		     after.interrupts-before.interrupts, after.completions-before.completions);
+    }
+#endif
+
+ out:
+    for (i=0;i<depth;i++) {
+	if (op[i].buf) {
+	    free(op[i].buf);
+	}
+    }
+    free(op);
+
+    return rc;
+}
+
+static int
+handle_blkbench (char * buf, void * priv)
+{
+    char name[32], rw[16];
+    uint64_t depth = DEFAULT_DEPTH;
+    uint64_t ops = DEFAULT_OPS;
+    uint64_t blocks = DEFAULT_BLOCKS;
+    struct nk_block_dev *d;
+
+    if ((sscanf(buf,"blkbench %s %s %lu %lu %lu",name,rw,&depth,&ops,&blocks)<2)
+	|| (*rw!='r' && *rw!='w')) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return 0;
+    }
+
+    if (!depth || depth>MAX_DEPTH || !ops || !blocks) {
+	nk_vc_printf("need a depth of 1 to %d and at least one op and block\n",MAX_DEPTH);
+	return 0;
+    }
+
+    if (!(d=nk_block_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return 0;
+    }
+
+    nk_vc_printf("blkbench: %s %s, depth %lu, %lu ops of %lu blocks\n",
+		 name, *rw=='w' ? "write" : "read", depth, ops, blocks);
+
+    nk_vc_printf("blkbench %s\n", blkbench(d,*rw=='w',depth,ops,blocks) ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl blkbench_impl = {
+    .cmd      = "blkbench",
+    .help_str = "blkbench dev r|w [depth] [ops] [blocks per op]",
+    .handler  = handle_blkbench,
+};
+nk_register_shell_cmd(blkbench_impl);
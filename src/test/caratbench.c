@@ -0,0 +1,217 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+
+#include <nautilus/nautilus.h>
+#include <nautilus/aspace.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Moving regions of a CARAT address space while they are in use.  The
+// blocks form a ring of nodes that point to each other and to
+// themselves, and an array and a local variable also point to them.
+// Each move relocates one node, and afterwards the ring is walked to
+// check that every pointer, including ours, was patched and that the
+// contents came along.  A move costs a scan of the whole heap with the
+// world stopped, so its time grows with the amount of allocated memory.
+//
+
+#define DEFAULT_BLOCKS 1024
+#define DEFAULT_SIZE   256
+#define DEFAULT_MOVES  64
+
+struct node {
+    struct node *next;
+    struct node *self;
+    uint64_t     id;
+    uint8_t      data[0];
+};
+
+static void region_of(nk_aspace_region_t *r, void *block, uint64_t size)
+{
+    r->va_start = r->pa_start = block;
+    r->len_bytes = size;
+    r->protect.flags = NK_ASPACE_READ | NK_ASPACE_WRITE;
+}
+
+static int check_ring(struct node *head, uint64_t blocks, uint64_t size)
+{
+    struct node *n = head;
+    uint64_t i, j;
+
+    for (i=0;i<blocks;i++) {
+	if (n->self!=n || n->id!=i) {
+	    nk_vc_printf("node %lu at %p is wrong (self %p id %lu)\n",i,n,n->self,n->id);
+	    return -1;
+	}
+	for (j=0;j<size-sizeof(struct node);j++) {
+	    if (n->data[j]!=(uint8_t)i) {
+		nk_vc_printf("node %lu has lost its contents\n",i);
+		return -1;
+	    }
+	}
+	n = n->next;
+    }
+
+    if (n!=head) {
+	nk_vc_printf("ring does not close\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+static int caratbench(uint64_t blocks, uint64_t size, uint64_t moves)
+{
+    nk_aspace_characteristics_t c;
+    nk_aspace_region_t cur, new;
+    nk_aspace_t *a;
+    struct node **nodes, *head;
+    void *block;
+    uint64_t i, j, added = 0, start, total = 0, worst = 0, t;
+    int rc = -1;
+
+    if (nk_aspace_query("carat",&c)) {
+	nk_vc_printf("carat address spaces are not available\n");
+	return -1;
+    }
+
+    if (!(nodes = malloc(blocks*sizeof(struct node *)))) {
+	nk_vc_printf("cannot allocate node array\n");
+	return -1;
+    }
+
+    memset(nodes,0,blocks*sizeof(struct node *));
+
+    for (i=0;i<blocks;i++) {
+	if (!(nodes[i] = malloc(size))) {
+	    nk_vc_printf("cannot allocate nodes\n");
+	    goto out_free;
+	}
+	nodes[i]->self = nodes[i];
+	nodes[i]->id = i;
+	memset(nodes[i]->data,(uint8_t)i,size-sizeof(struct node));
+    }
+
+    for (i=0;i<blocks;i++) {
+	nodes[i]->next = nodes[(i+1)%blocks];
+    }
+
+    head = nodes[0];
+
+    if (!(a = nk_aspace_create("carat","caratbench",&c))) {
+	nk_vc_printf("cannot create address space\n");
+	goto out_free;
+    }
+
+    for (added=0;added<blocks;added++) {
+	region_of(&cur,nodes[added],size);
+	if (nk_aspace_add_region(a,&cur)) {
+	    nk_vc_printf("cannot add regions\n");
+	    goto out;
+	}
+    }
+
+    for (i=0;i<moves;i++) {
+	j = i%blocks;
+	if (!(block = malloc(size))) {
+	    nk_vc_printf("cannot allocate a new block\n");
+	    goto out;
+	}
+	region_of(&cur,nodes[j],size);
+	region_of(&new,block,size);
+
+	start = nk_sched_get_realtime();
+	if (nk_aspace_move_region(a,&cur,&new)) {
+	    nk_vc_printf("cannot move node %lu\n",j);
+	    free(block);
+	    goto out;
+	}
+	t = nk_sched_get_realtime() - start;
+
+	total += t;
+	worst = t > worst ? t : worst;
+
+	if (nodes[j]!=block || (!j && head!=block)) {
+	    nk_vc_printf("pointers to node %lu were not patched\n",j);
+	    goto out;
+	}
+    }
+
+    if (check_ring(head,blocks,size)) {
+	goto out;
+    }
+
+    nk_vc_printf("%lu moves: %lu ns average, %lu ns worst\n",
+		 moves, moves ? total/moves : 0, worst);
+
+    nk_aspace_dump_aspaces(0);
+
+    rc = 0;
+
+ out:
+    for (i=0;i<added;i++) {
+	region_of(&cur,nodes[i],size);
+	nk_aspace_remove_region(a,&cur);
+    }
+    if (nk_aspace_destroy(a)) {
+	nk_vc_printf("cannot destroy address space\n");
+	rc = -1;
+    }
+ out_free:
+    for (i=0;i<blocks;i++) {
+	free(nodes[i]);
+    }
+    free(nodes);
+    return rc;
+}
+
+static int
+handle_caratbench (char * buf, void * priv)
+{
+    uint64_t blocks = DEFAULT_BLOCKS;
+    uint64_t size = DEFAULT_SIZE;
+    uint64_t moves = DEFAULT_MOVES;
+
+    sscanf(buf,"caratbench %lu %lu %lu",&blocks,&size,&moves);
+
+    if (!blocks || size<sizeof(struct node)) {
+	nk_vc_printf("need at least one block of at least %lu bytes\n",sizeof(struct node));
+	return 0;
+    }
+
+    nk_vc_printf("caratbench: %lu blocks of %lu bytes, %lu moves\n",blocks,size,moves);
+
+    nk_vc_printf("caratbench %s\n", caratbench(blocks,size,moves) ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl caratbench_impl = {
+    .cmd      = "caratbench",
+    .help_str = "caratbench [blocks] [block size] [moves]",
+    .handler  = handle_caratbench,
+};
+nk_register_shell_cmd(caratbench_impl);
@@ -0,0 +1,203 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2019, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2019, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/fiber.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Fiber scheduler microbenchmarks: yield latency between two fibers
+// started on the same CPU, and spawn throughput of many short fibers
+// started with F_RAND_CPU.  Build with and without
+// NAUT_CONFIG_FIBER_WORK_STEALING to compare the two schedulers.
+//
+
+#define DEFAULT_YIELDS 100000
+#define DEFAULT_FIBERS 10000
+
+static volatile uint64_t yield_start;
+static volatile uint64_t yield_end;
+static volatile uint64_t yield_done;
+
+static volatile uint64_t spawn_done;
+
+static void pingpong(void *in, void **out)
+{
+    uint64_t n = (uint64_t)in;
+    uint64_t i;
+
+    __sync_bool_compare_and_swap(&yield_start, 0, nk_sched_get_realtime());
+
+    for (i=0;i<n;i++) {
+	nk_fiber_yield();
+    }
+
+    yield_end = nk_sched_get_realtime();
+    __sync_fetch_and_add(&yield_done, 1);
+}
+
+static void spawnee(void *in, void **out)
+{
+    __sync_fetch_and_add(&spawn_done, 1);
+}
+
+static void wait_for(volatile uint64_t *count, uint64_t target)
+{
+    while (*count < target) {
+	nk_yield();
+    }
+}
+
+static void sum_stats(struct nk_fiber_stats *s)
+{
+    struct nk_fiber_stats c;
+    int i;
+
+    memset(s, 0, sizeof(*s));
+
+    for (i=0;i<nk_get_num_cpus();i++) {
+	if (!nk_fiber_get_stats(i, &c)) {
+	    s->spawns += c.spawns;
+	    s->yields += c.yields;
+	    s->steals += c.steals;
+	    s->steal_fails += c.steal_fails;
+	    s->stale += c.stale;
+	}
+    }
+}
+
+static void print_stats(struct nk_fiber_stats *b, struct nk_fiber_stats *a)
+{
+    nk_vc_printf("         %lu spawns %lu yields %lu steals %lu empty steal passes %lu stale entries\n",
+		 a->spawns-b->spawns, a->yields-b->yields, a->steals-b->steals,
+		 a->steal_fails-b->steal_fails, a->stale-b->stale);
+}
+
+static int bench_yield(uint64_t n)
+{
+    struct nk_fiber_stats before, after;
+    int cpu = nk_get_num_cpus() > 1 ? 1 : 0;
+    nk_fiber_t *f;
+    int i;
+
+    yield_start = 0;
+    yield_end = 0;
+    yield_done = 0;
+
+    sum_stats(&before);
+
+    // both fibers are pinned so that an idle CPU cannot steal one,
+    // which would turn their yields into switches to the idle fiber
+    for (i=0;i<2;i++) {
+	if (nk_fiber_create(pingpong, (void*)n, 0, 0, &f) < 0) {
+	    nk_vc_printf("cannot create yield fiber\n");
+	    return -1;
+	}
+	nk_fiber_set_pinned(f, 1);
+	if (nk_fiber_run(f, cpu) < 0) {
+	    nk_vc_printf("cannot run yield fiber\n");
+	    return -1;
+	}
+    }
+
+    wait_for(&yield_done, 2);
+
+    sum_stats(&after);
+
+    nk_vc_printf("yield:   %lu yields on cpu %d in %lu ns, %lu ns per yield\n",
+		 2*n, cpu, yield_end-yield_start, (yield_end-yield_start)/(2*n));
+    print_stats(&before, &after);
+
+    return 0;
+}
+
+static int bench_spawn(uint64_t n)
+{
+    struct nk_fiber_stats before, after;
+    nk_fiber_t *f;
+    uint64_t i, start, end;
+
+    spawn_done = 0;
+
+    sum_stats(&before);
+
+    start = nk_sched_get_realtime();
+
+    for (i=0;i<n;i++) {
+	if (nk_fiber_start(spawnee, 0, 0, 0, F_RAND_CPU, &f) < 0) {
+	    nk_vc_printf("cannot start fiber %lu\n", i);
+	    // wait for the ones we did start so they do not outlive us
+	    wait_for(&spawn_done, i);
+	    return -1;
+	}
+    }
+
+    wait_for(&spawn_done, n);
+
+    end = nk_sched_get_realtime();
+
+    sum_stats(&after);
+
+    nk_vc_printf("spawn:   %lu fibers in %lu ns, %lu ns per fiber, %lu fibers/s\n",
+		 n, end-start, (end-start)/n, (n*1000000000ULL)/((end-start) ? (end-start) : 1));
+    print_stats(&before, &after);
+
+    return 0;
+}
+
+static int
+handle_fiberbench (char * buf, void * priv)
+{
+    uint64_t yields = DEFAULT_YIELDS;
+    uint64_t fibers = DEFAULT_FIBERS;
+    int rc = 0;
+
+    sscanf(buf,"fiberbench %lu %lu",&yields,&fibers);
+
+    if (!yields || !fibers) {
+	nk_vc_printf("need at least one yield and one fiber\n");
+	return 0;
+    }
+
+#ifdef NAUT_CONFIG_FIBER_WORK_STEALING
+    nk_vc_printf("fiberbench: work-stealing scheduler, %d cpus\n", nk_get_num_cpus());
+#else
+    nk_vc_printf("fiberbench: locked queue scheduler, %d cpus\n", nk_get_num_cpus());
+#endif
+
+    rc |= bench_yield(yields);
+    rc |= bench_spawn(fibers);
+
+    nk_vc_printf("fiberbench %s\n", rc ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl fiberbench_impl = {
+    .cmd      = "fiberbench",
+    .help_str = "fiberbench [yields per fiber] [fibers to spawn]",
+    .handler  = handle_fiberbench,
+};
+nk_register_shell_cmd(fiberbench_impl);
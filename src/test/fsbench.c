@@ -0,0 +1,227 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/fs.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/bcache.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// File throughput through the filesystem layer.  "read" reads a file
+// sequentially several times - the first pass shows the device (with
+// read-ahead), later ones the buffer cache, if the file fits in it.
+// "write" writes a file sequentially and then syncs, timing both.
+// Naming the block device the filesystem is on adds the cache's
+// counters for each pass.  Compare a ramdisk with virtio-blk to
+// separate the cache from the device.
+//
+
+#define DEFAULT_PASSES 3
+#define DEFAULT_CHUNK  4096
+#define MAX_CHUNK      (1024*1024)
+
+static void stats_diff(struct nk_block_dev *d, struct nk_bcache_stats *before)
+{
+    struct nk_bcache_stats after;
+    uint64_t hits, misses;
+
+    if (!d || nk_bcache_get_stats(d,&after)) {
+	return;
+    }
+
+    hits = after.hits - before->hits;
+    misses = after.misses - before->misses;
+
+    nk_vc_printf("  cache: %lu hits %lu misses (%lu%% hit rate) %lu read ahead %lu used %lu writebacks\n",
+		 hits, misses, (hits+misses) ? (hits*100)/(hits+misses) : 0,
+		 after.readaheads - before->readaheads,
+		 after.readahead_hits - before->readahead_hits,
+		 after.writebacks - before->writebacks);
+
+    *before = after;
+}
+
+static void report(char *what, uint64_t bytes, uint64_t ns)
+{
+    nk_vc_printf("%s: %lu bytes in %lu ns, %lu MB/s\n", what, bytes, ns,
+		 (bytes*1000ULL)/(ns ? ns : 1));
+}
+
+static int bench_read(char *path, uint64_t passes, uint64_t chunk, struct nk_block_dev *d)
+{
+    struct nk_bcache_stats s;
+    uint8_t *buf;
+    nk_fs_fd_t fd;
+    uint64_t p, total, start, end;
+    ssize_t n;
+    char what[32];
+
+    if (!(buf = malloc(chunk))) {
+	nk_vc_printf("cannot allocate buffer\n");
+	return -1;
+    }
+
+    if (d) {
+	nk_bcache_get_stats(d,&s);
+    }
+
+    for (p=0;p<passes;p++) {
+	fd = nk_fs_open(path,O_RDONLY,0);
+
+	if (FS_FD_ERR(fd)) {
+	    nk_vc_printf("cannot open %s\n",path);
+	    free(buf);
+	    return -1;
+	}
+
+	total = 0;
+	start = nk_sched_get_realtime();
+
+	while ((n = nk_fs_read(fd,buf,chunk))>0) {
+	    total += n;
+	}
+
+	end = nk_sched_get_realtime();
+
+	nk_fs_close(fd);
+
+	if (n<0) {
+	    nk_vc_printf("read failed after %lu bytes\n",total);
+	    free(buf);
+	    return -1;
+	}
+
+	snprintf(what,32,"pass %lu%s",p,p ? "" : " (cold)");
+	report(what,total,end-start);
+	stats_diff(d,&s);
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int bench_write(char *path, uint64_t size, uint64_t chunk, struct nk_block_dev *d)
+{
+    struct nk_bcache_stats s;
+    uint8_t *buf;
+    nk_fs_fd_t fd;
+    uint64_t total = 0, start, mid, end;
+    ssize_t n;
+
+    if (!(buf = malloc(chunk))) {
+	nk_vc_printf("cannot allocate buffer\n");
+	return -1;
+    }
+
+    memset(buf,0x5a,chunk);
+
+    fd = nk_fs_open(path,O_WRONLY | O_CREAT,0);
+
+    if (FS_FD_ERR(fd)) {
+	nk_vc_printf("cannot open %s\n",path);
+	free(buf);
+	return -1;
+    }
+
+    if (d) {
+	nk_bcache_get_stats(d,&s);
+    }
+
+    start = nk_sched_get_realtime();
+
+    while (total<size) {
+	n = nk_fs_write(fd,buf,size-total < chunk ? size-total : chunk);
+	if (n<=0) {
+	    nk_vc_printf("write failed after %lu bytes\n",total);
+	    break;
+	}
+	total += n;
+    }
+
+    mid = nk_sched_get_realtime();
+
+    nk_fs_close(fd);
+
+    if (nk_fs_sync()) {
+	nk_vc_printf("sync failed\n");
+    }
+
+    end = nk_sched_get_realtime();
+
+    free(buf);
+
+    report("write",total,mid-start);
+    report("write+sync",total,end-start);
+    stats_diff(d,&s);
+
+    return total==size ? 0 : -1;
+}
+
+static int
+handle_fsbench (char * buf, void * priv)
+{
+    char op[16], path[SHELL_MAX_CMD], devname[32];
+    uint64_t arg = 0, chunk = DEFAULT_CHUNK;
+    struct nk_block_dev *d = 0;
+    int n, rc;
+
+    devname[0] = 0;
+
+    if ((n=sscanf(buf,"fsbench %15s %s %lu %lu %31s",op,path,&arg,&chunk,devname))<2
+	|| (strcmp(op,"read") && strcmp(op,"write"))
+	|| (!strcmp(op,"write") && n<3)) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return 0;
+    }
+
+    if (!chunk || chunk>MAX_CHUNK) {
+	nk_vc_printf("chunk must be 1 to %d bytes\n",MAX_CHUNK);
+	return 0;
+    }
+
+    if (devname[0] && !(d=nk_block_dev_find(devname))) {
+	nk_vc_printf("Can't find %s\n",devname);
+	return 0;
+    }
+
+    if (!strcmp(op,"read")) {
+	rc = bench_read(path,arg ? arg : DEFAULT_PASSES,chunk,d);
+    } else {
+	rc = bench_write(path,arg,chunk,d);
+    }
+
+    nk_vc_printf("fsbench %s\n", rc ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl fsbench_impl = {
+    .cmd      = "fsbench",
+    .help_str = "fsbench read path [passes] [chunk] [blockdev] | fsbench write path bytes [chunk] [blockdev]",
+    .handler  = handle_fsbench,
+};
+nk_register_shell_cmd(fsbench_impl);
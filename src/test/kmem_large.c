@@ -0,0 +1,114 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Exact-size large allocations and in-place realloc
+//
+
+#define MB (1024UL*1024UL)
+
+static int check_block(char *what, void *p, uint64_t expect)
+{
+    void *block;
+    uint64_t size, flags;
+
+    if (kmem_find_block(p+expect-1,&block,&size,&flags) || block!=p || size!=expect) {
+	nk_vc_printf("%s: block %p has size %lu, expected %lu\n", what, p, size, expect);
+	return -1;
+    }
+
+    return 0;
+}
+
+static int test_large(void)
+{
+    struct kmem_stats before, after;
+    uint64_t len = 3*MB + PAGE_SIZE_4KB;
+    char *p, *q;
+    int rc = 0;
+
+    before.max_pools = 0;
+    kmem_stats(&before);
+
+    if (!(p = malloc(3*MB + 1))) {
+	nk_vc_printf("cannot allocate %lu bytes\n", 3*MB+1);
+	return -1;
+    }
+
+    rc |= check_block("alloc", p, len);
+
+    p[0] = 1;
+    p[3*MB] = 2;
+
+    // a shrink is always done in place
+    q = realloc(p, 5*MB/2);
+    if (q!=p) {
+	nk_vc_printf("shrink moved the block\n");
+	rc = -1;
+    }
+    rc |= check_block("shrink", q, 5*MB/2);
+
+    // a grow is done in place only if the memory after is free
+    p = realloc(q, 6*MB);
+    if (!p || p[0]!=1) {
+	nk_vc_printf("grow lost the data\n");
+	rc = -1;
+    } else {
+	nk_vc_printf("grow %s\n", p==q ? "in place" : "moved");
+	rc |= check_block("grow", p, 6*MB);
+    }
+
+    free(p);
+
+    after.max_pools = 0;
+    kmem_stats(&after);
+
+    if (after.large_blocks != before.large_blocks) {
+	nk_vc_printf("large block leaked (%lu before, %lu after)\n",
+		     before.large_blocks, after.large_blocks);
+	rc = -1;
+    }
+
+    return rc;
+}
+
+static int
+handle_kmemlarge (char * buf, void * priv)
+{
+    int rc = test_large();
+
+    nk_vc_printf("kmem large block test %s\n", rc ? "FAILED" : "passed");
+
+    return 0;
+}
+
+static struct shell_cmd_impl kmemlarge_impl = {
+    .cmd      = "kmemlarge",
+    .help_str = "kmemlarge",
+    .handler  = handle_kmemlarge,
+};
+nk_register_shell_cmd(kmemlarge_impl);
@@ -0,0 +1,246 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/netdev.h>
+#include <nautilus/devpoll.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+#ifdef NAUT_CONFIG_VIRTIO_NET
+#include <dev/virtio_net.h>
+#endif
+
+//
+// Raw packet rate of a network device, below any stack.  "tx" keeps
+// a fixed number of broadcast frames of an experimental ethertype in
+// flight; "rx" keeps that many receive buffers posted and counts
+// whatever arrives.  Run it on a device nothing else is attached to.
+// Latency is from posting a request to its completion callback, so
+// for rx it includes waiting for traffic.
+//
+
+#define DEFAULT_DEPTH   64
+#define DEFAULT_PACKETS 1000000
+#define DEFAULT_SIZE    60
+#define MAX_DEPTH       1024
+#define BENCH_ETHERTYPE 0x88b5
+
+struct net_op {
+    uint8_t      *buf;
+    uint64_t      start;
+    volatile uint64_t end;
+    volatile int  done;
+    volatile int  failed;
+    int           outstanding;
+};
+
+static void net_op_done(nk_net_dev_status_t status, void *context)
+{
+    struct net_op *op = (struct net_op *)context;
+
+    op->end = nk_sched_get_realtime();
+    op->failed = status != NK_NET_DEV_STATUS_SUCCESS;
+    op->done = 1;
+}
+
+static int net_op_issue(struct nk_net_dev *d, struct net_op *op, uint64_t size, int send)
+{
+    op->done = 0;
+    op->outstanding = 1;
+    op->start = nk_sched_get_realtime();
+
+    if (send) {
+	return nk_net_dev_send_packet(d,op->buf,size,NK_DEV_REQ_CALLBACK,net_op_done,op);
+    } else {
+	return nk_net_dev_receive_packet(d,op->buf,size,NK_DEV_REQ_CALLBACK,net_op_done,op);
+    }
+}
+
+static void fill_frame(uint8_t *f, uint64_t size, uint8_t *mac)
+{
+    memset(f,0xff,ETHER_MAC_LEN);
+    memcpy(f+ETHER_MAC_LEN,mac,ETHER_MAC_LEN);
+    f[12] = BENCH_ETHERTYPE>>8;
+    f[13] = BENCH_ETHERTYPE & 0xff;
+    memset(f+14,0xa5,size-14);
+}
+
+static int netbench(struct nk_net_dev *d, int send, uint64_t depth, uint64_t packets, uint64_t size)
+{
+    struct nk_net_dev_characteristics c;
+    struct net_op *op;
+    uint64_t issued = 0, completed = 0, errors = 0;
+    uint64_t start, end, i;
+    struct nk_dev_poll_hist hist;
+    int rc = 0;
+#ifdef NAUT_CONFIG_VIRTIO_NET
+    struct virtio_net_stats before, after;
+    int have_stats;
+#endif
+
+    if (nk_net_dev_get_characteristics(d,&c)) {
+	nk_vc_printf("cannot get characteristics\n");
+	return -1;
+    }
+
+    if (!send) {
+	// a receive buffer has to hold any frame
+	size = c.max_tu;
+    }
+
+    if (size < c.min_tu || size > c.max_tu) {
+	nk_vc_printf("frame size must be %lu to %lu bytes\n", c.min_tu, c.max_tu);
+	return -1;
+    }
+
+    nk_vc_printf("device: %u queue pairs, offloads 0x%lx\n", c.num_queues, c.offloads);
+
+    op = malloc(depth*sizeof(struct net_op));
+
+    if (!op) {
+	nk_vc_printf("cannot allocate requests\n");
+	return -1;
+    }
+
+    memset(op,0,depth*sizeof(struct net_op));
+    memset(&hist,0,sizeof(hist));
+
+    for (i=0;i<depth;i++) {
+	if (!(op[i].buf = malloc(c.packet_size_to_buffer_size(size)))) {
+	    nk_vc_printf("cannot allocate buffers\n");
+	    rc = -1;
+	    goto out;
+	}
+	fill_frame(op[i].buf,size,c.mac);
+    }
+
+#ifdef NAUT_CONFIG_VIRTIO_NET
+    have_stats = !virtio_net_get_stats(d,&before);
+#endif
+
+    start = nk_sched_get_realtime();
+
+    for (i=0;i<depth && issued<packets;i++) {
+	if (net_op_issue(d,&op[i],size,send)) {
+	    nk_vc_printf("cannot issue request\n");
+	    op[i].outstanding = 0;
+	    rc = -1;
+	    break;
+	}
+	issued++;
+    }
+
+    // for rx, this waits until the requested number of packets shows up
+    while (completed < issued) {
+	for (i=0;i<depth;i++) {
+	    if (!op[i].outstanding || !op[i].done) {
+		continue;
+	    }
+
+	    errors += op[i].failed;
+	    completed++;
+	    nk_dev_poll_hist_add(&hist,op[i].end - op[i].start);
+	    op[i].outstanding = 0;
+
+	    if (issued < packets && !rc) {
+		if (net_op_issue(d,&op[i],size,send)) {
+		    nk_vc_printf("cannot issue request\n");
+		    op[i].outstanding = 0;
+		    rc = -1;
+		} else {
+		    issued++;
+		}
+	    }
+	}
+    }
+
+    end = nk_sched_get_realtime();
+
+    nk_vc_printf("%lu packets %s in %lu ns: %lu packets/s, %lu Mbit/s, %lu errors\n",
+		 completed, send ? "sent" : "received", end-start,
+		 (completed*1000000000ULL)/((end-start) ? (end-start) : 1),
+		 send ? (completed*size*8000ULL)/((end-start) ? (end-start) : 1) : 0,
+		 errors);
+
+    nk_dev_poll_hist_print(&hist,"latency","ns");
+
+#ifdef NAUT_CONFIG_VIRTIO_NET
+    if (have_stats && !virtio_net_get_stats(d,&after)) {
+	nk_vc_printf("virtio: %lu posts %lu kicks %lu kicks suppressed %lu interrupts %lu completions %lu checksums finished\n",
+		     after.posts-before.posts, after.kicks-before.kicks,
+		     after.kicks_suppressed-before.kicks_suppressed,
+		     after.interrupts-before.interrupts, after.completions-before.completions,
+		     after.csum_fixups-before.csum_fixups);
+    }
+#endif
+
+ out:
+    for (i=0;i<depth;i++) {
+	if (op[i].buf) {
+	    free(op[i].buf);
+	}
+    }
+    free(op);
+
+    return rc;
+}
+
+static int
+handle_netbench (char * buf, void * priv)
+{
+    char name[32], dir[16];
+    uint64_t depth = DEFAULT_DEPTH;
+    uint64_t packets = DEFAULT_PACKETS;
+    uint64_t size = DEFAULT_SIZE;
+    struct nk_net_dev *d;
+
+    if ((sscanf(buf,"netbench %s %s %lu %lu %lu",name,dir,&depth,&packets,&size)<2)
+	|| (strcmp(dir,"tx") && strcmp(dir,"rx"))) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return 0;
+    }
+
+    if (!depth || depth>MAX_DEPTH || !packets) {
+	nk_vc_printf("need a depth of 1 to %d and at least one packet\n",MAX_DEPTH);
+	return 0;
+    }
+
+    if (!(d=nk_net_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return 0;
+    }
+
+    nk_vc_printf("netbench: %s %s, depth %lu, %lu packets\n", name, dir, depth, packets);
+
+    nk_vc_printf("netbench %s\n", netbench(d,!strcmp(dir,"tx"),depth,packets,size) ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl netbench_impl = {
+    .cmd      = "netbench",
+    .help_str = "netbench dev tx|rx [depth] [packets] [frame size]",
+    .handler  = handle_netbench,
+};
+nk_register_shell_cmd(netbench_impl);
@@ -0,0 +1,200 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/numa.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Local vs remote memory bandwidth, using kmem placement policies
+//
+
+#define DEFAULT_MB      64
+#define READ_PASSES     4
+#define INTERLEAVE_NUM  64
+#define INTERLEAVE_SIZE (1UL<<20)
+
+static int domain_of(void *p)
+{
+    struct mem_region *r = kmem_get_region_by_addr((ulong_t)p);
+
+    return r ? (int)r->domain_id : -1;
+}
+
+static uint64_t read_bw(volatile uint64_t *buf, uint64_t len)
+{
+    uint64_t i, p, sum=0, start, ns;
+    uint64_t n = len/sizeof(uint64_t);
+
+    start = nk_sched_get_realtime();
+    for (p=0;p<READ_PASSES;p++) {
+	for (i=0;i<n;i++) {
+	    sum += buf[i];
+	}
+    }
+    ns = nk_sched_get_realtime() - start;
+
+    // keep the loop from being discarded
+    buf[0] = sum;
+
+    // MB/s
+    return (READ_PASSES*len*1000000000ULL)/((ns ? ns : 1)*1024*1024);
+}
+
+static int test_bind(uint64_t len)
+{
+    unsigned d, nd = nk_get_num_domains();
+    unsigned me = nk_my_numa_node();
+    int rc = 0;
+
+    for (d=0;d<nd && d<64;d++) {
+	void *buf = kmem_malloc_policy(len,KMEM_POLICY_BIND,KMEM_NODEMASK_NODE(d));
+
+	if (!buf) {
+	    nk_vc_printf("domain %u: cannot allocate %lu bytes\n",d,len);
+	    continue;
+	}
+
+	if (domain_of(buf)!=d) {
+	    nk_vc_printf("domain %u: bind placed memory in domain %d\n",d,domain_of(buf));
+	    rc = -1;
+	}
+
+	memset(buf,1,len);
+
+	nk_vc_printf("domain %u (%s): %lu MB/s\n", d,
+		     d==me ? "local" : "remote", read_bw(buf,len));
+
+	free(buf);
+    }
+
+    return rc;
+}
+
+static int test_interleave(void)
+{
+    unsigned d, nd = nk_get_num_domains();
+    uint64_t count[64];
+    void *chunks[INTERLEAVE_NUM];
+    int i;
+
+    memset(count,0,sizeof(count));
+
+    for (i=0;i<INTERLEAVE_NUM;i++) {
+	chunks[i] = kmem_malloc_policy(INTERLEAVE_SIZE,KMEM_POLICY_INTERLEAVE,KMEM_NODEMASK_ALL);
+	if (chunks[i] && domain_of(chunks[i])>=0 && domain_of(chunks[i])<64) {
+	    count[domain_of(chunks[i])]++;
+	}
+    }
+
+    nk_vc_printf("interleave of %d chunks:",INTERLEAVE_NUM);
+    for (d=0;d<nd && d<64;d++) {
+	nk_vc_printf(" %lu",count[d]);
+    }
+    nk_vc_printf("\n");
+
+    for (i=0;i<INTERLEAVE_NUM;i++) {
+	if (chunks[i]) {
+	    free(chunks[i]);
+	}
+    }
+
+    return 0;
+}
+
+static void inherit_func(void *in, void **out)
+{
+    int policy;
+    uint64_t mask;
+    void *p;
+
+    kmem_get_thread_policy(&policy,&mask);
+
+    p = malloc(PAGE_SIZE);
+
+    *(int*)in = policy==KMEM_POLICY_BIND && mask==KMEM_NODEMASK_NODE(nk_get_num_domains()-1)
+	&& p && domain_of(p)==nk_get_num_domains()-1;
+
+    if (p) {
+	free(p);
+    }
+}
+
+// a bind policy set by the parent must carry over to its children
+static int test_inherit(void)
+{
+    int old_policy, ok = 0;
+    uint64_t old_mask;
+    nk_thread_id_t tid;
+
+    kmem_get_thread_policy(&old_policy,&old_mask);
+
+    if (kmem_set_thread_policy(KMEM_POLICY_BIND,KMEM_NODEMASK_NODE(nk_get_num_domains()-1))) {
+	nk_vc_printf("cannot set thread policy\n");
+	return -1;
+    }
+
+    if (nk_thread_start(inherit_func,&ok,0,0,0,&tid,-1)) {
+	nk_vc_printf("cannot start thread\n");
+	kmem_set_thread_policy(old_policy,old_mask);
+	return -1;
+    }
+
+    kmem_set_thread_policy(old_policy,old_mask);
+
+    nk_join(tid,0);
+
+    nk_vc_printf("policy inheritance %s\n", ok ? "passed" : "FAILED");
+
+    return ok ? 0 : -1;
+}
+
+static int
+handle_numabw (char * buf, void * priv)
+{
+    uint64_t mb = DEFAULT_MB;
+    int rc = 0;
+
+    sscanf(buf,"numabw %lu",&mb);
+
+    nk_vc_printf("numabw: %u domains, running on cpu %u in domain %u, %lu MB buffers\n",
+		 nk_get_num_domains(), my_cpu_id(), nk_my_numa_node(), mb);
+
+    rc |= test_bind(mb*1024*1024);
+    rc |= test_interleave();
+    rc |= test_inherit();
+
+    nk_vc_printf("numabw %s\n", rc ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl numabw_impl = {
+    .cmd      = "numabw",
+    .help_str = "numabw [MB]",
+    .handler  = handle_numabw,
+};
+nk_register_shell_cmd(numabw_impl);
@@ -0,0 +1,147 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/stackpool.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Thread spawn throughput: create, run, join, and destroy batches of
+// threads.  Destroying the batch between rounds forces the following
+// round to build new threads, so after the first round their stacks
+// come from the stack pools rather than the allocator.
+//
+
+#define DEFAULT_THREADS  256
+#define DEFAULT_STACK_KB 64
+#define ROUNDS           4
+
+static void spawn_func(void *in, void **out)
+{
+    volatile char probe[256];
+
+    // touch the stack so that a bad stack shows up here
+    probe[0] = 1;
+    probe[sizeof(probe)-1] = probe[0];
+}
+
+static int spawn_round(nk_thread_id_t *tids, uint64_t n, nk_stack_size_t stack, uint64_t *ns)
+{
+    uint64_t i, start;
+    int rc = 0;
+
+    start = nk_sched_get_realtime();
+
+    for (i=0;i<n;i++) {
+	if (nk_thread_start(spawn_func,0,0,0,stack,&tids[i],CPU_ANY)) {
+	    nk_vc_printf("cannot start thread %lu\n",i);
+	    tids[i] = 0;
+	    rc = -1;
+	}
+    }
+
+    for (i=0;i<n;i++) {
+	if (tids[i]) {
+	    nk_join(tids[i],0);
+	}
+    }
+
+    // get rid of the exited threads so that none can be reanimated
+    nk_sched_reap(1);
+
+    *ns = nk_sched_get_realtime() - start;
+
+    return rc;
+}
+
+static int spawnbench(uint64_t n, nk_stack_size_t stack)
+{
+    nk_thread_id_t *tids = malloc(n*sizeof(nk_thread_id_t));
+    uint64_t ns;
+    int r, rc = 0;
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+    struct nk_stack_pool_stats before, after;
+#endif
+
+    if (!tids) {
+	nk_vc_printf("cannot allocate thread array\n");
+	return -1;
+    }
+
+    nk_vc_printf("spawnbench: %lu threads per round, requested stack %lu bytes, usable %lu bytes\n",
+		 n, stack, nk_stack_size(stack));
+
+    for (r=0;r<ROUNDS;r++) {
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+	nk_stack_pool_get_stats(&before);
+#endif
+	rc |= spawn_round(tids,n,stack,&ns);
+
+	nk_vc_printf("round %d: %lu ns per thread, %lu threads/s\n",
+		     r, ns/n, (n*1000000000ULL)/(ns ? ns : 1));
+
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+	nk_stack_pool_get_stats(&after);
+	nk_vc_printf("         stacks: %lu pooled %lu allocated %lu kept %lu released\n",
+		     after.hits-before.hits, after.misses-before.misses,
+		     after.frees-before.frees, after.releases-before.releases);
+#endif
+    }
+
+#ifdef NAUT_CONFIG_THREAD_STACK_POOL
+    nk_vc_printf("pools now hold %lu stacks (%lu bytes), %lu guard pages armed\n",
+		 after.pooled, after.bytes, after.guards);
+#endif
+
+    free(tids);
+
+    return rc;
+}
+
+static int
+handle_spawnbench (char * buf, void * priv)
+{
+    uint64_t n = DEFAULT_THREADS;
+    uint64_t kb = DEFAULT_STACK_KB;
+
+    sscanf(buf,"spawnbench %lu %lu",&n,&kb);
+
+    if (!n) {
+	nk_vc_printf("need at least one thread\n");
+	return 0;
+    }
+
+    nk_vc_printf("spawnbench %s\n", spawnbench(n,kb*1024) ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl spawnbench_impl = {
+    .cmd      = "spawnbench",
+    .help_str = "spawnbench [threads] [stack KB]",
+    .handler  = handle_spawnbench,
+};
+nk_register_shell_cmd(spawnbench_impl);
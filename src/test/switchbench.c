@@ -0,0 +1,136 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Kyle C. Hale <khale@cs.iit.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Kyle C. Hale <khale@cs.iit.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/fpu.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Thread context switch latency: two threads bound to the same CPU
+// yield to each other, first without touching the FPU, then doing a
+// floating point add between yields.  With NAUT_CONFIG_FPU_LAZY the
+// first case should not save or restore any FPU state.
+//
+
+#define DEFAULT_SWITCHES 100000
+
+struct switch_arg {
+    uint64_t n;
+    int      use_fp;
+};
+
+static volatile uint64_t switch_start;
+static volatile uint64_t switch_end;
+
+static void switcher(void *in, void **out)
+{
+    struct switch_arg *a = (struct switch_arg *)in;
+    volatile double x = 0.0;
+    uint64_t i;
+
+    __sync_bool_compare_and_swap(&switch_start, 0, nk_sched_get_realtime());
+
+    for (i=0;i<a->n;i++) {
+	if (a->use_fp) {
+	    x = x + 1.0;
+	}
+	nk_yield();
+    }
+
+    switch_end = nk_sched_get_realtime();
+}
+
+static int switch_round(uint64_t n, int use_fp, int cpu)
+{
+    struct switch_arg arg = { .n = n, .use_fp = use_fp };
+    nk_thread_id_t tids[2];
+    uint64_t restores;
+    int i;
+
+    switch_start = 0;
+    switch_end = 0;
+    restores = nk_fpu_lazy_restores;
+
+    for (i=0;i<2;i++) {
+	if (nk_thread_start(switcher,&arg,0,0,0,&tids[i],cpu)) {
+	    nk_vc_printf("cannot start thread\n");
+	    if (i) {
+		nk_join(tids[0],0);
+	    }
+	    return -1;
+	}
+    }
+
+    nk_join(tids[0],0);
+    nk_join(tids[1],0);
+
+    nk_vc_printf("%s: %lu switches in %lu ns, %lu ns per switch, %lu lazy FPU restores\n",
+		 use_fp ? "fp  " : "int ", 2*n, switch_end-switch_start,
+		 (switch_end-switch_start)/(2*n), nk_fpu_lazy_restores-restores);
+
+    return 0;
+}
+
+static int
+handle_switchbench (char * buf, void * priv)
+{
+    uint64_t n = DEFAULT_SWITCHES;
+    int cpu = nk_get_num_cpus() > 1 ? 1 : 0;
+    int rc = 0;
+
+    sscanf(buf,"switchbench %lu",&n);
+
+    if (!n) {
+	nk_vc_printf("need at least one switch\n");
+	return 0;
+    }
+
+    nk_vc_printf("switchbench: cpu %d, FPU state saved with %s, %s\n", cpu,
+		 nk_fpu_save_mode == NK_FPU_XSAVEOPT ? "xsaveopt" :
+		 nk_fpu_save_mode == NK_FPU_XSAVE ? "xsave" : "fxsave",
+#if defined(NAUT_CONFIG_FPU_LAZY)
+		 "lazily"
+#elif defined(NAUT_CONFIG_FPU_SAVE)
+		 "on every switch"
+#else
+		 "never"
+#endif
+		 );
+
+    rc |= switch_round(n,0,cpu);
+    rc |= switch_round(n,1,cpu);
+
+    nk_vc_printf("switchbench %s\n", rc ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl switchbench_impl = {
+    .cmd      = "switchbench",
+    .help_str = "switchbench [switches per thread]",
+    .handler  = handle_switchbench,
+};
+nk_register_shell_cmd(switchbench_impl);
@@ -25,6 +25,7 @@
 #include <nautilus/shell.h>
 #include <nautilus/task.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/thread.h>
 
 #define DO_PRINT       0
 
@@ -167,12 +168,55 @@ static int test_recursive_create_wait()
 }
 
 
+// stealers may run these, so they must not need an argument
+static void *sized_nop(void *in)
+{
+    return 0;
+}
+
+// queue sized tasks on our own cpu and check that consuming
+// with a size limit only ever returns tasks that fit
+static int test_sized_consume(int numt)
+{
+    int i, found=0;
+    uint64_t limit = 1000000;   // 1 ms
+    struct nk_task *t;
+
+    for (i=0;i<numt;i++) {
+	// sizes spread from 1 us to ~4 ms
+	tasks[i] = nk_task_produce(my_cpu_id(), 1000ULL << (i % 13), sized_nop, 0, NK_TASK_DETACHED);
+	if (!tasks[i]) {
+	    PRINT("Failed to launch sized task %d\n", i);
+	    return -1;
+	}
+    }
+
+    while ((t = nk_task_consume(my_cpu_id(), limit, 8))) {
+	if (t->stats.size_ns > limit) {
+	    nk_vc_printf("Consumed task of size %lu with limit %lu\n", t->stats.size_ns, limit);
+	    return -1;
+	}
+	nk_task_complete(t,0);
+	found++;
+    }
+
+    // drain everything else
+    while ((t = nk_task_consume(my_cpu_id(), 0, 0))) {
+	nk_task_complete(t,0);
+    }
+
+    // other cpus may have stolen some, so the count is only informative
+    PRINT("Found %d of %d tasks fitting in %lu ns\n", found, numt, limit);
+
+    return 0;
+}
 
 
 int test_tasks()
 {
     int create_wait;
     int recursive_create_wait;
+    int sized_consume;
 
     create_wait = test_create_wait(NUM_PASSES,NUM_TASKS);
 
@@ -184,7 +228,12 @@ int test_tasks()
     nk_vc_printf("Recursive create-wait test of %lu passes with %lu tasks each: %s\n", 
 		 NUM_PASSES,NUM_TASKS, recursive_create_wait ? "FAIL" : "PASS");
 
-    return create_wait | recursive_create_wait;
+    sized_consume = test_sized_consume(NUM_TASKS);
+
+    nk_vc_printf("Sized consume test of %lu tasks: %s\n",
+		 NUM_TASKS, sized_consume ? "FAIL" : "PASS");
+
+    return create_wait | recursive_create_wait | sized_consume;
 
 }
 
@@ -201,3 +250,144 @@ static struct shell_cmd_impl tasks_impl = {
     .handler  = handle_tasks,
 };
 nk_register_shell_cmd(tasks_impl);
+
+
+
+// Throughput microbenchmark
+//
+// For 1, 2, 4, ... cores, one thread bound to each core produces a
+// batch of tiny tasks and then waits on them, running whatever it
+// can find while waiting.  In "spread" mode every core produces the
+// same number of tasks, in "single" mode only core 0 produces and
+// the others only run what they can steal from it.
+
+#define BENCH_TASKS 4096
+#define BENCH_WORK  64
+
+static volatile int bench_ready;
+static volatile int bench_go;
+static volatile int bench_producers;
+
+static void *bench_task(void *in)
+{
+    volatile uint64_t i, x = (uint64_t) in;
+
+    for (i=0;i<BENCH_WORK;i++) {
+	x = x*31 + i;
+    }
+
+    return (void*) x;
+}
+
+static void bench_thread(void *in, void **out)
+{
+    uint64_t num = (uint64_t) in;
+    struct nk_task **t = 0;
+    struct nk_task *s;
+    uint64_t i;
+
+    if (num) {
+	t = (struct nk_task **) malloc(sizeof(struct nk_task *)*num);
+	if (!t) {
+	    nk_vc_printf("Failed to allocate task array\n");
+	    num = 0;
+	}
+    }
+
+    __sync_fetch_and_add(&bench_ready,1);
+
+    while (!bench_go) {
+	// wait for the others
+    }
+
+    if (num) {
+	for (i=0;i<num;i++) {
+	    t[i] = nk_task_produce(-1,0,bench_task,(void*)i,0);
+	}
+	for (i=0;i<num;i++) {
+	    if (t[i]) {
+		nk_task_wait(t[i],0,0);
+	    }
+	}
+	free(t);
+	__sync_fetch_and_sub(&bench_producers,1);
+    } else {
+	// pure thief; help until the producers are done
+	while (bench_producers) {
+	    if ((s = nk_task_try_consume(-1,0,0))) {
+		nk_task_complete(s,s->func(s->input));
+	    }
+	}
+    }
+}
+
+static int bench_run(int cores, uint64_t num, int single, uint64_t *ns)
+{
+    int i;
+    uint64_t start;
+
+    bench_ready = 0;
+    bench_go = 0;
+    bench_producers = single ? 1 : cores;
+
+    for (i=0;i<cores;i++) {
+	if (nk_thread_start(bench_thread, (void*)((single && i) ? 0 : num), 0, 0, PAGE_SIZE_4KB, NULL, i)) {
+	    nk_vc_printf("Failed to launch thread on cpu %d\n", i);
+	    bench_producers = 0;
+	    bench_go = 1;
+	    nk_join_all_children(0);
+	    return -1;
+	}
+    }
+
+    while (bench_ready < cores) {
+	nk_yield();
+    }
+
+    start = nk_sched_get_realtime();
+    bench_go = 1;
+    nk_join_all_children(0);
+    *ns = nk_sched_get_realtime() - start;
+
+    nk_sched_reap(1);
+
+    return 0;
+}
+
+static int
+handle_taskbench (char * buf, void * priv)
+{
+    uint64_t num = BENCH_TASKS;
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t spread_ns, single_ns;
+    int cores, last;
+
+    if (sscanf(buf,"taskbench %lu", &num)!=1 || !num) {
+	num = BENCH_TASKS;
+    }
+
+    nk_vc_printf("%lu tasks per producer, %d units of work each\n", num, BENCH_WORK);
+    nk_vc_printf("cores    spread tasks/s    single tasks/s\n");
+
+    for (cores=1, last=0; !last; cores*=2) {
+	if (cores >= sys->num_cpus) {
+	    cores = sys->num_cpus;
+	    last = 1;
+	}
+	if (bench_run(cores,num,0,&spread_ns) || bench_run(cores,num,1,&single_ns)) {
+	    return -1;
+	}
+	nk_vc_printf("%5d %17lu %17lu\n", cores,
+		     (num*cores*1000000000ULL)/(spread_ns ? spread_ns : 1),
+		     (num*1000000000ULL)/(single_ns ? single_ns : 1));
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl taskbench_impl = {
+    .cmd      = "taskbench",
+    .help_str = "taskbench [tasks-per-core]",
+    .handler  = handle_taskbench,
+};
+nk_register_shell_cmd(taskbench_impl);
@@ -0,0 +1,162 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The Interweaving Project <http://interweaving.org>
+ *                     The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/timer.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/vc.h>
+
+//
+// Timer stress: start and cancel rates, and expiry lateness
+//
+
+#define DEFAULT_TIMERS  1000
+#define FAR_NS          1000000000ULL   // 1 s, never reached by the start/cancel pass
+#define SPREAD_NS       10000000ULL     // expirations are spread over 10 ms
+#define WAIT_LIMIT      1000            // ms to wait for all expirations
+
+static volatile uint64_t fired;
+static volatile uint64_t late_sum;
+static volatile uint64_t late_max;
+
+static void bench_callback(void *p)
+{
+    nk_timer_t *t = p;
+    uint64_t late = nk_sched_get_realtime() - t->time_ns;
+    uint64_t old;
+
+    __sync_fetch_and_add(&late_sum, late);
+    while ((old = late_max) < late && !__sync_bool_compare_and_swap(&late_max, old, late)) {
+    }
+    __sync_fetch_and_add(&fired, 1);
+}
+
+static uint64_t rate(uint64_t n, uint64_t ns)
+{
+    return (n*1000000000ULL)/(ns ? ns : 1);
+}
+
+static int timerbench(uint64_t n)
+{
+    nk_timer_t **timers = malloc(n*sizeof(nk_timer_t*));
+    uint32_t cpu = my_cpu_id();
+    uint64_t i, start, start_ns, cancel_ns;
+    int waited, rc = 0;
+    struct nk_timer_stats stats;
+
+    if (!timers) {
+	nk_vc_printf("cannot allocate timer array\n");
+	return -1;
+    }
+
+    memset(timers, 0, n*sizeof(nk_timer_t*));
+
+    for (i=0;i<n;i++) {
+	if (!(timers[i] = nk_timer_create(0))) {
+	    nk_vc_printf("cannot create timer %lu\n",i);
+	    rc = -1;
+	    goto out;
+	}
+    }
+
+    // start and then cancel timers that are far from expiring
+    start = nk_sched_get_realtime();
+    for (i=0;i<n;i++) {
+	nk_timer_set(timers[i], FAR_NS + i*1000, NK_TIMER_CALLBACK, bench_callback, timers[i], cpu);
+	nk_timer_start(timers[i]);
+    }
+    start_ns = nk_sched_get_realtime() - start;
+
+    start = nk_sched_get_realtime();
+    for (i=0;i<n;i++) {
+	nk_timer_cancel(timers[i]);
+    }
+    cancel_ns = nk_sched_get_realtime() - start;
+
+    // now let them all expire over a short window; the expirations
+    // are paced by SPREAD_NS, so only their lateness is meaningful
+    fired = 0;
+    late_sum = 0;
+    late_max = 0;
+
+    for (i=0;i<n;i++) {
+	nk_timer_set(timers[i], 1000000ULL + (i*SPREAD_NS)/n, NK_TIMER_CALLBACK, bench_callback, timers[i], cpu);
+	nk_timer_start(timers[i]);
+    }
+
+    for (waited=0; fired<n && waited<WAIT_LIMIT; waited++) {
+	nk_sleep(1000000ULL);
+    }
+
+    if (fired<n) {
+	nk_vc_printf("only %lu of %lu timers expired\n", fired, n);
+	rc = -1;
+    }
+
+    nk_vc_printf("%lu timers on cpu %u: %lu starts/s %lu cancels/s\n",
+		 n, cpu, rate(n,start_ns), rate(n,cancel_ns));
+    nk_vc_printf("lateness: %lu ns mean %lu ns max\n",
+		 fired ? late_sum/fired : 0, late_max);
+
+    if (!nk_timer_get_stats(cpu,&stats)) {
+	nk_vc_printf("wheel: %lu active %lu starts %lu cancels %lu expires %lu cascades %lu ns mean late %lu ns max late\n",
+		     stats.active, stats.starts, stats.cancels, stats.expires, stats.cascades,
+		     stats.expires ? stats.late_sum_ns/stats.expires : 0, stats.late_max_ns);
+    }
+
+ out:
+    for (i=0;i<n;i++) {
+	if (timers[i]) {
+	    nk_timer_destroy(timers[i]);
+	}
+    }
+    free(timers);
+
+    return rc;
+}
+
+static int
+handle_timerbench (char * buf, void * priv)
+{
+    uint64_t n = DEFAULT_TIMERS;
+
+    sscanf(buf,"timerbench %lu",&n);
+
+    if (!n) {
+	nk_vc_printf("timerbench [timers]\n");
+	return 0;
+    }
+
+    timerbench(n);
+
+    return 0;
+}
+
+static struct shell_cmd_impl timerbench_impl = {
+    .cmd      = "timerbench",
+    .help_str = "timerbench [timers]",
+    .handler  = handle_timerbench,
+};
+nk_register_shell_cmd(timerbench_impl);
@@ -0,0 +1,225 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+
+#include <nautilus/nautilus.h>
+#include <nautilus/aspace.h>
+#include <nautilus/paging.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
+#include <nautilus/tlb.h>
+#include <nautilus/vc.h>
+
+//
+// Cost of changing the protections of a region of a paging address
+// space as the number of CPUs running in it grows.  Threads bound to
+// other CPUs move into the address space and keep reading the
+// region, while this thread (outside of it) flips the region between
+// read/write and read-only.  Every change has to be shot down on each
+// of those CPUs.  Up to NK_TLB_INVLPG_MAX pages are invalidated one
+// by one, more than that with a full flush.
+//
+
+#define DEFAULT_PAGES 16
+#define DEFAULT_ITERS 10000
+
+#define BENCH_VA 0x100000001000ULL  // 4 KB off of 2 MB alignment
+
+struct spinner {
+    nk_aspace_t       *aspace;
+    volatile uint8_t  *va;
+    uint64_t           pages;
+    volatile int       stop;
+    volatile int       ready;
+    volatile int       done;
+    volatile uint64_t  sink;
+};
+
+static void spin(void *in, void **out)
+{
+    struct spinner *s = (struct spinner *)in;
+    uint64_t i = 0, sum = 0;
+
+    nk_aspace_move_thread(s->aspace);
+
+    __sync_fetch_and_add(&s->ready,1);
+
+    while (!s->stop) {
+	sum += s->va[(i++ % s->pages)*PAGE_SIZE_4KB];
+    }
+
+    s->sink = sum;
+
+    nk_aspace_move_thread(0);
+
+    __sync_fetch_and_add(&s->done,1);
+}
+
+static int run(uint8_t *buf, uint64_t pages, uint64_t iters, int ncpus)
+{
+    struct spinner s;
+    struct nk_tlb_stats before, after;
+    nk_aspace_characteristics_t c;
+    nk_aspace_region_t r;
+    nk_aspace_protection_t ro, rw;
+    uint64_t i, start, end;
+    int cpu, started = 0, rc = 0;
+
+    if (nk_aspace_query("paging",&c)) {
+	nk_vc_printf("paging address spaces are not available\n");
+	return -1;
+    }
+
+    memset(&s,0,sizeof(s));
+
+    if (!(s.aspace = nk_aspace_create("paging","tlbbench",&c))) {
+	nk_vc_printf("cannot create address space\n");
+	return -1;
+    }
+
+    s.va = (volatile uint8_t *)BENCH_VA;
+    s.pages = pages;
+
+    rw.flags = NK_ASPACE_READ | NK_ASPACE_WRITE | NK_ASPACE_EAGER;
+    ro.flags = NK_ASPACE_READ | NK_ASPACE_EAGER;
+
+    r.va_start = (void*)BENCH_VA;
+    r.pa_start = buf;
+    r.len_bytes = pages*PAGE_SIZE_4KB;
+    r.protect = rw;
+
+    if (nk_aspace_add_region(s.aspace,&r)) {
+	nk_vc_printf("cannot add region\n");
+	nk_aspace_destroy(s.aspace);
+	return -1;
+    }
+
+    for (cpu=0; cpu<nk_get_num_cpus() && started<ncpus; cpu++) {
+	if (cpu==my_cpu_id()) {
+	    continue;
+	}
+	if (nk_thread_start(spin,&s,0,1,TSTACK_DEFAULT,0,cpu)) {
+	    nk_vc_printf("cannot start thread on cpu %d\n",cpu);
+	    rc = -1;
+	    break;
+	}
+	started++;
+    }
+
+    while (s.ready < started) {
+	nk_yield();
+    }
+
+    nk_tlb_get_stats(&before);
+
+    start = nk_sched_get_realtime();
+    for (i=0;i<iters && !rc;i++) {
+	if (nk_aspace_protect(s.aspace,&r,(i&1) ? &rw : &ro)) {
+	    nk_vc_printf("cannot change protections\n");
+	    rc = -1;
+	}
+    }
+    end = nk_sched_get_realtime();
+
+    nk_tlb_get_stats(&after);
+
+    s.stop = 1;
+
+    while (s.done < started) {
+	nk_yield();
+    }
+
+    // leave it read/write for the next removal
+    if (i&1) {
+	nk_aspace_protect(s.aspace,&r,&rw);
+    }
+
+    if (!rc) {
+	nk_vc_printf("%3d cpus: %lu ns/change, %lu IPIs, %lu handled (%lu lazily), %lu INVLPGs, %lu full flushes\n",
+		     started, (end-start)/iters,
+		     after.ipis - before.ipis,
+		     after.handled - before.handled,
+		     after.lazy - before.lazy,
+		     after.invlpgs - before.invlpgs,
+		     after.full_flushes - before.full_flushes);
+    }
+
+    nk_aspace_remove_region(s.aspace,&r);
+    nk_aspace_destroy(s.aspace);
+
+    return rc;
+}
+
+static int
+handle_tlbbench (char * buf, void * priv)
+{
+    uint64_t pages = DEFAULT_PAGES;
+    uint64_t iters = DEFAULT_ITERS;
+    int maxcpus = nk_get_num_cpus()-1;
+    int n, rc = 0;
+    uint8_t *mem;
+
+    sscanf(buf,"tlbbench %lu %lu %d",&pages,&iters,&maxcpus);
+
+    if (!pages || !iters) {
+	nk_vc_printf("need at least one page and one iteration\n");
+	return 0;
+    }
+
+    if (maxcpus > nk_get_num_cpus()-1) {
+	maxcpus = nk_get_num_cpus()-1;
+    }
+
+    if (!(mem = malloc(pages*PAGE_SIZE_4KB))) {
+	nk_vc_printf("cannot allocate %lu pages\n",pages);
+	return 0;
+    }
+
+    nk_vc_printf("tlbbench: %lu pages (%s), %lu changes, up to %d other cpus\n",
+		 pages, pages > NK_TLB_INVLPG_MAX ? "full flush" : "invlpg", iters, maxcpus);
+
+    // 0, 1, 2, 4, ... and always the maximum
+    for (n=0; !rc; n = n ? n*2 : 1) {
+	if (n > maxcpus) {
+	    n = maxcpus;
+	}
+	rc = run(mem,pages,iters,n);
+	if (n==maxcpus) {
+	    break;
+	}
+    }
+
+    free(mem);
+
+    nk_vc_printf("tlbbench %s\n", rc ? "FAILED" : "done");
+
+    return 0;
+}
+
+static struct shell_cmd_impl tlbbench_impl = {
+    .cmd      = "tlbbench",
+    .help_str = "tlbbench [pages] [changes] [max cpus]",
+    .handler  = handle_tlbbench,
+};
+nk_register_shell_cmd(tlbbench_impl);